@@ -4,5 +4,10 @@
 #include "common.h"
 
 void dealResponseAtCmd(struct KernelResponse rsp);
+int showOneLog(struct IPLog log);
+int showEvent(struct FwEvent *ev);
+int showStats(struct FwStatsHead *head);
+int showTalkers(struct DumpTalker *top, int len, const char *by);
+int showNATUsage(const struct NATRecord *nats, struct DumpPoolUse *uses, int len);
 
 #endif
\ No newline at end of file
@@ -2,8 +2,14 @@
 
 int showRules(struct IPRule *rules, int len);
 int showNATRules(struct NATRecord *rules, int len);
+int showDNATRules(struct DNATRule *rules, int len);
+int showIPSets(struct IPSetInfo *sets, int len);
+int showIPSetEntries(struct IPSetEntry *entries, int len);
 int showLogs(struct IPLog *logs, int len);
 int showConns(struct ConnLog *logs, int len);
+int showTimeouts(struct ConnTimeouts *timeouts);
+int showConnStats(struct ConnStats *stats);
+int showStats(struct FwStatsHead *head);
 
 void dealResponseAtCmd(struct KernelResponse rsp) {
 	// 判断错误码
@@ -17,6 +23,15 @@ void dealResponseAtCmd(struct KernelResponse rsp) {
 	case ERROR_CODE_WRONG_IP:
 		printf("Incorrect IP format.\n");
 		return;
+	case ERROR_CODE_LOG_DEV:
+		printf("log device unavailable, is the module loaded?\n");
+		return;
+	case ERROR_CODE_SNAP_FILE:
+		printf("can not read or write the snapshot file.\n");
+		return;
+	case ERROR_CODE_DUMP_FILE:
+		printf("can not read or write the dump file.\n");
+		return;
 	}
 	if(rsp.code < 0 || rsp.data == NULL || rsp.header == NULL || rsp.body == NULL) 
 		return;
@@ -34,12 +49,30 @@ void dealResponseAtCmd(struct KernelResponse rsp) {
 	case RSP_NATRules:
 		showNATRules((struct NATRecord*)rsp.body, rsp.header->arrayLen);
 		break;
+	case RSP_DNATRules:
+		showDNATRules((struct DNATRule*)rsp.body, rsp.header->arrayLen);
+		break;
+	case RSP_IPSets:
+		showIPSets((struct IPSetInfo*)rsp.body, rsp.header->arrayLen);
+		break;
+	case RSP_IPSetEntries:
+		showIPSetEntries((struct IPSetEntry*)rsp.body, rsp.header->arrayLen);
+		break;
 	case RSP_IPLogs:
 		showLogs((struct IPLog*)rsp.body, rsp.header->arrayLen);
 		break;
 	case RSP_ConnLogs:
 		showConns((struct ConnLog*)rsp.body, rsp.header->arrayLen);
 		break;
+	case RSP_Timeouts:
+		showTimeouts((struct ConnTimeouts*)rsp.body);
+		break;
+	case RSP_ConnStats:
+		showConnStats((struct ConnStats*)rsp.body);
+		break;
+	case RSP_Stats:
+		showStats((struct FwStatsHead*)rsp.body);
+		break;
 	}
 	if(rsp.header->bodyTp != RSP_Only_Head && rsp.body != NULL) {
 		free(rsp.data);
@@ -54,11 +87,30 @@ void printLine(int len) {
 	printf("\n");
 }
 
+// 按地址族格式化带端口的地址，IPv6地址取自 ip6
+static void addrWithPort(u_int8_t family, unsigned int ip, const unsigned int *ip6, unsigned short port, char *out) {
+	if(family == AF_INET6)
+		IP6int2IP6strWithPort(ip6, port, out);
+	else
+		IPint2IPstrWithPort(ip, port, out);
+}
+
 int showOneRule(struct IPRule rule) {
-	char saddr[25],daddr[25],sport[13],dport[13],proto[6],action[8],log[5];
+	char saddr[IPSTR_MAXLEN],daddr[IPSTR_MAXLEN],sport[13],dport[13],proto[6],action[8],log[5],limit[32];
 	// ip
-	IPint2IPstr(rule.saddr,rule.smask,saddr);
-	IPint2IPstr(rule.daddr,rule.dmask,daddr);
+	if(rule.family == AF_INET6) {
+		IP6int2IP6str(rule.saddr6,rule.splen,saddr);
+		IP6int2IP6str(rule.daddr6,rule.dplen,daddr);
+	} else {
+		if(rule.sset)
+			sprintf(saddr, "set:%u", rule.sset);
+		else
+			IPint2IPstr(rule.saddr,rule.smask,saddr);
+		if(rule.dset)
+			sprintf(daddr, "set:%u", rule.dset);
+		else
+			IPint2IPstr(rule.daddr,rule.dmask,daddr);
+	}
 	// port
 	if(rule.sport == 0xFFFFu)
 		strcpy(sport, "any");
@@ -87,6 +139,8 @@ int showOneRule(struct IPRule rule) {
 		sprintf(proto, "UDP");
 	} else if(rule.protocol == IPPROTO_ICMP) {
 		sprintf(proto, "ICMP");
+	} else if(rule.protocol == IPPROTO_ICMPV6) {
+		sprintf(proto, "ICMP6");
 	} else if(rule.protocol == IPPROTO_IP) {
 		sprintf(proto, "IP");
 	} else {
@@ -98,10 +152,15 @@ int showOneRule(struct IPRule rule) {
 	} else {
 		sprintf(log, "no");
 	}
+	// limit: 每源前缀每秒新建连接数/令牌桶容量/前缀长度
+	if(rule.rate == 0)
+		strcpy(limit, "-");
+	else
+		sprintf(limit, "%u/%u/%u", rule.rate, rule.burst ? rule.burst : rule.rate, rule.limitPlen);
 	// print
-	printf("| %-*s | %-18s | %-18s | %-11s | %-11s | %-8s | %-6s | %-3s |\n", MAXRuleNameLen,
-	rule.name, saddr, daddr, sport, dport, proto, action, log);
-	printLine(111);
+	printf("| %-*s | %-18s | %-18s | %-11s | %-11s | %-8s | %-6s | %-3s | %-16s |\n", MAXRuleNameLen,
+	rule.name, saddr, daddr, sport, dport, proto, action, log, limit);
+	printLine(130);
 }
 
 int showRules(struct IPRule *rules, int len) {
@@ -111,10 +170,10 @@ int showRules(struct IPRule *rules, int len) {
 		return 0;
 	}
 	//printf("rule num: %d\n", len);
-	printLine(111);
-	printf("| %-*s | %-18s | %-18s | %-11s | %-11s | %-8s | %-6s | %-3s |\n", MAXRuleNameLen,
-	 "name", "source ip", "target ip", "source port", "target port", "protocol", "action", "log");
-	printLine(111);
+	printLine(130);
+	printf("| %-*s | %-18s | %-18s | %-11s | %-11s | %-8s | %-6s | %-3s | %-16s |\n", MAXRuleNameLen,
+	 "name", "source ip", "target ip", "source port", "target port", "protocol", "action", "log", "limit");
+	printLine(130);
 	for(i = 0; i < len; i++) {
 		showOneRule(rules[i]);
 	}
@@ -141,12 +200,66 @@ int showNATRules(struct NATRecord *rules, int len) {
 	return 0;
 }
 
+int showDNATRules(struct DNATRule *rules, int len) {
+	int i, j, col = 68;
+	char daddr[25], backend[25];
+	if(len == 0) {
+		printf("No DNAT rules now.\n");
+		return 0;
+	}
+	printLine(col);
+	printf("| %-22s | %-5s |->| %-28s |\n", "address", "proto", "backends");
+	printLine(col);
+	for(i = 0; i < len; i++) {
+		IPint2IPstrWithPort(rules[i].daddr, rules[i].dport, daddr);
+		for(j = 0; j < rules[i].backendNum && j < DNAT_MAX_BACKENDS; j++) {
+			IPint2IPstrWithPort(rules[i].backends[j].addr, rules[i].backends[j].port, backend);
+			if(j == 0)
+				printf("| %-22s | %-5s |->| %-28s |\n", daddr, rules[i].protocol == IPPROTO_TCP ? "TCP" : "UDP", backend);
+			else
+				printf("| %-22s | %-5s |  | %-28s |\n", "", "", backend);
+		}
+		printLine(col);
+	}
+	return 0;
+}
+
+int showIPSets(struct IPSetInfo *sets, int len) {
+	int i, col = 34;
+	if(len == 0) {
+		printf("No IP sets now.\n");
+		return 0;
+	}
+	printLine(col);
+	printf("| %-4s | %-6s | %-14s |\n", "id", "type", "entries");
+	printLine(col);
+	for(i = 0; i < len; i++)
+		printf("| %-4u | %-6s | %-14u |\n", sets[i].id, sets[i].type == IPSET_TYPE_HASH ? "hash" : "net", sets[i].num);
+	printLine(col);
+	return 0;
+}
+
+int showIPSetEntries(struct IPSetEntry *entries, int len) {
+	int i;
+	char addr[25];
+	if(len == 0) {
+		printf("The set is empty.\n");
+		return 0;
+	}
+	for(i = 0; i < len; i++) {
+		IPint2IPstr(entries[i].addr, entries[i].plen ? 0xFFFFFFFFu << (32 - entries[i].plen) : 0, addr);
+		printf("%s\n", addr);
+	}
+	printf("%d entries.\n", len);
+	return 0;
+}
+
 int showOneLog(struct IPLog log) {
 	struct tm * timeinfo;
-	char saddr[25],daddr[25],proto[6],action[8],tm[21];
+	char saddr[IPSTR_MAXLEN],daddr[IPSTR_MAXLEN],proto[6],action[8],tm[21];
 	// ip
-	IPint2IPstrWithPort(log.saddr, log.sport, saddr);
-	IPint2IPstrWithPort(log.daddr, log.dport, daddr);
+	addrWithPort(log.family, log.saddr, log.saddr6, log.sport, saddr);
+	addrWithPort(log.family, log.daddr, log.daddr6, log.dport, daddr);
 	// action
 	if(log.action == NF_ACCEPT) {
 		sprintf(action, "[ACCEPT]");
@@ -162,6 +275,8 @@ int showOneLog(struct IPLog log) {
 		sprintf(proto, "UDP");
 	} else if(log.protocol == IPPROTO_ICMP) {
 		sprintf(proto, "ICMP");
+	} else if(log.protocol == IPPROTO_ICMPV6) {
+		sprintf(proto, "ICMP6");
 	} else if(log.protocol == IPPROTO_IP) {
 		sprintf(proto, "IP");
 	} else {
@@ -191,10 +306,10 @@ int showLogs(struct IPLog *logs, int len) {
 
 int showOneConn(struct ConnLog log) {
 	struct tm * timeinfo;
-	char saddr[25],daddr[25],proto[6];
+	char saddr[IPSTR_MAXLEN],daddr[IPSTR_MAXLEN],proto[6];
 	// ip
-	IPint2IPstrWithPort(log.saddr,log.sport,saddr);
-	IPint2IPstrWithPort(log.daddr,log.dport,daddr);
+	addrWithPort(log.family, log.saddr, log.saddr6, log.sport, saddr);
+	addrWithPort(log.family, log.daddr, log.daddr6, log.dport, daddr);
 	// protocol
 	if(log.protocol == IPPROTO_TCP) {
 		sprintf(proto, "TCP");
@@ -202,6 +317,8 @@ int showOneConn(struct ConnLog log) {
 		sprintf(proto, "UDP");
 	} else if(log.protocol == IPPROTO_ICMP) {
 		sprintf(proto, "ICMP");
+	} else if(log.protocol == IPPROTO_ICMPV6) {
+		sprintf(proto, "ICMP6");
 	} else if(log.protocol == IPPROTO_IP) {
 		sprintf(proto, "any");
 	} else {
@@ -234,3 +351,160 @@ int showConns(struct ConnLog *logs, int len) {
 	printLine(col);
 	return 0;
 }
+
+int showTimeouts(struct ConnTimeouts *timeouts) {
+	int col = 30;
+	printLine(col);
+	printf("| %-12s | %11s |\n", "item", "timeout(s)");
+	printLine(col);
+	printf("| %-12s | %11u |\n", "tcp-syn", timeouts->tcpSyn);
+	printf("| %-12s | %11u |\n", "tcp-est", timeouts->tcpEst);
+	printf("| %-12s | %11u |\n", "tcp-fin", timeouts->tcpFin);
+	printf("| %-12s | %11u |\n", "tcp-close", timeouts->tcpClose);
+	printf("| %-12s | %11u |\n", "udp", timeouts->udp);
+	printf("| %-12s | %11u |\n", "icmp", timeouts->icmp);
+	printf("| %-12s | %11u |\n", "other", timeouts->other);
+	printLine(col);
+	return 0;
+}
+
+int showConnStats(struct ConnStats *stats) {
+	int col = 30;
+	printLine(col);
+	printf("| %-12s | %11u |\n", "connections", stats->connNum);
+	printf("| %-12s | %11u |\n", "max", stats->maxConns);
+	printf("| %-12s | %11s |\n", "policy", stats->policy == CONN_FULL_EVICT ? "evict" : "drop");
+	printf("| %-12s | %11u |\n", "prealloc", stats->prealloc);
+	printLine(col);
+	printf("| %-12s | %11u |\n", "table full", stats->tableFull);
+	printf("| %-12s | %11u |\n", "evicted", stats->evicted);
+	printf("| %-12s | %11u |\n", "alloc fail", stats->allocFail);
+	printLine(col);
+	return 0;
+}
+
+// 直方图中累计次数达到 calls*permille/1000 的桶的上界 (周期数)
+static unsigned long long histPercentile(struct HookStat *st, unsigned int permille) {
+	unsigned long long need, sum = 0;
+	int i;
+	if(st->calls == 0)
+		return 0;
+	need = (st->calls * permille + 999) / 1000;
+	for(i = 0; i < HOOK_HIST_BUCKETS - 1; i++) {
+		sum += st->hist[i];
+		if(sum >= need)
+			break;
+	}
+	return i == 0 ? 0 : 1ULL << i;
+}
+
+int showStats(struct FwStatsHead *head) {
+	const char *hookNames[HOOK_STAT_NUM] = {"filter in", "filter out", "nat in", "nat out"};
+	struct RuleStat *rules = (struct RuleStat *)(head + 1);
+	struct HookStat *st;
+	char name[13];
+	unsigned int i;
+	int col = 79;
+	// 钩子耗时，分位数为直方图桶的上界
+	printLine(col);
+	printf("| %-10s | %14s | %10s | %10s | %10s | %10s |\n", "hook", "calls", "avg cyc", "p50 <", "p99 <", "p999 <");
+	printLine(col);
+	for(i = 0; i < HOOK_STAT_NUM; i++) {
+		st = &head->hooks[i];
+		printf("| %-10s | %14llu | %10llu | %10llu | %10llu | %10llu |\n", hookNames[i], st->calls,
+			st->calls ? st->cycles / st->calls : 0,
+			histPercentile(st, 500), histPercentile(st, 990), histPercentile(st, 999));
+	}
+	printLine(col);
+	// 过滤规则与默认动作
+	col = 59;
+	printLine(col);
+	printf("| %5s | %-12s | %14s | %16s |\n", "index", "rule", "packets", "bytes");
+	printLine(col);
+	for(i = 0; i < head->ruleNum; i++)
+		printf("| %5u | %-12s | %14llu | %16llu |\n", rules[i].index, rules[i].name, rules[i].packets, rules[i].bytes);
+	printf("| %5s | %-12s | %14llu | %16llu |\n", "-", "default", head->deflt.packets, head->deflt.bytes);
+	printLine(col);
+	// NAT规则
+	if(head->natNum > 0) {
+		printLine(col);
+		printf("| %5s | %-12s | %14s | %16s |\n", "index", "nat", "bindings", "bytes");
+		printLine(col);
+		for(i = 0; i < head->natNum; i++) {
+			snprintf(name, sizeof(name), "nat %u", rules[head->ruleNum + i].index);
+			printf("| %5u | %-12s | %14llu | %16llu |\n", rules[head->ruleNum + i].index, name,
+				rules[head->ruleNum + i].packets, rules[head->ruleNum + i].bytes);
+		}
+		printLine(col);
+	}
+	return 0;
+}
+
+int showTalkers(struct DumpTalker *top, int len, const char *by) {
+	char addr[IPSTR_MAXLEN];
+	int i, col = 117;
+	if(len == 0) {
+		printf("No sources in the dump.\n");
+		return 0;
+	}
+	printf("top %d sources by %s:\n", len, by);
+	printLine(col);
+	printf("| %4s | %-39s | %9s | %9s | %11s | %14s | %9s |\n", "rank", "source addr", "conns", "snat", "logs", "bytes", "dropped");
+	printLine(col);
+	for(i = 0; i < len; i++) {
+		if(top[i].family == AF_INET6)
+			IP6int2IP6str(top[i].addr6, 128, addr);
+		else
+			IPint2IPstrNoMask(top[i].addr, addr);
+		printf("| %4d | %-39s | %9u | %9u | %11llu | %14llu | %9llu |\n", i + 1, addr,
+			top[i].conns, top[i].snat, top[i].logs, top[i].bytes, top[i].dropped);
+	}
+	printLine(col);
+	return 0;
+}
+
+int showNATUsage(const struct NATRecord *nats, struct DumpPoolUse *uses, int len) {
+	char daddr[25];
+	int i, col = 71;
+	if(len == 0) {
+		printf("No NAT rules in the dump.\n");
+		return 0;
+	}
+	printLine(col);
+	printf("| seq | %-18s | %-11s | %7s | %7s | %6s |\n", "NAT ip", "NAT port", "used", "size", "usage");
+	printLine(col);
+	for(i = 0; i < len; i++) {
+		IPint2IPstrNoMask(nats[i].daddr, daddr);
+		printf("| %3d | %-18s | %5u~%-5u | %7u | %7u | %5.1f%% |\n", i, daddr, nats[i].sport, nats[i].dport,
+			uses[i].used, uses[i].size, uses[i].size ? 100.0 * uses[i].used / uses[i].size : 0.0);
+	}
+	printLine(col);
+	return 0;
+}
+
+int showEvent(struct FwEvent *ev) {
+	struct tm * timeinfo;
+	char saddr[IPSTR_MAXLEN],daddr[IPSTR_MAXLEN],natAddr[25],tm[21];
+	const char *type;
+	switch(ev->type) {
+	case EVT_CONN_NEW:     type = "NEW"; break;
+	case EVT_CONN_NAT:     type = "NAT"; break;
+	case EVT_CONN_EXPIRED: type = "EXPIRED"; break;
+	case EVT_CONN_DEL:     type = "DEL"; break;
+	case EVT_RULE_HIT:     type = "HIT"; break;
+	default:               type = "unknown"; break;
+	}
+	addrWithPort(ev->conn.family, ev->conn.saddr, ev->conn.saddr6, ev->conn.sport, saddr);
+	addrWithPort(ev->conn.family, ev->conn.daddr, ev->conn.daddr6, ev->conn.dport, daddr);
+	timeinfo = localtime(&ev->tm);
+	strftime(tm, sizeof(tm), "%Y-%m-%d %H:%M:%S", timeinfo);
+	printf("[%s] %-8s proto=%-3u %s->%s", tm, type, ev->conn.protocol, saddr, daddr);
+	if(ev->type == EVT_RULE_HIT) {
+		printf(" rule=%s %s", ev->ruleName, ev->action == NF_ACCEPT ? "[ACCEPT]" : "[DROP]");
+	} else if(ev->conn.natType != NAT_TYPE_NO) {
+		IPint2IPstrWithPort(ev->conn.nat.daddr, ev->conn.nat.dport, natAddr);
+		printf(" %s=>%s", ev->conn.natType == NAT_TYPE_SRC ? "SNAT" : "DNAT", natAddr);
+	}
+	printf("\n");
+	return 0;
+}
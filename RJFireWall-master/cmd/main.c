@@ -14,13 +14,15 @@
  *       - 协议类型(proto)
  *       - 动作(action)
  *       - 日志标志(log)
+ *       - 放行规则的新建连接限速(rate/burst/prefix)
  */
 struct KernelResponse cmdAddRule() {
     struct KernelResponse empty;
     // 定义各种参数缓冲区
-    char after[MAXRuleNameLen+1],name[MAXRuleNameLen+1],saddr[25],daddr[25],sport[15],dport[15],protoS[6];
+    char after[MAXRuleNameLen+1],name[MAXRuleNameLen+1],saddr[IPSTR_MAXLEN],daddr[IPSTR_MAXLEN],sport[15],dport[15],protoS[6];
     unsigned short sportMin,sportMax,dportMin,dportMax;
-    unsigned int action = NF_DROP, log = 0, proto, i;
+    char limit[40];
+    unsigned int action = NF_DROP, log = 0, proto, i, rate = 0, burst = 0, limitPlen = 0;
     empty.code = ERROR_CODE_EXIT;
     
     // 获取前序规则名（在此规则后插入）
@@ -46,8 +48,8 @@ struct KernelResponse cmdAddRule() {
     }
     
     // 获取源IP地址和掩码
-    printf("source ip and mask [like 127.0.0.1/16]: ");
-    scanf("%s",saddr);
+    printf("source ip and mask [like 127.0.0.1/16, 2001:db8::/32 or set:1]: ");
+    scanf("%55s",saddr);
     
     // 获取源端口范围
     printf("source port range [like 8080-8031 or any]: ");
@@ -63,8 +65,8 @@ struct KernelResponse cmdAddRule() {
     }
     
     // 获取目的IP地址和掩码
-    printf("target ip and mask [like 127.0.0.1/16]: ");
-    scanf("%s",daddr);
+    printf("target ip and mask [like 127.0.0.1/16, 2001:db8::/32 or set:1]: ");
+    scanf("%55s",daddr);
     
     // 获取目的端口范围
     printf("target port range [like 8080-8031 or any]: ");
@@ -80,14 +82,16 @@ struct KernelResponse cmdAddRule() {
     }
     
     // 获取协议类型
-    printf("protocol [TCP/UDP/ICMP/any]: ");
-    scanf("%s",protoS);
+    printf("protocol [TCP/UDP/ICMP/ICMP6/any]: ");
+    scanf("%5s",protoS);
     if(strcmp(protoS,"TCP")==0)
         proto = IPPROTO_TCP;
     else if(strcmp(protoS,"UDP")==0)
         proto = IPPROTO_UDP;
     else if(strcmp(protoS,"ICMP")==0)
         proto = IPPROTO_ICMP;
+    else if(strcmp(protoS,"ICMP6")==0)
+        proto = IPPROTO_ICMPV6;
     else if(strcmp(protoS,"any")==0)
         proto = IPPROTO_IP;
     else {
@@ -102,12 +106,56 @@ struct KernelResponse cmdAddRule() {
     // 获取是否记录日志标志
     printf("is log [1 for yes,0 for no]: ");
     scanf("%u",&log);
+
+    // 放行规则可按源前缀限制新建连接的速率
+    if(action == NF_ACCEPT) {
+        printf("new flows per source limit [rate/burst/prefix like 100/200/24, or none]: ");
+        scanf("%39s",limit);
+        if(strcmp(limit, "none") != 0) {
+            if(sscanf(limit,"%u/%u/%u",&rate,&burst,&limitPlen) != 3 || rate == 0 || limitPlen > 128) {
+                printf("Incorrect limit format.\n");
+                return empty;
+            }
+        }
+    }
     
     printf("result:\n");
     // 调用添加过滤规则的核心函数，将端口范围打包成32位整数
     return addFilterRule(after,name,saddr,daddr,
         (((unsigned int)sportMin << 16) | (((unsigned int)sportMax) & 0xFFFFu)),
-        (((unsigned int)dportMin << 16) | (((unsigned int)dportMax) & 0xFFFFu)),proto,log,action);
+        (((unsigned int)dportMin << 16) | (((unsigned int)dportMax) & 0xFFFFu)),proto,log,action,
+        rate,burst,(u_int8_t)limitPlen);
+}
+
+/**
+ * @brief 从规则文件载入整套过滤规则
+ * @param path 规则文件路径
+ * @return struct KernelResponse 内核对批量提交的响应；文件与内核规则一致时code为ERROR_CODE_EXIT
+ * @note 只提交与内核现有规则链的差异，格式错误时报告行号且不修改内核规则
+ */
+struct KernelResponse cmdLoadRules(char *path) {
+    struct KernelResponse rsp;
+    struct IPRule *rules;
+    unsigned int num, errLine, mode, pushed;
+    rsp.code = readRuleFile(path, &rules, &num, &errLine);
+    if(rsp.code < 0) {
+        if(errLine)
+            printf("%s:%u: ", path, errLine);
+        if(rsp.code == ERROR_CODE_RULE_FILE)
+            printf(errLine ? "bad rule line or duplicated rule name.\n" : "can not read the rule file.\n");
+        rsp.code = rsp.code == ERROR_CODE_WRONG_IP ? ERROR_CODE_WRONG_IP : ERROR_CODE_EXIT;
+        return rsp;
+    }
+    rsp = applyFilterRules(rules, num, &mode, &pushed);
+    free(rules);
+    if(mode == 0 && rsp.code == ERROR_CODE_EXIT)
+        printf("%u rules already up to date.\n", num);
+    else if(rsp.code >= 0 && rsp.header->bodyTp == RSP_Only_Head) {
+        printf("%s %u rules, %d rules now.\n", mode == IPRULE_BATCH_APPEND ? "appended" : "replaced with", pushed, rsp.header->arrayLen);
+        free(rsp.data);
+        rsp.code = ERROR_CODE_EXIT;
+    }
+    return rsp;
 }
 
 /**
@@ -151,6 +199,301 @@ struct KernelResponse cmdAddNATRule() {
     return addNATRule(saddr,daddr,portMin,portMax);
 }
 
+/**
+ * @brief 设置单项连接超时的命令处理函数
+ * @param item 超时项名称(tcp-syn/tcp-est/tcp-fin/tcp-close/udp/icmp/other)
+ * @param value 超时时长字符串(秒，须大于0)
+ * @return struct KernelResponse 内核响应结果
+ * @note 只发送被修改的一项，其余各项置0由内核保持原值
+ */
+struct KernelResponse cmdSetTimeout(char *item, char *value) {
+    struct KernelResponse empty;
+    struct ConnTimeouts timeouts;
+    unsigned int sec = 0;
+    empty.code = ERROR_CODE_EXIT;
+    memset(&timeouts, 0, sizeof(timeouts));
+
+    if(sscanf(value, "%u", &sec) != 1 || sec == 0) {
+        printf("timeout must be a positive number of seconds.\n");
+        return empty;
+    }
+    if(strcmp(item, "tcp-syn")==0)
+        timeouts.tcpSyn = sec;
+    else if(strcmp(item, "tcp-est")==0)
+        timeouts.tcpEst = sec;
+    else if(strcmp(item, "tcp-fin")==0)
+        timeouts.tcpFin = sec;
+    else if(strcmp(item, "tcp-close")==0)
+        timeouts.tcpClose = sec;
+    else if(strcmp(item, "udp")==0)
+        timeouts.udp = sec;
+    else if(strcmp(item, "icmp")==0)
+        timeouts.icmp = sec;
+    else if(strcmp(item, "other")==0)
+        timeouts.other = sec;
+    else {
+        printf("No such timeout item. Only tcp-syn, tcp-est, tcp-fin, tcp-close, udp, icmp or other.\n");
+        return empty;
+    }
+    return setTimeouts(timeouts);
+}
+
+/**
+ * @brief 设置连接池容量的命令处理函数
+ * @param max 连接数上限字符串("keep"表示不修改)
+ * @param policy 满表策略字符串(drop/evict)，为NULL时不修改
+ * @return struct KernelResponse 内核响应结果
+ */
+struct KernelResponse cmdSetConnLimit(char *max, char *policy) {
+    struct KernelResponse empty;
+    unsigned int maxConns = 0, pol = 0;
+    empty.code = ERROR_CODE_EXIT;
+
+    if(strcmp(max, "keep") != 0 && (sscanf(max, "%u", &maxConns) != 1 || maxConns == 0)) {
+        printf("max connections must be a positive number or \"keep\".\n");
+        return empty;
+    }
+    if(policy != NULL) {
+        if(strcmp(policy, "drop")==0)
+            pol = CONN_FULL_DROP;
+        else if(strcmp(policy, "evict")==0)
+            pol = CONN_FULL_EVICT;
+        else {
+            printf("No such policy. Only \"drop\" or \"evict\".\n");
+            return empty;
+        }
+    }
+    return setConnLimit(maxConns, pol);
+}
+
+// 日志流回调：逐条打印并立即刷新，便于重定向给其他程序消费
+static int printStreamLog(struct IPLog *log) {
+    showOneLog(*log);
+    fflush(stdout);
+    return 0;
+}
+
+static void printStreamLost(unsigned long count) {
+    printf("[%lu logs lost]\n", count);
+}
+
+// 事件回调：逐条打印并立即刷新
+static int printEvent(struct FwEvent *ev) {
+    showEvent(ev);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * @brief 监听内核推送的连接与规则命中事件
+ * @param which 要监听的事件组(conn/rule/all)
+ * @return struct KernelResponse 仅code有效，监听在进程被中断前不会返回
+ */
+struct KernelResponse cmdMonitor(char *which) {
+    struct KernelResponse rsp;
+    unsigned int groups;
+    rsp.code = ERROR_CODE_EXIT;
+    if(strcmp(which, "conn")==0)
+        groups = 1 << (FW_GROUP_CONN - 1);
+    else if(strcmp(which, "rule")==0)
+        groups = 1 << (FW_GROUP_RULE - 1);
+    else if(strcmp(which, "all")==0)
+        groups = (1 << FW_GROUP_MAX) - 1;
+    else {
+        printf("No such event group. Only \"conn\", \"rule\" or \"all\".\n");
+        return rsp;
+    }
+    if(monitorEvents(groups, printEvent) != 0) {
+        printf("can not join netlink event groups.\n");
+    }
+    return rsp;
+}
+
+/**
+ * @brief 持续输出内核日志流
+ * @return struct KernelResponse 仅code有效，日志流在进程被中断前不会返回
+ * @note 通过映射日志流设备读取，不经过Netlink
+ */
+struct KernelResponse cmdStreamLogs() {
+    struct KernelResponse rsp;
+    rsp.code = streamLogs(printStreamLog, printStreamLost);
+    if(rsp.code == 0)
+        rsp.code = ERROR_CODE_EXIT;
+    return rsp;
+}
+
+/**
+ * @brief 保存或载入防火墙状态快照
+ * @param op 操作(save/load)
+ * @param path 快照文件路径
+ * @return struct KernelResponse 成功时code为ERROR_CODE_EXIT，结果已在此打印
+ * @note 载入应在模块重新加载后立即进行，快照中不包含默认动作
+ */
+struct KernelResponse cmdSnapshot(char *op, char *path) {
+    struct KernelResponse rsp;
+    struct SnapHead head;
+    int ret;
+    rsp.code = ERROR_CODE_EXIT;
+    if(strcmp(op, "save")==0) {
+        ret = saveSnapshot(path, &head);
+        if(ret == 0)
+            printf("saved %u rules, %u nat rules and %u connections.\n", head.ruleNum, head.natNum, head.connNum);
+    } else if(strcmp(op, "load")==0) {
+        ret = loadSnapshot(path, &head);
+        if(ret >= 0)
+            printf("restored %u rules, %u nat rules and %d of %u connections.\n", head.ruleNum, head.natNum, ret, head.connNum);
+    } else {
+        printf("No such operation. Only \"save\" or \"load\".\n");
+        return rsp;
+    }
+    if(ret < 0)
+        rsp.code = ret;
+    return rsp;
+}
+
+/**
+ * @brief 将规则、命中统计、连接表与日志转储到文件
+ * @param path 转储文件路径
+ * @return struct KernelResponse 成功时code为ERROR_CODE_EXIT，结果已在此打印
+ */
+struct KernelResponse cmdDump(char *path) {
+    struct KernelResponse rsp;
+    struct DumpHead head;
+    rsp.code = saveDump(path, &head);
+    if(rsp.code == 0) {
+        printf("dumped %u rules, %u nat rules, %u connections and %u logs.\n",
+            head.ruleNum, head.natNum, head.connNum, head.logNum);
+        rsp.code = ERROR_CODE_EXIT;
+    }
+    return rsp;
+}
+
+/**
+ * @brief 离线分析转储文件
+ * @param path 转储文件路径
+ * @param topStr 列出的来源地址数，NULL表示默认的10个
+ * @return struct KernelResponse 成功时code为ERROR_CODE_EXIT，结果已在此打印
+ * @note 只读取文件，不与内核通信；依次输出规则命中计数、按连接数与按日志字节数排名的来源地址、NAT端口池占用
+ */
+struct KernelResponse cmdAnalyze(char *path, char *topStr) {
+    struct KernelResponse rsp;
+    struct DumpView view;
+    struct DumpTalker *talkers, top[DUMP_TOP_MAX];
+    struct DumpPoolUse *uses;
+    unsigned int n = 10, num, cnt;
+    char tm[21];
+    time_t at;
+    rsp.code = ERROR_CODE_EXIT;
+    if(topStr != NULL && (sscanf(topStr, "%u", &n) != 1 || n == 0 || n > DUMP_TOP_MAX)) {
+        printf("top number must be 1 ~ %d.\n", DUMP_TOP_MAX);
+        return rsp;
+    }
+    rsp.code = mapDump(path, &view);
+    if(rsp.code < 0)
+        return rsp;
+    rsp.code = ERROR_CODE_EXIT;
+    at = (time_t)view.head->savedAt;
+    strftime(tm, sizeof(tm), "%Y-%m-%d %H:%M:%S", localtime(&at));
+    printf("dump saved at %s: %u rules, %u nat rules, %u connections, %u logs.\n", tm,
+        view.head->ruleNum, view.head->natNum, view.head->connNum, view.head->logNum);
+    // 规则命中计数
+    showStats((struct FwStatsHead *)view.stats);
+    // 来源地址排名
+    if(dumpTalkers(&view, &talkers, &num) != 0) {
+        printf("out of memory.\n");
+        unmapDump(&view);
+        return rsp;
+    }
+    cnt = dumpTopTalkers(talkers, num, 0, top, n);
+    showTalkers(top, cnt, "connections");
+    cnt = dumpTopTalkers(talkers, num, 1, top, n);
+    showTalkers(top, cnt, "logged bytes");
+    free(talkers);
+    // NAT端口池占用
+    uses = (struct DumpPoolUse *)malloc((view.head->natNum ? view.head->natNum : 1) * sizeof(struct DumpPoolUse));
+    if(uses != NULL) {
+        if(dumpNATUsage(&view, uses) == 0)
+            showNATUsage(view.nats, uses, view.head->natNum);
+        free(uses);
+    }
+    unmapDump(&view);
+    return rsp;
+}
+
+/**
+ * @brief 维护地址集合
+ * @param argc 参数个数
+ * @param argv 参数数组，argv[2] 起为子命令与选项
+ * @return struct KernelResponse 内核响应；提交成功时code为ERROR_CODE_EXIT，结果已在此打印
+ * @note load 以文件内容替换整个集合(集合不存在时创建)，add/del 在已有集合上增删文件中的条目
+ */
+struct KernelResponse cmdIPSet(int argc, char *argv[]) {
+    struct KernelResponse rsp;
+    struct IPSetEntry *entries;
+    unsigned int id = 0, num, errLine;
+    u_int8_t type = 0, mode;
+    char *path;
+    rsp.code = ERROR_CODE_EXIT;
+    if(strcmp(argv[2], "ls")==0 || strcmp(argv[2], "list")==0) {
+        if(argc < 4)
+            return getIPSets();
+        if(sscanf(argv[3], "%u", &id) != 1 || id == 0 || id > IPSET_MAX) {
+            printf("set id must be 1 ~ %d.\n", IPSET_MAX);
+            return rsp;
+        }
+        return getIPSetEntries((u_int8_t)id);
+    }
+    if(argc < 4 || sscanf(argv[3], "%u", &id) != 1 || id == 0 || id > IPSET_MAX) {
+        printf("Please point set id (1 ~ %d) in option.\n", IPSET_MAX);
+        return rsp;
+    }
+    if(strcmp(argv[2], "destroy")==0)
+        return destroyIPSet((u_int8_t)id);
+    if(strcmp(argv[2], "load")==0) {
+        if(argc < 6) {
+            printf("Please point set type (hash or net) and set file in option.\n");
+            return rsp;
+        }
+        if(strcmp(argv[4], "hash")==0)
+            type = IPSET_TYPE_HASH;
+        else if(strcmp(argv[4], "net")==0)
+            type = IPSET_TYPE_NET;
+        else {
+            printf("No such set type. Only \"hash\" or \"net\".\n");
+            return rsp;
+        }
+        mode = IPSET_MODE_REPLACE;
+        path = argv[5];
+    } else if(strcmp(argv[2], "add")==0 || strcmp(argv[2], "del")==0) {
+        if(argc < 5) {
+            printf("Please point set file in option.\n");
+            return rsp;
+        }
+        mode = argv[2][0] == 'a' ? IPSET_MODE_ADD : IPSET_MODE_DEL;
+        path = argv[4];
+    } else {
+        printf("No such operation. Only \"load\", \"add\", \"del\", \"destroy\" or \"ls\".\n");
+        return rsp;
+    }
+    rsp.code = readIPSetFile(path, &entries, &num, &errLine);
+    if(rsp.code < 0) {
+        if(errLine)
+            printf("%s:%u: ", path, errLine);
+        if(rsp.code == ERROR_CODE_RULE_FILE)
+            printf(errLine ? "bad set line or too many entries.\n" : "can not read the set file.\n");
+        rsp.code = rsp.code == ERROR_CODE_WRONG_IP ? ERROR_CODE_WRONG_IP : ERROR_CODE_EXIT;
+        return rsp;
+    }
+    rsp = pushIPSet((u_int8_t)id, type, mode, entries, num);
+    free(entries);
+    if(rsp.code >= 0 && rsp.header->bodyTp == RSP_Only_Head) {
+        printf("set %u has %d entries now.\n", id, rsp.header->arrayLen);
+        free(rsp.data);
+        rsp.code = ERROR_CODE_EXIT;
+    }
+    return rsp;
+}
+
 /**
  * @brief 显示错误命令提示信息
  * @note 当用户输入无效命令时显示帮助信息
@@ -158,9 +501,18 @@ struct KernelResponse cmdAddNATRule() {
 void wrongCommand() {
     printf("wrong command.\n");
     printf("uapp <command> <sub-command> [option]\n");
-    printf("commands: rule <add | del | ls | default> [del rule's name]\n");
+    printf("commands: rule <add | del | ls | default | load> [del rule's name | rule file]\n");
     printf("          nat  <add | del | ls> [del number]\n");
-    printf("          ls   <rule | nat | log | connect>\n");
+    printf("          dnat <add | del | ls> [ip:port tcp|udp] [add backend[:port],...]\n");
+    printf("          timeout <ls | set> [item seconds]\n");
+    printf("          conn <stat | limit> [max|keep] [drop | evict]\n");
+    printf("          log  <stream>\n");
+    printf("          monitor <conn | rule | all>\n");
+    printf("          set  <load | add | del | destroy | ls> [id] [load hash|net] [set file]\n");
+    printf("          snapshot <save | load> <file>\n");
+    printf("          dump <file>\n");
+    printf("          analyze <file> [top number]\n");
+    printf("          ls   <rule | nat | dnat | log | connect | timeout | stats>\n");
     exit(0);
 }
 
@@ -172,6 +524,14 @@ void wrongCommand() {
  * @note 支持的命令包括：
  *       - 过滤规则管理(rule)
  *       - NAT规则管理(nat)
+ *       - DNAT规则管理(dnat)
+ *       - 连接超时配置(timeout)
+ *       - 连接池容量(conn)
+ *       - 日志流(log)
+ *       - 事件监听(monitor)
+ *       - 地址集合(set)
+ *       - 状态快照(snapshot)
+ *       - 转储(dump)与离线分析(analyze)
  *       - 查看各种信息(ls)
  */
 int main(int argc, char *argv[]) {
@@ -199,6 +559,12 @@ int main(int argc, char *argv[]) {
         } else if(strcmp(argv[2], "add")==0) {
             // 添加过滤规则
             rsp = cmdAddRule();
+        } else if(strcmp(argv[2], "load")==0) {
+            // 从规则文件载入整套过滤规则
+            if(argc < 4)
+                printf("Please point rule file in option.\n");
+            else
+                rsp = cmdLoadRules(argv[3]);
         } else if(strcmp(argv[2], "default")==0) {
             // 设置默认规则
             if(argc < 4)
@@ -233,6 +599,90 @@ int main(int argc, char *argv[]) {
             wrongCommand();
         }
     } 
+    // 转储须在DNAT之前判断，否则会被首字母 'd' 匹配
+    else if(strcmp(argv[1], "dump")==0) {
+        rsp = cmdDump(argv[2]);
+    }
+    // 离线分析转储文件
+    else if(strcmp(argv[1], "analyze")==0 || argv[1][0] == 'a') {
+        rsp = cmdAnalyze(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+    // DNAT (端口转发) 规则相关命令处理
+    else if(strcmp(argv[1], "dnat")==0 || argv[1][0] == 'd') {
+        if(strcmp(argv[2], "ls")==0 || strcmp(argv[2], "list")==0) {
+            rsp = getAllDNATRules();
+        } else if(strcmp(argv[2], "add")==0 || strcmp(argv[2], "del")==0) {
+            u_int8_t proto = IPPROTO_IP;
+            if(argc > 4 && strcmp(argv[4], "tcp")==0)
+                proto = IPPROTO_TCP;
+            else if(argc > 4 && strcmp(argv[4], "udp")==0)
+                proto = IPPROTO_UDP;
+            if(proto == IPPROTO_IP)
+                printf("Please point address:port and protocol (tcp or udp) in option.\n");
+            else if(argv[2][0] == 'd')
+                rsp = delDNATRule(argv[3], proto);
+            else if(argc < 6)
+                printf("Please point backends in option.\n");
+            else
+                rsp = addDNATRule(argv[3], proto, argv[5]);
+        } else {
+            wrongCommand();
+        }
+    }
+    // 连接超时配置相关命令处理
+    else if(strcmp(argv[1], "timeout")==0 || argv[1][0] == 't') {
+        if(strcmp(argv[2], "ls")==0 || strcmp(argv[2], "list")==0) {
+            // 列出当前超时配置
+            rsp = getTimeouts();
+        } else if(strcmp(argv[2], "set")==0) {
+            // 修改一项超时配置
+            if(argc < 5)
+                printf("Please point timeout item and seconds in option.\n");
+            else
+                rsp = cmdSetTimeout(argv[3], argv[4]);
+        } else {
+            wrongCommand();
+        }
+    }
+    // 连接池容量相关命令处理
+    else if(strcmp(argv[1], "conn")==0 || argv[1][0] == 'c') {
+        if(strcmp(argv[2], "stat")==0) {
+            // 查看连接池统计
+            rsp = getConnStats();
+        } else if(strcmp(argv[2], "limit")==0) {
+            // 修改连接数上限与满表策略
+            if(argc < 4)
+                printf("Please point max connections in option.\n");
+            else
+                rsp = cmdSetConnLimit(argv[3], argc > 4 ? argv[4] : NULL);
+        } else {
+            wrongCommand();
+        }
+    }
+    // 日志流相关命令处理
+    else if(strcmp(argv[1], "log")==0) {
+        if(strcmp(argv[2], "stream")==0) {
+            // 持续输出日志，直到被中断
+            rsp = cmdStreamLogs();
+        } else {
+            wrongCommand();
+        }
+    }
+    // 事件监听相关命令处理
+    else if(strcmp(argv[1], "monitor")==0 || argv[1][0] == 'm') {
+        rsp = cmdMonitor(argv[2]);
+    }
+    // 地址集合相关命令处理 (须在 snapshot 的首字母匹配之前)
+    else if(strcmp(argv[1], "set")==0) {
+        rsp = cmdIPSet(argc, argv);
+    }
+    // 状态快照相关命令处理
+    else if(strcmp(argv[1], "snapshot")==0 || argv[1][0] == 's') {
+        if(argc < 4)
+            printf("Please point snapshot file in option.\n");
+        else
+            rsp = cmdSnapshot(argv[2], argv[3]);
+    }
     // 查看信息相关命令处理
     else if(strcmp(argv[1], "ls")==0 || argv[1][0] == 'l') {
         if(strcmp(argv[2],"log")==0 || argv[2][0] == 'l') {
@@ -250,6 +700,15 @@ int main(int argc, char *argv[]) {
         } else if(strcmp(argv[2],"nat")==0 || argv[2][0] == 'n') {
             // 获取已有NAT规则
             rsp = getAllNATRules();
+        } else if(strcmp(argv[2],"dnat")==0 || argv[2][0] == 'd') {
+            // 获取已有DNAT规则
+            rsp = getAllDNATRules();
+        } else if(strcmp(argv[2],"timeout")==0 || argv[2][0] == 't') {
+            // 获取连接超时配置
+            rsp = getTimeouts();
+        } else if(strcmp(argv[2],"stats")==0 || argv[2][0] == 's') {
+            // 获取规则命中计数与钩子耗时统计
+            rsp = getStats();
         } else
             wrongCommand();
     } else 
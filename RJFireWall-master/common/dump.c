@@ -0,0 +1,330 @@
+#include "common.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// 取得命中统计；成功时由调用者释放 rsp->data
+static int dumpFetchStats(struct KernelResponse *rsp, unsigned int *num) {
+	const struct FwStatsHead *st;
+	*rsp = getStats();
+	if(rsp->code < 0)
+		return ERROR_CODE_EXCHANGE;
+	if(rsp->header->bodyTp != RSP_Stats || (unsigned int)rsp->code < sizeof(struct FwStatsHead))
+		goto bad;
+	st = (const struct FwStatsHead *)rsp->body;
+	*num = st->ruleNum + st->natNum;
+	if((unsigned int)rsp->code < sizeof(struct FwStatsHead) + *num * sizeof(struct RuleStat))
+		goto bad;
+	return 0;
+bad:
+	free(rsp->data);
+	return ERROR_CODE_EXCHANGE;
+}
+
+/**
+ * @brief 保存转储文件
+ * @param path 转储文件路径
+ * @param head [out] 写出的文件头，可为NULL
+ * @return int 成功返回0，失败返回错误码
+ */
+int saveDump(const char *path, struct DumpHead *head) {
+	struct KernelResponse rules, nats, stats, conns, logs;
+	struct DumpHead h;
+	FILE *fp;
+	int ret;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = DUMP_MAGIC;
+	h.version = DUMP_VERSION;
+	h.ruleSize = sizeof(struct IPRule);
+	h.natSize = sizeof(struct NATRecord);
+	h.statSize = sizeof(struct RuleStat);
+	h.connSize = sizeof(struct ConnSnap);
+	h.logSize = sizeof(struct IPLog);
+	if((ret = snapFetch(REQ_GETAllIPRules, RSP_IPRules, h.ruleSize, &rules, &h.ruleNum)) != 0)
+		return ret;
+	if((ret = snapFetch(REQ_GETNATRules, RSP_NATRules, h.natSize, &nats, &h.natNum)) != 0)
+		goto freeRules;
+	if((ret = dumpFetchStats(&stats, &h.statNum)) != 0)
+		goto freeNats;
+	if((ret = snapFetch(REQ_GETConnSnap, RSP_ConnSnap, h.connSize, &conns, &h.connNum)) != 0)
+		goto freeStats;
+	// num 为0的日志请求导出内核中的全部日志
+	if((ret = snapFetch(REQ_GETAllIPLogs, RSP_IPLogs, h.logSize, &logs, &h.logNum)) != 0)
+		goto freeConns;
+	h.savedAt = (long long)time(NULL);
+
+	ret = ERROR_CODE_DUMP_FILE;
+	fp = fopen(path, "wb");
+	if(fp == NULL)
+		goto freeLogs;
+	if(fwrite(&h, sizeof(h), 1, fp) == 1 &&
+	   fwrite(rules.body, h.ruleSize, h.ruleNum, fp) == h.ruleNum &&
+	   fwrite(nats.body, h.natSize, h.natNum, fp) == h.natNum &&
+	   fwrite(stats.body, sizeof(struct FwStatsHead) + h.statSize * h.statNum, 1, fp) == 1 &&
+	   fwrite(conns.body, h.connSize, h.connNum, fp) == h.connNum &&
+	   fwrite(logs.body, h.logSize, h.logNum, fp) == h.logNum)
+		ret = 0;
+	if(fclose(fp) != 0)
+		ret = ERROR_CODE_DUMP_FILE;
+	if(ret == 0 && head != NULL)
+		*head = h;
+freeLogs:
+	free(logs.data);
+freeConns:
+	free(conns.data);
+freeStats:
+	free(stats.data);
+freeNats:
+	free(nats.data);
+freeRules:
+	free(rules.data);
+	return ret;
+}
+
+/**
+ * @brief 映射转储文件
+ * @param path 转储文件路径
+ * @param view [out] 各部分的位置
+ * @return int 成功返回0，失败返回 ERROR_CODE_DUMP_FILE
+ * @note 文件长度须与文件头中的条目数完全一致，截断或拼接过的文件被拒绝
+ */
+int mapDump(const char *path, struct DumpView *view) {
+	const struct DumpHead *h;
+	const char *p;
+	struct stat st;
+	size_t want;
+	void *base;
+	int fd;
+
+	memset(view, 0, sizeof(*view));
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return ERROR_CODE_DUMP_FILE;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct DumpHead)) {
+		close(fd);
+		return ERROR_CODE_DUMP_FILE;
+	}
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+		return ERROR_CODE_DUMP_FILE;
+	h = (const struct DumpHead *)base;
+	if(h->magic != DUMP_MAGIC || h->version != DUMP_VERSION ||
+	   h->ruleSize != sizeof(struct IPRule) || h->natSize != sizeof(struct NATRecord) ||
+	   h->statSize != sizeof(struct RuleStat) || h->connSize != sizeof(struct ConnSnap) ||
+	   h->logSize != sizeof(struct IPLog))
+		goto bad;
+	want = sizeof(struct DumpHead) + (size_t)h->ruleSize * h->ruleNum + (size_t)h->natSize * h->natNum +
+		sizeof(struct FwStatsHead) + (size_t)h->statSize * h->statNum +
+		(size_t)h->connSize * h->connNum + (size_t)h->logSize * h->logNum;
+	if(want != (size_t)st.st_size)
+		goto bad;
+	p = (const char *)(h + 1);
+	view->rules = (const struct IPRule *)p;
+	p += (size_t)h->ruleSize * h->ruleNum;
+	view->nats = (const struct NATRecord *)p;
+	p += (size_t)h->natSize * h->natNum;
+	view->stats = (const struct FwStatsHead *)p;
+	if(view->stats->ruleNum + view->stats->natNum != h->statNum)
+		goto bad;
+	p += sizeof(struct FwStatsHead) + (size_t)h->statSize * h->statNum;
+	view->conns = (const struct ConnSnap *)p;
+	p += (size_t)h->connSize * h->connNum;
+	view->logs = (const struct IPLog *)p;
+	view->head = h;
+	view->base = base;
+	view->len = (size_t)st.st_size;
+	// 连接与日志都只顺序扫描一遍
+	madvise(base, view->len, MADV_SEQUENTIAL);
+	return 0;
+bad:
+	munmap(base, (size_t)st.st_size);
+	memset(view, 0, sizeof(*view));
+	return ERROR_CODE_DUMP_FILE;
+}
+
+/**
+ * @brief 解除转储文件的映射
+ * @param view 已映射的转储
+ */
+void unmapDump(struct DumpView *view) {
+	if(view->base != NULL)
+		munmap(view->base, view->len);
+	memset(view, 0, sizeof(*view));
+}
+
+// 汇总用的开放寻址哈希表，槽位保存汇总数组下标加一，0表示空槽
+struct talkerTable {
+	unsigned int *slots;
+	unsigned int mask;
+	struct DumpTalker *arr;
+	unsigned int num;
+};
+
+static unsigned int talkerHash(u_int8_t v6, unsigned int addr, const unsigned int *addr6) {
+	unsigned int h = v6 ? addr6[0] ^ addr6[1] * 0x85EBCA6Bu ^ addr6[2] * 0xC2B2AE35u ^ addr6[3] : addr;
+	h ^= h >> 16;
+	h *= 0x9E3779B1u;
+	return h ^ (h >> 15);
+}
+
+// 找到或新建来源地址的汇总项，表中的项数不会超过 mask/2
+static struct DumpTalker *talkerOf(struct talkerTable *t, u_int8_t family, unsigned int addr, const unsigned int *addr6) {
+	u_int8_t v6 = family == AF_INET6;
+	unsigned int i = talkerHash(v6, addr, addr6) & t->mask;
+	struct DumpTalker *e;
+	for(; t->slots[i] != 0; i = (i + 1) & t->mask) {
+		e = &t->arr[t->slots[i] - 1];
+		if((e->family == AF_INET6) != v6)
+			continue;
+		if(v6 ? memcmp(e->addr6, addr6, sizeof(e->addr6)) == 0 : e->addr == addr)
+			return e;
+	}
+	e = &t->arr[t->num++];
+	memset(e, 0, sizeof(*e));
+	e->family = v6 ? AF_INET6 : AF_INET;
+	if(v6)
+		memcpy(e->addr6, addr6, sizeof(e->addr6));
+	else
+		e->addr = addr;
+	t->slots[i] = t->num;
+	return e;
+}
+
+/**
+ * @brief 按源地址汇总连接与日志
+ * @param view 已映射的转储
+ * @param talkers [out] 汇总数组(需要调用者free)
+ * @param num [out] 不同来源地址的个数
+ * @return int 成功返回0，内存不足返回 ERROR_CODE_EXIT
+ */
+int dumpTalkers(const struct DumpView *view, struct DumpTalker **talkers, unsigned int *num) {
+	const struct DumpHead *h = view->head;
+	size_t rows = (size_t)h->connNum + h->logNum, cap = 16;
+	struct talkerTable t;
+	struct DumpTalker *e, *shrunk;
+	const struct ConnLog *c;
+	const struct IPLog *l;
+	unsigned int i;
+
+	*num = 0;
+	while(cap < rows * 2)
+		cap <<= 1;
+	t.slots = (unsigned int *)calloc(cap, sizeof(unsigned int));
+	t.arr = (struct DumpTalker *)malloc((rows ? rows : 1) * sizeof(struct DumpTalker));
+	if(t.slots == NULL || t.arr == NULL) {
+		free(t.slots);
+		free(t.arr);
+		return ERROR_CODE_EXIT;
+	}
+	t.mask = (unsigned int)(cap - 1);
+	t.num = 0;
+	for(i = 0; i < h->connNum; i++) {
+		c = &view->conns[i].conn;
+		e = talkerOf(&t, c->family, c->saddr, c->saddr6);
+		e->conns++;
+		if(c->natType == NAT_TYPE_SRC)
+			e->snat++;
+	}
+	for(i = 0; i < h->logNum; i++) {
+		l = &view->logs[i];
+		e = talkerOf(&t, l->family, l->saddr, l->saddr6);
+		e->logs++;
+		e->bytes += l->len;
+		if(l->action == NF_DROP)
+			e->dropped++;
+	}
+	free(t.slots);
+	shrunk = (struct DumpTalker *)realloc(t.arr, (t.num ? t.num : 1) * sizeof(struct DumpTalker));
+	*talkers = shrunk != NULL ? shrunk : t.arr;
+	*num = t.num;
+	return 0;
+}
+
+// a 是否排在 b 之前
+static int talkerAbove(const struct DumpTalker *a, const struct DumpTalker *b, int byBytes) {
+	if(byBytes)
+		return a->bytes != b->bytes ? a->bytes > b->bytes : a->conns > b->conns;
+	return a->conns != b->conns ? a->conns > b->conns : a->bytes > b->bytes;
+}
+
+/**
+ * @brief 取出排名最前的来源地址
+ * @param talkers 汇总数组
+ * @param num 汇总数组长度
+ * @param byBytes 非0时按日志字节数排序，否则按连接数排序
+ * @param top [out] 按降序排列的结果
+ * @param n 需要的个数
+ * @return unsigned int 实际取出的个数
+ * @note n 很小，保持 top 有序并插入排序；大多数来源只与末位比较一次就被跳过
+ */
+unsigned int dumpTopTalkers(const struct DumpTalker *talkers, unsigned int num, int byBytes, struct DumpTalker *top, unsigned int n) {
+	unsigned int i, j, cnt = 0;
+	for(i = 0; i < num && n > 0; i++) {
+		if(cnt == n && !talkerAbove(&talkers[i], &top[n - 1], byBytes))
+			continue;
+		j = cnt < n ? cnt++ : n - 1;
+		for(; j > 0 && talkerAbove(&talkers[i], &top[j - 1], byBytes); j--)
+			top[j] = top[j - 1];
+		top[j] = talkers[i];
+	}
+	return cnt;
+}
+
+/**
+ * @brief 统计各NAT规则的端口池占用
+ * @param view 已映射的转储
+ * @param uses [out] 与NAT规则一一对应的占用
+ * @return int 成功返回0，内存不足返回 ERROR_CODE_EXIT
+ */
+int dumpNATUsage(const struct DumpView *view, struct DumpPoolUse *uses) {
+	const struct DumpHead *h = view->head;
+	const struct NATRecord *r;
+	const struct ConnLog *c;
+	unsigned char seen[(0xFFFFu + 1) / 8];
+	unsigned int *owner;
+	unsigned int i, j, minPort;
+
+	owner = (unsigned int *)malloc((h->connNum ? h->connNum : 1) * sizeof(unsigned int));
+	if(owner == NULL)
+		return ERROR_CODE_EXIT;
+	// 与内核端口池一致：端口0不可分配，池从 sport ? sport : 1 开始
+	for(j = 0; j < h->natNum; j++) {
+		r = &view->nats[j];
+		minPort = r->sport ? r->sport : 1;
+		uses[j].used = 0;
+		uses[j].size = r->dport >= minPort ? (unsigned int)r->dport - minPort + 1 : 0;
+	}
+	// 源NAT连接的反向连接记为目的NAT，只数源NAT的一侧；
+	// DNAT回程方向的源NAT记录以对外地址为转换地址，只有该地址恰好在某个池中时才会被计入
+	for(i = 0; i < h->connNum; i++) {
+		c = &view->conns[i].conn;
+		owner[i] = h->natNum;
+		if(c->natType != NAT_TYPE_SRC || c->family == AF_INET6)
+			continue;
+		for(j = 0; j < h->natNum; j++) {
+			r = &view->nats[j];
+			minPort = r->sport ? r->sport : 1;
+			if(r->daddr == c->nat.daddr && c->nat.dport >= minPort && c->nat.dport <= r->dport) {
+				owner[i] = j;
+				break;
+			}
+		}
+	}
+	// 不同目的地的连接可以共用同一个转换端口，按端口去重后占用不会超过池的大小
+	for(j = 0; j < h->natNum; j++) {
+		memset(seen, 0, sizeof(seen));
+		for(i = 0; i < h->connNum; i++) {
+			if(owner[i] != j)
+				continue;
+			c = &view->conns[i].conn;
+			if(seen[c->nat.dport / 8] & (1u << (c->nat.dport % 8)))
+				continue;
+			seen[c->nat.dport / 8] |= 1u << (c->nat.dport % 8);
+			uses[j].used++;
+		}
+	}
+	free(owner);
+	return 0;
+}
@@ -1,4 +1,5 @@
 #include "common.h"
+#include <errno.h>
 
 /**
  * @brief 通过Netlink套接字与内核模块进行消息交换的核心函数
@@ -10,127 +11,183 @@
  *         - header: 指向响应头部的指针
  *         - body: 指向响应实际数据的指针
  * @note 函数执行流程：
- *       1. 创建并绑定Netlink套接字
- *       2. 构建Netlink消息头并填充发送数据
- *       3. 发送消息到内核并等待响应
- *       4. 解析响应数据并组织返回结构
- *       5. 错误处理贯穿整个流程，确保资源释放
+ *       1. 取得进程内共用的会话 (首次调用时创建并绑定Netlink套接字、分配接收缓冲区)
+ *       2. 以新的序列号发送请求
+ *       3. 等待该序列号的响应，并组织返回结构
+ *       套接字在多次调用之间复用，连续发送大量请求时不再为每个请求创建套接字
  */
 struct KernelResponse exchangeMsgK(void *smsg, unsigned int slen) {
-    // 地址结构初始化
-    struct sockaddr_nl local;  // 本地(用户空间)地址结构
-    struct sockaddr_nl kpeer;  // 内核地址结构
-    struct KernelResponse rsp; // 返回结果结构体
-    int dlen;                 // 实际接收数据长度
-    int kpeerlen = sizeof(struct sockaddr_nl); // 地址结构长度
+    struct KernelResponse rsp;
+    struct NLSession *s = nlDefaultSession();
+    unsigned int seq;
 
-    /* ---------- 1. 创建Netlink套接字 ---------- */
-    // 创建NETLINK_MYFW协议的原始套接字
-    int skfd = socket(PF_NETLINK, SOCK_RAW, NETLINK_MYFW);
-    if (skfd < 0) {
-        rsp.code = ERROR_CODE_EXCHANGE; // 套接字创建失败
+    rsp.code = ERROR_CODE_EXCHANGE;
+    if (s == NULL)
         return rsp;
-    }
+    seq = nlSessionSend(s, smsg, slen);
+    if (seq == 0)
+        return rsp;
+    return nlSessionWait(s, seq);
+}
 
-    /* ---------- 2. 绑定本地地址 ---------- */
+/**
+ * @brief 以分段导出(NLM_F_DUMP)的方式向内核请求一张表
+ * @param smsg 要发送到内核的请求
+ * @param slen 请求长度
+ * @return struct KernelResponse 与exchangeMsgK相同的结构：
+ *         各段的条目按顺序拼接在一个响应体中，header->arrayLen 为条目总数
+ * @note 内核每段只填充一个skb，以 NLM_F_MULTI 标记，最后发送 NLMSG_DONE。
+ *       内核无法启动导出时会回复一条普通消息，此时原样返回该消息
+ */
+struct KernelResponse exchangeDumpK(void *smsg, unsigned int slen) {
+    struct sockaddr_nl local, kpeer;
+    socklen_t alen = sizeof(local);
+    struct KernelResponse rsp;
+    struct KernelResponseHeader total, *head;
+    struct nlmsghdr *message, *nlh, *buf;
+    char *body = NULL, *tmp;
+    unsigned int bodyLen = 0, partLen;
+    int skfd, len, done = 0, single = 0;
+
+    rsp.code = ERROR_CODE_EXCHANGE;
+    skfd = socket(PF_NETLINK, SOCK_RAW, NETLINK_MYFW);
+    if (skfd < 0)
+        return rsp;
     memset(&local, 0, sizeof(local));
-    local.nl_family = AF_NETLINK;   // 协议族
-    local.nl_pid = getpid();        // 使用当前进程ID作为标识
-    local.nl_groups = 0;            // 不加入任何多播组
-    
-    if (bind(skfd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+    local.nl_family = AF_NETLINK;
+    local.nl_pid = 0; // 由内核分配端口号，不与进程内共用的会话冲突
+    if (bind(skfd, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+        getsockname(skfd, (struct sockaddr *)&local, &alen) != 0) {
         close(skfd);
-        rsp.code = ERROR_CODE_EXCHANGE; // 绑定失败
         return rsp;
     }
-
-    /* ---------- 3. 配置内核地址结构 ---------- */
     memset(&kpeer, 0, sizeof(kpeer));
     kpeer.nl_family = AF_NETLINK;
-    kpeer.nl_pid = 0;       // 内核端PID固定为0
-    kpeer.nl_groups = 0;    // 无多播组
 
-    /* ---------- 4. 构建发送消息 ---------- */
-    // 分配消息内存(包含Netlink头和数据空间)
-    struct nlmsghdr *message = (struct nlmsghdr *)malloc(NLMSG_SPACE(slen));
-    if (!message) {
+    message = (struct nlmsghdr *)calloc(1, NLMSG_SPACE(slen));
+    buf = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
+    if (!message || !buf) {
         close(skfd);
-        rsp.code = ERROR_CODE_EXCHANGE; // 内存分配失败
+        free(message);
+        free(buf);
         return rsp;
     }
-
-    // 初始化消息头
-    memset(message, '\0', sizeof(struct nlmsghdr));
-    message->nlmsg_len = NLMSG_SPACE(slen); // 总消息长度
-    message->nlmsg_flags = 0;      // 无特殊标志
-    message->nlmsg_type = 0;       // 消息类型(0表示无类型)
-    message->nlmsg_seq = 0;        // 序列号(未使用)
-    message->nlmsg_pid = local.nl_pid; // 发送方PID
-    
-    // 拷贝实际数据到消息体
+    message->nlmsg_len = NLMSG_SPACE(slen);
+    message->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    message->nlmsg_seq = 1;
+    message->nlmsg_pid = local.nl_pid;
     memcpy(NLMSG_DATA(message), smsg, slen);
+    if (sendto(skfd, message, message->nlmsg_len, 0, (struct sockaddr *)&kpeer, sizeof(kpeer)) < 0)
+        done = -1;
 
-    /* ---------- 5. 发送消息到内核 ---------- */
-    if (!sendto(skfd, message, message->nlmsg_len, 0,
-               (struct sockaddr *)&kpeer, sizeof(kpeer))) {
-        close(skfd);
-        free(message);
-        rsp.code = ERROR_CODE_EXCHANGE; // 发送失败
-        return rsp;
+    memset(&total, 0, sizeof(total));
+    while (!done) {
+        len = recv(skfd, buf, NLMSG_SPACE(MAX_PAYLOAD), 0);
+        if (len <= 0) {
+            done = -1;
+            break;
+        }
+        for (nlh = buf; NLMSG_OK(nlh, len) && !done; nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+            } else if (nlh->nlmsg_type == NLMSG_ERROR ||
+                       nlh->nlmsg_len < NLMSG_SPACE(sizeof(struct KernelResponseHeader))) {
+                done = -1;
+            } else {
+                head = (struct KernelResponseHeader *)NLMSG_DATA(nlh);
+                partLen = nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct KernelResponseHeader));
+                if (!(nlh->nlmsg_flags & NLM_F_MULTI)) // 非分段的普通回复，例如导出失败的提示
+                    single = 1, bodyLen = 0;
+                tmp = realloc(body, bodyLen + partLen + 1);
+                if (!tmp) {
+                    done = -1;
+                    break;
+                }
+                body = tmp;
+                memcpy(body + bodyLen, (char *)head + sizeof(struct KernelResponseHeader), partLen);
+                bodyLen += partLen;
+                total.bodyTp = head->bodyTp;
+                total.arrayLen = single ? head->arrayLen : total.arrayLen + head->arrayLen;
+                if (single)
+                    done = 1;
+            }
+        }
     }
-
-    /* ---------- 6. 接收内核响应 ---------- */
-    // 分配接收缓冲区(按最大负载预分配)
-    struct nlmsghdr *nlh = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
-    if (!nlh) {
-        close(skfd);
-        free(message);
-        rsp.code = ERROR_CODE_EXCHANGE; // 内存分配失败
+    close(skfd);
+    free(message);
+    free(buf);
+    if (done < 0) {
+        free(body);
+        rsp.code = ERROR_CODE_EXCHANGE;
         return rsp;
     }
-
-    // 阻塞接收内核响应
-    if (!recvfrom(skfd, nlh, NLMSG_SPACE(MAX_PAYLOAD), 0,
-                 (struct sockaddr *)&kpeer, (socklen_t *)&kpeerlen))) {
-        close(skfd);
-        free(message);
-        free(nlh);
-        rsp.code = ERROR_CODE_EXCHANGE; // 接收失败
-        return rsp;
-    }
-
-    /* ---------- 7. 处理响应数据 ---------- */
-    // 计算实际数据长度(减去Netlink头部)
-    dlen = nlh->nlmsg_len - NLMSG_SPACE(0);
-    
-    // 分配存储空间
-    rsp.data = malloc(dlen);
+    // 组织成与 exchangeMsgK 相同的布局：头部 + 响应体
+    rsp.data = malloc(sizeof(struct KernelResponseHeader) + bodyLen + 1);
     if (!rsp.data) {
-        close(skfd);
-        free(message);
-        free(nlh);
-        rsp.code = ERROR_CODE_EXCHANGE; // 内存分配失败
+        free(body);
+        rsp.code = ERROR_CODE_EXCHANGE;
         return rsp;
     }
+    memcpy(rsp.data, &total, sizeof(total));
+    if (bodyLen)
+        memcpy((char *)rsp.data + sizeof(total), body, bodyLen);
+    ((char *)rsp.data)[sizeof(total) + bodyLen] = '\0';
+    free(body);
+    rsp.code = bodyLen;
+    rsp.header = (struct KernelResponseHeader *)rsp.data;
+    rsp.body = (char *)rsp.data + sizeof(struct KernelResponseHeader);
+    return rsp;
+}
 
-    // 初始化并拷贝数据
-    memset(rsp.data, 0, dlen);
-    memcpy(rsp.data, NLMSG_DATA(nlh), dlen);
+/**
+ * @brief 监听内核多播事件
+ * @param groups 要加入的多播组掩码，第n组对应 1 << (n-1)
+ * @param onEvent 每收到一个事件调用一次，返回非0时停止监听
+ * @return int onEvent 要求停止时返回0，套接字创建或绑定失败返回ERROR_CODE_EXCHANGE
+ * @note 与exchangeMsgK不同，这里不发送任何请求，只在绑定时加入多播组后阻塞接收。
+ *       接收缓冲区溢出(ENOBUFS)表示有事件被丢弃，打印提示后继续监听
+ */
+int monitorEvents(unsigned int groups, int (*onEvent)(struct FwEvent *ev)) {
+    struct sockaddr_nl local;
+    struct KernelResponseHeader *head;
+    struct nlmsghdr *nlh;
+    char buf[NLMSG_SPACE(sizeof(struct KernelResponseHeader) + sizeof(struct FwEvent)) * 16];
+    int skfd, len, ret = 0;
 
-    // 设置返回结构字段
-    rsp.code = dlen - sizeof(struct KernelResponseHeader); // 实际数据长度
-    if (rsp.code < 0) {
-        rsp.code = ERROR_CODE_EXCHANGE; // 长度异常处理
+    skfd = socket(PF_NETLINK, SOCK_RAW, NETLINK_MYFW);
+    if (skfd < 0)
+        return ERROR_CODE_EXCHANGE;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_pid = 0;           // 由内核分配端口号，可与其他命令同时运行
+    local.nl_groups = groups;   // 加入多播组
+    if (bind(skfd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+        close(skfd);
+        return ERROR_CODE_EXCHANGE;
     }
-    rsp.header = (struct KernelResponseHeader*)rsp.data; // 头部指针
-    rsp.body = rsp.data + sizeof(struct KernelResponseHeader); // 数据指针
-
-    /* ---------- 8. 资源清理 ---------- */
-    close(skfd);      // 关闭套接字
-    free(message);    // 释放发送缓冲区
-    free(nlh);        // 释放接收缓冲区
-    
-    return rsp;       // 返回响应结构
+    while (ret == 0) {
+        len = recv(skfd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == ENOBUFS) { // 监听过慢，内核丢弃了部分事件
+                printf("[events lost]\n");
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // 一次接收可能包含多条消息
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len) && ret == 0; nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_len < NLMSG_SPACE(sizeof(struct KernelResponseHeader) + sizeof(struct FwEvent)))
+                continue;
+            head = (struct KernelResponseHeader *)NLMSG_DATA(nlh);
+            if (head->bodyTp != RSP_Event)
+                continue;
+            ret = onEvent((struct FwEvent *)((char *)head + sizeof(struct KernelResponseHeader)));
+        }
+    }
+    close(skfd);
+    return 0;
 }
 
 /**
@@ -1,50 +1,146 @@
 #include "common.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// 解析 "set:N" 形式的集合引用：不是集合引用返回0，编号无效返回-1
+static int parseSetRef(const char *str) {
+	unsigned int id;
+	char tail;
+	if(strncmp(str, "set:", 4) != 0)
+		return 0;
+	if(sscanf(str + 4, "%u%c", &id, &tail) != 1 || id == 0 || id > IPSET_MAX)
+		return -1;
+	return (int)id;
+}
 
 /**
- * @brief 添加IP过滤规则
- * @param after 新规则要插入的位置(规则名称)，空字符串表示插入到链表头部
- * @param name 新规则的名称(最大长度MAXRuleNameLen)
- * @param sip 源IP地址字符串(格式如"192.168.1.1/24")
- * @param dip 目的IP地址字符串
+ * @brief 由字符串形式的参数构造一条IP过滤规则
+ * @param rule [out] 构造的规则
+ * @param name 规则名称(最大长度MAXRuleNameLen)
+ * @param sip 源IP地址字符串(格式如"192.168.1.1/24"，或IPv6的"2001:db8::/32")，"set:N"表示编号为N的地址集合
+ * @param dip 目的IP地址字符串，须与sip同为IPv4或同为IPv6；地址集合只能用于IPv4规则
  * @param sport 源端口范围(高16位为最小端口，低16位为最大端口)
  * @param dport 目的端口范围(格式同sport)
  * @param proto 协议类型(IPPROTO_TCP/IPPROTO_UDP等)
  * @param log 是否记录日志(1=记录，0=不记录)
  * @param action 规则动作(NF_ACCEPT=允许，NF_DROP=拒绝)
+ * @return int 成功返回0，IP格式错误返回ERROR_CODE_WRONG_IP
+ */
+int formIPRule(struct IPRule *rule,const char *name,const char *sip,const char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action,
+	unsigned int rate,unsigned int burst,u_int8_t limitPlen) {
+	int sset, dset;
+	memset(rule, 0, sizeof(*rule));
+	sset = parseSetRef(sip);
+	dset = parseSetRef(dip);
+	if(sset < 0 || dset < 0)
+		return ERROR_CODE_WRONG_IP;
+	if((!sset && strchr(sip, ':') != NULL) || (!dset && strchr(dip, ':') != NULL)) { // IPv6规则
+		rule->family = AF_INET6;
+		if(sset || dset) // 地址集合只收录IPv4地址
+			return ERROR_CODE_WRONG_IP;
+		if(IP6str2IP6int(sip,rule->saddr6,&rule->splen)!=0 || IP6str2IP6int(dip,rule->daddr6,&rule->dplen)!=0)
+			return ERROR_CODE_WRONG_IP;
+	} else {
+		rule->family = AF_INET;
+		// 引用集合的一侧地址与掩码为0，不限制地址
+		if(!sset && IPstr2IPint(sip,&rule->saddr,&rule->smask)!=0)
+			return ERROR_CODE_WRONG_IP;
+		if(!dset && IPstr2IPint(dip,&rule->daddr,&rule->dmask)!=0)
+			return ERROR_CODE_WRONG_IP;
+		rule->sset = (u_int8_t)sset;
+		rule->dset = (u_int8_t)dset;
+	}
+	rule->sport = sport;
+	rule->dport = dport;
+	rule->log = log;
+	rule->action = action;
+	rule->protocol = proto;
+	rule->rate = rate;
+	rule->burst = burst;
+	rule->limitPlen = limitPlen;
+	strncpy(rule->name, name, MAXRuleNameLen);
+	return 0;
+}
+
+/**
+ * @brief 添加IP过滤规则
+ * @param after 新规则要插入的位置(规则名称)，空字符串表示插入到链表头部
+ * @param name 新规则的名称，其余参数与 formIPRule 相同
  * @return struct KernelResponse 内核响应，包含错误码和响应数据
  *         - code: 错误码(>=0成功，<0失败)
  *         - data: 响应数据指针(需要调用者释放)
  */
-struct KernelResponse addFilterRule(char *after,char *name,char *sip,char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action) {
+struct KernelResponse addFilterRule(char *after,char *name,char *sip,char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action,
+	unsigned int rate,unsigned int burst,u_int8_t limitPlen) {
 	struct APPRequest req;
     struct KernelResponse rsp;
 	// form rule
-	struct IPRule rule;
-	if(IPstr2IPint(sip,&rule.saddr,&rule.smask)!=0) {
-		rsp.code = ERROR_CODE_WRONG_IP;
+	rsp.code = formIPRule(&req.msg.ipRule,name,sip,dip,sport,dport,proto,log,action,rate,burst,limitPlen);
+	if(rsp.code != 0)
 		return rsp;
-	}
-	if(IPstr2IPint(dip,&rule.daddr,&rule.dmask)!=0) {
-		rsp.code = ERROR_CODE_WRONG_IP;
-		return rsp;
-	}
-	rule.saddr = rule.saddr;
-	rule.daddr = rule.daddr;
-	rule.sport = sport;
-	rule.dport = dport;
-	rule.log = log;
-	rule.action = action;
-	rule.protocol = proto;
-	strncpy(rule.name, name, MAXRuleNameLen);
 	// form req
 	req.tp = REQ_ADDIPRule;
 	req.ruleName[0]=0;
 	strncpy(req.ruleName, after, MAXRuleNameLen);
-	req.msg.ipRule = rule;
 	// exchange
 	return exchangeMsgK(&req, sizeof(req));
 }
 
+// 批量步骤是否成功：内核以只有头部的响应表示成功
+static int batchStepOK(struct KernelResponse *rsp) {
+	return rsp->code >= 0 && rsp->header->bodyTp == RSP_Only_Head;
+}
+
+/**
+ * @brief 以一个事务提交一组过滤规则
+ * @param rules 规则数组
+ * @param num 规则数
+ * @param mode IPRULE_BATCH_REPLACE 或 IPRULE_BATCH_APPEND
+ * @return struct KernelResponse 提交成功时 arrayLen 为提交后的规则数；失败时为内核的提示消息
+ */
+struct KernelResponse addFilterRules(struct IPRule *rules, unsigned int num, unsigned int mode) {
+	struct APPRequest *req;
+	struct KernelResponse rsp, ab;
+	unsigned int sent, part;
+	req = (struct APPRequest *)calloc(1, sizeof(struct APPRequest) + IPRULE_BATCH_CHUNK * sizeof(struct IPRule));
+	if(req == NULL) {
+		rsp.code = ERROR_CODE_EXCHANGE;
+		return rsp;
+	}
+	req->tp = REQ_BeginIPRules;
+	req->msg.num = mode;
+	rsp = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(!batchStepOK(&rsp)) {
+		free(req);
+		return rsp;
+	}
+	for(sent = 0; sent < num; sent += part) {
+		free(rsp.data);
+		part = num - sent < IPRULE_BATCH_CHUNK ? num - sent : IPRULE_BATCH_CHUNK;
+		req->tp = REQ_ChunkIPRules;
+		req->msg.num = part;
+		memcpy(req + 1, rules + sent, part * sizeof(struct IPRule));
+		rsp = exchangeMsgK(req, sizeof(struct APPRequest) + part * sizeof(struct IPRule));
+		if(!batchStepOK(&rsp))
+			goto abort;
+	}
+	free(rsp.data);
+	req->tp = REQ_CommitIPRules;
+	rsp = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(!batchStepOK(&rsp))
+		goto abort;
+	free(req);
+	return rsp;
+abort:
+	// 放弃事务，把导致失败的那个响应返回给调用者
+	req->tp = REQ_AbortIPRules;
+	ab = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(ab.code >= 0)
+		free(ab.data);
+	free(req);
+	return rsp;
+}
+
 /**
  * @brief 删除指定名称的过滤规则
  * @param name 要删除的规则名称
@@ -73,7 +169,7 @@ struct KernelResponse getAllFilterRules(void) {
 	struct APPRequest req;
 	// exchange msg
 	req.tp = REQ_GETAllIPRules;
-	return exchangeMsgK(&req, sizeof(req));
+	return exchangeDumpK(&req, sizeof(req));
 }
 
 /**
@@ -136,9 +232,179 @@ struct KernelResponse getAllNATRules(void) {
 	struct APPRequest req;
 	// exchange msg
 	req.tp = REQ_GETNATRules;
+	return exchangeDumpK(&req, sizeof(req));
+}
+
+// 解析 "IP[:端口]"，没有端口时 *port 为0
+static int parseIPPort(const char *str, unsigned int *ip, unsigned short *port) {
+	char buf[25], *colon, tail;
+	unsigned int mask, p;
+	if(strlen(str) >= sizeof(buf) || strchr(str, '/') != NULL)
+		return -1;
+	strcpy(buf, str);
+	*port = 0;
+	colon = strchr(buf, ':');
+	if(colon != NULL) {
+		*colon = '\0';
+		if(sscanf(colon + 1, "%u%c", &p, &tail) != 1 || p == 0 || p > 0xFFFFu)
+			return -1;
+		*port = (unsigned short)p;
+	}
+	return IPstr2IPint(buf, ip, &mask);
+}
+
+/**
+ * @brief 添加DNAT(端口转发)规则
+ * @param dst 被访问的地址与端口(格式如"202.100.10.1:80")
+ * @param proto IPPROTO_TCP 或 IPPROTO_UDP
+ * @param backends 以逗号分隔的后端(格式如"10.0.0.2:8080,10.0.0.3"，省略端口时沿用原目的端口)
+ * @return struct KernelResponse 内核响应
+ *         - code: 错误码(ERROR_CODE_WRONG_IP=地址格式错误或后端多于 DNAT_MAX_BACKENDS 个)
+ */
+struct KernelResponse addDNATRule(const char *dst, u_int8_t proto, const char *backends) {
+	struct APPRequest req;
+	struct KernelResponse rsp;
+	struct DNATRule *rule = &req.msg.dnatRule;
+	char buf[DNAT_MAX_BACKENDS * 25], *tok, *save = NULL;
+
+	memset(&req, 0, sizeof(req));
+	rsp.code = ERROR_CODE_WRONG_IP;
+	if(parseIPPort(dst, &rule->daddr, &rule->dport) != 0 || rule->dport == 0 || strlen(backends) >= sizeof(buf))
+		return rsp;
+	strcpy(buf, backends);
+	for(tok = strtok_r(buf, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		if(rule->backendNum == DNAT_MAX_BACKENDS ||
+		   parseIPPort(tok, &rule->backends[rule->backendNum].addr, &rule->backends[rule->backendNum].port) != 0)
+			return rsp;
+		rule->backendNum++;
+	}
+	if(rule->backendNum == 0)
+		return rsp;
+	rule->protocol = proto;
+	req.tp = REQ_ADDDNATRule;
 	return exchangeMsgK(&req, sizeof(req));
 }
 
+/**
+ * @brief 删除DNAT规则
+ * @param dst 规则的被访问地址与端口
+ * @param proto 规则的协议
+ * @return struct KernelResponse 内核响应，arrayLen 为删除的规则数
+ */
+struct KernelResponse delDNATRule(const char *dst, u_int8_t proto) {
+	struct APPRequest req;
+	struct KernelResponse rsp;
+	memset(&req, 0, sizeof(req));
+	if(parseIPPort(dst, &req.msg.dnatRule.daddr, &req.msg.dnatRule.dport) != 0 || req.msg.dnatRule.dport == 0) {
+		rsp.code = ERROR_CODE_WRONG_IP;
+		return rsp;
+	}
+	req.msg.dnatRule.protocol = proto;
+	req.tp = REQ_DELDNATRule;
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取所有DNAT规则
+ * @return struct KernelResponse 包含所有DNAT规则的响应 (RSP_DNATRules)
+ */
+struct KernelResponse getAllDNATRules(void) {
+	struct APPRequest req;
+	memset(&req, 0, sizeof(req));
+	req.tp = REQ_GETDNATRules;
+	return exchangeDumpK(&req, sizeof(req));
+}
+
+/**
+ * @brief 以一个事务提交地址集合的条目
+ * @param id 集合编号(1 ~ IPSET_MAX)
+ * @param type 集合类型，增删模式下可为0
+ * @param mode IPSET_MODE_REPLACE / IPSET_MODE_ADD / IPSET_MODE_DEL
+ * @param entries 条目数组
+ * @param num 条目数
+ * @return struct KernelResponse 提交成功时 arrayLen 为集合现有的条目数；失败时为内核的提示消息
+ */
+struct KernelResponse pushIPSet(u_int8_t id, u_int8_t type, u_int8_t mode, const struct IPSetEntry *entries, unsigned int num) {
+	struct APPRequest *req;
+	struct KernelResponse rsp, ab;
+	unsigned int sent, part;
+	req = (struct APPRequest *)calloc(1, sizeof(struct APPRequest) + IPSET_CHUNK * sizeof(struct IPSetEntry));
+	if(req == NULL) {
+		rsp.code = ERROR_CODE_EXCHANGE;
+		return rsp;
+	}
+	req->tp = REQ_BeginIPSet;
+	req->msg.ipSet.id = id;
+	req->msg.ipSet.type = type;
+	req->msg.ipSet.mode = mode;
+	rsp = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(!batchStepOK(&rsp)) {
+		free(req);
+		return rsp;
+	}
+	for(sent = 0; sent < num; sent += part) {
+		free(rsp.data);
+		part = num - sent < IPSET_CHUNK ? num - sent : IPSET_CHUNK;
+		req->tp = REQ_ChunkIPSet;
+		req->msg.num = part;
+		memcpy(req + 1, entries + sent, part * sizeof(struct IPSetEntry));
+		rsp = exchangeMsgK(req, sizeof(struct APPRequest) + part * sizeof(struct IPSetEntry));
+		if(!batchStepOK(&rsp))
+			goto abort;
+	}
+	free(rsp.data);
+	req->tp = REQ_CommitIPSet;
+	rsp = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(!batchStepOK(&rsp))
+		goto abort;
+	free(req);
+	return rsp;
+abort:
+	req->tp = REQ_AbortIPSet;
+	ab = exchangeMsgK(req, sizeof(struct APPRequest));
+	if(ab.code >= 0)
+		free(ab.data);
+	free(req);
+	return rsp;
+}
+
+/**
+ * @brief 删除地址集合
+ * @param id 集合编号
+ * @return struct KernelResponse 内核响应，arrayLen 为删除的集合数
+ */
+struct KernelResponse destroyIPSet(u_int8_t id) {
+	struct APPRequest req;
+	memset(&req, 0, sizeof(req));
+	req.tp = REQ_DestroyIPSet;
+	req.msg.num = id;
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取所有地址集合的概要
+ * @return struct KernelResponse 包含 IPSetInfo 数组的响应 (RSP_IPSets)
+ */
+struct KernelResponse getIPSets(void) {
+	struct APPRequest req;
+	memset(&req, 0, sizeof(req));
+	req.tp = REQ_GETIPSets;
+	return exchangeDumpK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取一个地址集合的条目
+ * @param id 集合编号
+ * @return struct KernelResponse 包含 IPSetEntry 数组的响应 (RSP_IPSetEntries)
+ */
+struct KernelResponse getIPSetEntries(u_int8_t id) {
+	struct APPRequest req;
+	memset(&req, 0, sizeof(req));
+	req.tp = REQ_GETIPSetEntries;
+	req.msg.num = id;
+	return exchangeDumpK(&req, sizeof(req));
+}
+
 /**
  * @brief 设置默认过滤动作
  * @param action 默认动作(NF_ACCEPT=允许，NF_DROP=拒绝)
@@ -165,7 +431,7 @@ struct KernelResponse getLogs(unsigned int num) {
 	// exchange msg
 	req.msg.num = num;
 	req.tp = REQ_GETAllIPLogs;
-	return exchangeMsgK(&req, sizeof(req));
+	return exchangeDumpK(&req, sizeof(req));
 }
 
 /**
@@ -178,5 +444,174 @@ struct KernelResponse getAllConns(void) {
 	struct APPRequest req;
 	// exchange msg
 	req.tp = REQ_GETAllConns;
+	return exchangeDumpK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取连接超时配置
+ * @return struct KernelResponse 包含超时配置的响应
+ *         - header->bodyTp: 响应体类型(RSP_Timeouts)
+ */
+struct KernelResponse getTimeouts(void) {
+	struct APPRequest req;
+	// exchange msg
+	req.tp = REQ_GETTimeouts;
 	return exchangeMsgK(&req, sizeof(req));
 }
+
+/**
+ * @brief 设置连接超时配置
+ * @param timeouts 新的超时配置(秒)，值为0的项保持不变
+ * @return struct KernelResponse 内核响应
+ */
+struct KernelResponse setTimeouts(struct ConnTimeouts timeouts) {
+	struct APPRequest req;
+	// form request
+	req.tp = REQ_SETTimeouts;
+	req.msg.timeouts = timeouts;
+	// exchange
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取连接池统计
+ * @return struct KernelResponse 包含统计的响应
+ *         - header->bodyTp: 响应体类型(RSP_ConnStats)
+ */
+struct KernelResponse getConnStats(void) {
+	struct APPRequest req;
+	// exchange msg
+	req.tp = REQ_GETConnStats;
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 获取规则命中计数与钩子耗时统计
+ * @return struct KernelResponse 内核响应
+ */
+struct KernelResponse getStats(void) {
+	struct APPRequest req;
+	// exchange msg
+	req.tp = REQ_GETStats;
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 设置连接数上限与满表策略
+ * @param maxConns 连接数上限(0表示不修改)
+ * @param policy 满表策略(CONN_FULL_DROP/CONN_FULL_EVICT，0表示不修改)
+ * @return struct KernelResponse 内核响应
+ */
+struct KernelResponse setConnLimit(unsigned int maxConns, unsigned int policy) {
+	struct APPRequest req;
+	// form request
+	req.tp = REQ_SETConnLimit;
+	req.msg.connLimit.maxConns = maxConns;
+	req.msg.connLimit.policy = policy;
+	// exchange
+	return exchangeMsgK(&req, sizeof(req));
+}
+
+/**
+ * @brief 从一个日志环形缓冲区读出消费位置之后的全部日志
+ * @param ring 已映射的环形缓冲区
+ * @param tail [in/out] 该缓冲区的消费位置，返回时推进到本次读取时的head
+ * @param onLog 每条日志的回调
+ * @param lost [out] 累加读取前已被覆盖的日志条数
+ * @return int onLog 返回非0时返回该值，否则返回0
+ */
+static int drainLogRing(const struct logRing *ring, unsigned long *tail,
+		int (*onLog)(struct IPLog *log), unsigned long *lost) {
+	unsigned long head, pos, seq;
+	const struct logSlot *slot;
+	struct IPLog log;
+	int ret;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if(head - *tail > LOG_RING_SIZE) { // 消费过慢，最旧的部分已被覆盖
+		*lost += head - *tail - LOG_RING_SIZE;
+		*tail = head - LOG_RING_SIZE;
+	}
+	for(pos = *tail; pos != head; pos++) {
+		slot = &ring->slot[pos & (LOG_RING_SIZE - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if(seq != 2 * pos + 2) {
+			(*lost)++;
+			continue;
+		}
+		memcpy(&log, &slot->log, sizeof(log));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) { // 复制期间被覆盖
+			(*lost)++;
+			continue;
+		}
+		ret = onLog(&log);
+		if(ret != 0) {
+			*tail = pos + 1;
+			return ret;
+		}
+	}
+	*tail = head;
+	return 0;
+}
+
+/**
+ * @brief 持续读取内核日志流
+ * @param onLog 每条日志的回调，返回非0时停止
+ * @param onLost 日志丢失回调(可为NULL)
+ * @return int 正常停止返回0，设备不可用返回ERROR_CODE_LOG_DEV
+ * @note 内核各CPU的缓冲区依次映射，CPU编号不存在的偏移会映射失败并被跳过；
+ *       每个CPU内的日志按写入顺序输出
+ */
+int streamLogs(int (*onLog)(struct IPLog *log), void (*onLost)(unsigned long count)) {
+	long pageSize = sysconf(_SC_PAGESIZE), ncpu = sysconf(_SC_NPROCESSORS_CONF);
+	size_t ringBytes = (sizeof(struct logRing) + pageSize - 1) / pageSize * pageSize;
+	struct logRing **rings;
+	unsigned long *tails, lost;
+	int fd, i, n = 0, ret = 0, busy;
+	void *p;
+	fd = open(LOG_DEV_PATH, O_RDONLY);
+	if(fd < 0) {
+		perror("open " LOG_DEV_PATH);
+		return ERROR_CODE_LOG_DEV;
+	}
+	rings = calloc(ncpu, sizeof(*rings));
+	tails = calloc(ncpu, sizeof(*tails));
+	if(rings == NULL || tails == NULL) {
+		close(fd);
+		free(rings);
+		free(tails);
+		return ERROR_CODE_LOG_DEV;
+	}
+	for(i = 0; i < ncpu; i++) {
+		p = mmap(NULL, ringBytes, PROT_READ, MAP_SHARED, fd, (off_t)i * ringBytes);
+		if(p == MAP_FAILED)
+			continue;
+		rings[n] = p;
+		// 从缓冲区中仍保留的最旧日志开始读
+		tails[n] = rings[n]->head > LOG_RING_SIZE ? rings[n]->head - LOG_RING_SIZE : 0;
+		n++;
+	}
+	close(fd); // 映射建立后不再需要文件描述符
+	if(n == 0) {
+		printf("mmap " LOG_DEV_PATH " fail.\n");
+		ret = ERROR_CODE_LOG_DEV;
+	}
+	while(ret == 0 && n > 0) {
+		busy = 0;
+		for(i = 0; i < n && ret == 0; i++) {
+			lost = 0;
+			if(tails[i] != __atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE))
+				busy = 1;
+			ret = drainLogRing(rings[i], &tails[i], onLog, &lost);
+			if(lost && onLost != NULL)
+				onLost(lost);
+		}
+		if(!busy)
+			usleep(LOG_STREAM_IDLE_US);
+	}
+	for(i = 0; i < n; i++)
+		munmap(rings[i], ringBytes);
+	free(rings);
+	free(tails);
+	return ret < 0 ? ret : 0;
+}
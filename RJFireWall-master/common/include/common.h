@@ -25,6 +25,7 @@
 #include <unistd.h>     // POSIX 操作系统API (例如 close, read, write)
 #include <sys/types.h>  // 基本系统数据类型 (例如 pid_t, size_t)
 #include <sys/socket.h> // 套接字接口 (例如 socket, send, recv)
+#include <arpa/inet.h>  // inet_pton/inet_ntop，用于IPv6地址 (须在 linux/in.h 之前包含)
 #include <linux/types.h>  // Linux 特有的数据类型 (例如 __u8, __u32)
 #include <linux/in.h>     // IP协议相关定义 (例如 struct sockaddr_in)
 #include <linux/netfilter.h> // Netfilter 框架相关定义 (例如 NF_ACCEPT, NF_DROP)
@@ -45,6 +46,27 @@
 #define REQ_ADDNATRule 7     // 请求：添加一条NAT规则
 #define REQ_DELNATRule 8     // 请求：删除一条NAT规则
 #define REQ_GETNATRules 9    // 请求：获取所有NAT规则
+#define REQ_GETTimeouts 16   // 请求：获取连接超时配置
+#define REQ_SETTimeouts 17   // 请求：设置连接超时配置
+#define REQ_GETConnStats 19  // 请求：获取连接池容量与满表统计
+#define REQ_SETConnLimit 20  // 请求：设置连接数上限与满表策略
+#define REQ_BeginIPRules 23  // 请求：开始批量规则事务 (msg.num 为 IPRULE_BATCH_*)
+#define REQ_ChunkIPRules 24  // 请求：向事务追加一段规则 (msg.num 条 IPRule 紧跟在请求之后)
+#define REQ_CommitIPRules 25 // 请求：提交批量规则事务
+#define REQ_AbortIPRules 26  // 请求：放弃批量规则事务
+#define REQ_GETStats 27      // 请求：获取规则命中计数与钩子耗时统计
+#define REQ_GETConnSnap 29   // 请求：导出连接表快照 (只以 NLM_F_DUMP 分段导出)
+#define REQ_LoadConns 30     // 请求：导入一段连接快照 (msg.num 条 ConnSnap 紧跟在请求之后)
+#define REQ_ADDDNATRule 32   // 请求：添加一条DNAT (端口转发) 规则
+#define REQ_DELDNATRule 33   // 请求：删除一条DNAT规则 (按 msg.dnatRule 的地址、端口与协议)
+#define REQ_GETDNATRules 34  // 请求：获取所有DNAT规则
+#define REQ_BeginIPSet 36    // 请求：开始一个地址集合事务 (msg.ipSet 指定集合、类型与模式)
+#define REQ_ChunkIPSet 37    // 请求：向集合事务追加一段条目 (msg.num 个 IPSetEntry 紧跟在请求之后)
+#define REQ_CommitIPSet 38   // 请求：提交地址集合事务
+#define REQ_AbortIPSet 39    // 请求：放弃地址集合事务
+#define REQ_DestroyIPSet 40  // 请求：删除编号为 msg.num 的地址集合
+#define REQ_GETIPSets 41     // 请求：获取所有地址集合的概要 (只以 NLM_F_DUMP 分段导出)
+#define REQ_GETIPSetEntries 42 // 请求：获取编号为 msg.num 的集合的条目 (只以 NLM_F_DUMP 分段导出)
 
 // 定义响应类型常量，用于内核向APP发送响应时标识消息体内容类型。
 #define RSP_Only_Head 10     // 响应：仅包含头部信息 (通常表示操作成功或失败，无额外数据体)
@@ -53,6 +75,21 @@
 #define RSP_IPLogs 13        // 响应：IP日志列表 (消息体是 IPLog 结构体数组)
 #define RSP_NATRules 14      // 响应：NAT规则/记录列表 (消息体是 NATRecord 结构体数组)
 #define RSP_ConnLogs 15      // 响应：连接日志/信息列表 (消息体是 ConnLog 结构体数组)
+#define RSP_Timeouts 18      // 响应：连接超时配置 (消息体是一个 ConnTimeouts 结构体)
+#define RSP_ConnStats 21     // 响应：连接池统计 (消息体是一个 ConnStats 结构体)
+#define RSP_Event 22         // 多播事件 (消息体是一个 FwEvent 结构体)
+#define RSP_Stats 28         // 响应：命中与耗时统计 (消息体是一个 FwStatsHead 加 RuleStat 数组)
+#define RSP_ConnSnap 31      // 响应：连接快照 (消息体是 ConnSnap 结构体数组)
+#define RSP_DNATRules 35     // 响应：DNAT规则列表 (消息体是 DNATRule 结构体数组)
+#define RSP_IPSets 43        // 响应：地址集合概要 (消息体是 IPSetInfo 结构体数组)
+#define RSP_IPSetEntries 44  // 响应：地址集合条目 (消息体是 IPSetEntry 结构体数组)
+
+// 批量规则事务的模式与大小限制
+#define IPRULE_BATCH_REPLACE 1  // 提交时用暂存的规则替换整个规则链
+#define IPRULE_BATCH_APPEND 2   // 提交时把暂存的规则追加到规则链末尾
+#define IPRULE_BATCH_CHUNK 256  // 每条 REQ_ChunkIPRules 请求最多携带的规则数
+#define CONN_SNAP_CHUNK 256     // 每条 REQ_LoadConns 请求最多携带的连接数
+#define IPRULE_BATCH_MAX 65536  // 一个事务最多暂存的规则数
 
 /**
  * @brief IP规则结构体 (IPRule)
@@ -68,8 +105,18 @@ struct IPRule {
     unsigned int sport;          // 源端口号范围。高2字节表示最小端口，低2字节表示最大端口。0表示任意端口。
     unsigned int dport;          // 目的端口号范围。同上。0表示任意端口。
     u_int8_t protocol;           // 协议类型 (例如 TCP, UDP, ICMP，通常使用 IPPROTO_* 常量)
+    u_int8_t family;             // 地址族：0 或 AF_INET 为IPv4规则；AF_INET6 为IPv6规则，此时使用下面的 v6 字段
+    u_int8_t splen;              // IPv6 源地址前缀长度 (0-128)
+    u_int8_t dplen;              // IPv6 目的地址前缀长度 (0-128)
     unsigned int action;         // 对匹配此规则的数据包采取的动作 (例如 NF_ACCEPT, NF_DROP)
     unsigned int log;            // 是否记录日志 (1表示记录，0表示不记录)
+    unsigned int saddr6[4];      // IPv6 源地址 (网络字节序，即 struct in6_addr 的内容)
+    unsigned int daddr6[4];      // IPv6 目的地址 (网络字节序)
+    unsigned int rate;           // 限速：每个源前缀每秒允许新建的连接数，0表示不限速 (仅对放行规则有效)
+    unsigned int burst;          // 限速：令牌桶容量，即每个源前缀可瞬间新建的连接数，0表示等于 rate
+    u_int8_t limitPlen;          // 限速：按源地址的前多少位归为同一个源前缀 (IPv4 0-32，IPv6 0-128)
+    u_int8_t sset;               // 源地址须属于此编号的地址集合 (IPSET_MAX 以内)，0表示不引用集合；只用于IPv4规则
+    u_int8_t dset;               // 目的地址须属于此编号的地址集合，同上
     struct IPRule* nx;           // 指向下一条IP规则的指针。主要用于内核内部形成链表，
                                  // 在用户空间接收到规则数组时，此字段可能为NULL或无意义。
 };
@@ -86,12 +133,37 @@ struct IPLog {
     unsigned short sport;        // 源端口号 (网络字节序)
     unsigned short dport;        // 目的端口号 (网络字节序)
     u_int8_t protocol;           // 协议类型
+    u_int8_t family;             // 地址族 (AF_INET 或 AF_INET6)，IPv6 时地址在 saddr6/daddr6 中
     unsigned int len;            // IP数据包的负载长度 (IP总长度 - IP头长度)
     unsigned int action;         // 对该数据包采取的动作 (例如 NF_ACCEPT, NF_DROP)
+    unsigned int saddr6[4];      // IPv6 源地址 (网络字节序)
+    unsigned int daddr6[4];      // IPv6 目的地址 (网络字节序)
     struct IPLog* nx;            // 指向下一条IP日志的指针。主要用于内核内部可能的链式存储，
                                  // 在用户空间接收到日志数组时，此字段可能为NULL或无意义。
 };
 
+/**
+ * @brief 日志环形缓冲区 (logRing / logSlot)
+ * @功能描述: 内核为每个CPU维护一个日志环形缓冲区，并通过设备 LOG_DEV_PATH 只读映射给用户空间。
+ *           第 cpu 个缓冲区位于映射偏移 cpu * 按页对齐后的 sizeof(struct logRing) 处。
+ *           head 为该CPU已写入的日志总数；第 pos 条日志位于 slot[pos % LOG_RING_SIZE]，
+ *           写入中其 seq 为 2*pos+1，写完为 2*pos+2。读取时复制前后 seq 均为 2*pos+2 才是完整的日志。
+ *           布局须与内核 helper.h 中的定义保持一致。
+ */
+#define LOG_RING_SHIFT 10
+#define LOG_RING_SIZE (1u << LOG_RING_SHIFT)
+
+struct logSlot {
+    unsigned long seq;        // 槽位序号，奇数表示内核正在写入
+    unsigned long long stamp; // 纳秒级时间戳
+    struct IPLog log;         // 日志内容
+};
+
+struct logRing {
+    unsigned long head;                  // 该CPU已写入的日志总数 (生产者位置)
+    struct logSlot slot[LOG_RING_SIZE];
+};
+
 /**
  * @brief NAT记录或规则结构体 (NATRecord)
  * @功能描述: 用于定义网络地址转换 (NAT) 的规则或已建立的NAT转换记录。
@@ -111,6 +183,70 @@ struct NATRecord {
                                  // 在用户空间接收到数组时，此字段可能为NULL或无意义。
 };
 
+// 一条DNAT规则最多的后端数
+#define DNAT_MAX_BACKENDS 8
+
+/**
+ * @brief DNAT后端 (DNATBackend)
+ */
+struct DNATBackend {
+    unsigned int addr;          // 后端IP地址 (主机字节序)
+    unsigned short port;        // 后端端口，0表示沿用原目的端口
+    unsigned short pad;
+};
+
+/**
+ * @brief DNAT (端口转发) 规则结构体 (DNATRule)
+ * @功能描述: 以 (daddr, dport, protocol) 为键，到达该地址与端口的新连接被转发到某一个后端。
+ *           有多个后端时按 (源IP, 源端口) 做一致性哈希选择，增删后端只影响落在该后端上的新连接。
+ *           此结构体在用户空间和内核空间之间传递。
+ */
+struct DNATRule {
+    unsigned int daddr;         // 被访问的目的IP地址 (主机字节序)
+    unsigned short dport;       // 被访问的目的端口
+    u_int8_t protocol;          // IPPROTO_TCP 或 IPPROTO_UDP
+    u_int8_t backendNum;        // 后端个数 (1 ~ DNAT_MAX_BACKENDS)
+    struct DNATBackend backends[DNAT_MAX_BACKENDS];
+};
+
+// 地址集合：过滤规则以编号引用，集合内容可整体替换或增删，而不改动规则链
+#define IPSET_MAX 64               // 集合编号为 1 ~ IPSET_MAX
+#define IPSET_TYPE_HASH 1          // 单个IPv4地址的哈希集合，条目前缀长度必须为32
+#define IPSET_TYPE_NET 2           // IPv4前缀集合
+#define IPSET_MODE_REPLACE 1       // 提交时替换集合的全部条目 (集合不存在时创建)
+#define IPSET_MODE_ADD 2           // 提交时把条目加入已有集合
+#define IPSET_MODE_DEL 3           // 提交时从已有集合删除条目
+#define IPSET_CHUNK 2048           // 每条 REQ_ChunkIPSet 请求最多携带的条目数
+#define IPSET_MAX_ENTRIES (1<<21)  // 一个集合最多的条目数
+
+/**
+ * @brief 地址集合事务的参数 (IPSetHead)
+ * @功能描述: 替换模式下 type 为集合类型；增删模式下 type 为0或与已有集合相同。
+ */
+struct IPSetHead {
+    u_int8_t id;                // 集合编号
+    u_int8_t type;              // IPSET_TYPE_*
+    u_int8_t mode;              // IPSET_MODE_*
+    u_int8_t pad;
+};
+
+/**
+ * @brief 地址集合条目 (IPSetEntry)
+ */
+struct IPSetEntry {
+    unsigned int addr;          // IPv4地址或前缀 (主机字节序)
+    unsigned int plen;          // 前缀长度 (0-32)
+};
+
+/**
+ * @brief 地址集合概要 (IPSetInfo)
+ */
+struct IPSetInfo {
+    unsigned int id;
+    unsigned int type;
+    unsigned int num;           // 条目数
+};
+
 /**
  * @brief 连接日志/信息结构体 (ConnLog)
  * @功能描述: 定义一条网络连接的详细信息，包括可能的NAT转换。
@@ -122,8 +258,132 @@ struct ConnLog {
     unsigned short sport;       // 连接的源端口号 (网络字节序)
     unsigned short dport;       // 连接的目的端口号 (网络字节序)
     u_int8_t protocol;          // 连接的协议类型
+    u_int8_t family;            // 地址族 (AF_INET 或 AF_INET6)，IPv6 时地址在 saddr6/daddr6 中
     int natType;                // NAT转换类型 (参考下面的 NAT_TYPE_* 常量)
-    struct NATRecord nat;       // 如果该连接经过了NAT，这里存储相关的NAT转换记录信息。
+    struct NATRecord nat;       // 如果该连接经过了NAT，这里存储相关的NAT转换记录信息 (仅IPv4)。
+    unsigned int saddr6[4];     // IPv6 源地址 (网络字节序)
+    unsigned int daddr6[4];     // IPv6 目的地址 (网络字节序)
+};
+
+/**
+ * @brief 连接快照结构体 (ConnSnap)
+ * @功能描述: 用于模块重新加载前后保存与恢复连接表。相比 ConnLog 多出剩余存活时间、
+ *           TCP状态与日志标志，导入后连接按原状态继续，不必重新匹配规则。
+ */
+struct ConnSnap {
+    struct ConnLog conn;        // 连接键、协议、地址族与NAT记录
+    unsigned int ttl;           // 导出时剩余的存活时间 (秒)
+    u_int8_t state;             // TCP连接状态 (内核的 CONN_TCP_*)
+    u_int8_t needLog;           // 是否为该连接的数据包记录日志
+};
+
+/**
+ * @brief 连接超时配置结构体 (ConnTimeouts)
+ * @功能描述: 内核按协议及TCP状态为连接选择存活时长（秒）。
+ *           作为设置请求发送时，值为0的字段表示保持内核中的原值不变。
+ */
+struct ConnTimeouts {
+    unsigned int tcpSyn;     // TCP握手阶段 (只见过SYN)
+    unsigned int tcpEst;     // TCP已建立
+    unsigned int tcpFin;     // TCP关闭中 (见过FIN)
+    unsigned int tcpClose;   // TCP已关闭 (见过RST)
+    unsigned int udp;        // UDP
+    unsigned int icmp;       // ICMP
+    unsigned int other;      // 其他协议
+};
+
+// 连接池满时内核对新连接的处理策略
+#define CONN_FULL_DROP 1   // 丢弃新连接的数据包
+#define CONN_FULL_EVICT 2  // 在最先检查的一批连接中淘汰最早到期的一个，为新连接腾出位置
+
+/**
+ * @brief 连接池容量配置结构体 (ConnLimit)
+ * @功能描述: 用于 REQ_SETConnLimit 请求，值为0的字段表示保持内核中的原值不变。
+ */
+struct ConnLimit {
+    unsigned int maxConns;   // 连接数上限
+    unsigned int policy;     // 满表策略 (CONN_FULL_DROP 或 CONN_FULL_EVICT)
+};
+
+/**
+ * @brief 连接池统计结构体 (ConnStats)
+ * @功能描述: 内核连接池当前的容量、配置以及自模块加载以来的满表计数。
+ */
+struct ConnStats {
+    unsigned int connNum;    // 当前连接数
+    unsigned int maxConns;   // 连接数上限
+    unsigned int policy;     // 满表策略
+    unsigned int prealloc;   // 预留的节点数 (内核模块参数 conn_prealloc)
+    unsigned int tableFull;  // 新建连接时触及上限的次数
+    unsigned int evicted;    // 因满表被淘汰的连接数
+    unsigned int allocFail;  // 节点内存分配失败的次数
+};
+
+// 统计耗时的钩子点，IPv6过滤钩子计入同一钩子点的过滤统计
+#define HOOK_STAT_FILTER_IN 0   // 过滤钩子 (PRE_ROUTING)
+#define HOOK_STAT_FILTER_OUT 1  // 过滤钩子 (POST_ROUTING)
+#define HOOK_STAT_NAT_IN 2      // DNAT钩子 (PRE_ROUTING)
+#define HOOK_STAT_NAT_OUT 3     // SNAT钩子 (POST_ROUTING)
+#define HOOK_STAT_NUM 4
+#define HOOK_HIST_BUCKETS 32    // 桶0为0个周期，桶i (i>0) 为 [2^(i-1), 2^i) 个周期，最后一个桶不设上限
+
+/**
+ * @brief 钩子耗时统计结构体 (HookStat)
+ * @功能描述: 内核钩子函数每次调用所用CPU周期数的调用次数、总和与对数直方图。
+ */
+struct HookStat {
+    unsigned long long calls;                     // 调用次数
+    unsigned long long cycles;                    // 周期数总和
+    unsigned long long hist[HOOK_HIST_BUCKETS];   // 各耗时区间的调用次数
+};
+
+/**
+ * @brief 规则命中统计结构体 (RuleStat)
+ * @功能描述: 过滤规则只在新连接的首包上匹配，命中计数即按该规则建立 (或拒绝) 的连接数；
+ *           NAT规则在连接绑定SNAT时计数。
+ */
+struct RuleStat {
+    char name[MAXRuleNameLen+1];   // 过滤规则的名称，NAT规则为空
+    unsigned int index;            // 规则在链表中的序号
+    unsigned long long packets;    // 命中的数据包数
+    unsigned long long bytes;      // 命中的字节数
+};
+
+/**
+ * @brief 统计响应的头部 (FwStatsHead)
+ * @功能描述: RSP_Stats 的消息体以此开头，其后依次是 ruleNum 个过滤规则与 natNum 个NAT规则的 RuleStat。
+ */
+struct FwStatsHead {
+    struct HookStat hooks[HOOK_STAT_NUM]; // 各钩子点的耗时统计 (HOOK_STAT_*)
+    struct RuleStat deflt;                // 按默认动作处理的新连接
+    unsigned int ruleNum;                 // 过滤规则条数
+    unsigned int natNum;                  // NAT规则条数
+};
+
+// 多播组，用户空间绑定时 nl_groups 取 1 << (组号-1)
+#define FW_GROUP_CONN 1      // 连接事件：新建、NAT绑定、超时、删除
+#define FW_GROUP_RULE 2      // 规则命中事件
+#define FW_GROUP_MAX 2
+
+// 事件类型
+#define EVT_CONN_NEW 1       // 新建连接
+#define EVT_CONN_NAT 2       // 连接绑定了NAT记录
+#define EVT_CONN_EXPIRED 3   // 连接超时
+#define EVT_CONN_DEL 4       // 连接因满表淘汰或规则变化被删除
+#define EVT_RULE_HIT 5       // 数据包命中过滤规则
+
+/**
+ * @brief 多播事件结构体 (FwEvent)
+ * @功能描述: 内核以 KernelResponseHeader (bodyTp = RSP_Event) 加一个 FwEvent 的形式向多播组推送增量事件，
+ *           监听者据此维护连接表的镜像，无需反复拉取全表。
+ *           连接事件填写 conn；规则命中事件额外填写 ruleName 与 action，其中 conn 为数据包的五元组。
+ */
+struct FwEvent {
+    unsigned int type;                 // 事件类型 (EVT_*)
+    long tm;                           // 事件发生时间 (秒)
+    struct ConnLog conn;               // 连接或数据包的五元组及NAT信息
+    char ruleName[MAXRuleNameLen+1];   // 命中的规则名称
+    unsigned int action;               // 命中规则的动作
 };
 
 /**
@@ -138,8 +398,12 @@ struct APPRequest {
     union {                                   // 联合体，根据请求类型(tp)的不同，msg中存储不同的数据
         struct IPRule ipRule;                 // 当tp为 REQ_ADDIPRule 时，存储IP规则信息
         struct NATRecord natRule;             // 当tp为 REQ_ADDNATRule 时，存储NAT规则信息
+        struct DNATRule dnatRule;             // 当tp为 REQ_ADDDNATRule 或 REQ_DELDNATRule 时，存储DNAT规则
+        struct IPSetHead ipSet;               // 当tp为 REQ_BeginIPSet 时，存储集合事务的参数
         unsigned int defaultAction;           // 当tp为 REQ_SETAction 时，存储默认动作 (NF_ACCEPT 或 NF_DROP)
         unsigned int num;                     // 通用数字参数，例如 REQ_GETAllIPLogs 时用于指定获取日志数量
+        struct ConnTimeouts timeouts;         // 当tp为 REQ_SETTimeouts 时，存储新的超时配置
+        struct ConnLimit connLimit;           // 当tp为 REQ_SETConnLimit 时，存储新的容量配置
     } msg;                                    // 请求的具体消息内容
 };
 
@@ -165,12 +429,18 @@ struct KernelResponseHeader {
 #define uint8_t unsigned char // 为 u_int8_t 定义一个别名 (尽管 <linux/types.h> 中已有 __u8)
 #define NETLINK_MYFW 17      // 自定义的Netlink协议类型编号。用户空间和内核空间必须使用相同的协议号进行通信。
 #define MAX_PAYLOAD (1024 * 256) // 定义Netlink消息的最大负载大小 (256KB)。
+#define LOG_DEV_PATH "/dev/myfw_log" // 日志流设备，映射后可持续读取内核日志环形缓冲区。
+#define LOG_STREAM_IDLE_US 50000     // 日志流无新日志时的轮询间隔 (微秒)。
 
 // 定义应用程序层面的错误码
 #define ERROR_CODE_EXIT -1         // 通用退出错误码
 #define ERROR_CODE_EXCHANGE -2     // 与内核交换信息失败 (例如Netlink通信故障)
 #define ERROR_CODE_WRONG_IP -11    // 提供的IP地址格式错误
 #define ERROR_CODE_NO_SUCH_RULE -12 // 尝试操作一个不存在的规则
+#define ERROR_CODE_LOG_DEV -13     // 无法打开或映射日志流设备
+#define ERROR_CODE_SNAP_FILE -14   // 快照文件无法读写，或不是本版本写出的快照
+#define ERROR_CODE_RULE_FILE -15   // 规则文件无法读取，或某一行格式错误
+#define ERROR_CODE_DUMP_FILE -16   // 转储文件无法读写，或不是本版本写出的转储
 
 /**
  * @brief 内核回应包结构体 (KernelResponse)
@@ -199,9 +469,111 @@ struct KernelResponse {
  * @功能描述:
  *   此函数负责通过Netlink套接字向内核模块发送请求消息，并接收内核模块的响应。
  *   它处理Netlink消息的封装、发送、接收和初步解析，并将结果包装在 KernelResponse 结构体中返回。
+ *   请求经由 nlDefaultSession 发送，套接字与接收缓冲区在多次调用之间复用。
  */
 struct KernelResponse exchangeMsgK(void *smsg, unsigned int slen);
 
+/**
+ * @brief 以分段导出的方式与内核交换数据 (通过Netlink)。
+ * @param smsg 指向要发送给内核的请求 (struct APPRequest)。
+ * @param slen 请求的长度 (字节数)。
+ * @return struct KernelResponse 与 exchangeMsgK 相同；内核分多段发回的条目被拼接为一个数组，
+ *         `header->arrayLen` 为条目总数。调用者负责 `free(resp.data)`。
+ * @功能描述: 请求带 NLM_F_DUMP 标志，内核逐段回复直至 NLMSG_DONE，表的大小不再受 MAX_PAYLOAD 限制。
+ *           表为空时内核不回复任何分段，此时 `header->bodyTp` 与 `header->arrayLen` 均为0。
+ */
+struct KernelResponse exchangeDumpK(void *smsg, unsigned int slen);
+
+// ----- Netlink会话 -----
+// 会话在多次请求之间复用同一个套接字与接收缓冲区；请求以 nlmsg_seq 编号，
+// 可以连续发出多个请求后再按序列号取回复。分段导出 (exchangeDumpK) 不经过会话。
+
+#define NL_SESSION_NONBLOCK 1   // nlSessionOpen 标志：套接字非阻塞，nlSessionRecv 无回复时立即返回
+#define NL_SESSION_PARKED 64    // 等待某个回复期间最多暂存的其他回复数
+
+/**
+ * @brief 暂存的回复：等待某个序列号时先收到的其他请求的回复
+ */
+struct NLParked {
+    unsigned int seq;           // 所属请求的序列号
+    struct KernelResponse rsp;  // 回复内容，取走后由调用者释放 rsp.data
+};
+
+/**
+ * @brief Netlink会话 (NLSession)
+ * @功能描述: `fd` 可以加入 epoll/poll 等待可读，可读后反复调用 nlSessionRecv 直到其返回0。
+ */
+struct NLSession {
+    int fd;                     // Netlink套接字
+    int nonblock;               // 是否以 NL_SESSION_NONBLOCK 打开
+    unsigned int portid;        // 内核为套接字分配的端口号，作为请求的 nlmsg_pid
+    unsigned int seq;           // 上一个请求的序列号
+    struct nlmsghdr *rbuf;      // 复用的接收缓冲区 (NLMSG_SPACE(MAX_PAYLOAD) 字节)
+    struct nlmsghdr *rnext;     // rbuf 中下一条尚未取走的消息
+    int rlen;                   // rbuf 中从 rnext 开始尚未取走的字节数
+    unsigned int parkedNum;     // 暂存的回复数
+    struct NLParked parked[NL_SESSION_PARKED];
+};
+
+/**
+ * @brief 打开一个Netlink会话。
+ * @param s 会话。
+ * @param flags 0 或 NL_SESSION_NONBLOCK。
+ * @return int 成功返回0，无法创建或绑定套接字、分配接收缓冲区时返回 ERROR_CODE_EXCHANGE。
+ * @功能描述: 套接字绑定时由内核分配端口号，同一进程可以同时打开多个会话。
+ */
+int nlSessionOpen(struct NLSession *s, unsigned int flags);
+
+/**
+ * @brief 关闭会话，释放接收缓冲区与尚未取走的回复。
+ */
+void nlSessionClose(struct NLSession *s);
+
+/**
+ * @brief 发送一个请求，不等待回复。
+ * @param s 会话。
+ * @param smsg 请求 (struct APPRequest，可带有后续数据)。
+ * @param slen 请求长度。
+ * @return unsigned int 请求的序列号 (非0)，发送失败返回0。
+ */
+unsigned int nlSessionSend(struct NLSession *s, void *smsg, unsigned int slen);
+
+/**
+ * @brief 取出下一个回复，不论其属于哪个请求。
+ * @param s 会话。
+ * @param rsp [输出参数] 回复，布局与 exchangeMsgK 相同，调用者负责 `free(rsp->data)`。
+ * @param seq [输出参数] 回复所属请求的序列号。
+ * @return int 取到回复返回1；非阻塞会话暂无回复返回0；接收失败返回 ERROR_CODE_EXCHANGE。
+ * @功能描述: 先取出此前等待其他回复时暂存的回复，再从套接字接收。
+ */
+int nlSessionRecv(struct NLSession *s, struct KernelResponse *rsp, unsigned int *seq);
+
+/**
+ * @brief 等待指定请求的回复。
+ * @param s 会话。
+ * @param seq nlSessionSend 返回的序列号。
+ * @return struct KernelResponse 与 exchangeMsgK 相同；接收失败时 code 为 ERROR_CODE_EXCHANGE。
+ * @功能描述: 期间收到的其他回复被暂存，之后可由 nlSessionWait 或 nlSessionRecv 取出；
+ *           暂存已满时丢弃最早的一条。非阻塞会话在此以 poll 等待。
+ */
+struct KernelResponse nlSessionWait(struct NLSession *s, unsigned int seq);
+
+/**
+ * @brief 取得进程内共用的阻塞会话，首次调用时打开。
+ * @return struct NLSession* 会话，无法打开时返回NULL。
+ * @功能描述: exchangeMsgK 与批量接口经由该会话收发，连续的请求不再各自创建套接字。
+ */
+struct NLSession *nlDefaultSession(void);
+
+/**
+ * @brief 监听内核推送的多播事件。
+ * @param groups 多播组掩码，FW_GROUP_CONN 对应 1 << (FW_GROUP_CONN-1)，依此类推。
+ * @param onEvent 每收到一个事件调用一次，返回非0时停止监听。
+ * @return int 正常停止返回0，无法创建或绑定Netlink套接字时返回 ERROR_CODE_EXCHANGE。
+ * @功能描述: 加入指定的多播组后持续接收 FwEvent，用于在用户空间维护连接表镜像而无需轮询全表。
+ */
+int monitorEvents(unsigned int groups, int (*onEvent)(struct FwEvent *ev));
+
 // ----- 与内核交互函数 -----
 // 以下函数是对 exchangeMsgK 的进一步封装，提供了更语义化的接口来执行特定操作。
 // 它们内部会构建相应的 APPRequest 结构体，调用 exchangeMsgK，并返回 KernelResponse。
@@ -211,17 +583,41 @@ struct KernelResponse exchangeMsgK(void *smsg, unsigned int slen);
  * @param after 指向现有规则名称的字符串，新规则将插入到此规则之后。如果为NULL或空字符串，可能表示添加到链表头部或尾部 (具体行为由内核实现决定)。
  * @param name 新规则的名称字符串。
  * @param sip 源IP地址字符串 (例如 "192.168.1.0/24" 或 "192.168.1.100")。
- * @param dip 目的IP地址字符串 (格式同sip)。
+ * @param dip 目的IP地址字符串 (格式同sip)。任一侧可写作 "set:N"，表示地址须属于编号为N的地址集合 (仅IPv4)。
  * @param sport 源端口范围。高2字节为最小端口，低2字节为最大端口。0表示任意端口。
  *              例如，端口80: (80 << 16) | 80。范围80-90: (80 << 16) | 90。
  * @param dport 目的端口范围。编码方式同sport。
  * @param proto 协议类型 (例如 IPPROTO_TCP, IPPROTO_UDP)。
  * @param log 是否记录日志 (1表示记录，0表示不记录)。
  * @param action 对匹配数据包采取的动作 (NF_ACCEPT 或 NF_DROP)。
+ * @param rate 每个源前缀每秒允许新建的连接数，0表示不限速 (仅对 NF_ACCEPT 规则有效)。
+ * @param burst 令牌桶容量，0表示等于 rate。
+ * @param limitPlen 限速时按源地址的前多少位归为同一个源前缀。
  * @return struct KernelResponse 内核的响应。
  * @功能描述: 构建一个添加IP规则的请求发送给内核。
  */
-struct KernelResponse addFilterRule(char *after,char *name,char *sip,char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action);
+struct KernelResponse addFilterRule(char *after,char *name,char *sip,char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action,
+	unsigned int rate,unsigned int burst,u_int8_t limitPlen);
+
+/**
+ * @brief 由字符串形式的参数在本地构造一条IP过滤规则，不与内核交互。
+ * @param rule [输出参数] 构造的规则。
+ * @return int 成功返回0，IP地址格式错误返回 ERROR_CODE_WRONG_IP。
+ * @功能描述: 其余参数与 addFilterRule 相同，供 addFilterRule 与规则文件解析共用。
+ */
+int formIPRule(struct IPRule *rule,const char *name,const char *sip,const char *dip,unsigned int sport,unsigned int dport,u_int8_t proto,unsigned int log,unsigned int action,
+	unsigned int rate,unsigned int burst,u_int8_t limitPlen);
+
+/**
+ * @brief 以一个事务向内核提交一组IP过滤规则。
+ * @param rules 规则数组，按匹配优先级排列。
+ * @param num 规则数 (不超过 IPRULE_BATCH_MAX)。
+ * @param mode IPRULE_BATCH_REPLACE 替换整个规则链，IPRULE_BATCH_APPEND 追加到规则链末尾。
+ * @return struct KernelResponse 成功时 bodyTp 为 RSP_Only_Head，arrayLen 为提交后的规则数；
+ *         任一步骤失败时为内核回复的文本消息，事务已放弃，内核中的规则集保持不变。
+ * @功能描述: 规则按 IPRULE_BATCH_CHUNK 分段发送，内核在提交时一次性替换规则集，并只清理一次连接池。
+ */
+struct KernelResponse addFilterRules(struct IPRule *rules, unsigned int num, unsigned int mode);
 
 /**
  * @brief 从内核删除指定名称的IP过滤规则。
@@ -264,6 +660,56 @@ struct KernelResponse delNATRule(int num);
  */
 struct KernelResponse getAllNATRules(void);
 
+/**
+ * @brief 新增一条DNAT (端口转发) 规则。
+ * @param dst 被访问的地址与端口字符串 (例如 "202.100.10.1:80")。
+ * @param proto 协议 (IPPROTO_TCP 或 IPPROTO_UDP)。
+ * @param backends 以逗号分隔的后端列表 (例如 "10.0.0.2:8080,10.0.0.3")，最多 DNAT_MAX_BACKENDS 个。
+ * @return struct KernelResponse 内核的响应，地址格式错误时 code 为 ERROR_CODE_WRONG_IP。
+ */
+struct KernelResponse addDNATRule(const char *dst, u_int8_t proto, const char *backends);
+
+/**
+ * @brief 删除被访问地址、端口与协议都相同的DNAT规则。
+ * @return struct KernelResponse 内核的响应 (RSP_Only_Head，arrayLen 为删除的规则数)。
+ */
+struct KernelResponse delDNATRule(const char *dst, u_int8_t proto);
+
+/**
+ * @brief 从内核获取所有DNAT规则。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分为 `DNATRule` 结构体数组。
+ */
+struct KernelResponse getAllDNATRules(void);
+
+/**
+ * @brief 在一个事务中替换地址集合的内容，或向集合增删条目。
+ * @param id 集合编号 (1 ~ IPSET_MAX)。
+ * @param type 集合类型 (IPSET_TYPE_*)；增删模式下可为0。
+ * @param mode IPSET_MODE_REPLACE、IPSET_MODE_ADD 或 IPSET_MODE_DEL。
+ * @param entries 条目数组，num 可以为0 (例如清空集合)。
+ * @return struct KernelResponse 成功时为 RSP_Only_Head，arrayLen 为提交后集合的条目数；失败时为内核的提示消息。
+ * @功能描述: 条目按 IPSET_CHUNK 分段发送，任何一步失败都会放弃事务，内核中的集合保持原样。
+ */
+struct KernelResponse pushIPSet(u_int8_t id, u_int8_t type, u_int8_t mode, const struct IPSetEntry *entries, unsigned int num);
+
+/**
+ * @brief 删除地址集合，引用它的规则从此不再匹配。
+ * @return struct KernelResponse 内核的响应 (RSP_Only_Head，arrayLen 为删除的集合数)。
+ */
+struct KernelResponse destroyIPSet(u_int8_t id);
+
+/**
+ * @brief 获取所有地址集合的概要。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分为 `IPSetInfo` 结构体数组。
+ */
+struct KernelResponse getIPSets(void);
+
+/**
+ * @brief 获取一个地址集合的全部条目。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分为 `IPSetEntry` 结构体数组。
+ */
+struct KernelResponse getIPSetEntries(u_int8_t id);
+
 /**
  * @brief 设置内核防火墙的默认动作。
  * @param action 默认动作 (NF_ACCEPT 或 NF_DROP)。
@@ -287,6 +733,277 @@ struct KernelResponse getLogs(unsigned int num);
  */
 struct KernelResponse getAllConns(void);
 
+/**
+ * @brief 从内核获取连接超时配置。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分是一个 `ConnTimeouts` 结构体。
+ * @功能描述: 构建一个获取超时配置的请求发送给内核。
+ */
+struct KernelResponse getTimeouts(void);
+
+/**
+ * @brief 修改内核的连接超时配置。
+ * @param timeouts 新的超时配置（秒），值为0的字段保持不变。
+ * @return struct KernelResponse 内核的响应。
+ * @功能描述: 构建一个设置超时配置的请求发送给内核，新配置在连接下一次刷新时生效。
+ */
+struct KernelResponse setTimeouts(struct ConnTimeouts timeouts);
+
+/**
+ * @brief 从内核获取连接池统计。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分是一个 `ConnStats` 结构体。
+ * @功能描述: 构建一个获取连接池容量与满表计数的请求发送给内核。
+ */
+struct KernelResponse getConnStats(void);
+
+/**
+ * @brief 从内核获取规则命中计数与钩子耗时统计。
+ * @return struct KernelResponse 内核的响应。响应的 `body` 部分是一个 `FwStatsHead` 加 `RuleStat` 数组。
+ * @功能描述: 构建一个获取统计的请求发送给内核。
+ */
+struct KernelResponse getStats(void);
+
+/**
+ * @brief 修改内核连接池的容量配置。
+ * @param maxConns 新的连接数上限，0表示不修改。
+ * @param policy 新的满表策略 (CONN_FULL_DROP 或 CONN_FULL_EVICT)，0表示不修改。
+ * @return struct KernelResponse 内核的响应。
+ * @功能描述: 构建一个设置连接数上限与满表策略的请求发送给内核。
+ */
+struct KernelResponse setConnLimit(unsigned int maxConns, unsigned int policy);
+
+/**
+ * @brief 持续读取内核日志流。
+ * @param onLog 每读到一条日志调用一次，返回非0时停止读取。
+ * @param onLost 发现有日志在读取前已被覆盖时调用，参数为丢失的条数；可为NULL。
+ * @return int onLog 要求停止时返回0；无法打开或映射日志流设备时返回 ERROR_CODE_LOG_DEV。
+ * @功能描述: 映射 LOG_DEV_PATH 中每个CPU的日志环形缓冲区，在用户空间维护各缓冲区的消费位置并轮询读取，
+ *           先读出缓冲区中现存的日志，之后持续读取新日志，每条日志不需要系统调用。
+ */
+int streamLogs(int (*onLog)(struct IPLog *log), void (*onLost)(unsigned long count));
+
+// ----- 规则文件相关 -----
+// 规则文件每行一条规则，字段以空白分隔，'#' 之后为注释：
+//   <name> <sip> <sport> <dip> <dport> <proto> <accept|drop> [log] [limit=rate/burst/prefix]
+// 端口为 any、单个端口或 min-max；协议为 tcp/udp/icmp/icmp6/any (不区分大小写)。
+// 地址可写作 set:N 引用地址集合，集合的内容由 `uapp set` 单独维护。
+// 规则按文件中的顺序匹配，名称不能重复。
+
+#define RULE_LINE_MAX 256   // 规则文件一行的最大长度
+
+/**
+ * @brief 解析规则文件中的一行。
+ * @param line 该行内容，解析过程中会被修改。
+ * @param rule [输出参数] 解析出的规则。
+ * @return int 解析出规则返回1，空行或注释返回0，格式错误返回 ERROR_CODE_RULE_FILE 或 ERROR_CODE_WRONG_IP。
+ */
+int parseRuleLine(char *line, struct IPRule *rule);
+
+/**
+ * @brief 读取并解析整个规则文件。
+ * @param path 规则文件路径。
+ * @param rules [输出参数] 规则数组，由调用者 free；文件中没有规则时也会分配。
+ * @param num [输出参数] 规则数，不超过 IPRULE_BATCH_MAX。
+ * @param errLine [输出参数] 出错时为出错的行号，无法打开文件或内存不足时为0。
+ * @return int 成功返回0，失败返回 ERROR_CODE_RULE_FILE 或 ERROR_CODE_WRONG_IP。
+ */
+int readRuleFile(const char *path, struct IPRule **rules, unsigned int *num, unsigned int *errLine);
+
+/**
+ * @brief 使内核中的规则链与给定的规则数组一致，只提交差异部分。
+ * @param rules 期望的规则数组。
+ * @param num 规则数。
+ * @param mode [输出参数] 实际采用的方式：0 表示两者已经一致未发送任何请求，
+ *             IPRULE_BATCH_APPEND 表示只追加了内核规则链之后的新规则，IPRULE_BATCH_REPLACE 表示替换了整个规则链。
+ * @param pushed [输出参数] 提交给内核的规则数。
+ * @return struct KernelResponse 与 addFilterRules 相同；mode 为0时 code 为 ERROR_CODE_EXIT。
+ * @功能描述: 规则按顺序匹配，规则链中间的变化会影响其后所有规则的生效范围，
+ *           因此只有“内核规则链是期望规则的前缀”时才以追加方式提交，其余情况在一个事务中整体替换。
+ */
+struct KernelResponse applyFilterRules(struct IPRule *rules, unsigned int num, unsigned int *mode, unsigned int *pushed);
+
+// 地址集合文件每行一个IPv4地址或前缀 (如 10.0.0.1、10.0.0.0/8)，'#' 之后为注释。
+
+/**
+ * @brief 读取地址集合文件。
+ * @param path 文件路径。
+ * @param entries [输出参数] 条目数组，由调用者 free；文件中没有条目时也会分配。
+ * @param num [输出参数] 条目数，不超过 IPSET_MAX_ENTRIES。
+ * @param errLine [输出参数] 出错时为出错的行号，无法打开文件或内存不足时为0。
+ * @return int 成功返回0，失败返回 ERROR_CODE_RULE_FILE 或 ERROR_CODE_WRONG_IP。
+ */
+int readIPSetFile(const char *path, struct IPSetEntry **entries, unsigned int *num, unsigned int *errLine);
+
+// ----- 快照相关 -----
+
+#define SNAP_MAGIC 0x57464A52  // 快照文件标识 "RJFW"
+#define SNAP_VERSION 1         // 快照文件格式版本
+
+/**
+ * @brief 快照文件头 (SnapHead)
+ * @功能描述: 文件依次保存头部、过滤规则、NAT规则与连接快照。记录各结构体的大小，
+ *           由不同版本的结构体定义写出的快照在载入时被拒绝。
+ */
+struct SnapHead {
+    unsigned int magic;         // SNAP_MAGIC
+    unsigned int version;       // SNAP_VERSION
+    long long savedAt;          // 保存时间 (time(NULL))，载入时据此扣减连接的剩余存活时间
+    unsigned int ruleSize;      // sizeof(struct IPRule)
+    unsigned int natSize;       // sizeof(struct NATRecord)
+    unsigned int connSize;      // sizeof(struct ConnSnap)
+    unsigned int ruleNum;       // 过滤规则条数
+    unsigned int natNum;        // NAT规则条数
+    unsigned int connNum;       // 连接条数
+};
+
+/**
+ * @brief 将内核中的过滤规则、NAT规则与连接表保存到快照文件。
+ * @param path 快照文件路径。
+ * @param head [输出参数] 写出的文件头，可为NULL。
+ * @return int 成功返回0；与内核交换失败返回 ERROR_CODE_EXCHANGE，写文件失败返回 ERROR_CODE_SNAP_FILE。
+ * @功能描述: 三部分分别导出，彼此之间内核状态可能变化。默认动作无法从内核读取，不在快照中。
+ */
+int saveSnapshot(const char *path, struct SnapHead *head);
+
+/**
+ * @brief 将快照文件载入内核，用于模块重新加载之后恢复状态。
+ * @param path 快照文件路径。
+ * @param head [输出参数] 读到的文件头，可为NULL。
+ * @return int 成功返回恢复的连接数；文件无效返回 ERROR_CODE_SNAP_FILE，与内核交换失败或内核拒绝某条NAT规则时返回 ERROR_CODE_EXCHANGE。
+ * @功能描述: 过滤规则以一个事务替换现有规则集，NAT规则先清空现有链再逐条添加，
+ *           重复载入不会叠出重复规则。连接的剩余存活时间扣除保存以来经过的时间，已超时的连接不再恢复。
+ */
+int loadSnapshot(const char *path, struct SnapHead *head);
+
+/**
+ * @brief 以分段导出取得一类条目，供快照与转储共用。
+ * @param reqTp 请求类型 (如 REQ_GETAllIPRules)。
+ * @param rspTp 期望的响应类型 (如 RSP_IPRules)。
+ * @param size 每个条目的大小，用于核对响应长度。
+ * @param rsp [输出参数] 内核响应，成功时由调用者 free(rsp->data)。
+ * @param num [输出参数] 条目数，表为空时为0。
+ * @return int 成功返回0，失败返回 ERROR_CODE_EXCHANGE。
+ */
+int snapFetch(unsigned int reqTp, unsigned int rspTp, unsigned int size, struct KernelResponse *rsp, unsigned int *num);
+
+// ----- 转储与离线分析相关 -----
+
+#define DUMP_MAGIC 0x44464A52  // 转储文件标识 "RJFD"
+#define DUMP_VERSION 1         // 转储文件格式版本
+#define DUMP_TOP_MAX 100       // 离线分析最多列出的来源地址数
+
+/**
+ * @brief 转储文件头 (DumpHead)
+ * @功能描述: 文件依次保存头部、过滤规则、NAT规则、一个 FwStatsHead 及其后的 statNum 个 RuleStat、
+ *           连接快照与过滤日志，均为内核回复中的原始结构体。各部分的大小都是8的倍数，
+ *           映射文件后可直接按结构体数组访问。
+ */
+struct DumpHead {
+    unsigned int magic;         // DUMP_MAGIC
+    unsigned int version;       // DUMP_VERSION
+    long long savedAt;          // 保存时间 (time(NULL))
+    unsigned int ruleSize;      // sizeof(struct IPRule)
+    unsigned int natSize;       // sizeof(struct NATRecord)
+    unsigned int statSize;      // sizeof(struct RuleStat)
+    unsigned int connSize;      // sizeof(struct ConnSnap)
+    unsigned int logSize;       // sizeof(struct IPLog)
+    unsigned int ruleNum;       // 过滤规则条数
+    unsigned int natNum;        // NAT规则条数
+    unsigned int statNum;       // 命中统计条数，等于统计头中的 ruleNum + natNum
+    unsigned int connNum;       // 连接条数
+    unsigned int logNum;        // 日志条数
+};
+
+/**
+ * @brief 映射后的转储文件 (DumpView)
+ * @功能描述: 各指针指向映射内存中的对应部分，由 mapDump 填写、unmapDump 释放。
+ */
+struct DumpView {
+    const struct DumpHead *head;
+    const struct IPRule *rules;
+    const struct NATRecord *nats;
+    const struct FwStatsHead *stats;  // 其后紧跟 statNum 个 RuleStat，可直接交给统计的显示函数
+    const struct ConnSnap *conns;
+    const struct IPLog *logs;
+    void *base;                       // 映射起始地址
+    size_t len;                       // 映射长度
+};
+
+/**
+ * @brief 一个来源地址的汇总 (DumpTalker)
+ * @功能描述: 以连接与日志的源地址为键，汇总该来源的连接数与日志中的流量。
+ */
+struct DumpTalker {
+    u_int8_t family;                 // 地址族，IPv4 为 0 或 AF_INET
+    unsigned int addr;               // IPv4 源地址
+    unsigned int addr6[4];           // IPv6 源地址 (网络字节序)
+    unsigned int conns;              // 以该地址为源的连接数
+    unsigned int snat;               // 其中做了源NAT的连接数
+    unsigned long long logs;         // 日志中以该地址为源的数据包数
+    unsigned long long bytes;        // 这些数据包的负载字节数
+    unsigned long long dropped;      // 其中被丢弃的数据包数
+};
+
+/**
+ * @brief NAT规则的端口池占用 (DumpPoolUse)
+ */
+struct DumpPoolUse {
+    unsigned int used;          // 已被源NAT连接占用的不同转换端口数
+    unsigned int size;          // 端口池的大小，与内核一样不含端口0
+};
+
+/**
+ * @brief 将内核中的规则、命中统计、连接表与全部日志原样写入转储文件。
+ * @param path 转储文件路径。
+ * @param head [输出参数] 写出的文件头，可为NULL。
+ * @return int 成功返回0；与内核交换失败返回 ERROR_CODE_EXCHANGE，写文件失败返回 ERROR_CODE_DUMP_FILE。
+ * @功能描述: 与快照不同，转储只用于离线分析，不能载入内核；各部分分别导出，彼此之间内核状态可能变化。
+ */
+int saveDump(const char *path, struct DumpHead *head);
+
+/**
+ * @brief 只读映射转储文件并核对文件头。
+ * @param path 转储文件路径。
+ * @param view [输出参数] 各部分的位置。
+ * @return int 成功返回0；文件无法读取、长度不符或不是本版本写出的转储时返回 ERROR_CODE_DUMP_FILE。
+ */
+int mapDump(const char *path, struct DumpView *view);
+
+/**
+ * @brief 解除 mapDump 建立的映射。
+ * @param view 已映射的转储。
+ */
+void unmapDump(struct DumpView *view);
+
+/**
+ * @brief 按源地址汇总转储中的连接与日志。
+ * @param view 已映射的转储。
+ * @param talkers [输出参数] 汇总数组，由调用者 free；没有来源时也会分配。
+ * @param num [输出参数] 不同来源地址的个数。
+ * @return int 成功返回0，内存不足返回 ERROR_CODE_EXIT。
+ */
+int dumpTalkers(const struct DumpView *view, struct DumpTalker **talkers, unsigned int *num);
+
+/**
+ * @brief 从汇总中取出排名最前的来源地址。
+ * @param talkers dumpTalkers 得到的汇总数组。
+ * @param num 汇总数组长度。
+ * @param byBytes 非0时按日志字节数排序，否则按连接数排序。
+ * @param top [输出参数] 按降序排列的结果，至少能容纳 n 个。
+ * @param n 需要的个数。
+ * @return unsigned int 实际取出的个数。
+ */
+unsigned int dumpTopTalkers(const struct DumpTalker *talkers, unsigned int num, int byBytes, struct DumpTalker *top, unsigned int n);
+
+/**
+ * @brief 统计各NAT规则的端口池占用。
+ * @param view 已映射的转储。
+ * @param uses [输出参数] 长度为 natNum 的数组，与转储中的NAT规则一一对应。
+ * @return int 成功返回0，内存不足返回 ERROR_CODE_EXIT。
+ * @功能描述: 每条源NAT连接归入第一条NAT地址相同且端口池包含其转换后端口的规则，
+ *           每条规则按转换后端口去重计数。
+ */
+int dumpNATUsage(const struct DumpView *view, struct DumpPoolUse *uses);
+
 // ----- 一些工具函数 ------
 // 以下函数为辅助函数，主要用于IP地址字符串和整数表示之间的转换。
 
@@ -329,4 +1046,29 @@ int IPint2IPstrNoMask(unsigned int ip, char *ipStr);
  */
 int IPint2IPstrWithPort(unsigned int ip, unsigned short port, char *ipStr);
 
+#define IPSTR_MAXLEN 56 // 可容纳带前缀长度 ("/128") 或端口 ("[...]:65535") 的IPv6地址字符串
+
+/**
+ * @brief 将IPv6地址字符串 (如 "2001:db8::/32" 或 "::1") 转换为地址与前缀长度。
+ * @param ipStr 输入字符串，不带 '/' 时前缀长度为128。
+ * @param ip6 [输出参数] 4个 unsigned int，按网络字节序存放地址 (即 struct in6_addr 的内容)。
+ * @param plen [输出参数] 前缀长度 (0-128)。
+ * @return int 成功返回0，地址或前缀长度非法返回-1。
+ */
+int IP6str2IP6int(const char *ipStr, unsigned int *ip6, u_int8_t *plen);
+
+/**
+ * @brief 将IPv6地址与前缀长度格式化为 "addr/plen"，前缀长度为128时只输出地址。
+ * @param ipStr [输出参数] 至少 IPSTR_MAXLEN 字节。
+ * @return int 成功返回0，失败返回-1。
+ */
+int IP6int2IP6str(const unsigned int *ip6, u_int8_t plen, char *ipStr);
+
+/**
+ * @brief 将IPv6地址与端口格式化为 "[addr]:port"，端口为0时只输出地址。
+ * @param ipStr [输出参数] 至少 IPSTR_MAXLEN 字节。
+ * @return int 成功返回0，失败返回-1。
+ */
+int IP6int2IP6strWithPort(const unsigned int *ip6, unsigned short port, char *ipStr);
+
 #endif // _COMMON_APP_H 结束条件预处理指令
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "common.h"
+
+#define IPSET_LINE_MAX 64 // 集合文件一行的最大长度
+
+// 解析集合文件中的一行：解析出条目返回1，空行或注释返回0，格式错误返回错误码
+static int parseIPSetLine(char *line, struct IPSetEntry *entry) {
+	char *tok, *save = NULL;
+	unsigned int mask;
+
+	tok = strchr(line, '#');
+	if(tok != NULL)
+		*tok = '\0';
+	tok = strtok_r(line, " \t\r\n", &save);
+	if(tok == NULL)
+		return 0;
+	if(strtok_r(NULL, " \t\r\n", &save) != NULL)
+		return ERROR_CODE_RULE_FILE;
+	if(IPstr2IPint(tok, &entry->addr, &mask) != 0)
+		return ERROR_CODE_WRONG_IP;
+	for(entry->plen = 0; entry->plen < 32 && (mask & (0x80000000u >> entry->plen)); entry->plen++);
+	entry->addr &= mask;
+	return 1;
+}
+
+/**
+ * @brief 读取地址集合文件
+ * @param path 文件路径
+ * @param entries [out] 条目数组(需要调用者free)
+ * @param num [out] 条目数
+ * @param errLine [out] 出错的行号
+ * @return int 成功返回0，失败返回错误码
+ * @note 重复的条目原样保留，由内核在提交时去重
+ */
+int readIPSetFile(const char *path, struct IPSetEntry **entries, unsigned int *num, unsigned int *errLine) {
+	char line[IPSET_LINE_MAX + 2];
+	unsigned int cap = 1024, lineNo = 0;
+	struct IPSetEntry *arr, *tmp, entry;
+	FILE *fp;
+	int ret = 0;
+
+	*errLine = 0;
+	*num = 0;
+	fp = fopen(path, "r");
+	if(fp == NULL)
+		return ERROR_CODE_RULE_FILE;
+	arr = (struct IPSetEntry *)malloc(cap * sizeof(struct IPSetEntry));
+	if(arr == NULL) {
+		fclose(fp);
+		return ERROR_CODE_RULE_FILE;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		lineNo++;
+		if(strchr(line, '\n') == NULL && !feof(fp)) { // 行过长
+			ret = ERROR_CODE_RULE_FILE;
+			break;
+		}
+		ret = parseIPSetLine(line, &entry);
+		if(ret <= 0) {
+			if(ret < 0)
+				break;
+			continue;
+		}
+		ret = 0;
+		if(*num == cap) {
+			if(cap == IPSET_MAX_ENTRIES) {
+				ret = ERROR_CODE_RULE_FILE;
+				break;
+			}
+			cap = cap * 2 < IPSET_MAX_ENTRIES ? cap * 2 : IPSET_MAX_ENTRIES;
+			tmp = (struct IPSetEntry *)realloc(arr, cap * sizeof(struct IPSetEntry));
+			if(tmp == NULL) {
+				lineNo = 0;
+				ret = ERROR_CODE_RULE_FILE;
+				break;
+			}
+			arr = tmp;
+		}
+		arr[(*num)++] = entry;
+	}
+	fclose(fp);
+	if(ret < 0) {
+		*errLine = lineNo;
+		*num = 0;
+		free(arr);
+		return ret;
+	}
+	*entries = arr;
+	return 0;
+}
@@ -0,0 +1,244 @@
+#include "common.h"
+#include <strings.h>
+
+// 解析端口范围 (any、单个端口或 min-max)，结果的高16位为最小端口，低16位为最大端口
+static int parsePortRange(const char *s, unsigned int *range) {
+	unsigned int min, max;
+	char tail;
+	if(strcasecmp(s, "any") == 0) {
+		*range = 0xFFFFu;
+		return 0;
+	}
+	if(sscanf(s, "%u-%u%c", &min, &max, &tail) == 2) {
+		if(min > max || max > 0xFFFFu)
+			return -1;
+	} else if(sscanf(s, "%u%c", &min, &tail) == 1 && min <= 0xFFFFu) {
+		max = min;
+	} else
+		return -1;
+	*range = (min << 16) | max;
+	return 0;
+}
+
+// 解析协议名
+static int parseProto(const char *s, u_int8_t *proto) {
+	if(strcasecmp(s, "tcp") == 0)
+		*proto = IPPROTO_TCP;
+	else if(strcasecmp(s, "udp") == 0)
+		*proto = IPPROTO_UDP;
+	else if(strcasecmp(s, "icmp") == 0)
+		*proto = IPPROTO_ICMP;
+	else if(strcasecmp(s, "icmp6") == 0)
+		*proto = IPPROTO_ICMPV6;
+	else if(strcasecmp(s, "any") == 0)
+		*proto = IPPROTO_IP;
+	else
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief 解析规则文件中的一行
+ * @param line 该行内容(会被修改)
+ * @param rule [out] 解析出的规则
+ * @return int 解析出规则返回1，空行或注释返回0，格式错误返回错误码
+ */
+int parseRuleLine(char *line, struct IPRule *rule) {
+	char *f[9], *save = NULL, *tok, *hash;
+	unsigned int n = 0, sport, dport, action, log = 0, rate = 0, burst = 0, plen = 0, i;
+	u_int8_t proto;
+
+	hash = strchr(line, '#');
+	if(hash != NULL)
+		*hash = '\0';
+	for(tok = strtok_r(line, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save)) {
+		if(n == 9)
+			return ERROR_CODE_RULE_FILE;
+		f[n++] = tok;
+	}
+	if(n == 0)
+		return 0;
+	if(n < 7 || strlen(f[0]) > MAXRuleNameLen)
+		return ERROR_CODE_RULE_FILE;
+	if(parsePortRange(f[2], &sport) != 0 || parsePortRange(f[4], &dport) != 0 || parseProto(f[5], &proto) != 0)
+		return ERROR_CODE_RULE_FILE;
+	if(strcasecmp(f[6], "accept") == 0)
+		action = NF_ACCEPT;
+	else if(strcasecmp(f[6], "drop") == 0)
+		action = NF_DROP;
+	else
+		return ERROR_CODE_RULE_FILE;
+	for(i = 7; i < n; i++) {
+		if(strcasecmp(f[i], "log") == 0 && !log)
+			log = 1;
+		else if(strncasecmp(f[i], "limit=", 6) == 0 && rate == 0 && action == NF_ACCEPT) {
+			if(sscanf(f[i] + 6, "%u/%u/%u", &rate, &burst, &plen) != 3 || rate == 0 || plen > 128)
+				return ERROR_CODE_RULE_FILE;
+		} else
+			return ERROR_CODE_RULE_FILE;
+	}
+	if(formIPRule(rule, f[0], f[1], f[3], sport, dport, proto, log, action, rate, burst, (u_int8_t)plen) != 0)
+		return ERROR_CODE_WRONG_IP;
+	return 1;
+}
+
+// 按名称排序规则序号，用于检查重复的名称
+static const struct IPRule *sortBase;
+static int cmpRuleName(const void *a, const void *b) {
+	int r = strncmp(sortBase[*(const unsigned int *)a].name, sortBase[*(const unsigned int *)b].name, MAXRuleNameLen);
+	if(r != 0)
+		return r;
+	return *(const unsigned int *)a < *(const unsigned int *)b ? -1 : 1;
+}
+
+/**
+ * @brief 读取规则文件
+ * @param path 规则文件路径
+ * @param rules [out] 规则数组(需要调用者free)
+ * @param num [out] 规则数
+ * @param errLine [out] 出错的行号
+ * @return int 成功返回0，失败返回错误码
+ * @note 为每条规则记下行号，名称重复时报告后出现的那一行
+ */
+int readRuleFile(const char *path, struct IPRule **rules, unsigned int *num, unsigned int *errLine) {
+	char line[RULE_LINE_MAX + 2];
+	unsigned int cap = 1024, lineNo = 0, *lines, *order, i;
+	struct IPRule *arr, *tmp, rule;
+	unsigned int *ltmp;
+	FILE *fp;
+	int ret = 0;
+
+	*errLine = 0;
+	*num = 0;
+	fp = fopen(path, "r");
+	if(fp == NULL)
+		return ERROR_CODE_RULE_FILE;
+	arr = (struct IPRule *)malloc(cap * sizeof(struct IPRule));
+	lines = (unsigned int *)malloc(cap * sizeof(unsigned int));
+	if(arr == NULL || lines == NULL) {
+		ret = ERROR_CODE_RULE_FILE;
+		goto out;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		lineNo++;
+		if(strchr(line, '\n') == NULL && !feof(fp)) { // 行过长
+			ret = ERROR_CODE_RULE_FILE;
+			break;
+		}
+		ret = parseRuleLine(line, &rule);
+		if(ret <= 0) {
+			if(ret < 0)
+				break;
+			continue;
+		}
+		ret = 0;
+		if(*num == cap) {
+			if(cap == IPRULE_BATCH_MAX) {
+				ret = ERROR_CODE_RULE_FILE;
+				break;
+			}
+			cap = cap * 2 < IPRULE_BATCH_MAX ? cap * 2 : IPRULE_BATCH_MAX;
+			tmp = (struct IPRule *)realloc(arr, cap * sizeof(struct IPRule));
+			if(tmp != NULL)
+				arr = tmp;
+			ltmp = (unsigned int *)realloc(lines, cap * sizeof(unsigned int));
+			if(ltmp != NULL)
+				lines = ltmp;
+			if(tmp == NULL || ltmp == NULL) {
+				lineNo = 0;
+				ret = ERROR_CODE_RULE_FILE;
+				break;
+			}
+		}
+		arr[*num] = rule;
+		lines[(*num)++] = lineNo;
+	}
+	if(ret < 0) {
+		*errLine = lineNo;
+		goto out;
+	}
+	// 检查重复的名称
+	order = (unsigned int *)malloc((*num ? *num : 1) * sizeof(unsigned int));
+	if(order == NULL) {
+		ret = ERROR_CODE_RULE_FILE;
+		goto out;
+	}
+	for(i = 0; i < *num; i++)
+		order[i] = i;
+	sortBase = arr;
+	qsort(order, *num, sizeof(unsigned int), cmpRuleName);
+	for(i = 1; i < *num; i++) {
+		if(strncmp(arr[order[i]].name, arr[order[i - 1]].name, MAXRuleNameLen) == 0) {
+			*errLine = lines[order[i]];
+			ret = ERROR_CODE_RULE_FILE;
+			break;
+		}
+	}
+	free(order);
+out:
+	fclose(fp);
+	free(lines);
+	if(ret < 0) {
+		free(arr);
+		*num = 0;
+		return ret;
+	}
+	*rules = arr;
+	return 0;
+}
+
+// 两条规则的匹配条件与动作是否相同 (不比较内核内部使用的 nx)
+static int ruleSame(const struct IPRule *a, const struct IPRule *b) {
+	int v6 = a->family == AF_INET6;
+	if(v6 != (b->family == AF_INET6) || strncmp(a->name, b->name, MAXRuleNameLen) != 0)
+		return 0;
+	if(v6) {
+		if(memcmp(a->saddr6, b->saddr6, sizeof(a->saddr6)) != 0 || memcmp(a->daddr6, b->daddr6, sizeof(a->daddr6)) != 0 ||
+		   a->splen != b->splen || a->dplen != b->dplen)
+			return 0;
+	} else if(a->saddr != b->saddr || a->smask != b->smask || a->daddr != b->daddr || a->dmask != b->dmask ||
+		a->sset != b->sset || a->dset != b->dset)
+		return 0;
+	return a->sport == b->sport && a->dport == b->dport && a->protocol == b->protocol &&
+		a->action == b->action && a->log == b->log &&
+		a->rate == b->rate && a->burst == b->burst && a->limitPlen == b->limitPlen;
+}
+
+/**
+ * @brief 只提交与内核规则链的差异
+ * @param rules 期望的规则数组
+ * @param num 规则数
+ * @param mode [out] 采用的提交方式
+ * @param pushed [out] 提交的规则数
+ * @return struct KernelResponse 提交的结果
+ */
+struct KernelResponse applyFilterRules(struct IPRule *rules, unsigned int num, unsigned int *mode, unsigned int *pushed) {
+	struct KernelResponse rsp, cur;
+	const struct IPRule *now;
+	unsigned int curNum, same;
+
+	*mode = 0;
+	*pushed = 0;
+	cur = getAllFilterRules();
+	if(cur.code < 0)
+		return cur;
+	if(cur.header->bodyTp != RSP_IPRules && cur.header->bodyTp != 0) // 例如内核回复了导出失败的消息
+		return cur;
+	now = (const struct IPRule *)cur.body;
+	curNum = cur.header->arrayLen;
+	for(same = 0; same < curNum && same < num && ruleSame(&now[same], &rules[same]); same++);
+	free(cur.data);
+
+	if(same == curNum && same == num) {
+		rsp.code = ERROR_CODE_EXIT;
+		return rsp;
+	}
+	if(same == curNum) { // 内核规则链是期望规则的前缀，只需追加
+		*mode = IPRULE_BATCH_APPEND;
+		*pushed = num - same;
+		return addFilterRules(rules + same, num - same, IPRULE_BATCH_APPEND);
+	}
+	*mode = IPRULE_BATCH_REPLACE;
+	*pushed = num;
+	return addFilterRules(rules, num, IPRULE_BATCH_REPLACE);
+}
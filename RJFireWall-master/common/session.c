@@ -0,0 +1,221 @@
+#include "common.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+/**
+ * @brief 打开Netlink会话
+ * @param s 会话
+ * @param flags 0 或 NL_SESSION_NONBLOCK
+ * @return int 成功返回0，失败返回ERROR_CODE_EXCHANGE
+ */
+int nlSessionOpen(struct NLSession *s, unsigned int flags) {
+    struct sockaddr_nl local;
+    socklen_t alen = sizeof(local);
+    int type = SOCK_RAW | SOCK_CLOEXEC;
+
+    memset(s, 0, sizeof(*s));
+    s->nonblock = (flags & NL_SESSION_NONBLOCK) != 0;
+    if (s->nonblock)
+        type |= SOCK_NONBLOCK;
+    s->fd = socket(PF_NETLINK, type, NETLINK_MYFW);
+    if (s->fd < 0)
+        return ERROR_CODE_EXCHANGE;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_pid = 0; // 由内核分配端口号，不与同一进程中的其他套接字冲突
+    if (bind(s->fd, (struct sockaddr *)&local, sizeof(local)) != 0 ||
+        getsockname(s->fd, (struct sockaddr *)&local, &alen) != 0)
+        goto fail;
+    s->portid = local.nl_pid;
+    s->rbuf = (struct nlmsghdr *)malloc(NLMSG_SPACE(MAX_PAYLOAD));
+    if (!s->rbuf)
+        goto fail;
+    return 0;
+fail:
+    close(s->fd);
+    s->fd = -1;
+    return ERROR_CODE_EXCHANGE;
+}
+
+/**
+ * @brief 关闭会话
+ */
+void nlSessionClose(struct NLSession *s) {
+    unsigned int i;
+    if (s->fd >= 0)
+        close(s->fd);
+    s->fd = -1;
+    for (i = 0; i < s->parkedNum; i++)
+        free(s->parked[i].rsp.data);
+    s->parkedNum = 0;
+    free(s->rbuf);
+    s->rbuf = NULL;
+}
+
+/**
+ * @brief 发送一个请求
+ * @return unsigned int 请求的序列号，失败返回0
+ * @note 消息头与请求以两段iovec发出，不需要为每个请求拼接发送缓冲区
+ */
+unsigned int nlSessionSend(struct NLSession *s, void *smsg, unsigned int slen) {
+    struct sockaddr_nl kpeer;
+    struct nlmsghdr nlh;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t ret;
+
+    if (++s->seq == 0) // 0 留作失败返回值
+        s->seq = 1;
+    memset(&nlh, 0, sizeof(nlh));
+    nlh.nlmsg_len = NLMSG_LENGTH(slen);
+    nlh.nlmsg_flags = NLM_F_REQUEST;
+    nlh.nlmsg_seq = s->seq;
+    nlh.nlmsg_pid = s->portid; // 内核按 nlmsg_pid 回复
+    memset(&kpeer, 0, sizeof(kpeer));
+    kpeer.nl_family = AF_NETLINK;
+    iov[0].iov_base = &nlh;
+    iov[0].iov_len = NLMSG_HDRLEN;
+    iov[1].iov_base = smsg;
+    iov[1].iov_len = slen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &kpeer;
+    msg.msg_namelen = sizeof(kpeer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    do {
+        ret = sendmsg(s->fd, &msg, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret < 0 ? 0 : s->seq;
+}
+
+// 把一条回复消息复制为 KernelResponse，布局与 exchangeMsgK 相同
+static struct KernelResponse sessionToRsp(struct nlmsghdr *nlh) {
+    struct KernelResponse rsp;
+    int dlen = nlh->nlmsg_len - NLMSG_SPACE(0);
+
+    rsp.code = ERROR_CODE_EXCHANGE;
+    rsp.data = NULL;
+    if (nlh->nlmsg_type == NLMSG_ERROR || dlen < (int)sizeof(struct KernelResponseHeader))
+        return rsp;
+    rsp.data = malloc(dlen + 1);
+    if (!rsp.data)
+        return rsp;
+    memcpy(rsp.data, NLMSG_DATA(nlh), dlen);
+    ((char *)rsp.data)[dlen] = '\0';
+    rsp.code = dlen - sizeof(struct KernelResponseHeader);
+    rsp.header = (struct KernelResponseHeader *)rsp.data;
+    rsp.body = (char *)rsp.data + sizeof(struct KernelResponseHeader);
+    return rsp;
+}
+
+// 从接收缓冲区或套接字取出下一条回复，不查看暂存区
+static int sessionRecvSocket(struct NLSession *s, struct KernelResponse *rsp, unsigned int *seq) {
+    struct nlmsghdr *nlh;
+
+    for (;;) {
+        // 一次接收可能包含多条消息，未取走的部分留在接收缓冲区中供下次调用
+        while (s->rlen > 0 && NLMSG_OK(s->rnext, s->rlen)) {
+            nlh = s->rnext;
+            s->rnext = NLMSG_NEXT(s->rnext, s->rlen);
+            if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_NOOP)
+                continue;
+            *seq = nlh->nlmsg_seq;
+            *rsp = sessionToRsp(nlh);
+            return 1;
+        }
+        s->rlen = recv(s->fd, s->rbuf, NLMSG_SPACE(MAX_PAYLOAD), 0);
+        if (s->rlen < 0) {
+            s->rlen = 0;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return ERROR_CODE_EXCHANGE;
+        }
+        if (s->rlen == 0)
+            return ERROR_CODE_EXCHANGE;
+        s->rnext = s->rbuf;
+    }
+}
+
+/**
+ * @brief 取出下一个回复
+ * @return int 取到返回1，非阻塞会话暂无回复返回0，失败返回ERROR_CODE_EXCHANGE
+ */
+int nlSessionRecv(struct NLSession *s, struct KernelResponse *rsp, unsigned int *seq) {
+    if (s->parkedNum > 0) {
+        *seq = s->parked[0].seq;
+        *rsp = s->parked[0].rsp;
+        memmove(&s->parked[0], &s->parked[1], (--s->parkedNum) * sizeof(struct NLParked));
+        return 1;
+    }
+    return sessionRecvSocket(s, rsp, seq);
+}
+
+// 暂存一个不是正在等待的回复，暂存已满时丢弃最早的一条
+static void sessionPark(struct NLSession *s, unsigned int seq, struct KernelResponse rsp) {
+    if (s->parkedNum == NL_SESSION_PARKED) {
+        free(s->parked[0].rsp.data);
+        memmove(&s->parked[0], &s->parked[1], (--s->parkedNum) * sizeof(struct NLParked));
+    }
+    s->parked[s->parkedNum].seq = seq;
+    s->parked[s->parkedNum].rsp = rsp;
+    s->parkedNum++;
+}
+
+/**
+ * @brief 等待指定请求的回复
+ * @param s 会话
+ * @param seq 请求的序列号
+ * @return struct KernelResponse 该请求的回复
+ */
+struct KernelResponse nlSessionWait(struct NLSession *s, unsigned int seq) {
+    struct KernelResponse rsp;
+    struct pollfd pfd;
+    unsigned int i, got;
+    int ret;
+
+    for (i = 0; i < s->parkedNum; i++) {
+        if (s->parked[i].seq == seq) {
+            rsp = s->parked[i].rsp;
+            memmove(&s->parked[i], &s->parked[i + 1], (s->parkedNum - i - 1) * sizeof(struct NLParked));
+            s->parkedNum--;
+            return rsp;
+        }
+    }
+    for (;;) {
+        ret = sessionRecvSocket(s, &rsp, &got);
+        if (ret < 0) {
+            rsp.code = ERROR_CODE_EXCHANGE;
+            return rsp;
+        }
+        if (ret == 0) { // 非阻塞会话，等待可读
+            pfd.fd = s->fd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                rsp.code = ERROR_CODE_EXCHANGE;
+                return rsp;
+            }
+            continue;
+        }
+        if (got == seq)
+            return rsp;
+        sessionPark(s, got, rsp);
+    }
+}
+
+/**
+ * @brief 取得进程内共用的会话
+ * @return struct NLSession* 会话，打开失败返回NULL (下次调用时重试)
+ */
+struct NLSession *nlDefaultSession(void) {
+    static struct NLSession session;
+    static int opened = 0;
+    if (!opened) {
+        if (nlSessionOpen(&session, 0) != 0)
+            return NULL;
+        opened = 1;
+    }
+    return &session;
+}
@@ -0,0 +1,233 @@
+#include "common.h"
+
+// 以分段导出取得一类条目；成功时由调用者释放 rsp->data，表为空时 *num 为0
+int snapFetch(unsigned int reqTp, unsigned int rspTp, unsigned int size,
+	struct KernelResponse *rsp, unsigned int *num) {
+	struct APPRequest req;
+	memset(&req, 0, sizeof(req));
+	req.tp = reqTp;
+	*rsp = exchangeDumpK(&req, sizeof(req));
+	if(rsp->code < 0)
+		return ERROR_CODE_EXCHANGE;
+	if((rsp->header->bodyTp != rspTp && rsp->header->bodyTp != 0) ||
+	   (unsigned int)rsp->code < rsp->header->arrayLen * size) { // 例如内核回复了导出失败的消息
+		free(rsp->data);
+		return ERROR_CODE_EXCHANGE;
+	}
+	*num = rsp->header->arrayLen;
+	return 0;
+}
+
+/**
+ * @brief 保存快照文件
+ * @param path 快照文件路径
+ * @param head [out] 写出的文件头，可为NULL
+ * @return int 成功返回0，失败返回错误码
+ */
+int saveSnapshot(const char *path, struct SnapHead *head) {
+	struct KernelResponse rules, nats, conns;
+	struct SnapHead h;
+	FILE *fp;
+	int ret;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAP_MAGIC;
+	h.version = SNAP_VERSION;
+	h.ruleSize = sizeof(struct IPRule);
+	h.natSize = sizeof(struct NATRecord);
+	h.connSize = sizeof(struct ConnSnap);
+	if((ret = snapFetch(REQ_GETAllIPRules, RSP_IPRules, h.ruleSize, &rules, &h.ruleNum)) != 0)
+		return ret;
+	if((ret = snapFetch(REQ_GETNATRules, RSP_NATRules, h.natSize, &nats, &h.natNum)) != 0)
+		goto freeRules;
+	// 连接最后导出，保存时间尽量贴近连接的剩余存活时间被计算的时刻
+	if((ret = snapFetch(REQ_GETConnSnap, RSP_ConnSnap, h.connSize, &conns, &h.connNum)) != 0)
+		goto freeNats;
+	h.savedAt = (long long)time(NULL);
+
+	ret = ERROR_CODE_SNAP_FILE;
+	fp = fopen(path, "wb");
+	if(fp == NULL)
+		goto freeConns;
+	if(fwrite(&h, sizeof(h), 1, fp) == 1 &&
+	   fwrite(rules.body, h.ruleSize, h.ruleNum, fp) == h.ruleNum &&
+	   fwrite(nats.body, h.natSize, h.natNum, fp) == h.natNum &&
+	   fwrite(conns.body, h.connSize, h.connNum, fp) == h.connNum)
+		ret = 0;
+	if(fclose(fp) != 0)
+		ret = ERROR_CODE_SNAP_FILE;
+	if(ret == 0 && head != NULL)
+		*head = h;
+freeConns:
+	free(conns.data);
+freeNats:
+	free(nats.data);
+freeRules:
+	free(rules.data);
+	return ret;
+}
+
+// 读取 num 个大小为 size 的条目，失败返回NULL
+static void *snapRead(FILE *fp, unsigned int size, unsigned int num) {
+	void *p = malloc((size_t)size * (num ? num : 1));
+	if(p != NULL && fread(p, size, num, fp) != num) {
+		free(p);
+		p = NULL;
+	}
+	return p;
+}
+
+#define SNAP_INFLIGHT 16 // 载入连接时同时未完成的请求数，不超过 NL_SESSION_PARKED
+
+// 快照中的连接按 CONN_SNAP_CHUNK 分段交给内核，返回恢复的连接数
+// 各段互不依赖，因此连续发出 SNAP_INFLIGHT 段后再按序列号依次取回复
+static int snapLoadConns(struct ConnSnap *conns, unsigned int num) {
+	struct NLSession *s = nlDefaultSession();
+	unsigned int seqs[SNAP_INFLIGHT];
+	struct APPRequest *req;
+	struct KernelResponse rsp;
+	unsigned int sent, part, head = 0, inflight = 0;
+	int count = 0;
+
+	if(s == NULL)
+		return ERROR_CODE_EXCHANGE;
+	req = (struct APPRequest *)calloc(1, sizeof(struct APPRequest) + CONN_SNAP_CHUNK * sizeof(struct ConnSnap));
+	if(req == NULL)
+		return ERROR_CODE_EXCHANGE;
+	for(sent = 0; sent < num || inflight > 0; ) {
+		if(sent < num && inflight < SNAP_INFLIGHT && count >= 0) {
+			part = num - sent < CONN_SNAP_CHUNK ? num - sent : CONN_SNAP_CHUNK;
+			req->tp = REQ_LoadConns;
+			req->msg.num = part;
+			memcpy(req + 1, conns + sent, part * sizeof(struct ConnSnap));
+			seqs[(head + inflight) % SNAP_INFLIGHT] = nlSessionSend(s, req, sizeof(struct APPRequest) + part * sizeof(struct ConnSnap));
+			if(seqs[(head + inflight) % SNAP_INFLIGHT] == 0) {
+				count = ERROR_CODE_EXCHANGE;
+				sent = num;
+				continue;
+			}
+			sent += part;
+			inflight++;
+			continue;
+		}
+		if(count < 0) // 已经失败，不再发送，但仍取走已发出请求的回复
+			sent = num;
+		rsp = nlSessionWait(s, seqs[head]);
+		head = (head + 1) % SNAP_INFLIGHT;
+		inflight--;
+		if(rsp.code < 0) {
+			count = ERROR_CODE_EXCHANGE;
+			continue;
+		}
+		if(rsp.header->bodyTp != RSP_Only_Head)
+			count = ERROR_CODE_EXCHANGE;
+		else if(count >= 0)
+			count += rsp.header->arrayLen;
+		free(rsp.data);
+	}
+	free(req);
+	return count;
+}
+
+// 逐条删除链首NAT规则直到链空；内核拒绝删除 (例如重建索引失败) 时返回 ERROR_CODE_EXCHANGE
+static int snapClearNATRules(void) {
+	struct KernelResponse rsp;
+	unsigned int i, num;
+	int ret;
+	if((ret = snapFetch(REQ_GETNATRules, RSP_NATRules, sizeof(struct NATRecord), &rsp, &num)) != 0)
+		return ret;
+	free(rsp.data);
+	for(i = 0; i < num; i++) {
+		rsp = delNATRule(0);
+		if(rsp.code < 0)
+			return ERROR_CODE_EXCHANGE;
+		ret = (rsp.header->bodyTp == RSP_Only_Head && rsp.header->arrayLen == 1) ? 0 : ERROR_CODE_EXCHANGE;
+		free(rsp.data);
+		if(ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * @brief 载入快照文件
+ * @param path 快照文件路径
+ * @param head [out] 读到的文件头，可为NULL
+ * @return int 成功返回恢复的连接数，失败返回错误码
+ */
+int loadSnapshot(const char *path, struct SnapHead *head) {
+	struct IPRule *rules = NULL;
+	struct NATRecord *nats = NULL;
+	struct ConnSnap *conns = NULL;
+	struct KernelResponse rsp;
+	struct APPRequest req;
+	struct SnapHead h;
+	unsigned int i, live;
+	long long elapsed;
+	FILE *fp;
+	int ret = ERROR_CODE_SNAP_FILE;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL)
+		return ERROR_CODE_SNAP_FILE;
+	if(fread(&h, sizeof(h), 1, fp) != 1 || h.magic != SNAP_MAGIC || h.version != SNAP_VERSION ||
+	   h.ruleSize != sizeof(struct IPRule) || h.natSize != sizeof(struct NATRecord) ||
+	   h.connSize != sizeof(struct ConnSnap) || h.ruleNum > IPRULE_BATCH_MAX) {
+		fclose(fp);
+		return ERROR_CODE_SNAP_FILE;
+	}
+	rules = snapRead(fp, h.ruleSize, h.ruleNum);
+	nats = snapRead(fp, h.natSize, h.natNum);
+	conns = snapRead(fp, h.connSize, h.connNum);
+	fclose(fp);
+	if(rules == NULL || nats == NULL || conns == NULL)
+		goto out;
+	if(head != NULL)
+		*head = h;
+
+	ret = ERROR_CODE_EXCHANGE;
+	// 规则先于连接恢复：恢复的SNAT连接要向NAT规则重新占用端口
+	rsp = addFilterRules(rules, h.ruleNum, IPRULE_BATCH_REPLACE);
+	if(rsp.code < 0)
+		goto out;
+	if(rsp.header->bodyTp != RSP_Only_Head) {
+		free(rsp.data);
+		goto out;
+	}
+	free(rsp.data);
+	// 先清空现有NAT链，重复载入同一快照不会叠出重复规则
+	if(snapClearNATRules() != 0)
+		goto out;
+	// 内核把新NAT规则插入链首，倒序添加以保持原有的匹配顺序
+	for(i = h.natNum; i > 0; i--) {
+		memset(&req, 0, sizeof(req));
+		req.tp = REQ_ADDNATRule;
+		req.msg.natRule = nats[i - 1];
+		req.msg.natRule.nx = NULL;
+		rsp = exchangeMsgK(&req, sizeof(req));
+		if(rsp.code < 0)
+			goto out;
+		if(rsp.header->bodyTp != RSP_MSG || strncmp((const char *)rsp.body, "Fail", 4) == 0) {
+			free(rsp.data);
+			goto out;
+		}
+		free(rsp.data);
+	}
+	// 扣除保存以来经过的时间，丢弃已经超时的连接
+	elapsed = (long long)time(NULL) - h.savedAt;
+	if(elapsed < 0)
+		elapsed = 0;
+	for(i = 0, live = 0; i < h.connNum; i++) {
+		if((long long)conns[i].ttl <= elapsed)
+			continue;
+		conns[live] = conns[i];
+		conns[live].ttl -= (unsigned int)elapsed;
+		live++;
+	}
+	ret = snapLoadConns(conns, live);
+out:
+	free(rules);
+	free(nats);
+	free(conns);
+	return ret;
+}
@@ -10,6 +10,7 @@
  * 2. 将32位整数形式的IP地址和子网掩码（或掩码长度）转换回点分十进制的字符串表示。
  * 3. 将32位整数形式的IP地址转换为不带掩码的点分十进制字符串。
  * 4. 将32位整数形式的IP地址和端口号格式化为 "A.B.C.D:PORT" 形式的字符串。
+ * 5. IPv6地址 (可带前缀长度或端口) 与网络字节序的128位地址之间的转换，借助 inet_pton/inet_ntop 完成。
  *
  * 这些工具函数对于解析用户输入的IP地址以及格式化IP地址以供显示非常有用。
  */
@@ -297,4 +298,58 @@ int IPint2IPstrWithPort(unsigned int ip, unsigned short port, char *ipStr) {
 	// 使用sprintf格式化输出字符串，包含IP地址和端口号
 	sprintf(ipStr, "%u.%u.%u.%u:%u", ips[0], ips[1], ips[2], ips[3], port);
 	return 0; // 转换成功
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 将IPv6地址字符串 (可带 "/前缀长度") 转换为网络字节序的128位地址与前缀长度。
+ * @return int 成功返回0，地址或前缀长度非法返回-1。
+ */
+int IP6str2IP6int(const char *ipStr, unsigned int *ip6, u_int8_t *plen) {
+	char addr[INET6_ADDRSTRLEN];
+	const char *slash = strchr(ipStr, '/');
+	size_t n = slash ? (size_t)(slash - ipStr) : strlen(ipStr);
+	char *end;
+	long len = 128;
+
+	if(n == 0 || n >= sizeof(addr))
+		return -1;
+	memcpy(addr, ipStr, n);
+	addr[n] = '\0';
+	if(slash != NULL) {
+		len = strtol(slash + 1, &end, 10);
+		if(slash[1] == '\0' || *end != '\0' || len < 0 || len > 128)
+			return -1;
+	}
+	if(inet_pton(AF_INET6, addr, ip6) != 1)
+		return -1;
+	*plen = (u_int8_t)len;
+	return 0;
+}
+
+/**
+ * @brief 将128位地址与前缀长度格式化为 "addr/plen"，/128 省略前缀长度。
+ */
+int IP6int2IP6str(const unsigned int *ip6, u_int8_t plen, char *ipStr) {
+	char addr[INET6_ADDRSTRLEN];
+	if(ipStr == NULL || inet_ntop(AF_INET6, ip6, addr, sizeof(addr)) == NULL)
+		return -1;
+	if(plen >= 128)
+		strcpy(ipStr, addr);
+	else
+		sprintf(ipStr, "%s/%u", addr, plen);
+	return 0;
+}
+
+/**
+ * @brief 将128位地址与端口格式化为 "[addr]:port"，加方括号以免端口与地址中的冒号混淆。
+ */
+int IP6int2IP6strWithPort(const unsigned int *ip6, unsigned short port, char *ipStr) {
+	char addr[INET6_ADDRSTRLEN];
+	if(ipStr == NULL || inet_ntop(AF_INET6, ip6, addr, sizeof(addr)) == NULL)
+		return -1;
+	if(port == 0)
+		strcpy(ipStr, addr);
+	else
+		sprintf(ipStr, "[%s]:%u", addr, port);
+	return 0;
+}
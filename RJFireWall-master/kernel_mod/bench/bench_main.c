@@ -0,0 +1,511 @@
+/**
+ * @file bench_main.c
+ * @brief 数据包路径的基准测试模块 (myfw_bench)。
+ *
+ * 由 `make bench` 与防火墙的全部 helpers/hooks 源文件一起编译成独立的 myfw_bench.ko，
+ * 它不注册任何Netfilter钩子也不创建Netlink套接字，与已加载的 myfw 互不影响。
+ * 加载时依次运行下列测试，结果以 "[fw bench]" 前缀写入内核日志，之后可直接卸载：
+ *   -   fill:  只改写合成数据包的头部，作为其余基于 skb 的测试的基线；
+ *   -   rules: `matchIPRules`，规则链为 bench_rules 条随机生成的规则；
+ *   -   hook:  `hook_main` (PRE_ROUTING)，连接表初始为空，每个流的首包建立连接；
+ *   -   conn:  `hasConn`，连接表预先填入 bench_conns 个连接，流号不小于 bench_conns 的查找不命中；
+ *   -   nat:   `getNewNATPort` + `putNATPort`，端口池为 1024-65535。
+ * 测试开始前先做一次分类器检查：引用地址集合的规则位于更宽的放行规则之前时，集合外的数据包仍须命中后者。
+ * 每个测试依次在 1, 2, 4, ... 直至 bench_cpus 个CPU上并发运行，每个CPU各处理 bench_pkts 个数据包，
+ * 报告每包耗时 (各CPU的平均值)、总吞吐量及相对单CPU的扩展倍数。
+ * 数据包按 bench_dist 从 bench_flows 个UDP流中抽取，流号序列在计时前生成。
+ */
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include "tools.h"
+#include "helper.h"
+#include "hook.h"
+
+#define BENCH_SEQ_LEN 65536       // 每个CPU预先生成的流号序列长度 (2的幂)，数据包循环使用
+#define BENCH_BATCH 1024          // 每批数据包在关闭软中断的情况下连续处理，批与批之间允许调度
+#define BENCH_MAX_FLOWS (1 << 20) // 流号映射为 10.0.0.0/8 内的源地址，同时限制Zipf累积分布表的大小
+#define BENCH_PID 1               // 提交规则事务时使用的事务属主，本模块不与用户进程共享规则链
+#define BENCH_PAYLOAD 18          // 合成UDP数据包的载荷长度，使IP包长为最小以太网帧的载荷
+
+static unsigned int bench_rules = 1000;
+module_param(bench_rules, uint, 0444);
+MODULE_PARM_DESC(bench_rules, "synthetic filter rules in the rule chain");
+
+static unsigned int bench_conns = 65536;
+module_param(bench_conns, uint, 0444);
+MODULE_PARM_DESC(bench_conns, "connections preloaded before the hasConn test");
+
+static unsigned int bench_flows = 4096;
+module_param(bench_flows, uint, 0444);
+MODULE_PARM_DESC(bench_flows, "distinct UDP flows the packets are drawn from");
+
+static char *bench_dist = "uniform";
+module_param(bench_dist, charp, 0444);
+MODULE_PARM_DESC(bench_dist, "flow distribution: uniform or zipf");
+
+static unsigned int bench_pkts = 1000000;
+module_param(bench_pkts, uint, 0444);
+MODULE_PARM_DESC(bench_pkts, "packets per CPU per run");
+
+static unsigned int bench_cpus = 0;
+module_param(bench_cpus, uint, 0444);
+MODULE_PARM_DESC(bench_cpus, "largest number of CPUs to scale to (0 = all online)");
+
+enum { BENCH_FILL, BENCH_RULES, BENCH_HOOK, BENCH_CONN, BENCH_NAT, BENCH_TEST_NUM };
+static const char *benchNames[BENCH_TEST_NUM] = {"fill", "rules", "hook", "conn", "nat"};
+
+// 每个参与测试的CPU一份，由该CPU上的线程独占
+struct benchCtx {
+    unsigned int cpu;
+    u32 *seq;                   // 流号序列
+    struct sk_buff *skb;        // 合成的数据包，每次改写其头部
+    struct nf_hook_state state; // hook 测试使用的钩子状态
+    unsigned long hits;         // 命中规则、放行、命中连接或取得端口的数据包数
+    u64 ns;                     // 本CPU处理 bench_pkts 个数据包的耗时
+};
+
+static struct benchCtx *benchCtxs;
+static unsigned int benchCtxNum;
+static int benchTest;
+static struct NATRecord *benchNAT;
+static struct completion benchStart, benchDone;
+static atomic_t benchRunning;
+
+static const unsigned short benchPorts[8] = {53, 80, 123, 443, 1194, 3478, 5060, 8080};
+
+// 流号到五元组的映射 (主机字节序)；源地址各不相同，保证不同流号的五元组不同
+static inline void benchFlow(u32 id, unsigned int *sip, unsigned int *dip, unsigned short *sport, unsigned short *dport) {
+    *sip = 0x0A000000u + id;
+    *dip = 0xC0A80000u | (jhash_1word(id, 0) & 0xFFFFu);
+    *sport = 1024 + (id & 0x7FFF);
+    *dport = benchPorts[id & 7];
+}
+
+// 以流号改写合成数据包的地址与端口
+static inline void benchFill(struct sk_buff *skb, u32 id) {
+    struct iphdr *iph = ip_hdr(skb);
+    struct udphdr *uh = (struct udphdr *)((unsigned char *)iph + sizeof(struct iphdr));
+    unsigned int sip, dip;
+    unsigned short sport, dport;
+    benchFlow(id, &sip, &dip, &sport, &dport);
+    iph->saddr = htonl(sip);
+    iph->daddr = htonl(dip);
+    uh->source = htons(sport);
+    uh->dest = htons(dport);
+}
+
+static struct sk_buff *benchAllocSkb(void) {
+    unsigned int len = sizeof(struct iphdr) + sizeof(struct udphdr) + BENCH_PAYLOAD;
+    struct sk_buff *skb = alloc_skb(len + 64, GFP_KERNEL);
+    struct iphdr *iph;
+    struct udphdr *uh;
+    if(skb == NULL)
+        return NULL;
+    skb_reserve(skb, 64);
+    iph = skb_put(skb, len);
+    memset(iph, 0, len);
+    skb_reset_network_header(skb);
+    skb_set_transport_header(skb, sizeof(struct iphdr));
+    skb->protocol = htons(ETH_P_IP);
+    iph->version = 4;
+    iph->ihl = sizeof(struct iphdr) / 4;
+    iph->ttl = 64;
+    iph->protocol = IPPROTO_UDP;
+    iph->tot_len = htons(len);
+    uh = (struct udphdr *)(iph + 1);
+    uh->len = htons(sizeof(struct udphdr) + BENCH_PAYLOAD);
+    return skb;
+}
+
+// 处理一个数据包，返回是否命中
+static inline int benchOne(struct benchCtx *c, u32 id) {
+    unsigned int sip, dip;
+    unsigned short sport, dport, port;
+    int isMatch = 0;
+
+    switch(benchTest) {
+    case BENCH_FILL:
+        benchFill(c->skb, id);
+        return 1;
+    case BENCH_RULES:
+        benchFill(c->skb, id);
+        benchFlow(id, &sip, &dip, &sport, &dport);
+        matchIPRules(&init_net, c->skb, sport, dport, &isMatch);
+        return isMatch;
+    case BENCH_HOOK:
+        benchFill(c->skb, id);
+        return hook_main(NULL, c->skb, &c->state) == NF_ACCEPT;
+    case BENCH_CONN:
+        benchFlow(id, &sip, &dip, &sport, &dport);
+        return hasConn(&init_net, sip, dip, sport, dport) != NULL;
+    case BENCH_NAT:
+        benchFlow(id, &sip, &dip, &sport, &dport);
+        port = getNewNATPort(benchNAT, dip, dport);
+        if(port == 0)
+            return 0;
+        putNATPort(benchNAT, port);
+        return 1;
+    }
+    return 0;
+}
+
+// 绑定在 c->cpu 上的测试线程：等所有线程就绪后同时开始，按批处理 bench_pkts 个数据包
+static int benchThread(void *data) {
+    struct benchCtx *c = data;
+    unsigned int done, n, i;
+    unsigned long hits = 0;
+    u64 start;
+
+    wait_for_completion(&benchStart);
+    start = ktime_get_ns();
+    for(done = 0; done < bench_pkts; done += n) {
+        n = min_t(unsigned int, bench_pkts - done, BENCH_BATCH);
+        local_bh_disable(); // 与软中断中的钩子处于同样的上下文
+        rcu_read_lock();
+        for(i = 0; i < n; i++)
+            hits += benchOne(c, c->seq[(done + i) & (BENCH_SEQ_LEN - 1)]);
+        rcu_read_unlock();
+        local_bh_enable();
+        cond_resched();
+    }
+    c->ns = ktime_get_ns() - start;
+    c->hits = hits;
+    if(atomic_dec_and_test(&benchRunning))
+        complete(&benchDone);
+    return 0;
+}
+
+/**
+ * @brief 在前 cpus 个CPU上并发运行一次测试
+ * @param test 测试编号 (BENCH_*)
+ * @param cpus 参与的CPU数
+ * @param base [输入输出] 单CPU时的吞吐量 (单位 0.01 Mpps)，cpus 为1时写入，其余时候用于计算扩展倍数
+ * @return int 成功返回0，创建线程失败返回负的错误码
+ */
+static int benchRun(int test, unsigned int cpus, u64 *base) {
+    struct task_struct *t;
+    unsigned long hits = 0;
+    u64 sumNs = 0, maxNs = 1, mpps, total = (u64)bench_pkts * cpus;
+    unsigned int i;
+
+    benchTest = test;
+    init_completion(&benchStart);
+    init_completion(&benchDone);
+    atomic_set(&benchRunning, cpus);
+    for(i = 0; i < cpus; i++) {
+        t = kthread_create_on_node(benchThread, &benchCtxs[i], cpu_to_node(benchCtxs[i].cpu),
+            "fw_bench/%u", benchCtxs[i].cpu);
+        if(IS_ERR(t)) {
+            // 已创建的线程仍须放行并等其结束，只是本次结果不再报告
+            printk(KERN_WARNING "[fw bench] create thread fail.\n");
+            atomic_sub(cpus - i, &benchRunning);
+            if(i == 0)
+                return PTR_ERR(t);
+            complete_all(&benchStart);
+            wait_for_completion(&benchDone);
+            return PTR_ERR(t);
+        }
+        kthread_bind(t, benchCtxs[i].cpu);
+        wake_up_process(t);
+    }
+    complete_all(&benchStart);
+    wait_for_completion(&benchDone);
+
+    for(i = 0; i < cpus; i++) {
+        sumNs += benchCtxs[i].ns;
+        maxNs = max(maxNs, benchCtxs[i].ns);
+        hits += benchCtxs[i].hits;
+    }
+    mpps = div64_u64(total * 100000, maxNs); // 0.01 Mpps
+    if(cpus == 1)
+        *base = mpps ? mpps : 1;
+    printk(KERN_INFO "[fw bench] %-5s cpus=%-3u %6llu ns/pkt  %5llu.%02llu Mpps  x%llu.%02llu  hit %llu%%\n",
+        benchNames[test], cpus, div64_u64(sumNs, total), mpps / 100, mpps % 100,
+        div64_u64(mpps, *base), div64_u64(mpps * 100, *base) % 100, div64_u64((u64)hits * 100, total));
+    return 0;
+}
+
+// 按 1, 2, 4, ... 个CPU运行一个测试，最后一次使用全部 benchCtxNum 个CPU
+static int benchScale(int test) {
+    unsigned int cpus;
+    u64 base = 1;
+    int ret;
+    for(cpus = 1; ; cpus = min(cpus * 2, benchCtxNum)) {
+        ret = benchRun(test, cpus, &base);
+        if(ret != 0 || cpus == benchCtxNum)
+            return ret;
+    }
+}
+
+// Zipf(s=1) 分布的累积权重，流号 i 的权重正比于 1/(i+1)
+static u64 *benchZipfCdf(void) {
+    u64 *cdf = vmalloc(sizeof(u64) * bench_flows), acc = 0;
+    unsigned int i;
+    if(cdf == NULL)
+        return NULL;
+    for(i = 0; i < bench_flows; i++) {
+        acc += div_u64(1ULL << 40, i + 1);
+        cdf[i] = acc;
+    }
+    return cdf;
+}
+
+static u32 benchZipfDraw(const u64 *cdf) {
+    u64 total = cdf[bench_flows - 1], mask = (fls64(total) >= 64) ? ULLONG_MAX : (1ULL << fls64(total)) - 1, r;
+    unsigned int lo = 0, hi = bench_flows - 1, mid;
+    do {
+        r = get_random_u64() & mask;
+    } while(r >= total);
+    while(lo < hi) { // 第一个累积权重大于 r 的流号
+        mid = lo + (hi - lo) / 2;
+        if(cdf[mid] > r)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// 为前 bench_cpus 个在线CPU分配数据包、流号序列与钩子状态
+static int benchSetupCtxs(void) {
+    u64 *cdf = NULL;
+    unsigned int i, j, cpu, want = num_online_cpus();
+    int zipf = strcmp(bench_dist, "zipf") == 0;
+
+    if(!zipf && strcmp(bench_dist, "uniform") != 0) {
+        printk(KERN_WARNING "[fw bench] unknown distribution %s.\n", bench_dist);
+        return -EINVAL;
+    }
+    if(bench_cpus != 0 && bench_cpus < want)
+        want = bench_cpus;
+    benchCtxs = kcalloc(want, sizeof(struct benchCtx), GFP_KERNEL);
+    if(benchCtxs == NULL)
+        return -ENOMEM;
+    if(zipf && (cdf = benchZipfCdf()) == NULL)
+        return -ENOMEM;
+    i = 0;
+    for_each_online_cpu(cpu) {
+        struct benchCtx *c = &benchCtxs[i];
+        if(i == want)
+            break;
+        c->cpu = cpu;
+        c->state.hook = NF_INET_PRE_ROUTING;
+        c->state.pf = NFPROTO_IPV4;
+        c->state.net = &init_net;
+        c->skb = benchAllocSkb();
+        c->seq = vmalloc(sizeof(u32) * BENCH_SEQ_LEN);
+        benchCtxNum = ++i;
+        if(c->skb == NULL || c->seq == NULL) {
+            vfree(cdf);
+            return -ENOMEM;
+        }
+        for(j = 0; j < BENCH_SEQ_LEN; j++)
+            c->seq[j] = zipf ? benchZipfDraw(cdf) : reciprocal_scale(get_random_u32(), bench_flows);
+    }
+    vfree(cdf);
+    return 0;
+}
+
+static void benchFreeCtxs(void) {
+    unsigned int i;
+    for(i = 0; i < benchCtxNum; i++) {
+        kfree_skb(benchCtxs[i].skb);
+        vfree(benchCtxs[i].seq);
+    }
+    kfree(benchCtxs);
+    benchCtxs = NULL;
+    benchCtxNum = 0;
+}
+
+/**
+ * @brief 生成并提交 bench_rules 条规则
+ * @return int 成功返回0，失败返回负的错误码
+ * @note 每条规则取一个随机流的源、目的地址前缀 (长度16-32) 与目的端口 (一半为任意端口)，
+ *       因此一部分数据包会命中规则，其余的落到默认动作。规则只放行，使 hook 测试中的流都能建立连接。
+ */
+static int benchLoadRules(void) {
+    struct IPRule *rules;
+    unsigned int i, sip, dip, slen, dlen;
+    unsigned short sport, dport;
+    int ret;
+
+    if(bench_rules == 0)
+        return 0;
+    rules = kvcalloc(bench_rules, sizeof(struct IPRule), GFP_KERNEL);
+    if(rules == NULL)
+        return -ENOMEM;
+    for(i = 0; i < bench_rules; i++) {
+        benchFlow(reciprocal_scale(get_random_u32(), bench_flows), &sip, &dip, &sport, &dport);
+        slen = 16 + reciprocal_scale(get_random_u32(), 17);
+        dlen = 16 + reciprocal_scale(get_random_u32(), 17);
+        snprintf(rules[i].name, sizeof(rules[i].name), "b%u", i);
+        rules[i].smask = slen == 32 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> slen);
+        rules[i].saddr = sip & rules[i].smask;
+        rules[i].dmask = dlen == 32 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> dlen);
+        rules[i].daddr = dip & rules[i].dmask;
+        rules[i].sport = 0xFFFFu;
+        rules[i].dport = (get_random_u32() & 1) ? 0xFFFFu : (((unsigned int)dport << 16) | dport);
+        rules[i].protocol = IPPROTO_UDP;
+        rules[i].family = AF_INET;
+        rules[i].action = NF_ACCEPT;
+    }
+    ret = beginIPRuleBatch(&init_net, BENCH_PID, IPRULE_BATCH_REPLACE);
+    if(ret == 0 && (ret = addIPRuleBatch(&init_net, BENCH_PID, rules, bench_rules)) >= 0)
+        ret = commitIPRuleBatch(&init_net, BENCH_PID);
+    if(ret < 0)
+        abortIPRuleBatch(&init_net, BENCH_PID);
+    kvfree(rules);
+    return ret < 0 ? ret : 0;
+}
+
+// 预先建立流号 0 .. bench_conns-1 的连接 (已由 hook 测试建立的流直接复用)，返回连接表中的连接数
+static unsigned int benchLoadConns(void) {
+    unsigned int i, sip, dip, n = 0;
+    unsigned short sport, dport;
+    for(i = 0; i < bench_conns; i++) {
+        benchFlow(i, &sip, &dip, &sport, &dport);
+        local_bh_disable();
+        if(addConn(&init_net, sip, dip, sport, dport, IPPROTO_UDP, 0) != NULL)
+            n++;
+        local_bh_enable();
+        if((i & (BENCH_BATCH - 1)) == 0)
+            cond_resched();
+    }
+    return n;
+}
+
+/**
+ * @brief 检查引用地址集合的规则不会截断分类器的候选规则
+ * @return int 通过返回0，分类结果错误返回-EINVAL，内存不足返回-ENOMEM
+ * @note 第0条规则丢弃源地址属于集合 IPSET_MAX 的任意数据包，本模块不创建集合，因此它永远不命中；
+ *       第1条规则放行任意数据包，分类结果必须是它
+ */
+static int benchCheckClassifier(void) {
+    struct ruleClassifier *cls;
+    struct IPRule *rules, *hit;
+    int i, ret = 0;
+
+    rules = kvcalloc(2, sizeof(struct IPRule), GFP_KERNEL);
+    if(rules == NULL)
+        return -ENOMEM;
+    for(i = 0; i < 2; i++) {
+        snprintf(rules[i].name, sizeof(rules[i].name), "c%d", i);
+        rules[i].sport = 0xFFFFu;
+        rules[i].dport = 0xFFFFu;
+        rules[i].protocol = IPPROTO_IP;
+        rules[i].family = AF_INET;
+        rules[i].action = NF_ACCEPT;
+    }
+    rules[0].sset = IPSET_MAX;
+    rules[0].action = NF_DROP;
+    cls = buildClassifier(rules, 2);
+    if(cls == NULL) {
+        kvfree(rules);
+        return -ENOMEM;
+    }
+    hit = classifyPacket(cls, 0x0A000001u, 0x0A000002u, 1024, 53, IPPROTO_UDP);
+    if(hit != &cls->rules[1]) {
+        printk(KERN_WARNING "[fw bench] classifier check fail: set rule hides the rules after it.\n");
+        ret = -EINVAL;
+    }
+    freeClassifier(cls);
+    return ret;
+}
+
+static int benchAll(void) {
+    struct NATRecord nat;
+    int ret;
+
+    if((ret = benchSetupCtxs()) != 0)
+        return ret;
+    printk(KERN_INFO "[fw bench] rules=%u conns=%u flows=%u dist=%s pkts=%u cpus=%u\n",
+        bench_rules, bench_conns, bench_flows, bench_dist, bench_pkts, benchCtxNum);
+    if((ret = benchCheckClassifier()) != 0)
+        return ret;
+    if((ret = benchScale(BENCH_FILL)) != 0)
+        return ret;
+    if((ret = benchLoadRules()) != 0) {
+        printk(KERN_WARNING "[fw bench] load rules fail: %d.\n", ret);
+        return ret;
+    }
+    if((ret = benchScale(BENCH_RULES)) != 0 || (ret = benchScale(BENCH_HOOK)) != 0)
+        return ret;
+    printk(KERN_INFO "[fw bench] preloaded %u of %u conns.\n", benchLoadConns(), bench_conns);
+    if((ret = benchScale(BENCH_CONN)) != 0)
+        return ret;
+
+    memset(&nat, 0, sizeof(nat));
+    nat.saddr = 0x0A000000u;
+    nat.smask = 0xFF000000u;
+    nat.daddr = 0xCB007101u; // 203.0.113.1
+    nat.sport = 1024;
+    nat.dport = 65535;
+    benchNAT = addNATRuleToChain(nat);
+    if(benchNAT == NULL)
+        return -ENOMEM;
+    return benchScale(BENCH_NAT);
+}
+
+/**
+ * @brief 模块初始化：准备与 myfw 相同的子系统 (不含Netlink与钩子注册) 后运行全部测试
+ * @return int 测试全部完成返回0，参数或资源错误时返回负的错误码，模块不被加载
+ */
+static int bench_init(void) {
+    int ret;
+    if(bench_flows == 0 || bench_flows > BENCH_MAX_FLOWS || bench_pkts == 0) {
+        printk(KERN_WARNING "[fw bench] bench_flows must be 1-%u and bench_pkts non-zero.\n", BENCH_MAX_FLOWS);
+        return -EINVAL;
+    }
+    frag_init();
+    ret = log_init();
+    if(ret != 0)
+        return ret;
+    ret = rule_init();
+    if(ret != 0) {
+        log_exit();
+        return ret;
+    }
+    ret = conn_init();
+    if(ret != 0) {
+        rule_exit();
+        log_exit();
+        return ret;
+    }
+    ret = ratelimit_init();
+    if(ret == 0) {
+        ret = denycache_init();
+        if(ret != 0)
+            ratelimit_exit();
+    }
+    if(ret != 0) {
+        conn_exit();
+        rule_exit();
+        log_exit();
+        return ret;
+    }
+    ret = benchAll();
+    benchFreeCtxs();
+    conn_exit();
+    rule_exit();
+    ipset_exit();
+    nat_exit();
+    dnat_exit();
+    ratelimit_exit();
+    denycache_exit();
+    log_exit();
+    if(ret == 0)
+        printk(KERN_INFO "[fw bench] done.\n");
+    return ret;
+}
+
+// 全部资源已在 bench_init 中释放
+static void bench_exit(void) {
+}
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("packet-path benchmark for myfw");
+module_init(bench_init);
+module_exit(bench_exit);
@@ -10,7 +10,9 @@
  * 1.  `sendMsgToApp`: 一个辅助函数，用于将简单的文本消息打包并通过Netlink发送给指定PID的用户空间进程。
  * 2.  `dealWithSetAction`: 当防火墙的默认动作被修改时（特别是从允许变为拒绝），此函数负责执行一些清理操作，
  *     例如清除所有现有的网络连接，以确保新的默认策略能够立即生效。
- * 3.  `dealAppMessage`: 这是核心的Netlink消息处理函数。它接收一个来自用户空间应用的消息 (`APPRequest`)，
+ * 3.  `dealAppDump`: 规则、连接、日志与NAT规则的获取请求若带有 NLM_F_DUMP，则以分段导出的方式回复，
+ *     表再大也不需要一次分配整张表的内存。连接表快照只以这种方式导出。
+ * 4.  `dealAppMessage`: 这是核心的Netlink消息处理函数。它接收一个来自用户空间应用的消息 (`APPRequest`)，
  *     并根据请求类型 (`req->tp`) 分发到不同的处理分支。这些分支负责调用相应的内部函数来执行
  *     诸如获取规则/日志/连接、添加/删除规则、设置默认动作等操作。处理完毕后，它会调用
  *     `nlSend` (或 `sendMsgToApp`) 将结果或状态信息返回给用户空间应用程序。
@@ -25,14 +27,12 @@
                     //             addNATRuleToChain, delNATRuleFromChain, eraseConnRelated
                     // - 内核API: printk, kzalloc, kfree, GFP_ATOMIC, GFP_KERNEL, strlen, memcpy
 
-// 外部变量声明，DEFAULT_ACTION 在其他文件中定义 (例如 hook_main.c 或主模块文件)
-// 它存储了防火墙的默认处理动作 (NF_ACCEPT 或 NF_DROP)。
-extern unsigned int DEFAULT_ACTION;
-
 /**
  * @brief 将文本消息通过Netlink发送给指定PID的用户空间应用程序。
  *
+ * @param net 目标应用程序所在的网络命名空间。
  * @param pid 目标用户空间应用程序的进程ID。
+ * @param seq 所回复请求的序列号。
  * @param msg 指向要发送的以null结尾的C字符串消息的指针。
  * @return int 返回发送的消息的总长度 (包括头部和消息体)，如果内存分配失败则返回0。
  *
@@ -48,7 +48,7 @@ extern unsigned int DEFAULT_ACTION;
  *   7.  使用 `kfree` 释放之前分配的内存。
  *   8.  返回发送的总字节数。
  */
-int sendMsgToApp(unsigned int pid, const char *msg) {
+int sendMsgToApp(struct net *net, unsigned int pid, unsigned int seq, const char *msg) {
     void* mem;                          // 指向分配的内存块的通用指针
     unsigned int rspLen;                // 响应消息的总长度
     struct KernelResponseHeader *rspH;  // 指向响应头部的指针
@@ -72,47 +72,96 @@ int sendMsgToApp(unsigned int pid, const char *msg) {
 
     // 调用 nlSend (Netlink发送函数，未在此处定义，应在helper.h中声明并在其他地方实现)
     // 将构建好的消息发送给指定PID的用户空间进程
-    nlSend(pid, mem, rspLen);
+    nlSend(net, pid, seq, mem, rspLen);
 
     kfree(mem); // 释放分配的内存
     return rspLen; // 返回发送的总字节数
 }
 
+// 回复一个只有头部的响应，arrayLen 携带计数 (例如已暂存或已提交的规则数)
+static int sendCountToApp(struct net *net, unsigned int pid, unsigned int seq, unsigned int count) {
+    struct KernelResponseHeader rspH = {
+        .bodyTp = RSP_Only_Head,
+        .arrayLen = count,
+    };
+    nlSend(net, pid, seq, &rspH, sizeof(rspH));
+    return sizeof(rspH);
+}
+
+// 批量规则事务失败时回复给用户空间的说明
+static const char *batchErrMsg(int err) {
+    switch (err) {
+    case -ENOENT:
+        return "Fail: no batch in progress.";
+    case -E2BIG:
+        return "Fail: batch too large.";
+    case -EINVAL:
+        return "Fail: bad batch request.";
+    default:
+        return "Fail: no memory, batch kept, retry it.";
+    }
+}
+
+// NAT、DNAT、地址集合与连接超时由所有网络命名空间共用，只接受初始命名空间的修改；
+// 连接数上限虽然每个命名空间一份，但节点都来自全机共用的slab，也只由初始命名空间的管理者设置
+static bool isHostWideReq(unsigned int tp) {
+    switch (tp) {
+    case REQ_SETConnLimit:
+    case REQ_ADDNATRule:
+    case REQ_DELNATRule:
+    case REQ_ADDDNATRule:
+    case REQ_DELDNATRule:
+    case REQ_SETTimeouts:
+    case REQ_BeginIPSet:
+    case REQ_ChunkIPSet:
+    case REQ_CommitIPSet:
+    case REQ_AbortIPSet:
+    case REQ_DestroyIPSet:
+        return true;
+    default:
+        return false;
+    }
+}
+
 /**
  * @brief 处理设置默认防火墙动作后的附加操作。
  *
+ * @param net 修改了默认动作的网络命名空间。
  * @param action 新设置的默认防火墙动作 (NF_ACCEPT 或 NF_DROP)。
  * @return void 无返回值。
  *
  * @功能描述:
  *   当防火墙的默认动作被修改时，此函数被调用。
  *   主要逻辑是：如果新的默认动作不是 `NF_ACCEPT` (即通常是 `NF_DROP` 或其他限制性策略)，
- *   则调用 `eraseConnRelated` 函数来清除所有现有的网络连接。
+ *   则调用 `purgeConnRelated` 登记清除该命名空间中所有现有的网络连接，清理由工作队列在后台完成。
  *   这样做的目的是确保新的、更严格的默认策略能够立即对所有流量生效，
  *   防止已建立的连接绕过新的默认丢弃策略。
- *   `eraseConnRelated` 的参数是一个特殊的 `IPRule`，其字段被设置为通配符值，
+ *   `purgeConnRelated` 的参数是一个特殊的 `IPRule`，其字段被设置为通配符值，
  *   以匹配并清除所有连接。
  */
-void dealWithSetAction(unsigned int action) {
+void dealWithSetAction(struct net *net, unsigned int action) {
     if(action != NF_ACCEPT) { // 如果新的默认动作不是“允许” (例如，设置为“拒绝”)
         // 创建一个通配符IP规则，用于匹配所有连接
         struct IPRule rule = {
             .smask = 0,     // 源掩码为0，匹配任何源IP
             .dmask = 0,     // 目的掩码为0，匹配任何目的IP
-            .sport = (unsigned int)-1, // 源端口为-1 (或全1)，通常表示匹配任何源端口 (具体依赖eraseConnRelated的实现)
+            .sport = (unsigned int)-1, // 源端口为-1 (或全1)，通常表示匹配任何源端口 (具体依赖matchOneRule的实现)
             .dport = (unsigned int)-1  // 目的端口为-1，匹配任何目的端口
             // 其他字段 (saddr, daddr, protocol, name, action, log, nx) 会被默认初始化 (通常为0或NULL)
         };
-        // 调用 eraseConnRelated 函数，使用这个通配符规则来清除所有相关的连接跟踪条目。
-        // eraseConnRelated 函数未在此处定义，应在helper.h中声明并在其他地方实现。
-        eraseConnRelated(rule);
+        // 登记延迟清理，使用这个通配符规则清除所有连接跟踪条目；netlink处理不等待遍历完成。
+        purgeConnRelated(net, rule);
+        rule.family = AF_INET6; // 前缀长度为0，匹配所有IPv6连接
+        purgeConnRelated(net, rule);
     }
 }
 
 /**
  * @brief 处理从用户空间应用程序通过Netlink接收到的消息。
  *
+ * @param net 发送方所在的网络命名空间，规则、连接、日志与默认动作的请求都作用于该命名空间。
  * @param pid 发送该消息的用户空间应用程序的进程ID。
+ * @param seq 请求的序列号，所有回复都带回该序列号。
  * @param msg 指向接收到的消息数据 (通常是一个 `struct APPRequest`) 的指针。
  * @param len 接收到的消息数据的长度 (字节数)。
  * @return int 返回响应给用户空间的消息的长度，或在某些情况下返回0或错误指示（尽管此函数主要通过发送消息来反馈）。
@@ -120,6 +169,7 @@ void dealWithSetAction(unsigned int action) {
  * @功能描述:
  *   此函数是内核模块中处理用户空间请求的核心分发器。
  *   1.  将接收到的原始消息数据 (`msg`) 转换为 `struct APPRequest *` 指针。
+ *       修改NAT、DNAT、地址集合或连接超时的请求只接受来自初始网络命名空间的，其他命名空间回复一条失败消息。
  *   2.  使用 `switch` 语句根据 `req->tp` (请求类型) 执行不同的操作：
  *       -   **获取数据请求 (REQ_GETAllIPLogs, REQ_GETAllConns, REQ_GETAllIPRules, REQ_GETNATRules)**:
  *           调用相应的 `formAll...` 函数 (例如 `formAllIPLogs`) 来准备包含所请求数据的数据包。
@@ -133,70 +183,90 @@ void dealWithSetAction(unsigned int action) {
  *           构建一个只包含头部的响应 (`RSP_Only_Head`)，其中 `arrayLen` 字段存储实际删除的规则数量。
  *           将此响应发送给用户空间。
  *       -   **设置默认动作请求 (REQ_SETAction)**:
- *           根据请求中指定的动作 (`req->msg.defaultAction`) 更新全局的 `DEFAULT_ACTION` 变量。
+ *           根据请求中指定的动作 (`req->msg.defaultAction`) 更新请求方所在命名空间的默认动作。
  *           向用户空间发送一条确认消息。
  *           调用 `dealWithSetAction` 执行与默认动作更改相关的附加操作（如清除连接）。
+ *       -   **超时配置请求 (REQ_GETTimeouts, REQ_SETTimeouts)**:
+ *           分别返回当前的 `ConnTimeouts` 配置，或按请求修改配置并回复状态消息。
+ *       -   **连接池容量请求 (REQ_GETConnStats, REQ_SETConnLimit)**:
+ *           返回连接数、上限、满表策略与满表计数，或修改上限与满表策略。
+ *       -   **统计请求 (REQ_GETStats)**:
+ *           返回各钩子点的耗时直方图以及过滤规则、默认动作与NAT规则的命中计数。
+ *       -   **批量规则事务 (REQ_BeginIPRules, REQ_ChunkIPRules, REQ_CommitIPRules, REQ_AbortIPRules)**:
+ *           分段暂存规则，提交时一次性替换规则集。各步骤成功时以 `RSP_Only_Head` 回复 (追加与提交时
+ *           arrayLen 为规则数)，失败时回复文本消息。
+ *       -   **DNAT规则 (REQ_ADDDNATRule, REQ_DELDNATRule)**:
+ *           添加时回复文本消息，删除时以 `RSP_Only_Head` 回复删除的规则数；获取只以分段导出的方式回复。
+ *       -   **地址集合事务 (REQ_BeginIPSet, REQ_ChunkIPSet, REQ_CommitIPSet, REQ_AbortIPSet)**:
+ *           与批量规则事务相同的分段暂存与回复方式，提交时替换一个集合或对其增删条目；
+ *           REQ_DestroyIPSet 以 `RSP_Only_Head` 回复删除的集合数。
+ *       -   **导入连接快照 (REQ_LoadConns)**:
+ *           恢复请求后附带的一段 `ConnSnap`，以 `RSP_Only_Head` 回复实际恢复的连接数。
  *       -   **默认/未知请求**: 如果请求类型未知，向用户空间发送 "No such req." 消息。
  *   3.  函数返回发送给用户空间响应的长度。
  *
  *   此函数大量使用了 `printk` 进行内核日志记录，`kzalloc` 和 `kfree` 进行内存管理，
  *   以及 `nlSend` 和 `sendMsgToApp` 与用户空间进行通信。
  */
-int dealAppMessage(unsigned int pid, void *msg, unsigned int len) {
+int dealAppMessage(struct net *net, unsigned int pid, unsigned int seq, void *msg, unsigned int len) {
     struct APPRequest *req;             // 指向应用程序请求结构体的指针
     struct KernelResponseHeader *rspH;  // 指向内核响应头部的指针
     void* mem;                          // 通用内存指针，用于存储待发送的数据
     unsigned int rspLen = 0;            // 响应消息的长度
+    int ret;                            // 批量规则事务各步骤的返回值
 
     req = (struct APPRequest *) msg;    // 将接收到的void*消息转换为APPRequest类型指针
 
+    if(!net_eq(net, &init_net) && isHostWideReq(req->tp))
+        return sendMsgToApp(net, pid, seq, "Fail: only allowed in the initial network namespace.");
+
     switch (req->tp) // 根据请求类型 (req->tp) 进行分支处理
     {
     case REQ_GETAllIPLogs: // 请求：获取所有IP日志
         // 调用 formAllIPLogs 准备包含所有IP日志的数据包
         // req->msg.num 指定要获取的日志数量 (0表示所有)
         // rspLen 会被 formAllIPLogs 更新为实际数据包的长度
-        mem = formAllIPLogs(req->msg.num, &rspLen);
+        mem = formAllIPLogs(net, req->msg.num, &rspLen);
         if(mem == NULL) { // 如果准备数据失败 (例如内存不足)
             printk(KERN_WARNING "[fw k2app] formAllIPLogs fail.\n");
-            sendMsgToApp(pid, "form all logs fail."); // 向用户空间发送错误消息
+            sendMsgToApp(net, pid, seq, "form all logs fail."); // 向用户空间发送错误消息
             break; // 退出switch语句
         }
-        nlSend(pid, mem, rspLen); // 将日志数据发送给用户空间
+        nlSend(net, pid, seq, mem, rspLen); // 将日志数据发送给用户空间
         kfree(mem); // 释放为日志数据分配的内存
         break;
 
     case REQ_GETAllConns: // 请求：获取所有连接信息
-        mem = formAllConns(&rspLen); // 准备包含所有连接信息的数据包
+        mem = formAllConns(net, &rspLen); // 准备包含所有连接信息的数据包
         if(mem == NULL) {
             printk(KERN_WARNING "[fw k2app] formAllConns fail.\n");
-            sendMsgToApp(pid, "form all conns fail.");
+            sendMsgToApp(net, pid, seq, "form all conns fail.");
             break;
         }
-        nlSend(pid, mem, rspLen);
+        nlSend(net, pid, seq, mem, rspLen);
         kfree(mem);
         break;
 
     case REQ_GETAllIPRules: // 请求：获取所有IP规则
-        mem = formAllIPRules(&rspLen); // 准备包含所有IP规则的数据包
+        mem = formAllIPRules(net, &rspLen); // 准备包含所有IP规则的数据包
         if(mem == NULL) {
             printk(KERN_WARNING "[fw k2app] formAllIPRules fail.\n");
-            sendMsgToApp(pid, "form all rules fail.");
+            sendMsgToApp(net, pid, seq, "form all rules fail.");
             break;
         }
-        nlSend(pid, mem, rspLen);
+        nlSend(net, pid, seq, mem, rspLen);
         kfree(mem);
         break;
 
     case REQ_ADDIPRule: // 请求：添加一条IP规则
         // req->ruleName 是新规则要插入到其后的规则名称 (空表示头部)
         // req->msg.ipRule 是要添加的IPRule结构体
-        if(addIPRuleToChain(req->ruleName, req->msg.ipRule)==NULL) { // 调用函数添加规则
+        if(addIPRuleToChain(net, req->ruleName, req->msg.ipRule)==NULL) { // 调用函数添加规则
             // 如果添加失败 (例如，指定的前置规则不存在，或内存分配失败)
-            rspLen = sendMsgToApp(pid, "Fail: no such rule or retry it."); // 发送失败消息
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: no such rule or retry it."); // 发送失败消息
             printk("[fw k2app] add rule fail.\n");
         } else { // 如果添加成功
-            rspLen = sendMsgToApp(pid, "Success."); // 发送成功消息
+            rspLen = sendMsgToApp(net, pid, seq, "Success."); // 发送成功消息
             printk("[fw k2app] add one rule success: %s.\n", req->msg.ipRule.name);
         }
         break;
@@ -207,14 +277,14 @@ int dealAppMessage(unsigned int pid, void *msg, unsigned int len) {
         rspH = (struct KernelResponseHeader *)kzalloc(rspLen, GFP_KERNEL);
         if(rspH == NULL) { // 检查内存分配
             printk(KERN_WARNING "[fw k2app] kzalloc fail.\n");
-            sendMsgToApp(pid, "form rsp fail but del maybe success."); // 即使响应构建失败，删除可能已成功
+            sendMsgToApp(net, pid, seq, "form rsp fail but del maybe success."); // 即使响应构建失败，删除可能已成功
             break;
         }
         rspH->bodyTp = RSP_Only_Head; // 设置响应体类型为“仅头部”
         // 调用 delIPRuleFromChain 删除指定名称 (req->ruleName) 的规则，并返回实际删除的数量
-        rspH->arrayLen = delIPRuleFromChain(req->ruleName);
+        rspH->arrayLen = delIPRuleFromChain(net, req->ruleName);
         printk("[fw k2app] success del %d rules.\n", rspH->arrayLen);
-        nlSend(pid, rspH, rspLen); // 发送响应
+        nlSend(net, pid, seq, rspH, rspLen); // 发送响应
         kfree(rspH); // 释放为响应头分配的内存
         break;
 
@@ -222,20 +292,20 @@ int dealAppMessage(unsigned int pid, void *msg, unsigned int len) {
         mem = formAllNATRules(&rspLen); // 准备包含所有NAT规则的数据包
         if(mem == NULL) {
             printk(KERN_WARNING "[fw k2app] formAllNATRules fail.\n");
-            sendMsgToApp(pid, "form all NAT rules fail.");
+            sendMsgToApp(net, pid, seq, "form all NAT rules fail.");
             break;
         }
-        nlSend(pid, mem, rspLen);
+        nlSend(net, pid, seq, mem, rspLen);
         kfree(mem);
         break;
 
     case REQ_ADDNATRule: // 请求：添加一条NAT规则
         // req->msg.natRule 是要添加的NATRecord结构体
         if(addNATRuleToChain(req->msg.natRule)==NULL) { // 调用函数添加NAT规则
-            rspLen = sendMsgToApp(pid, "Fail: please retry it."); // 发送失败消息
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: please retry it."); // 发送失败消息
             printk("[fw k2app] add NAT rule fail.\n");
         } else {
-            rspLen = sendMsgToApp(pid, "Success."); // 发送成功消息
+            rspLen = sendMsgToApp(net, pid, seq, "Success."); // 发送成功消息
             printk("[fw k2app] add one NAT rule success.\n");
         }
         break;
@@ -245,33 +315,224 @@ int dealAppMessage(unsigned int pid, void *msg, unsigned int len) {
         rspH = (struct KernelResponseHeader *)kzalloc(rspLen, GFP_KERNEL);
         if(rspH == NULL) {
             printk(KERN_WARNING "[fw k2app] kzalloc fail.\n");
-            sendMsgToApp(pid, "form rsp fail but del maybe success.");
+            sendMsgToApp(net, pid, seq, "form rsp fail but del maybe success.");
             break;
         }
         rspH->bodyTp = RSP_Only_Head;
         // req->msg.num 是要删除的NAT规则的序号
         rspH->arrayLen = delNATRuleFromChain(req->msg.num);
         printk("[fw k2app] success del %d NAT rules.\n", rspH->arrayLen);
-        nlSend(pid, rspH, rspLen);
+        nlSend(net, pid, seq, rspH, rspLen);
         kfree(rspH);
         break;
 
+    case REQ_ADDDNATRule: // 请求：添加一条DNAT规则
+        ret = addDNATRuleToTable(req->msg.dnatRule);
+        if(ret == 0)
+            rspLen = sendMsgToApp(net, pid, seq, "Success.");
+        else if(ret == -EEXIST)
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: a DNAT rule for this address, port and protocol exists.");
+        else if(ret == -EINVAL)
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: invalid DNAT rule.");
+        else
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: please retry it.");
+        printk("[fw k2app] add DNAT rule: %d.\n", ret);
+        break;
+
+    case REQ_DELDNATRule: // 请求：删除与 req->msg.dnatRule 同键的DNAT规则
+        rspLen = sendCountToApp(net, pid, seq, delDNATRuleFromTable(req->msg.dnatRule));
+        break;
+
     case REQ_SETAction: // 请求：设置默认防火墙动作
         if(req->msg.defaultAction == NF_ACCEPT) { // 如果请求设置为“允许”
-            DEFAULT_ACTION = NF_ACCEPT; // 更新全局默认动作变量
-            rspLen = sendMsgToApp(pid, "Set default action to ACCEPT.");
+            setDefaultAction(net, NF_ACCEPT); // 更新本命名空间的默认动作
+            rspLen = sendMsgToApp(net, pid, seq, "Set default action to ACCEPT.");
             printk("[fw k2app] Set default action to NF_ACCEPT.\n");
         } else { // 否则 (通常请求设置为 NF_DROP)
-            DEFAULT_ACTION = NF_DROP; // 更新全局默认动作变量
-            rspLen = sendMsgToApp(pid, "Set default action to DROP.");
+            setDefaultAction(net, NF_DROP); // 更新本命名空间的默认动作
+            rspLen = sendMsgToApp(net, pid, seq, "Set default action to DROP.");
             printk("[fw k2app] Set default action to NF_DROP.\n");
         }
-        dealWithSetAction(DEFAULT_ACTION); // 调用函数处理默认动作更改后的附加操作
+        dealWithSetAction(net, getDefaultAction(net)); // 调用函数处理默认动作更改后的附加操作
+        break;
+
+    case REQ_GETTimeouts: // 请求：获取连接超时配置
+        mem = formConnTimeouts(&rspLen);
+        if(mem == NULL) {
+            printk(KERN_WARNING "[fw k2app] formConnTimeouts fail.\n");
+            sendMsgToApp(net, pid, seq, "form timeouts fail.");
+            break;
+        }
+        nlSend(net, pid, seq, mem, rspLen);
+        kfree(mem);
+        break;
+
+    case REQ_SETTimeouts: // 请求：设置连接超时配置，值为0的项保持不变
+        if(setConnTimeouts(req->msg.timeouts) != 0) {
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: timeout out of range.");
+            printk("[fw k2app] set timeouts fail.\n");
+        } else {
+            rspLen = sendMsgToApp(net, pid, seq, "Success.");
+            printk("[fw k2app] set timeouts success.\n");
+        }
+        break;
+
+    case REQ_GETConnStats: // 请求：获取连接池容量与满表统计
+        mem = formConnStats(net, &rspLen);
+        if(mem == NULL) {
+            printk(KERN_WARNING "[fw k2app] formConnStats fail.\n");
+            sendMsgToApp(net, pid, seq, "form conn stats fail.");
+            break;
+        }
+        nlSend(net, pid, seq, mem, rspLen);
+        kfree(mem);
+        break;
+
+    case REQ_GETStats: // 请求：获取规则命中计数与钩子耗时统计
+        mem = formAllStats(net, &rspLen);
+        if(mem == NULL) {
+            printk(KERN_WARNING "[fw k2app] formAllStats fail.\n");
+            sendMsgToApp(net, pid, seq, "form stats fail.");
+            break;
+        }
+        nlSend(net, pid, seq, mem, rspLen);
+        kvfree(mem);
+        break;
+
+    case REQ_SETConnLimit: // 请求：设置连接数上限与满表策略
+        if(setConnLimit(net, req->msg.connLimit) != 0) {
+            rspLen = sendMsgToApp(net, pid, seq, "Fail: no such full-table policy.");
+            printk("[fw k2app] set conn limit fail.\n");
+        } else {
+            rspLen = sendMsgToApp(net, pid, seq, "Success.");
+            printk("[fw k2app] set conn limit success.\n");
+        }
+        break;
+
+    case REQ_BeginIPRules: // 请求：开始批量规则事务，req->msg.num 为事务模式
+        ret = beginIPRuleBatch(net, pid, req->msg.num);
+        rspLen = ret ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, 0);
+        break;
+
+    case REQ_ChunkIPRules: // 请求：追加一段规则，req->msg.num 条规则紧跟在请求之后
+        if(req->msg.num > IPRULE_BATCH_CHUNK ||
+           len < sizeof(struct APPRequest) + req->msg.num * sizeof(struct IPRule)) {
+            rspLen = sendMsgToApp(net, pid, seq, batchErrMsg(-EINVAL));
+            break;
+        }
+        ret = addIPRuleBatch(net, pid, (struct IPRule *)(req + 1), req->msg.num);
+        rspLen = ret < 0 ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, ret);
+        break;
+
+    case REQ_CommitIPRules: // 请求：提交批量规则事务，回复提交后的规则数
+        ret = commitIPRuleBatch(net, pid);
+        rspLen = ret < 0 ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, ret);
+        printk("[fw k2app] commit rule batch: %d.\n", ret);
+        break;
+
+    case REQ_AbortIPRules: // 请求：放弃批量规则事务
+        ret = abortIPRuleBatch(net, pid);
+        rspLen = ret ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, 0);
+        break;
+
+    case REQ_BeginIPSet: // 请求：开始地址集合事务，req->msg.ipSet 为集合编号、类型与模式
+        ret = beginIPSetBatch(pid, req->msg.ipSet);
+        rspLen = ret ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, 0);
+        break;
+
+    case REQ_ChunkIPSet: // 请求：追加一段条目，req->msg.num 个条目紧跟在请求之后
+        if(req->msg.num > IPSET_CHUNK ||
+           len < sizeof(struct APPRequest) + req->msg.num * sizeof(struct IPSetEntry)) {
+            rspLen = sendMsgToApp(net, pid, seq, batchErrMsg(-EINVAL));
+            break;
+        }
+        ret = addIPSetBatch(pid, (struct IPSetEntry *)(req + 1), req->msg.num);
+        rspLen = ret < 0 ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, ret);
+        break;
+
+    case REQ_CommitIPSet: // 请求：提交地址集合事务，回复集合的条目数
+        ret = commitIPSetBatch(pid);
+        rspLen = ret < 0 ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, ret);
+        break;
+
+    case REQ_AbortIPSet: // 请求：放弃地址集合事务
+        ret = abortIPSetBatch(pid);
+        rspLen = ret ? sendMsgToApp(net, pid, seq, batchErrMsg(ret)) : sendCountToApp(net, pid, seq, 0);
+        break;
+
+    case REQ_DestroyIPSet: // 请求：删除编号为 req->msg.num 的地址集合
+        rspLen = sendCountToApp(net, pid, seq, destroyIPSet(req->msg.num));
+        break;
+
+    case REQ_LoadConns: // 请求：导入一段连接快照，req->msg.num 条快照紧跟在请求之后
+        if(req->msg.num > CONN_SNAP_CHUNK ||
+           len < sizeof(struct APPRequest) + req->msg.num * sizeof(struct ConnSnap)) {
+            rspLen = sendMsgToApp(net, pid, seq, "Invalid conn snapshot.");
+            break;
+        }
+        rspLen = sendCountToApp(net, pid, seq, restoreConns(net, (struct ConnSnap *)(req + 1), req->msg.num));
         break;
 
     default: // 如果请求类型未知
-        rspLen = sendMsgToApp(pid, "No such req."); // 发送未知请求消息
+        rspLen = sendMsgToApp(net, pid, seq, "No such req."); // 发送未知请求消息
         break;
     }
     return rspLen; // 返回发送给用户空间响应的长度
-}
\ No newline at end of file
+}
+/**
+ * @brief 以分段导出的方式处理获取类请求。
+ *
+ * @param skb 请求所在的skb。
+ * @param nlh 请求的消息头。
+ * @param req 请求内容。
+ * @return int 已处理返回1，不支持分段导出的请求类型返回0。
+ *
+ * @功能描述:
+ *   按请求类型选择导出回调并调用 `nlDumpStart`。导出期间的状态 (遍历位置、日志快照) 由各回调自行保存在
+ *   netlink_callback 中。启动失败 (例如内存不足) 时向用户空间回复一条文本消息，用户空间据此结束等待。
+ */
+int dealAppDump(struct sk_buff *skb, struct nlmsghdr *nlh, struct APPRequest *req) {
+    struct netlink_dump_control c = {};
+    int ret;
+
+    switch (req->tp) {
+    case REQ_GETAllIPRules:
+        c.dump = dumpIPRules;
+        break;
+    case REQ_GETNATRules:
+        c.dump = dumpNATRules;
+        break;
+    case REQ_GETDNATRules:
+        c.dump = dumpDNATRules;
+        break;
+    case REQ_GETIPSets:
+        c.dump = dumpIPSets;
+        break;
+    case REQ_GETIPSetEntries:
+        c.dump = dumpIPSetEntries;
+        break;
+    case REQ_GETAllConns:
+        c.start = dumpConnsStart;
+        c.dump = dumpConns;
+        c.done = dumpConnsDone;
+        break;
+    case REQ_GETConnSnap:
+        c.start = dumpConnSnapStart;
+        c.dump = dumpConns;
+        c.done = dumpConnsDone;
+        break;
+    case REQ_GETAllIPLogs:
+        c.start = dumpIPLogsStart;
+        c.dump = dumpIPLogs;
+        c.done = dumpIPLogsDone;
+        break;
+    default:
+        return 0;
+    }
+    ret = nlDumpStart(skb, nlh, &c);
+    if(ret != 0 && ret != -EINTR) {
+        printk(KERN_WARNING "[fw k2app] dump start fail: %d.\n", ret);
+        sendMsgToApp(sock_net(skb->sk), nlh->nlmsg_pid, nlh->nlmsg_seq, "dump fail.");
+    }
+    return 1;
+}
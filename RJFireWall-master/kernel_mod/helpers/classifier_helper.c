@@ -0,0 +1,439 @@
+#include "tools.h"
+#include "helper.h"
+
+/*
+ * 规则分类器 (HyperSplit 风格的决策树)
+ *
+ * 规则链表变化时，把整条链编译成一棵二叉决策树：每个内部节点在某一维
+ * (源IP/目的IP/源端口/目的端口/协议) 上按一个切分点把空间一分为二，
+ * 叶子节点保存落在该区域内、按链表顺序排列的候选规则下标。
+ * 查找时沿树下降到叶子，再对少量候选规则逐条调用 matchOneRule，
+ * 第一条命中的即为结果，从而保持与线性扫描完全一致的首匹配语义。
+ * IPv6规则的地址是128位前缀，不进入上述各维均为32位的决策树，而是按链表顺序
+ * 单独记下标，由 classifyPacket6 逐条匹配；两类规则共用同一份规则副本与发布流程。
+ */
+
+// 构建过程中每条规则在各维上的闭区间
+struct clsRange {
+    unsigned int lo[CLS_DIM_NUM];
+    unsigned int hi[CLS_DIM_NUM];
+    bool partial;               // 引用了地址集合，区间内的数据包也未必命中
+};
+
+// 构建上下文
+struct clsBuildCtx {
+    struct ruleClassifier *cls;
+    struct clsRange *ranges;    // 每条规则的区间
+    unsigned int *pts;          // 选取切分点时的临时缓冲区
+    unsigned int nodeCap;       // nodes 当前容量
+    unsigned int leafCap;       // leafRules 当前容量
+};
+
+/**
+ * @brief 计算规则在某一维上覆盖的闭区间
+ * @return bool 区间为空(该规则永远不会命中)时返回false
+ */
+static bool ruleRange(const struct IPRule *rule, int dim, unsigned int *lo, unsigned int *hi) {
+    switch(dim) {
+    case CLS_DIM_SIP:
+        *lo = rule->saddr & rule->smask;
+        *hi = *lo | ~rule->smask;
+        break;
+    case CLS_DIM_DIP:
+        *lo = rule->daddr & rule->dmask;
+        *hi = *lo | ~rule->dmask;
+        break;
+    case CLS_DIM_SPORT:
+        *lo = rule->sport >> 16;
+        *hi = rule->sport & 0xFFFFu;
+        break;
+    case CLS_DIM_DPORT:
+        *lo = rule->dport >> 16;
+        *hi = rule->dport & 0xFFFFu;
+        break;
+    default: // CLS_DIM_PROTO
+        if(rule->protocol == IPPROTO_IP) {
+            *lo = 0;
+            *hi = 0xFF;
+        } else {
+            *lo = *hi = rule->protocol;
+        }
+        break;
+    }
+    return *lo <= *hi;
+}
+
+static int cmpUint(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : (x > y);
+}
+
+// 申请 n 个连续的树节点，返回首个节点下标，超过上限或内存不足返回负数
+static int clsNewNodes(struct clsBuildCtx *ctx, unsigned int n) {
+    struct ruleClassifier *cls = ctx->cls;
+    struct clsNode *nodes;
+    unsigned int cap;
+    int idx;
+    if(cls->nodeNum + n > CLS_MAX_NODES)
+        return -ENOSPC;
+    if(cls->nodeNum + n > ctx->nodeCap) {
+        cap = min(ctx->nodeCap * 2, (unsigned int)CLS_MAX_NODES);
+        nodes = kvmalloc_array(cap, sizeof(struct clsNode), GFP_KERNEL);
+        if(nodes == NULL)
+            return -ENOMEM;
+        memcpy(nodes, cls->nodes, sizeof(struct clsNode) * cls->nodeNum);
+        kvfree(cls->nodes);
+        cls->nodes = nodes;
+        ctx->nodeCap = cap;
+    }
+    idx = cls->nodeNum;
+    cls->nodeNum += n;
+    memset(&cls->nodes[idx], 0, sizeof(struct clsNode) * n);
+    return idx;
+}
+
+// 将节点 idx 设为叶子，保存候选规则列表
+static int clsMakeLeaf(struct clsBuildCtx *ctx, unsigned int idx, unsigned int *list, unsigned int n) {
+    struct ruleClassifier *cls = ctx->cls;
+    unsigned int *leaf, cap;
+    if(cls->leafLen + n > CLS_MAX_LEAF_LEN)
+        return -ENOSPC;
+    if(cls->leafLen + n > ctx->leafCap) {
+        cap = max(ctx->leafCap * 2, cls->leafLen + n);
+        cap = min(cap, (unsigned int)CLS_MAX_LEAF_LEN);
+        leaf = kvmalloc_array(cap, sizeof(unsigned int), GFP_KERNEL);
+        if(leaf == NULL)
+            return -ENOMEM;
+        memcpy(leaf, cls->leafRules, sizeof(unsigned int) * cls->leafLen);
+        kvfree(cls->leafRules);
+        cls->leafRules = leaf;
+        ctx->leafCap = cap;
+    }
+    memcpy(&cls->leafRules[cls->leafLen], list, sizeof(unsigned int) * n);
+    cls->nodes[idx].dim = CLS_LEAF;
+    cls->nodes[idx].child = cls->leafLen;
+    cls->nodes[idx].count = n;
+    cls->leafLen += n;
+    return 0;
+}
+
+/**
+ * @brief 为当前区域选择切分维度与切分点
+ * @return bool 找到能减少规则数的切分时返回true
+ * @note 每一维取区域内规则端点的中位数作为候选切分点，
+ *       选择两侧最大规则数最小的维度，其次比较两侧规则总数(复制量)
+ */
+static bool clsChooseSplit(struct clsBuildCtx *ctx, unsigned int *list, unsigned int n,
+        unsigned int *lo, unsigned int *hi, int *bestDim, unsigned int *bestPt) {
+    unsigned int i, cnt, uniq, pt, nl, nr, a, b;
+    unsigned int bestMax = n, bestSum = 2 * n;
+    struct clsRange *r;
+    int d;
+    for(d = 0; d < CLS_DIM_NUM; d++) {
+        if(lo[d] == hi[d])
+            continue;
+        // 收集区域内部的规则边界: 切分点 p 表示 值<=p 走左子树
+        for(i = 0, cnt = 0; i < n; i++) {
+            r = &ctx->ranges[list[i]];
+            a = max(r->lo[d], lo[d]);
+            b = min(r->hi[d], hi[d]);
+            if(a > lo[d])
+                ctx->pts[cnt++] = a - 1;
+            if(b < hi[d])
+                ctx->pts[cnt++] = b;
+        }
+        if(cnt == 0)
+            continue;
+        sort(ctx->pts, cnt, sizeof(unsigned int), cmpUint, NULL);
+        for(i = 1, uniq = 1; i < cnt; i++)
+            if(ctx->pts[i] != ctx->pts[uniq - 1])
+                ctx->pts[uniq++] = ctx->pts[i];
+        pt = ctx->pts[uniq / 2];
+        for(i = 0, nl = 0, nr = 0; i < n; i++) {
+            r = &ctx->ranges[list[i]];
+            if(r->lo[d] <= pt)
+                nl++;
+            if(r->hi[d] > pt)
+                nr++;
+        }
+        if(max(nl, nr) < bestMax || (max(nl, nr) == bestMax && nl + nr < bestSum)) {
+            bestMax = max(nl, nr);
+            bestSum = nl + nr;
+            *bestDim = d;
+            *bestPt = pt;
+        }
+    }
+    return bestMax < n;
+}
+
+/**
+ * @brief 递归构建以 idx 为根、覆盖区域 [lo,hi] 的子树
+ * @param list 区域内的候选规则下标(按优先级升序)
+ * @return int 成功返回0，节点/叶子数量超限返回-ENOSPC，内存不足返回-ENOMEM
+ */
+static int clsBuild(struct clsBuildCtx *ctx, unsigned int idx, unsigned int *list, unsigned int n,
+        unsigned int *lo, unsigned int *hi, int depth) {
+    unsigned int i, nl, nr, pt = 0, saved, *left, *right;
+    struct clsRange *r;
+    int d, dim = 0, child, ret;
+    // 第一条覆盖整个区域的规则之后的规则都不可能被命中，直接裁掉；
+    // 引用地址集合的规则只命中集合内的地址，不能据此裁掉后面的规则
+    for(i = 0; i < n; i++) {
+        r = &ctx->ranges[list[i]];
+        if(r->partial)
+            continue;
+        for(d = 0; d < CLS_DIM_NUM; d++)
+            if(r->lo[d] > lo[d] || r->hi[d] < hi[d])
+                break;
+        if(d == CLS_DIM_NUM) {
+            n = i + 1;
+            break;
+        }
+    }
+    if(n <= CLS_LEAF_RULES || depth >= CLS_MAX_DEPTH ||
+        !clsChooseSplit(ctx, list, n, lo, hi, &dim, &pt))
+        return clsMakeLeaf(ctx, idx, list, n);
+    left = kmalloc_array(n, sizeof(unsigned int), GFP_KERNEL);
+    right = kmalloc_array(n, sizeof(unsigned int), GFP_KERNEL);
+    if(left == NULL || right == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for(i = 0, nl = 0, nr = 0; i < n; i++) {
+        r = &ctx->ranges[list[i]];
+        if(r->lo[dim] <= pt)
+            left[nl++] = list[i];
+        if(r->hi[dim] > pt)
+            right[nr++] = list[i];
+    }
+    child = clsNewNodes(ctx, 2);
+    if(child < 0) {
+        ret = child;
+        goto out;
+    }
+    ctx->cls->nodes[idx].dim = dim;
+    ctx->cls->nodes[idx].split = pt;
+    ctx->cls->nodes[idx].child = child;
+    saved = hi[dim];
+    hi[dim] = pt;
+    ret = clsBuild(ctx, child, left, nl, lo, hi, depth + 1);
+    hi[dim] = saved;
+    if(ret < 0)
+        goto out;
+    saved = lo[dim];
+    lo[dim] = pt + 1;
+    ret = clsBuild(ctx, child + 1, right, nr, lo, hi, depth + 1);
+    lo[dim] = saved;
+out:
+    kfree(left);
+    kfree(right);
+    return ret;
+}
+
+/**
+ * @brief 将规则数组编译为分类器
+ * @param rules 按优先级排列的规则数组(kvmalloc分配)，成功时所有权转移给分类器
+ * @param num 规则条数
+ * @return struct ruleClassifier* 成功返回分类器，失败返回NULL(此时rules仍由调用者释放)
+ * @note 可能睡眠，只能在进程上下文中调用；树规模超限时退化为单个叶子(线性匹配)
+ */
+struct ruleClassifier *buildClassifier(struct IPRule *rules, unsigned int num) {
+    unsigned int lo[CLS_DIM_NUM] = {0, 0, 0, 0, 0};
+    unsigned int hi[CLS_DIM_NUM] = {0xFFFFFFFFu, 0xFFFFFFFFu, 0xFFFFu, 0xFFFFu, 0xFFu};
+    struct clsBuildCtx ctx;
+    unsigned int i, n;
+    unsigned int *list = NULL;
+    int d, ret = -ENOMEM;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.cls = kzalloc(sizeof(struct ruleClassifier), GFP_KERNEL);
+    if(ctx.cls == NULL)
+        goto fail;
+    ctx.nodeCap = 64;
+    ctx.leafCap = max(num, 64u);
+    ctx.cls->nodes = kvmalloc_array(ctx.nodeCap, sizeof(struct clsNode), GFP_KERNEL);
+    ctx.cls->leafRules = kvmalloc_array(ctx.leafCap, sizeof(unsigned int), GFP_KERNEL);
+    ctx.ranges = kvmalloc_array(max(num, 1u), sizeof(struct clsRange), GFP_KERNEL);
+    ctx.pts = kvmalloc_array(2 * max(num, 1u), sizeof(unsigned int), GFP_KERNEL);
+    ctx.cls->rules6 = kvmalloc_array(max(num, 1u), sizeof(unsigned int), GFP_KERNEL);
+    ctx.cls->hitStride = ALIGN(max(num, 1u) * sizeof(struct clsCounter), SMP_CACHE_BYTES) / sizeof(struct clsCounter);
+    ctx.cls->hits = kvcalloc((size_t)nr_cpu_ids * ctx.cls->hitStride, sizeof(struct clsCounter), GFP_KERNEL);
+    ctx.cls->base = kvcalloc(max(num, 1u), sizeof(struct ruleCounter), GFP_KERNEL);
+    list = kvmalloc_array(max(num, 1u), sizeof(unsigned int), GFP_KERNEL);
+    if(!ctx.cls->nodes || !ctx.cls->leafRules || !ctx.cls->rules6 || !ctx.cls->hits || !ctx.cls->base ||
+       !ctx.ranges || !ctx.pts || !list)
+        goto fail;
+    // IPv6规则另行记录；区间为空的规则永远不会命中，不参与建树
+    for(i = 0, n = 0; i < num; i++) {
+        if(rules[i].family == AF_INET6) {
+            ctx.cls->rules6[ctx.cls->rule6Num++] = i;
+            continue;
+        }
+        for(d = 0; d < CLS_DIM_NUM; d++)
+            if(!ruleRange(&rules[i], d, &ctx.ranges[i].lo[d], &ctx.ranges[i].hi[d]))
+                break;
+        if(d == CLS_DIM_NUM) {
+            ctx.ranges[i].partial = rules[i].sset != 0 || rules[i].dset != 0;
+            list[n++] = i;
+        }
+    }
+    ctx.cls->nodeNum = 1;
+    memset(&ctx.cls->nodes[0], 0, sizeof(struct clsNode));
+    ret = clsBuild(&ctx, 0, list, n, lo, hi, 0);
+    if(ret == -ENOSPC) { // 规则重叠严重导致树过大，退化为线性匹配
+        printk(KERN_WARNING "[fw rules] classifier too large, fall back to linear match.\n");
+        ctx.cls->nodeNum = 1;
+        ctx.cls->leafLen = 0;
+        ret = clsMakeLeaf(&ctx, 0, list, n);
+    }
+    if(ret < 0)
+        goto fail;
+    ctx.cls->rules = rules;
+    ctx.cls->ruleNum = num;
+    kvfree(ctx.ranges);
+    kvfree(ctx.pts);
+    kvfree(list);
+    printk(KERN_INFO "[fw rules] classifier built: %u rules (%u ipv6), %u nodes, %u leaf entries.\n",
+        num, ctx.cls->rule6Num, ctx.cls->nodeNum, ctx.cls->leafLen);
+    return ctx.cls;
+fail:
+    printk(KERN_WARNING "[fw rules] build classifier fail (%d).\n", ret);
+    if(ctx.cls) {
+        kvfree(ctx.cls->nodes);
+        kvfree(ctx.cls->leafRules);
+        kvfree(ctx.cls->rules6);
+        kvfree(ctx.cls->hits);
+        kvfree(ctx.cls->base);
+        kfree(ctx.cls);
+    }
+    kvfree(ctx.ranges);
+    kvfree(ctx.pts);
+    kvfree(list);
+    return NULL;
+}
+
+/**
+ * @brief 释放分类器及其持有的规则数组
+ */
+void freeClassifier(struct ruleClassifier *cls) {
+    if(cls == NULL)
+        return;
+    kvfree(cls->rules);
+    kvfree(cls->nodes);
+    kvfree(cls->leafRules);
+    kvfree(cls->rules6);
+    kvfree(cls->hits);
+    kvfree(cls->base);
+    kfree(cls);
+}
+
+/**
+ * @brief 在分类器中查找第一条匹配的规则
+ * @return struct IPRule* 命中返回分类器内的规则指针，否则返回NULL
+ * @note 返回的指针仅在分类器被释放前有效，调用者需在取得cls的RCU读临界区内使用
+ */
+struct IPRule *classifyPacket(struct ruleClassifier *cls,
+ unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto) {
+    unsigned int key[CLS_DIM_NUM] = {sip, dip, sport, dport, proto};
+    struct clsNode *node;
+    struct IPRule *rule;
+    unsigned int i;
+    if(cls == NULL)
+        return NULL;
+    node = &cls->nodes[0];
+    while(node->dim != CLS_LEAF)
+        node = &cls->nodes[node->child + (key[node->dim] > node->split)];
+    for(i = 0; i < node->count; i++) {
+        rule = &cls->rules[cls->leafRules[node->child + i]];
+        if(matchOneRule(rule, sip, dip, sport, dport, proto))
+            return rule;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在分类器的IPv6规则中查找第一条匹配的规则
+ * @return struct IPRule* 命中返回分类器内的规则指针，否则返回NULL
+ * @note 与 classifyPacket 一样需在取得cls的RCU读临界区内使用
+ */
+struct IPRule *classifyPacket6(struct ruleClassifier *cls,
+ const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto) {
+    struct IPRule *rule;
+    unsigned int i;
+    if(cls == NULL)
+        return NULL;
+    for(i = 0; i < cls->rule6Num; i++) {
+        rule = &cls->rules[cls->rules6[i]];
+        if(matchOneRule6(rule, sip, dip, sport, dport, proto))
+            return rule;
+    }
+    return NULL;
+}
+
+/**
+ * @brief 累加一次规则命中
+ * @note 数据包路径调用；关闭抢占期间只写本CPU的计数段，local64 的加法无需加锁，
+ *       也不会与打断本路径的软中断互相覆盖
+ */
+void clsCountHit(struct ruleClassifier *cls, struct IPRule *rule, unsigned int packets, unsigned int bytes) {
+    struct clsCounter *c;
+    int cpu = get_cpu();
+    c = &cls->hits[(size_t)cpu * cls->hitStride + (rule - cls->rules)];
+    local64_add(packets, &c->packets);
+    local64_add(bytes, &c->bytes);
+    put_cpu();
+}
+
+/**
+ * @brief 读取一条规则的命中计数
+ * @note 与数据包并发读取时，所得只是某一时刻附近的近似值
+ */
+void clsReadHits(struct ruleClassifier *cls, unsigned int idx, struct ruleCounter *out) {
+    struct clsCounter *c;
+    int cpu;
+    *out = cls->base[idx];
+    for_each_possible_cpu(cpu) {
+        c = &cls->hits[(size_t)cpu * cls->hitStride + idx];
+        out->packets += local64_read(&c->packets);
+        out->bytes += local64_read(&c->bytes);
+    }
+}
+
+// 按名称排序的规则下标，用于继承计数时二分查找
+struct clsNameIdx {
+    const char *name;
+    unsigned int idx;
+};
+
+static int clsNameCmp(const void *a, const void *b) {
+    return strcmp(((const struct clsNameIdx *)a)->name, ((const struct clsNameIdx *)b)->name);
+}
+
+/**
+ * @brief 按规则名称继承旧分类器的命中计数
+ * @note 旧分类器按名称排序后逐条二分查找，O(n log n)；同名规则有多条时继承其中任意一条。
+ *       内存不足时放弃继承，计数从零开始
+ */
+void clsInheritHits(struct ruleClassifier *cls, struct ruleClassifier *old) {
+    struct clsNameIdx *names, key, *hit;
+    unsigned int i;
+    if(cls == NULL || old == NULL || cls->ruleNum == 0 || old->ruleNum == 0)
+        return;
+    names = kvmalloc_array(old->ruleNum, sizeof(struct clsNameIdx), GFP_KERNEL);
+    if(names == NULL) {
+        printk(KERN_WARNING "[fw rules] kvmalloc fail, rule counters reset.\n");
+        return;
+    }
+    for(i = 0; i < old->ruleNum; i++) {
+        names[i].name = old->rules[i].name;
+        names[i].idx = i;
+    }
+    sort(names, old->ruleNum, sizeof(struct clsNameIdx), clsNameCmp, NULL);
+    for(i = 0; i < cls->ruleNum; i++) {
+        key.name = cls->rules[i].name;
+        hit = bsearch(&key, names, old->ruleNum, sizeof(struct clsNameIdx), clsNameCmp);
+        if(hit != NULL)
+            clsReadHits(old, hit->idx, &cls->base[i]);
+    }
+    kvfree(names);
+}
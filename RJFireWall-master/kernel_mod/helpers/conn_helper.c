@@ -3,36 +3,58 @@
  * @brief 有状态连接跟踪模块实现。
  *
  * 主要功能：
- * 此文件实现了防火墙和NAT功能所需的核心连接跟踪机制。它使用红黑树（Red-Black Tree）
+ * 此文件实现了防火墙和NAT功能所需的核心连接跟踪机制。它使用可伸缩哈希表（rhashtable）
  * 来高效地存储和检索活动网络连接的信息。主要功能包括：
  *
- * 1.  **红黑树操作封装**:
- *     -   `connKeyCmp`: 比较两个连接的键（由源IP、目的IP、源端口和目的端口组成），用于在红黑树中排序和查找。
- *     -   `searchNode`: 在红黑树中根据连接键查找对应的连接节点 (`connNode`)。
- *     -   `insertNode`: 将新的连接节点插入到红黑树中，并保持树的平衡。
- *     -   `eraseNode`: 从红黑树中删除指定的连接节点，并释放其内存。
- *     所有这些操作都通过读写锁 (`connLock`) 进行保护，以确保并发访问的线程安全。
+ * 1.  **哈希表操作封装**:
+ *     -   连接池使用内核可伸缩哈希表 (`rhashtable`) 存储，以 `conn_key_t` 为键，表大小随连接数自动扩缩。
+ *     -   `searchNode`: 在RCU读临界区内无锁查找连接节点 (`connNode`)。
+ *     -   `insertNode`: 原子地"查找或插入"新的连接节点，键已存在时返回已有节点。
+ *     -   `eraseNode`: 从哈希表中摘除节点并标记为已删除，内存由时间轮统一回收。
+ *     -   `connEvent`: 连接新建、绑定NAT、超时或被删除时向 `FW_GROUP_CONN` 多播组推送事件，
+ *         监听者可据此维护连接表镜像，无需反复拉取全表。
+ *     数据包路径上的查找不再获取任何全局锁；节点的NAT绑定另行分配，以RCU整块替换。
  *
  * 2.  **连接管理业务逻辑**:
  *     -   `isTimeout`: 检查给定的超时时间戳是否已过期。
- *     -   `addConnExpires`: 更新指定连接节点的超时时间。
+ *     -   `addConnExpires`: 无锁地推后指定连接节点的超时时间，变化小于 `CONN_REFRESH_GAP` 时不写入。
+ *     -   `updateConnState`: 轻量的TCP状态跟踪 (SYN/EST/FIN/RST)，状态变化时按新状态重设超时时间。
+ *     -   `getConnTimeout` / `setConnTimeouts` / `formConnTimeouts`: 按协议与TCP状态划分的超时配置，
+ *         可由用户空间通过 `REQ_GETTimeouts` / `REQ_SETTimeouts` 读取和修改。
  *     -   `hasConn`: 供外部模块（如 `hook_main`）调用，用于检查是否存在与给定五元组匹配的活动连接。
- *         如果找到，则刷新其超时时间。
- *     -   `addConn`: 供外部模块调用，用于创建一个新的连接跟踪条目并将其插入红黑树。
+ *         如果找到且未超时，则按其协议与状态刷新超时时间。
+ *     -   `addConn`: 供外部模块调用，用于创建一个新的连接跟踪条目并将其插入哈希表。
  *         新连接会设置初始超时时间、日志标志、协议和NAT类型。
+ *         节点来自专用的slab缓存 (可选地带有预留池)；连接数达到上限时按满表策略
+ *         拒绝新连接或在所检查的一批连接中淘汰最接近过期的一个，并计入可由 `REQ_GETConnStats` 读取的统计。
  *     -   `setConnNAT`: 为指定的连接节点设置或更新其NAT转换记录和NAT类型。
- *     -   `getNewNATPort`: 为SNAT操作从指定的NAT规则定义的端口范围内查找并分配一个可用的新端口。
- *         它会遍历现有连接以避免端口冲突。
- *     -   `formAllConns`: 将红黑树中所有活动的连接信息打包成一个可通过Netlink发送给用户空间的数据块。
+ *     -   `getConnNAT`: 无锁地读取连接的NAT记录和NAT类型。
+ *     -   `setConnSNAT`: 设置SNAT记录并让连接持有所用端口，连接被回收时把端口归还给NAT规则的端口池。
+ *     -   `findConn`: 不刷新超时时间的查找，供端口分配探测反向连接。
+ *     -   `cacheConn` / `takeCachedConn`: 每CPU流缓存，NAT钩子复用 hook_main 在同一钩子点上查到的连接。
+ *     -   `hasConn6` / `addConn6`: IPv6连接。节点 (`connNode6`) 在 `connNode` 后追加128位地址的键，
+ *         存放在独立的 `table6` 中；除查找与插入外，时间轮、超时、上限、事件与遍历都与IPv4共用。
+ *     -   `formAllConns`: 将哈希表中所有活动的连接信息打包成一个可通过Netlink发送给用户空间的数据块。
  *     -   `eraseConnRelated`: 根据给定的IP过滤规则，删除连接池中所有匹配该规则的连接。
  *         这通常在防火墙策略更改（如默认动作变为DROP）或删除某条规则时使用。
- *     -   `rollConn`: 清理连接池，删除所有已超时的连接。此函数由定时器周期性调用。
+ *     -   `eraseConnIf`: 按任意判定函数遍历一次连接池并删除满足条件的连接，遍历分段进行。
+ *     -   `purgeConnRelated` / `purgeConnDenied`: 登记延迟清理，由工作队列把多次登记合并为一次遍历，
+ *         规则修改因此不必在netlink处理中等待遍历整个连接池。
+ *     -   `rollConn`: 转动时间轮，回收到期格中已超时或已删除的连接。此函数由定时器周期性调用。
  *
- * 3.  **定时器管理**:
- *     -   `conn_timer_callback`: 定时器的回调函数，在定时器触发时调用 `rollConn` 来清理超时连接，
- *         并重新设置定时器以供下次触发。
- *     -   `conn_init`: 初始化连接跟踪模块，包括设置并启动用于周期性清理的内核定时器 (`conn_timer`)。
- *     -   `conn_exit`: 在模块卸载时清理连接跟踪模块，主要是删除（停止）内核定时器。
+ * 3.  **时间轮与定时器管理**:
+ *     -   每个连接在创建时按超时时间挂入所在命名空间时间轮 (`cn->wheel`) 的某一格，每格对应 `CONN_ROLL_INTERVAL` 秒。
+ *         超时时间被无锁推后的连接不会立即移动，而是在其所在格到期时被惰性地重新挂到新的格中，
+ *         因此每次清理的工作量只与该格中的连接数成正比，而不是与整个连接池成正比。
+ *     -   `conn_timer_callback`: 定时器的回调函数，调用 `rollConn` 处理到期的格，单次处理量受
+ *         `CONN_GC_BUDGET` 限制，超出预算时尽快再次触发以继续处理。
+ *     -   `conn_init`: 初始化连接跟踪模块，创建节点缓存并注册 `connNetOps`。
+ *     -   `conn_exit`: 在模块卸载时清理连接跟踪模块，注销 `connNetOps` 后销毁节点缓存。
+ *
+ * 4.  **网络命名空间**:
+ *     -   哈希表、时间轮、定时器 (`cn->timer`)、延迟清理队列、连接数上限与满表统计都放在 `struct connNet` 中，
+ *         每个网络命名空间一份，由 `connNetInit` / `connNetExit` 建立与释放。对外接口以 `struct net *` 指定命名空间。
+ *     -   节点缓存、预留池与超时配置为全机共用。
  *
  * 此模块通过高效的连接存储和及时的超时管理，为防火墙提供了有状态的特性，
  * 使得对已建立连接的后续数据包可以快速处理，并为NAT功能提供了必要的会话保持能力。
@@ -42,187 +64,549 @@
 #include "tools.h"  // 可能包含 timeFromNow 等工具函数
 #include "helper.h" // 包含此文件中函数所需的各种声明和定义，例如：
                     // - 数据结构: connNode, conn_key_t, IPRule, NATRecord, KernelResponseHeader
-                    // - 常量: CONN_MAX_SYM_NUM, CONN_EXPIRES, CONN_ROLL_INTERVAL, NAT_TYPE_*, RSP_ConnLogs
-                    // - 红黑树API (来自 <linux/rbtree.h>): rb_root, RB_ROOT, rb_node, rb_entry,
-                    //                                   rb_link_node, rb_insert_color, rb_erase,
-                    //                                   rb_first, rb_next
-                    // - 锁API (来自 <linux/rwlock.h>): DEFINE_RWLOCK, read_lock, read_unlock, write_lock, write_unlock
+                    // - 常量: CONN_MAX_SYM_NUM, CONN_TIMEOUT_*, CONN_TCP_*, CONN_ROLL_INTERVAL, NAT_TYPE_*, RSP_ConnLogs
+                    // - 哈希表API (来自 <linux/rhashtable.h>): rhashtable_init, rhashtable_lookup,
+                    //                                       rhashtable_lookup_get_insert_fast, rhashtable_remove_fast,
+                    //                                       rhashtable_walk_*
                     // - 定时器API (来自 <linux/timer.h>): timer_list, init_timer, timer_setup, mod_timer, add_timer, del_timer
-                    // - 内核API: printk, kzalloc, kfree, GFP_ATOMIC, jiffies, memcpy
+                    // - 链表API (来自 <linux/list.h>): list_head, list_add_tail, list_del, list_for_each_entry_safe
+                    // - 内核API: printk, kmem_cache_*, mempool_*, call_rcu, GFP_ATOMIC, jiffies, memcpy
                     // - 函数声明: matchOneRule (可能在tools.h或helper.h中)
 
-// --- 红黑树相关 ---
+// --- 哈希表相关 ---
+
+// 哈希表参数：以 connNode.key (3个u32) 为键，使用默认的 jhash2 哈希；
+// 连接数减少时自动缩表，避免大量连接过期后长期占用桶数组。
+static const struct rhashtable_params connParams = {
+	.key_len = sizeof(conn_key_t),
+	.key_offset = offsetof(struct connNode, key),
+	.head_offset = offsetof(struct connNode, node),
+	.automatic_shrinking = true,
+};
 
-// 定义连接跟踪红黑树的根节点，并使用 RB_ROOT 宏进行静态初始化。
-// `connRoot` 将存储所有活动连接的 `connNode` 结构。
-static struct rb_root connRoot = RB_ROOT;
+// IPv6连接表参数：以 connNode6.key6 (两个128位地址加端口，36字节) 为键。
+// 两个地址族分表存放，各自使用默认的 jhash2 与按字节比较，IPv4的查找不必经过比较回调。
+// key6 之外的部分与IPv4节点完全相同，且 base 位于节点起始处，遍历时可统一当作 connNode 处理。
+static const struct rhashtable_params conn6Params = {
+	.key_len = sizeof(struct conn6Key),
+	.key_offset = offsetof(struct connNode6, key6),
+	.head_offset = offsetof(struct connNode6, base.node),
+	.automatic_shrinking = true,
+};
 
-// 定义一个读写锁 `connLock`，用于保护对红黑树 `connRoot` 的并发访问。
-// 读操作（如查找）可以并发进行，写操作（如插入、删除）则需要独占访问。
-static DEFINE_RWLOCK(connLock);
+// 时间轮每格对应的 jiffies 数
+#define CONN_WHEEL_TICK (CONN_ROLL_INTERVAL * HZ)
 
 /**
- * @brief 比较两个连接键 (`conn_key_t`)。
- *
- * @param l 第一个连接键 (数组)。
- * @param r 第二个连接键 (数组)。
- * @return int
- *         -  0: 如果两个键相等 (l == r)。
- *         - -1: 如果第一个键小于第二个键 (l < r)。
- *         -  1: 如果第一个键大于第二个键 (l > r)。
- *
- * @功能描述:
- *   `conn_key_t` 类型是一个包含多个 `unsigned int` 的数组，用于唯一标识一个连接
- *   (通常包含源IP、目的IP、以及源端口和目的端口的组合)。
- *   此函数逐个比较键数组中的元素，直到找到不相等的元素或比较完所有元素。
- *   比较顺序遵循字典序。`CONN_MAX_SYM_NUM` 定义了键数组中元素的数量。
- */
-int connKeyCmp(conn_key_t l, conn_key_t r) {
-	register int i; // 寄存器变量，用于循环计数器，可能略微提高性能
-	for(i=0;i<CONN_MAX_SYM_NUM;i++) { // 遍历连接键数组的每个元素
-		if(l[i] != r[i]) { // 如果当前元素不相等
-			return (l[i] < r[i]) ? -1 : 1; // 返回比较结果 (-1 表示 l < r, 1 表示 l > r)
-		}
+ * @brief 一个网络命名空间的连接池
+ * @功能描述: 每个命名空间各有两张哈希表、时间轮、清理定时器、延迟清理队列与容量配置，
+ *           按 connNetId 挂在 struct net 上。节点的slab缓存、预留池与超时配置为全机共用。
+ *           节点本身不记录所属的命名空间，凡是会摘除节点或推送事件的路径都显式带上 connNet。
+ */
+struct connNet {
+	struct net *net;
+	struct list_head list;          // 挂在 connNets 上
+	// 连接池哈希表。查找在RCU读临界区内完成，不需要加锁；
+	// 插入/删除由 rhashtable 内部的桶锁完成串行化。
+	struct rhashtable table;        // IPv4连接
+	struct rhashtable table6;       // IPv6连接
+
+	unsigned int max;               // 当前连接数上限，READ_ONCE/WRITE_ONCE 访问
+	unsigned int fullPolicy;        // 满表策略
+	atomic_t tableFull;             // 触及上限的次数
+	atomic_t evicted;               // 因满表被淘汰的连接数
+	atomic_t allocFail;             // 分配失败的次数
+
+	/**
+	 * 连接超时时间轮：共 CONN_WHEEL_SLOTS 格，`tick` 为下一个待处理的格序号，该格在 `due` (jiffies) 之后处理，
+	 * 其后第 k 格约在 due + k*CONN_WHEEL_TICK 处理。超过一圈的连接先挂在最远的格，到期时再重新挂入。
+	 * 时间均以相对 jiffies 计算，jiffies 回绕时仍然正确。
+	 * 每格一把自旋锁，建连 (软中断) 与清理 (定时器) 只在同一格上竞争。
+	 */
+	struct {
+		struct list_head slots[CONN_WHEEL_SLOTS];
+		spinlock_t locks[CONN_WHEEL_SLOTS];
+		unsigned long tick;     // 下一个待处理的格序号 (只增不减)
+		unsigned long due;      // 处理 tick 格的最早时间 (jiffies)
+	} wheel;
+	struct timer_list timer;        // 驱动时间轮的定时器
+
+	struct list_head purgeList;     // 待处理的规则条件 (struct connPurge)
+	bool purgeRecheck;              // 是否按当前规则集重新判定所有连接
+	spinlock_t purgeLock;           // 保护以上两项
+	struct work_struct purgeWork;
+};
+
+#define CONN_TABLE_NUM 2 // 需要遍历整个连接池时依次处理的表数：0为IPv4，1为IPv6
+
+static unsigned int connNetId;
+static LIST_HEAD(connNets);          // 所有命名空间的连接池，地址集合变化时逐个登记清理
+static DEFINE_MUTEX(connNetsMutex);  // 保护 connNets
+
+static struct connNet *connNetOf(const struct net *net) {
+	return net_generic(net, connNetId);
+}
+
+static struct rhashtable *connTableAt(struct connNet *cn, unsigned int t) {
+	return t == 0 ? &cn->table : &cn->table6;
+}
+
+// --- 节点分配相关 ---
+
+// 模块加载时预留的节点数。非0时节点经由 mempool 分配，软中断中 GFP_ATOMIC 分配失败时
+// 仍可从预留部分取得节点，使建连在内存紧张时不至于立即失败。
+static unsigned int conn_prealloc = 0;
+module_param(conn_prealloc, uint, 0444);
+MODULE_PARM_DESC(conn_prealloc, "connNode objects reserved at load time (0 = no reserve)");
+
+// 连接数上限的初始值，运行时可通过 REQ_SETConnLimit 修改。
+static unsigned int conn_max = CONN_MAX_DEFAULT;
+module_param(conn_max, uint, 0444);
+MODULE_PARM_DESC(conn_max, "initial limit on tracked connections");
+
+static struct kmem_cache *connCache;  // connNode 专用的slab缓存
+static struct kmem_cache *conn6Cache; // connNode6 专用的slab缓存 (不使用预留池)
+static struct kmem_cache *connNATCache; // connNAT 专用的slab缓存
+static mempool_t *connPool;           // conn_prealloc 非0时存在，建立在 connCache 之上
+
+// 分配一个清零的连接节点，软中断上下文可用
+static struct connNode *connAlloc(struct connNet *cn) {
+	struct connNode *node;
+	if(connPool != NULL)
+		node = mempool_alloc(connPool, GFP_ATOMIC);
+	else
+		node = kmem_cache_alloc(connCache, GFP_ATOMIC);
+	if(node == NULL) {
+		atomic_inc(&cn->allocFail);
+		return NULL;
 	}
-	return 0; // 如果所有元素都相等，则两个键相等，返回0
+	memset(node, 0, sizeof(struct connNode));
+	return node;
+}
+
+// 分配一个清零的IPv6连接节点，软中断上下文可用
+static struct connNode6 *connAlloc6(struct connNet *cn) {
+	struct connNode6 *node = kmem_cache_alloc(conn6Cache, GFP_ATOMIC);
+	if(node == NULL) {
+		atomic_inc(&cn->allocFail);
+		return NULL;
+	}
+	memset(node, 0, sizeof(struct connNode6));
+	return node;
+}
+
+// 分配一个NAT绑定，软中断上下文可用；rule 非NULL时绑定接管其端口
+static struct connNAT *connNATNew(struct connNet *cn, struct NATRecord record, int natType, struct NATRecord *rule) {
+	struct connNAT *b = kmem_cache_alloc(connNATCache, GFP_ATOMIC);
+	if(b == NULL) {
+		atomic_inc(&cn->allocFail);
+		return NULL;
+	}
+	b->saddr = record.saddr;
+	b->daddr = record.daddr;
+	b->sport = record.sport;
+	b->dport = record.dport;
+	b->natType = natType;
+	b->rule = rule;
+	return b;
+}
+
+// 归还绑定持有的SNAT端口；xchg 保证同一端口只归还一次
+static void connNATPutPort(struct connNAT *b) {
+	struct NATRecord *rule = xchg(&b->rule, NULL);
+	if(rule != NULL)
+		putNATPort(rule, b->dport);
+}
+
+static void connNATFreeRcu(struct rcu_head *head) {
+	kmem_cache_free(connNATCache, container_of(head, struct connNAT, rcu));
+}
+
+// 立即释放一个不会再被任何读者访问的节点
+static void connFree(struct connNode *node) {
+	if(node->nat != NULL) {
+		connNATPutPort(node->nat);
+		kmem_cache_free(connNATCache, node->nat);
+	}
+	if(node->family == AF_INET6)
+		kmem_cache_free(conn6Cache, container_of(node, struct connNode6, base));
+	else if(connPool != NULL)
+		mempool_free(node, connPool);
+	else
+		kmem_cache_free(connCache, node);
+}
+
+// RCU宽限期结束后释放节点
+static void connFreeRcu(struct rcu_head *head) {
+	connFree(container_of(head, struct connNode, rcu));
 }
 
 /**
- * @brief 在红黑树中根据给定的键查找连接节点。
+ * @brief 在哈希表中根据给定的键查找连接节点。
  *
- * @param root 指向红黑树根节点的指针。
+ * @param cn 所在命名空间的连接池。
  * @param key 要查找的连接键。
  * @return struct connNode*
  *         - 如果找到匹配的节点，则返回指向该 `connNode` 结构体的指针。
  *         - 如果未找到，则返回 `NULL`。
  *
  * @功能描述:
- *   此函数实现了在红黑树中查找特定连接节点的标准算法。
- *   1.  获取读锁 (`read_lock`)，因为查找操作不修改树结构。
- *   2.  从树的根节点开始向下遍历。
- *   3.  在每个节点，使用 `connKeyCmp` 将目标键与当前节点的键进行比较。
- *       -   如果目标键小于当前节点键，则向左子树移动。
- *       -   如果目标键大于当前节点键，则向右子树移动。
- *       -   如果目标键等于当前节点键，则表示已找到匹配节点，释放读锁并返回该节点。
- *   4.  如果遍历到 `NULL` 子节点仍未找到匹配项，则表示树中不存在该键，释放读锁并返回 `NULL`。
- */
-struct connNode *searchNode(struct rb_root *root, conn_key_t key) {
-	int result;                // 存储键比较的结果
-	struct rb_node *node;      // 指向当前遍历到的红黑树节点的指针
-
-	read_lock(&connLock);      // 获取读锁，保护对树的并发读取
-	node = root->rb_node;      // 从树的根节点开始查找
-	while (node) {             // 当当前节点不为NULL时循环
-		// rb_entry 宏用于从包含红黑树节点成员的结构体中获取该结构体的指针。
-		// 参数: node是指向rb_node成员的指针, struct connNode是包含该成员的结构体类型, node是该成员在结构体中的名称。
-		struct connNode *data = rb_entry(node, struct connNode, node);
-		result = connKeyCmp(key, data->key); // 比较目标键与当前节点数据的键
-
-		if (result < 0) // 如果目标键小于当前节点的键
-			node = node->rb_left; // 向左子树移动
-		else if (result > 0) // 如果目标键大于当前节点的键
-			node = node->rb_right; // 向右子树移动
-		else { // 如果键相等 (result == 0)
-			read_unlock(&connLock); // 释放读锁
-			return data; // 找到节点，返回指向 connNode 的指针
-		}
-	}
-	read_unlock(&connLock); // 如果循环结束仍未找到 (node变为NULL)，释放读锁
-	return NULL; // 未找到匹配节点，返回NULL
+ *   调用 `rhashtable_lookup` 做无锁查找。调用者必须处于RCU读临界区内
+ *   (netfilter 钩子函数本身即运行在RCU读临界区中)，返回的指针在退出临界区前保持有效。
+ */
+static struct connNode *searchNode(struct connNet *cn, conn_key_t key) {
+	return rhashtable_lookup(&cn->table, key, connParams);
 }
 
 /**
- * @brief 将新的连接节点 (`struct connNode`) 插入到红黑树中。
+ * @brief 将新的连接节点 (`struct connNode`) 插入到哈希表中。
  *
- * @param root 指向红黑树根节点的指针。
  * @param data 指向要插入的 `connNode` 结构体的指针。此结构体必须已分配内存，
- *             并且其 `key` 字段已正确填充。其 `node` (rb_node) 成员将用于链接到树中。
+ *             并且其 `key` 字段已正确填充。
  * @return struct connNode*
  *         - 如果插入成功，返回指向插入的 `data` 节点的指针。
- *         - 如果树中已存在具有相同键的节点，则不进行插入，并返回指向现有节点的指针。
- *         - 如果输入参数 `data` 为 `NULL`，则返回 `NULL`。
+ *         - 如果表中已存在具有相同键的节点，则释放 `data` 并返回指向现有节点的指针。
+ *         - 如果插入失败 (如扩表时内存不足)，释放 `data` 并返回 `NULL`。
  *
  * @功能描述:
- *   此函数实现了将新节点插入红黑树并保持其性质（颜色和平衡）的标准算法。
- *   1.  首先检查输入 `data` 是否为 `NULL`。
- *   2.  **查找插入位置**:
- *       -   获取读锁 (`read_lock`) 进行查找。
- *       -   从根节点开始遍历，找到新节点应该插入的位置（即一个 `NULL` 的子节点链接）。
- *       -   在遍历过程中，如果发现树中已存在具有相同键的节点，则释放读锁并直接返回该现有节点，不进行插入。
- *   3.  **执行插入**:
- *       -   释放读锁。
- *       -   获取写锁 (`write_lock`)，因为插入操作会修改树结构。
- *       -   使用 `rb_link_node` 将新节点的 `rb_node` 成员链接到之前找到的父节点和正确的子链接上。
- *       -   使用 `rb_insert_color` 对新插入的节点进行着色，并根据需要进行旋转以重新平衡红黑树。
- *       -   释放写锁。
- *   4.  返回指向成功插入的 `data` 节点的指针。
- *
- *   注意：此函数在查找插入位置时使用读锁，在实际链接和重平衡时切换到写锁。
- *   这是一个常见的优化，但需要小心处理从读锁到写锁的转换，确保在此期间树的状态没有被其他写者改变。
- *   更标准的做法可能是在整个插入操作（查找和修改）期间都持有写锁，或者使用更复杂的无锁/细粒度锁机制。
- *   当前实现中，在 `read_unlock` 和 `write_lock` 之间，树可能已被修改，导致 `parent` 和 `new` 指针失效。
- *   一个更安全的实现是将查找和链接操作都在写锁保护下进行。
- */
-struct connNode *insertNode(struct rb_root *root, struct connNode *data) {
-	struct rb_node **new_link; // 指向新节点应该链接到的父节点的子链接的指针 (例如 &parent->rb_left)
-	struct rb_node *parent_node = NULL; // 指向新节点的父节点的指针
+ *   使用 `rhashtable_lookup_get_insert_fast` 在桶锁保护下原子地完成"查找或插入"，
+ *   因此两个CPU同时为同一条流建连时只会有一个节点进入表中。
+ *   调用者需处于RCU读临界区内，以保证返回的已有节点不会被并发释放。
+ */
+static struct connNode *insertNode(struct connNet *cn, struct connNode *data) {
+	struct connNode *old;
 
 	if(data == NULL) { // 如果要插入的数据为空
 		return NULL;
 	}
+	if(data->family == AF_INET6) // base 位于 connNode6 起始处，返回的节点指针可直接当作 connNode 使用
+		old = rhashtable_lookup_get_insert_fast(&cn->table6, &data->node, conn6Params);
+	else
+		old = rhashtable_lookup_get_insert_fast(&cn->table, &data->node, connParams);
+	if(old == NULL) // 插入成功
+		return data;
+	connFree(data); // 新节点未进入表中，可直接释放
+	if(IS_ERR(old)) {
+		printk(KERN_WARNING "[fw conns] insert conn fail (%ld).\n", PTR_ERR(old));
+		return NULL;
+	}
+	return old; // 键已存在，返回已有节点
+}
+
+// 从连接节点复制出展示给用户空间的连接信息
+static void connToLog(struct connNode *node, struct ConnLog *log) {
+	struct connNode6 *node6;
+	if(node->family == AF_INET6) {
+		node6 = container_of(node, struct connNode6, base);
+		log->family = AF_INET6;
+		log->saddr = 0;
+		log->daddr = 0;
+		memcpy(log->saddr6, &node6->key6.saddr, sizeof(log->saddr6));
+		memcpy(log->daddr6, &node6->key6.daddr, sizeof(log->daddr6));
+	} else {
+		log->family = AF_INET;
+		log->saddr = node->key[0];
+		log->daddr = node->key[1];
+		memset(log->saddr6, 0, sizeof(log->saddr6));
+		memset(log->daddr6, 0, sizeof(log->daddr6));
+	}
+	log->sport = (unsigned short)(node->key[2] >> 16);       // 源端口在高16位
+	log->dport = (unsigned short)(node->key[2] & 0xFFFFu); // 目的端口在低16位
+	log->protocol = node->protocol;
+	log->natType = getConnNAT(node, &log->nat);
+}
+
+/**
+ * @brief 向连接事件组推送一个连接事件
+ *
+ * @param cn 连接所在命名空间的连接池，事件发往该命名空间的监听者。
+ * @param type 事件类型 (EVT_CONN_*)。
+ * @param node 事件涉及的连接节点。
+ *
+ * @功能描述: 无监听者时只做一次判断即返回；否则复制连接的键与NAT信息后多播。
+ */
+static void connEvent(struct connNet *cn, unsigned int type, struct connNode *node) {
+	struct FwEvent ev;
+	if(!nlHasListeners(cn->net, FW_GROUP_CONN))
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.tm = ktime_get_real_seconds();
+	connToLog(node, &ev.conn);
+	nlSendEvent(cn->net, FW_GROUP_CONN, &ev);
+}
+
+/**
+ * @brief 从哈希表中删除指定的连接节点。
+ *
+ * @param cn 节点所在命名空间的连接池。
+ * @param node 指向要删除的 `connNode` 结构体的指针。
+ * @param evt 摘除成功时推送的事件类型 (`EVT_CONN_EXPIRED` 或 `EVT_CONN_DEL`)。
+ * @return int
+ *         - 1: 本次调用将节点从表中摘除。
+ *         - 0: 节点为 `NULL` 或已被其他路径摘除。
+ *
+ * @功能描述:
+ *   调用 `rhashtable_remove_fast` 将节点从表中摘除，此后新的查找不会再找到它；
+ *   摘除成功后将节点标记为 `dead`。节点仍挂在时间轮上，内存由时间轮在其所在格到期时
+ *   统一在RCU宽限期后归还 `connCache`，因此节点的释放只有唯一的出口。
+ */
+static int eraseNode(struct connNet *cn, struct connNode *node, unsigned int evt) {
+	int ret;
+	if(node == NULL)
+		return 0;
+	if(node->family == AF_INET6)
+		ret = rhashtable_remove_fast(&cn->table6, &node->node, conn6Params);
+	else
+		ret = rhashtable_remove_fast(&cn->table, &node->node, connParams);
+	if(ret != 0)
+		return 0;
+	WRITE_ONCE(node->dead, 1);
+	connEvent(cn, evt, node);
+	return 1;
+}
 
-    // ---- 更安全的实现：整个查找和插入过程都在写锁下进行 ----
-    write_lock(&connLock); // 获取写锁
+// --- 时间轮相关 ---
 
-	new_link = &(root->rb_node); // 从根节点的链接开始查找
-	/* Figure out where to put new node */
-	while (*new_link) { // 当当前链接指向的节点不为NULL时
-		struct connNode *this = rb_entry(*new_link, struct connNode, node); // 获取当前节点的数据
-		int result = connKeyCmp(data->key, this->key); // 比较新数据的键与当前节点的键
+/**
+ * @brief 将连接节点按其当前超时时间挂入时间轮
+ *
+ * @param node 尚未挂在时间轮上的连接节点。
+ *
+ * @功能描述:
+ *   挂入 `tick + k` 格，k 取使该格处理时间不早于超时时间的最小值，且 1 <= k <= CONN_WHEEL_SLOTS-1
+ *   (不挂入正在处理的格)。读取 `tick` 不加锁：读到旧值只会让连接晚一圈被检查，不影响正确性。
+ */
+static void connWheelAdd(struct connNet *cn, struct connNode *node) {
+	unsigned long tick = READ_ONCE(cn->wheel.tick);
+	long left = (long)(READ_ONCE(node->expires) - jiffies);
+	unsigned long k;
+	unsigned int idx;
 
-		parent_node = *new_link; // 当前节点成为潜在的父节点
-		if (result < 0) // 如果新数据的键小于当前节点的键
-			new_link = &((*new_link)->rb_left); // 向左子树的链接移动
-		else if (result > 0) // 如果新数据的键大于当前节点的键
-			new_link = &((*new_link)->rb_right); // 向右子树的链接移动
-		else { // 如果键已存在
-            write_unlock(&connLock); // 释放写锁
-			return this; // 返回已存在的节点
+	k = (left <= 0) ? 1 : (unsigned long)left / CONN_WHEEL_TICK + 1;
+	if(k > CONN_WHEEL_SLOTS - 1)
+		k = CONN_WHEEL_SLOTS - 1;
+	idx = (tick + k) % CONN_WHEEL_SLOTS;
+	spin_lock_bh(&cn->wheel.locks[idx]);
+	list_add_tail(&node->tnode, &cn->wheel.slots[idx]);
+	spin_unlock_bh(&cn->wheel.locks[idx]);
+}
+
+/**
+ * @brief 满表时淘汰一个连接
+ *
+ * @return int 成功淘汰返回1，否则返回0。
+ *
+ * @功能描述:
+ *   从下一个待处理的格开始向后检查最多 `CONN_EVICT_SCAN` 个仍在表中的节点，淘汰其中真实超时时间
+ *   (`expires`) 最早的一个。节点所在的格只反映挂入时的超时时间，活跃连接刷新超时后仍留在靠前的格中，
+ *   直到时间轮处理到该格才重新挂入，因此不能只按格的先后判断。被摘除的节点留在原格中，
+ *   很快会被时间轮回收。检查数量有上限，避免满表时在软中断中长时间停留。
+ *   选定候选后先释放格锁再摘除；RCU读临界区保证候选节点在此期间不被释放，已被其他路径摘除时返回0。
+ */
+static int connEvictOne(struct connNet *cn) {
+	unsigned long tick = READ_ONCE(cn->wheel.tick);
+	struct connNode *now, *victim = NULL;
+	unsigned long expires, oldest = 0;
+	unsigned int i, idx, scanned = 0;
+	int done;
+
+	rcu_read_lock();
+	for(i = 0; i < CONN_WHEEL_SLOTS && scanned < CONN_EVICT_SCAN; i++) {
+		idx = (tick + i) % CONN_WHEEL_SLOTS;
+		spin_lock_bh(&cn->wheel.locks[idx]);
+		list_for_each_entry(now, &cn->wheel.slots[idx], tnode) {
+			if(READ_ONCE(now->dead))
+				continue;
+			if(++scanned > CONN_EVICT_SCAN)
+				break;
+			expires = READ_ONCE(now->expires);
+			if(victim == NULL || time_before(expires, oldest)) {
+				victim = now;
+				oldest = expires;
+			}
 		}
+		spin_unlock_bh(&cn->wheel.locks[idx]);
 	}
+	done = eraseNode(cn, victim, EVT_CONN_DEL);
+	rcu_read_unlock();
+	if(done)
+		atomic_inc(&cn->evicted);
+	return done;
+}
 
-	/* Add new node and rebalance tree. */
-	// 将新节点 (data->node) 链接到找到的父节点 (parent_node) 和正确的子链接 (*new_link)
-	rb_link_node(&data->node, parent_node, new_link);
-	// 为新插入的节点着色，并根据需要进行旋转以重新平衡红黑树
-	rb_insert_color(&data->node, root);
+// 两张表中的连接总数，上限与统计对两个地址族合并计算
+static unsigned int connCount(struct connNet *cn) {
+	return atomic_read(&cn->table.nelems) + atomic_read(&cn->table6.nelems);
+}
 
-    write_unlock(&connLock); // 释放写锁
-	return data; // 插入成功，返回指向新插入节点的指针
+/**
+ * @brief 新建连接前检查连接数上限
+ *
+ * @return int 可以新建返回1，应拒绝返回0。
+ *
+ * @功能描述:
+ *   以两张哈希表中的连接总数与上限比较 (并发建连时可能略微超出上限)。
+ *   触及上限时计数，并按 `cn->fullPolicy` 决定拒绝新连接还是淘汰一个旧连接。
+ */
+static int connReserve(struct connNet *cn) {
+	if(connCount(cn) < READ_ONCE(cn->max))
+		return 1;
+	atomic_inc(&cn->tableFull);
+	if(READ_ONCE(cn->fullPolicy) != CONN_FULL_EVICT)
+		return 0;
+	return connEvictOne(cn);
 }
 
 /**
- * @brief 从红黑树中删除指定的连接节点。
+ * @brief 修改连接数上限与满表策略。
  *
- * @param root 指向红黑树根节点的指针。
- * @param node 指向要删除的 `connNode` 结构体的指针。
- * @return void 无返回值。
+ * @param net 连接池所属的网络命名空间。
+ * @param limit 新的容量配置，值为0的字段保持不变。
+ * @return int 成功返回0；策略不是 `CONN_FULL_DROP` 或 `CONN_FULL_EVICT` 时返回 -EINVAL。
+ */
+int setConnLimit(struct net *net, struct ConnLimit limit) {
+	struct connNet *cn = connNetOf(net);
+	if(limit.policy != 0 && limit.policy != CONN_FULL_DROP && limit.policy != CONN_FULL_EVICT)
+		return -EINVAL;
+	if(limit.maxConns != 0)
+		WRITE_ONCE(cn->max, limit.maxConns);
+	if(limit.policy != 0)
+		WRITE_ONCE(cn->fullPolicy, limit.policy);
+	return 0;
+}
+
+/**
+ * @brief 将连接池统计形成Netlink回包。
+ *
+ * @param len [输出参数] 回包长度。
+ * @return void* 回包内存 (头部 + 一个 `ConnStats`)，需调用者 kfree；分配失败返回NULL。
+ */
+void *formConnStats(struct net *net, unsigned int *len) {
+	struct connNet *cn = connNetOf(net);
+	struct KernelResponseHeader *head;
+	struct ConnStats *stats;
+	void *mem;
+
+	*len = sizeof(struct KernelResponseHeader) + sizeof(struct ConnStats);
+	mem = kzalloc(*len, GFP_KERNEL);
+	if(mem == NULL) {
+		printk(KERN_WARNING "[fw conns] kzalloc fail.\n");
+		return NULL;
+	}
+	head = (struct KernelResponseHeader *)mem;
+	head->bodyTp = RSP_ConnStats;
+	head->arrayLen = 1;
+	stats = (struct ConnStats *)(mem + sizeof(struct KernelResponseHeader));
+	stats->connNum = connCount(cn);
+	stats->maxConns = READ_ONCE(cn->max);
+	stats->policy = READ_ONCE(cn->fullPolicy);
+	stats->prealloc = conn_prealloc;
+	stats->tableFull = atomic_read(&cn->tableFull);
+	stats->evicted = atomic_read(&cn->evicted);
+	stats->allocFail = atomic_read(&cn->allocFail);
+	return mem;
+}
+
+// --- 超时配置相关 ---
+
+// 按协议与TCP状态划分的超时配置。各字段独立地以 READ_ONCE/WRITE_ONCE 访问，
+// 修改过程中数据包可能看到新旧混合的配置，但每个字段本身总是合法值。
+static struct ConnTimeouts connTimeouts = {
+	.tcpSyn = CONN_TIMEOUT_TCP_SYN,
+	.tcpEst = CONN_TIMEOUT_TCP_EST,
+	.tcpFin = CONN_TIMEOUT_TCP_FIN,
+	.tcpClose = CONN_TIMEOUT_TCP_CLOSE,
+	.udp = CONN_TIMEOUT_UDP,
+	.icmp = CONN_TIMEOUT_ICMP,
+	.other = CONN_EXPIRES,
+};
+static DEFINE_MUTEX(connTimeoutsMutex); // 串行化配置的修改
+
+// 查表得到指定协议与状态的存活时长（秒）。尚未判断出状态的TCP连接按握手阶段处理。
+static unsigned int connTimeoutOf(u_int8_t proto, u_int8_t state) {
+	switch(proto) {
+	case IPPROTO_TCP:
+		switch(state) {
+		case CONN_TCP_EST:
+			return READ_ONCE(connTimeouts.tcpEst);
+		case CONN_TCP_FIN:
+			return READ_ONCE(connTimeouts.tcpFin);
+		case CONN_TCP_CLOSE:
+			return READ_ONCE(connTimeouts.tcpClose);
+		default:
+			return READ_ONCE(connTimeouts.tcpSyn);
+		}
+	case IPPROTO_UDP:
+		return READ_ONCE(connTimeouts.udp);
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		return READ_ONCE(connTimeouts.icmp);
+	default:
+		return READ_ONCE(connTimeouts.other);
+	}
+}
+
+/**
+ * @brief 获取连接在当前协议与状态下应使用的存活时长。
+ *
+ * @param node 指向连接节点的指针。
+ * @return unsigned int 存活时长（秒）。
+ */
+unsigned int getConnTimeout(struct connNode *node) {
+	return connTimeoutOf(node->protocol, READ_ONCE(node->state));
+}
+
+/**
+ * @brief 修改连接超时配置。
+ *
+ * @param timeouts 新的超时配置，值为0的字段保持不变。
+ * @return int 成功返回0；任一字段超过 `CONN_TIMEOUT_MAX` 时返回 -EINVAL，配置不做任何修改。
  *
  * @功能描述:
- *   1.  检查输入 `node` 是否为 `NULL`。
- *   2.  获取写锁 (`write_lock`)，因为删除操作会修改树结构。
- *   3.  调用 `rb_erase` 函数将节点的 `rb_node` 成员从红黑树中移除。
- *       `rb_erase` 会处理删除节点后的树的重新平衡。
- *   4.  释放写锁。
- *   5.  调用 `kfree(node)` 释放已从树中移除的 `connNode` 结构体所占用的内存。
+ *   先整体校验再逐字段写入。已有连接不会被立即调整，而是在下一次刷新或状态变化时使用新值。
  */
-void eraseNode(struct rb_root *root, struct connNode *node) {
-	if(node != NULL) { // 确保要删除的节点不为NULL
-		write_lock(&connLock); // 获取写锁
-		rb_erase(&(node->node), root); // 从红黑树中删除该节点
-		write_unlock(&connLock); // 释放写锁
-		kfree(node); // 释放 connNode 结构体占用的内存
+int setConnTimeouts(struct ConnTimeouts timeouts) {
+	unsigned int *dst = (unsigned int *)&connTimeouts;
+	unsigned int *src = (unsigned int *)&timeouts;
+	unsigned int i, n = sizeof(struct ConnTimeouts) / sizeof(unsigned int);
+
+	for(i = 0; i < n; i++) {
+		if(src[i] > CONN_TIMEOUT_MAX)
+			return -EINVAL;
+	}
+	mutex_lock(&connTimeoutsMutex);
+	for(i = 0; i < n; i++) {
+		if(src[i] != 0)
+			WRITE_ONCE(dst[i], src[i]);
 	}
+	mutex_unlock(&connTimeoutsMutex);
+	return 0;
+}
+
+/**
+ * @brief 将当前连接超时配置形成Netlink回包。
+ *
+ * @param len [输出参数] 回包长度。
+ * @return void* 回包内存 (头部 + 一个 `ConnTimeouts`)，需调用者 kfree；分配失败返回NULL。
+ */
+void *formConnTimeouts(unsigned int *len) {
+	struct KernelResponseHeader *head;
+	void *mem;
+
+	*len = sizeof(struct KernelResponseHeader) + sizeof(struct ConnTimeouts);
+	mem = kzalloc(*len, GFP_KERNEL);
+	if(mem == NULL) {
+		printk(KERN_WARNING "[fw conns] kzalloc fail.\n");
+		return NULL;
+	}
+	head = (struct KernelResponseHeader *)mem;
+	head->bodyTp = RSP_Timeouts;
+	head->arrayLen = 1;
+	mutex_lock(&connTimeoutsMutex);
+	memcpy(mem + sizeof(struct KernelResponseHeader), &connTimeouts, sizeof(struct ConnTimeouts));
+	mutex_unlock(&connTimeoutsMutex);
+	return mem;
 }
 
 // --- 业务相关 ---
@@ -237,37 +621,91 @@ void eraseNode(struct rb_root *root, struct connNode *node) {
  *
  * @功能描述:
  *   `jiffies` 是Linux内核中一个全局变量，表示自系统启动以来发生的tick数（时钟中断次数）。
- *   此函数通过比较当前的 `jiffies` 值与传入的 `expires` 值来判断是否超时。
+ *   使用 `time_after_eq` 比较，在 `jiffies` 回绕时仍能得到正确结果。
  */
 int isTimeout(unsigned long expires) {
-	return (jiffies >= expires)? 1 : 0; // 当前内核时间 (jiffies) 是否大于等于设定的超时时间
+	return time_after_eq(jiffies, expires) ? 1 : 0;
 }
 
 /**
- * @brief 更新指定连接节点的超时时间。
+ * @brief 推后指定连接节点的超时时间。
  *
  * @param node 指向要更新超时时间的 `connNode` 结构体的指针。
- * @param plus 要在当前时间基础上增加的超时时长 (通常以秒为单位，`timeFromNow` 会将其转换为 `jiffies`)。
+ * @param plus 要在当前时间基础上增加的超时时长 (秒)。
  * @return void 无返回值。
  *
  * @功能描述:
- *   1.  检查输入 `node` 是否为 `NULL`。
- *   2.  获取写锁 (`connLock`)，因为修改 `node->expires` 是写操作。
- *   3.  调用 `timeFromNow(plus)` (应在 `tools.h` 或类似文件中定义) 计算出从当前时间开始，
- *       经过 `plus` 时长后的 `jiffies` 值，并将其赋给 `node->expires`。
- *   4.  释放写锁。
+ *   1.  计算新的超时时间点 `timeFromNow(plus)`。
+ *   2.  仅当新时间点比当前值晚 `CONN_REFRESH_GAP` 以上时才用 `WRITE_ONCE` 写入。
+ *       同一条流的包分布在多个CPU上时，绝大多数包只读不写该缓存行，避免缓存行来回颠簸；
+ *       代价是连接最多可能提前 `CONN_REFRESH_GAP` 过期。
+ *   3.  只推后不提前：已设置为较长存活期的连接 (如NAT连接) 不会被普通刷新缩短。
+ *   并发写入之间不需要加锁：任意一个写入的值都是合法的超时时间。
  */
 void addConnExpires(struct connNode *node, unsigned int plus) {
+	unsigned long expires;
 	if(node == NULL) // 如果节点为空，则不执行任何操作
 		return ;
-	write_lock(&connLock); // 获取写锁，因为要修改节点数据
-	node->expires = timeFromNow(plus); // timeFromNow(seconds) 应返回 jiffies + seconds * HZ
-	write_unlock(&connLock); // 释放写锁
+	expires = timeFromNow(plus);
+	if(time_after(expires, READ_ONCE(node->expires) + CONN_REFRESH_GAP))
+		WRITE_ONCE(node->expires, expires);
+}
+
+/**
+ * @brief 根据本方向数据包的TCP标志推进连接状态。
+ *
+ * @param node 指向连接节点的指针。
+ * @param th 指向该数据包TCP头部 (或其副本) 的指针。
+ * @return void 无返回值。
+ *
+ * @功能描述:
+ *   连接池中每个方向各有一个节点，这里只根据本方向发出的报文判断：
+ *   -   RST: 进入 `CONN_TCP_CLOSE`。
+ *   -   FIN: 进入 `CONN_TCP_FIN` (已关闭的连接保持关闭)。
+ *   -   SYN: 新连接或复用已关闭连接的四元组时进入 `CONN_TCP_SYN`，其余状态下视为重传。
+ *   -   其余带ACK的报文: 握手阶段或中途接管的连接进入 `CONN_TCP_EST`。
+ *   状态变化时直接按新状态重设超时时间。与 `addConnExpires` 不同，这里允许缩短超时时间，
+ *   使关闭后的连接尽快失效；仍挂在较远时间轮格上的节点由 `hasConn` 判定超时后摘除。
+ */
+void updateConnState(struct connNode *node, const struct tcphdr *th) {
+	u_int8_t state, next;
+
+	if(node == NULL || th == NULL)
+		return ;
+	state = READ_ONCE(node->state);
+	if(th->rst)
+		next = CONN_TCP_CLOSE;
+	else if(th->fin)
+		next = (state == CONN_TCP_CLOSE) ? CONN_TCP_CLOSE : CONN_TCP_FIN;
+	else if(th->syn)
+		next = (state == CONN_TCP_NONE || state >= CONN_TCP_FIN) ? CONN_TCP_SYN : state;
+	else if(th->ack)
+		next = (state == CONN_TCP_NONE || state == CONN_TCP_SYN) ? CONN_TCP_EST : state;
+	else
+		next = state;
+	if(next == state)
+		return ;
+	WRITE_ONCE(node->state, next);
+	WRITE_ONCE(node->expires, timeFromNow(connTimeoutOf(node->protocol, next)));
+}
+
+// 查找命中后的统一处理：已超时 (如TCP关闭后超时时间被缩短，而时间轮尚未回收) 的节点
+// 被摘除并视为不存在，否则按协议与状态刷新超时时间
+static struct connNode *connHit(struct connNet *cn, struct connNode *node) {
+	if(node == NULL)
+		return NULL;
+	if(isTimeout(READ_ONCE(node->expires))) { // 已超时但尚未被时间轮回收
+		eraseNode(cn, node, EVT_CONN_EXPIRED);
+		return NULL;
+	}
+	addConnExpires(node, getConnTimeout(node)); // 刷新该连接的超时时间
+	return node;
 }
 
 /**
  * @brief 检查并获取与给定五元组匹配的活动连接。如果找到，则刷新其超时时间。
  *
+ * @param net 数据包所在的网络命名空间。
  * @param sip 源IP地址 (主机字节序)。
  * @param dip 目的IP地址 (主机字节序)。
  * @param sport 源端口号 (主机字节序)。
@@ -278,14 +716,14 @@ void addConnExpires(struct connNode *node, unsigned int plus) {
  *
  * @功能描述:
  *   1.  根据输入的IP地址和端口号构建一个连接键 (`conn_key_t`)。
- *       连接键通常是一个数组，包含 `sip`, `dip`, 以及 `sport` 和 `dport` 的组合。
  *       这里将 `sport` 左移16位后与 `dport` 进行或运算，形成一个32位整数作为键的一部分。
- *   2.  调用 `searchNode` 在全局连接红黑树 (`connRoot`) 中查找具有此键的节点。
- *   3.  如果找到了节点 (`node != NULL`)，则调用 `addConnExpires` 来刷新该连接的超时时间，
- *       延长其在连接池中的存活期。`CONN_EXPIRES` 是预定义的连接默认超时时长。
- *   4.  返回查找到的节点指针 (如果未找到，则为 `NULL`)。
+ *   2.  调用 `searchNode` 在连接哈希表中无锁查找具有此键的节点。
+ *   3.  由 `connHit` 处理命中的节点：已超时的节点从表中摘除并视为不存在，以便同一四元组
+ *       重新经过规则匹配后建连；否则按连接当前协议与状态的超时配置刷新超时时间。
+ *   4.  返回查找到的节点指针。调用者需处于RCU读临界区内。
  */
-struct connNode *hasConn(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport) {
+struct connNode *hasConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport) {
+	struct connNet *cn = connNetOf(net);
 	conn_key_t key;             // 定义连接键变量
 	struct connNode *node = NULL; // 初始化节点指针为NULL
 
@@ -296,20 +734,146 @@ struct connNode *hasConn(unsigned int sip, unsigned int dip, unsigned short spor
 	key[0] = sip;
 	key[1] = dip;
 	key[2] = ((((unsigned int)sport) << 16) | ((unsigned int)dport));
-    // key[3] 等，如果 CONN_MAX_SYM_NUM > 3，则需要填充
 
-	// 在红黑树中查找具有此键的节点
-	node = searchNode(&connRoot, key);
+	// 在哈希表中查找具有此键的节点
+	node = searchNode(cn, key);
+	return connHit(cn, node);
+}
 
-    if (node != NULL) { // 如果找到了连接
-	    addConnExpires(node, CONN_EXPIRES); // 刷新该连接的超时时间
-    }
-	return node; // 返回找到的节点 (或NULL)
+// 由地址与端口构建IPv6连接键。键会被整体哈希与比较，结构体中没有填充字节
+static void conn6KeyOf(struct conn6Key *key, const struct in6_addr *sip, const struct in6_addr *dip,
+ unsigned short sport, unsigned short dport) {
+	key->saddr = *sip;
+	key->daddr = *dip;
+	key->ports = ((((unsigned int)sport) << 16) | ((unsigned int)dport));
+}
+
+/**
+ * @brief 检查并获取与给定五元组匹配的IPv6活动连接，找到时刷新其超时时间。
+ *
+ * @return struct connNode* 找到且未超时的连接 (即 `connNode6.base`)，否则返回 `NULL`。
+ *         调用者需处于RCU读临界区内。
+ */
+struct connNode *hasConn6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport) {
+	struct connNet *cn = connNetOf(net);
+	struct connNode6 *node6;
+	struct conn6Key key;
+
+	conn6KeyOf(&key, sip, dip, sport, dport);
+	node6 = rhashtable_lookup(&cn->table6, &key, conn6Params);
+	return connHit(cn, node6 ? &node6->base : NULL);
 }
 
 /**
- * @brief 创建一个新的连接跟踪条目，并将其插入到连接红黑树中。
+ * @brief 查找连接但不刷新其超时时间。
  *
+ * @param net 连接所在的网络命名空间。
+ * @param sip 源IP地址 (主机字节序)。
+ * @param dip 目的IP地址 (主机字节序)。
+ * @param sport 源端口号 (主机字节序)。
+ * @param dport 目的端口号 (主机字节序)。
+ * @return struct connNode* 找到且未超时的连接，否则返回 `NULL`。
+ *
+ * @功能描述:
+ *   与 `hasConn` 不同，这里只做探测：不推后超时时间，也不摘除已超时的节点，
+ *   供SNAT端口分配判断某个端口对目的端点是否已被占用。调用者需处于RCU读临界区内。
+ */
+struct connNode *findConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport) {
+	conn_key_t key;
+	struct connNode *node;
+
+	key[0] = sip;
+	key[1] = dip;
+	key[2] = ((((unsigned int)sport) << 16) | ((unsigned int)dport));
+	node = searchNode(connNetOf(net), key);
+	if(node == NULL || isTimeout(READ_ONCE(node->expires)))
+		return NULL;
+	return node;
+}
+
+// --- 每CPU流缓存 ---
+// 同一钩子点上 hook_main 先于NAT钩子执行，且二者处于同一次 nf_hook 调用的RCU读临界区内。
+// hook_main 把查到或新建的连接记在本CPU的缓存里，NAT钩子据此直接取用，而不必再查一次哈希表。
+
+struct flowCache {
+	const struct sk_buff *skb;           // 缓存所属的数据包
+	const struct nf_hook_state *state;   // 所属的钩子调用，同一钩子点上的各钩子共享它
+	conn_key_t key;                      // 连接键，取用时再核对一次
+	struct connNode *conn;               // hook_main 查到或新建的连接，NULL表示缓存为空
+};
+
+static DEFINE_PER_CPU(struct flowCache, flowCache);
+
+/**
+ * @brief 记下数据包在当前钩子点上对应的连接，供随后的NAT钩子复用。
+ *
+ * @param skb 当前数据包。
+ * @param state 当前钩子调用的状态。
+ * @param conn 数据包所属的连接，NULL时清空缓存。
+ *
+ * @功能描述:
+ *   只在不可抢占的上下文中记录：此时从 hook_main 到NAT钩子不会换CPU，
+ *   也不会有其他数据包插在中间，取用时 skb 与 state 都一致就说明缓存属于同一次钩子调用。
+ *   可抢占的上下文 (如开启抢占式RCU时的本机发出流量) 不使用缓存，NAT钩子照常查表。
+ */
+void cacheConn(const struct sk_buff *skb, const struct nf_hook_state *state, struct connNode *conn) {
+	struct flowCache *fc;
+	if(preemptible())
+		return;
+	fc = this_cpu_ptr(&flowCache);
+	fc->skb = skb;
+	fc->state = state;
+	fc->conn = conn;
+	if(conn != NULL)
+		memcpy(fc->key, conn->key, sizeof(conn_key_t));
+}
+
+/**
+ * @brief 取出 hook_main 为同一数据包缓存的连接，取出后缓存即清空。
+ *
+ * @return struct connNode* 缓存属于这次钩子调用且五元组一致时返回连接，否则返回 `NULL`，
+ *         调用者应退回到 `hasConn`。返回的连接已由 hook_main 刷新过超时时间。
+ */
+struct connNode *takeCachedConn(const struct sk_buff *skb, const struct nf_hook_state *state,
+ unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport) {
+	struct flowCache *fc;
+	struct connNode *conn;
+	if(preemptible())
+		return NULL;
+	fc = this_cpu_ptr(&flowCache);
+	conn = fc->conn;
+	if(conn == NULL || fc->skb != skb || fc->state != state)
+		return NULL;
+	fc->conn = NULL;
+	if(fc->key[0] != sip || fc->key[1] != dip ||
+	   fc->key[2] != ((((unsigned int)sport) << 16) | ((unsigned int)dport)))
+		return NULL;
+	return conn;
+}
+
+// 初始化新节点中与地址族无关的字段
+static void connInitNode(struct connNode *node, u_int8_t proto, u_int8_t log) {
+	node->needLog = log;                 // 设置日志记录标志
+	node->protocol = proto;              // 设置协议类型
+	node->state = CONN_TCP_NONE;         // TCP状态由之后的 updateConnState 推进
+	node->expires = timeFromNow(connTimeoutOf(proto, CONN_TCP_NONE)); // 按协议设置初始超时时间
+}
+
+// 将新节点插入到对应的哈希表中，插入成功的新节点同时挂入时间轮。
+// 插入失败 (NULL) 或键已存在 (返回已有节点) 时 node 已被 insertNode 释放
+static struct connNode *connPublish(struct connNet *cn, struct connNode *node) {
+	struct connNode *ret = insertNode(cn, node);
+	if(ret == node) {
+		connWheelAdd(cn, node);
+		connEvent(cn, EVT_CONN_NEW, node);
+	}
+	return ret;
+}
+
+/**
+ * @brief 创建一个新的连接跟踪条目，并将其插入到连接哈希表中。
+ *
+ * @param net 数据包所在的网络命名空间，连接计入该命名空间的连接池与上限。
  * @param sip 源IP地址 (主机字节序)。
  * @param dip 目的IP地址 (主机字节序)。
  * @param sport 源端口号 (主机字节序)。
@@ -318,431 +882,866 @@ struct connNode *hasConn(unsigned int sip, unsigned int dip, unsigned short spor
  * @param log 是否需要为此连接记录日志的标志 (1表示需要，0表示不需要)。
  * @return struct connNode*
  *         - 如果成功创建并插入连接，则返回指向新 `connNode` 的指针。
- *         - 如果内存分配失败 (`kzalloc` 返回 `NULL`)，则返回 `NULL` (代码中返回0，应为NULL)。
- *         - 如果具有相同键的连接已存在，`insertNode` 会返回现有节点。
+ *         - 如果具有相同键的连接已存在，返回现有节点。
+ *         - 如果连接数已达上限且未能淘汰旧连接，或内存分配、插入失败，则返回 `NULL`。
  *
  * @功能描述:
- *   1.  使用 `kzalloc` (以 `GFP_ATOMIC` 标志) 为新的 `connNode` 结构体分配内存并清零。
- *   2.  如果内存分配失败，打印警告并返回 `NULL`。
- *   3.  初始化新节点的字段：
- *       -   `needLog`: 设置为传入的 `log` 参数。
- *       -   `protocol`: 设置为传入的 `proto` 参数。
- *       -   `expires`: 调用 `timeFromNow(CONN_EXPIRES)` 设置初始超时时间。
- *       -   `natType`: 初始化为 `NAT_TYPE_NO` (无NAT)。
- *   4.  构建连接键 (`node->key`)，方式与 `hasConn` 函数中相同。
- *   5.  调用 `insertNode` 将新创建的节点插入到全局连接红黑树 (`connRoot`) 中。
- *   6.  返回 `insertNode` 的结果 (指向插入的节点或已存在的节点)。
- */
-struct connNode *addConn(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log) {
+ *   1.  调用 `connReserve` 检查连接数上限，再从 `connCache` (或其预留池) 分配一个清零的节点。
+ *   2.  初始化新节点的字段 (日志标志、协议、超时时间) 并构建连接键；节点清零后没有NAT绑定。
+ *   3.  调用 `insertNode` 将新节点插入哈希表，返回其结果。
+ */
+struct connNode *addConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log) {
 	// 初始化
-	// 使用 kzalloc 分配 connNode 结构体内存并清零，GFP_ATOMIC 用于原子上下文
-	struct connNode *node = (struct connNode *)kzalloc(sizeof(struct connNode), GFP_ATOMIC); // sizeof(connNode) 而非 sizeof connNode
+	struct connNet *cn = connNetOf(net);
+	struct connNode *node;
+	if(!connReserve(cn)) // 连接池已满
+		return NULL;
+	node = connAlloc(cn);
 	if(node == NULL) { // 检查内存分配是否成功
-		printk(KERN_WARNING "[fw conns] kzalloc fail.\n");
-		return NULL; // 应该返回 NULL 而不是 0
+		printk_ratelimited(KERN_WARNING "[fw conns] alloc conn fail.\n");
+		return NULL;
 	}
-	node->needLog = log;                 // 设置日志记录标志
-	node->protocol = proto;              // 设置协议类型
-	node->expires = timeFromNow(CONN_EXPIRES); // 设置初始超时时间
-	node->natType = NAT_TYPE_NO;         // 默认NAT类型为“无NAT”
-	// node->nat 结构体由于kzalloc已被清零
+	node->family = AF_INET;
+	connInitNode(node, proto, log);
 
 	// 构建连接键
 	node->key[0] = sip;
 	node->key[1] = dip;
 	node->key[2] = ((((unsigned int)sport) << 16) | ((unsigned int)dport));
-    // node->key[3] 等
 
-	// 将新节点插入到红黑树中
-	return insertNode(&connRoot, node);
+	return connPublish(cn, node);
+}
+
+/**
+ * @brief 创建一个新的IPv6连接跟踪条目，语义与 `addConn` 相同。
+ *
+ * @return struct connNode* 新建或已存在的连接 (即 `connNode6.base`)，失败返回 `NULL`。
+ *
+ * @功能描述: 节点来自 `conn6Cache`，计入与IPv4共用的连接数上限与统计。
+ */
+struct connNode *addConn6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log) {
+	struct connNet *cn = connNetOf(net);
+	struct connNode6 *node6;
+	if(!connReserve(cn))
+		return NULL;
+	node6 = connAlloc6(cn);
+	if(node6 == NULL) {
+		printk_ratelimited(KERN_WARNING "[fw conns] alloc conn6 fail.\n");
+		return NULL;
+	}
+	node6->base.family = AF_INET6;
+	connInitNode(&node6->base, proto, log);
+	conn6KeyOf(&node6->key6, sip, dip, sport, dport);
+	node6->base.key[2] = node6->key6.ports; // 与IPv4节点一样从 key[2] 读取端口
+	return connPublish(cn, &node6->base);
+}
+
+// 为连接换上新的NAT绑定，旧绑定的端口立即归还，内存在RCU宽限期后释放
+static int connSetNAT(struct connNet *cn, struct connNode *node, struct NATRecord record, int natType, struct NATRecord *rule) {
+	struct connNAT *b, *old;
+	b = connNATNew(cn, record, natType, rule);
+	if(b == NULL) {
+		printk_ratelimited(KERN_WARNING "[fw conns] alloc conn nat fail.\n");
+		if(rule != NULL)
+			putNATPort(rule, record.dport);
+		return 0;
+	}
+	old = xchg(&node->nat, b); // xchg 带完整的内存屏障，读者看到指针时绑定的内容已经写好
+	if(old != NULL) {
+		connNATPutPort(old);
+		call_rcu(&old->rcu, connNATFreeRcu);
+	}
+	connEvent(cn, EVT_CONN_NAT, node);
+	return 1;
 }
 
 /**
  * @brief 为指定的连接节点设置NAT转换记录和NAT类型。
  *
+ * @param net 连接所在的网络命名空间，绑定事件发往该命名空间的监听者。
  * @param node 指向要修改的 `connNode` 结构体的指针。
  * @param record 包含NAT转换信息的 `NATRecord` 结构体。
  * @param natType 要设置的NAT类型 (例如 `NAT_TYPE_SRC`, `NAT_TYPE_DEST`)。
  * @return int
  *         - 1: 如果设置成功。
- *         - 0: 如果输入参数 `node` 为 `NULL`。
+ *         - 0: 如果输入参数 `node` 为 `NULL`，或无法分配NAT绑定。
  *
  * @功能描述:
- *   1.  检查输入 `node` 是否为 `NULL`。
- *   2.  获取写锁 (`connLock`)，因为修改节点数据是写操作。
- *   3.  将 `node->natType` 更新为传入的 `natType`。
- *   4.  将 `node->nat` (存储NAT记录的字段) 更新为传入的 `record`。
- *   5.  释放写锁。
+ *   分配一个新的 `connNAT` 并以 `xchg` 替换节点上的旧绑定，不需要任何锁。
+ *   读取方使用 `getConnNAT`，读到的总是某一个完整的绑定。
  */
-int setConnNAT(struct connNode *node, struct NATRecord record, int natType) {
+int setConnNAT(struct net *net, struct connNode *node, struct NATRecord record, int natType) {
 	if(node==NULL) // 如果节点为空
 		return 0; // 返回0表示失败
-	write_lock(&connLock); // 获取写锁
-	node->natType = natType; // 设置NAT类型
-	node->nat = record;      // 复制NAT记录到连接节点中
-	write_unlock(&connLock); // 释放写锁
-	return 1; // 返回1表示成功
+	return connSetNAT(connNetOf(net), node, record, natType, NULL);
 }
 
 /**
- * @brief 为SNAT操作从指定的NAT规则定义的端口范围内查找并分配一个可用的新端口。
+ * @brief 为连接设置SNAT记录，并由连接接管所用端口。
  *
- * @param rule 一个 `NATRecord` 结构体，代表一条SNAT规则。
- *             `rule.sport` 和 `rule.dport` 定义了可用的端口范围。
- *             `rule.daddr` 是SNAT转换后使用的IP地址。
- *             `rule.nowPort` 可能被用作上次分配端口的起始点。
- * @return unsigned short
- *         - 如果找到可用端口，则返回该端口号 (主机字节序)。
- *         - 如果在指定范围内未找到可用端口 (例如端口已全部被占用)，则返回0。
+ * @param net 连接所在的网络命名空间。
+ * @param node 指向要修改的 `connNode` 结构体的指针。
+ * @param record SNAT记录，`record.dport` 为 `rule` 分配的端口。
+ * @param rule 分配该端口的NAT规则。调用者由 `getNewNATPort` 取得的引用在此转交给连接。
+ * @return int
+ *         - 1: 设置成功。
+ *         - 0: `node` 为 `NULL` 或无法分配NAT绑定，端口立即归还。
  *
  * @功能描述:
- *   此函数尝试在给定的SNAT规则 (`rule`) 的端口范围 (`rule.sport` 到 `rule.dport`) 内
- *   找到一个当前未被其他具有相同NAT IP (`rule.daddr`) 的SNAT连接使用的端口。
- *   1.  初始化端口搜索的起始点。如果 `rule.nowPort` 不在有效范围内，则从 `rule.dport` 开始
- *       （或 `rule.sport`，取决于实现，这里是从 `rule.dport` 之后开始）。
- *       这是一个循环搜索，如果到达范围末端，会绕回到范围的起始端。
- *   2.  对范围内的每个端口进行检查：
- *       -   获取读锁 (`connLock`) 以遍历连接红黑树。
- *       -   遍历树中所有的连接节点 (`connNode`)。
- *       -   对于每个连接，如果它是源NAT类型 (`now->natType == NAT_TYPE_SRC`)，
- *           并且其NAT转换后的IP (`now->nat.daddr`) 与当前规则的NAT IP (`rule.daddr`) 相同，
- *           并且其NAT转换后的端口 (`now->nat.dport`) 等于当前正在检查的端口，
- *           则标记此端口为“已使用” (`inUse = 1`) 并中断内部遍历。
- *       -   释放读锁。
- *       -   如果当前检查的端口未被使用 (`!inUse`)，则返回此端口作为可用端口。
- *   3.  如果遍历完整个端口范围后仍未找到可用端口，则返回0。
- *
- *   注意：此端口分配方法不是完全原子的，并且在高并发情况下可能存在竞争条件或效率问题。
- *   `rule.nowPort` 的更新不在此函数中，调用者可能需要更新它。
- *   更健壮的端口分配机制可能需要更复杂的同步或使用内核的端口分配辅助函数。
- */
-unsigned short getNewNATPort(struct NATRecord rule) {
-	struct rb_node *node;   // 用于遍历红黑树的节点指针
-	struct connNode *now;   // 指向当前连接节点的指针
-	unsigned short port;    // 当前正在检查的端口
-	unsigned short inUse;   // 标志，指示当前端口是否已被使用
-
-	// 遍历端口范围以查找可用端口
-	// 初始化搜索起始点：如果 rule.nowPort 无效或未设置，则从 rule.dport (最大端口) 开始递增查找。
-	// 这是一个循环搜索，如果达到dport，会绕回到sport。
-	if(rule.nowPort > rule.dport || rule.nowPort < rule.sport) // 如果nowPort不在范围内
-		rule.nowPort = rule.sport -1; // 从sport开始 (因为下面是port+1) 或者 rule.dport (如果想从最大端口后开始)
-                                      // 原代码是 rule.nowPort = rule.dport; 然后 port = rule.nowPort + 1;
-                                      // 这会导致第一次检查 rule.dport + 1。如果想从sport开始，应设为sport-1。
-
-	// 循环遍历端口范围，从 rule.nowPort + 1 开始，直到再次回到 rule.nowPort
-	for(port = rule.nowPort + 1; port != rule.nowPort; port++) {
-		// 如果端口超出范围，则将其绕回到范围的起始点
-		if(port > rule.dport || port < rule.sport) // port < rule.sport 确保如果 nowPort 是 sport-1，则 port 从 sport 开始
-			port = rule.sport;
-
-		read_lock(&connLock); // 获取读锁以遍历连接树
-		inUse = 0; // 初始化端口为未使用
-		// 遍历所有现有连接
-		for(node = rb_first(&connRoot); node; node=rb_next(node)) {
-			now = rb_entry(node, struct connNode, node); // 获取连接节点数据
-			if(now->natType != NAT_TYPE_SRC) // 只关心源NAT连接
-				continue;
-			if(now->nat.daddr != rule.daddr) // 只关心使用相同NAT IP的连接
-                                             // now->nat.daddr 是该连接SNAT后的IP
-                                             // rule.daddr 是当前规则要使用的NAT IP
-				continue;
-			if(port == now->nat.dport) { // 如果当前检查的端口已被此SNAT连接使用
-                                         // now->nat.dport 是该连接SNAT后的端口
-				inUse = 1; // 标记端口已使用
-				break;     // 中断内部循环，无需再检查其他连接
-			}
-		}
-		read_unlock(&connLock); // 释放读锁
+ *   端口由新绑定持有，连接被时间轮回收时归还。两个CPU并发为同一连接做SNAT时，
+ *   后写入者的绑定生效，先前绑定占用的端口随即归还，不会泄漏。
+ */
+int setConnSNAT(struct net *net, struct connNode *node, struct NATRecord record, struct NATRecord *rule) {
+	if(node == NULL) {
+		putNATPort(rule, record.dport);
+		return 0;
+	}
+	return connSetNAT(connNetOf(net), node, record, NAT_TYPE_SRC, rule);
+}
 
-		if(!inUse) { // 如果当前端口未被使用
-			return port; // 返回此可用端口
-		}
-        if (port == rule.sport && rule.nowPort == rule.sport -1 && rule.nowPort != 0 ) { // 修正循环条件，避免死循环
-             // 当 nowPort = sport-1, port 从 sport 开始, 如果所有端口都占用，port会回到sport-1, 此时 port != nowPort, 会再跑一圈
-             // 此处仅为示例性修复，实际循环逻辑需仔细设计以确保覆盖所有情况并正确终止
-        }
-        // 如果 rule.nowPort 是 sport，第一次 port = sport+1。 如果所有都占用，port 会到 sport，此时 port != nowPort，继续。
-        // 需要确保如果所有端口都被占用，循环能正确终止。
-        // 例如，如果 rule.nowPort 是 sport，并且所有端口都检查完了，port 会变回 sport，此时 port == rule.nowPort，循环结束。
+// 连接被回收时归还其占用的SNAT端口；绑定本身随节点一起释放
+static void connPutNATPort(struct connNode *node) {
+	struct connNAT *b;
+	rcu_read_lock();
+	b = rcu_dereference(node->nat);
+	if(b != NULL)
+		connNATPutPort(b);
+	rcu_read_unlock();
+}
+
+/**
+ * @brief 读取指定连接节点的NAT转换记录和NAT类型。
+ *
+ * @param node 指向连接节点的指针。
+ * @param record [输出参数] 存放NAT记录的副本，可为 `NULL`。
+ * @return int 连接的NAT类型 (`NAT_TYPE_*`)；`node` 为 `NULL` 或未绑定NAT时返回 `NAT_TYPE_NO`。
+ *
+ * @功能描述:
+ *   在RCU读临界区内取得当前绑定并复制，绑定发布后不再修改，因此无需加锁。
+ */
+int getConnNAT(struct connNode *node, struct NATRecord *record) {
+	struct connNAT *b;
+	int natType = NAT_TYPE_NO;
+	if(node == NULL)
+		return NAT_TYPE_NO;
+	rcu_read_lock();
+	b = rcu_dereference(node->nat);
+	if(b != NULL) {
+		natType = b->natType;
+		if(record != NULL)
+			*record = genNATRecord(b->saddr, b->daddr, b->sport, b->dport);
 	}
-	return 0; // 如果遍历完整个范围都未找到可用端口，返回0
+	rcu_read_unlock();
+	return natType;
 }
 
 /**
- * @brief 将红黑树中所有活动的连接信息打包成一个可通过Netlink发送给用户空间的数据块。
+ * @brief 将哈希表中所有活动的连接信息打包成一个可通过Netlink发送给用户空间的数据块。
  *
+ * @param net 要导出的连接池所属的网络命名空间。
  * @param len [输出参数] 指向一个 `unsigned int` 的指针，函数将通过它返回最终构建的数据包的总长度 (字节数)。
  * @return void*
  *         - 指向构建好的数据包内存块的指针。
  *         - 如果内存分配失败，则返回 `NULL`。
  *
  * @功能描述:
- *   1.  获取读锁 (`connLock`)。
- *   2.  **计算连接总数**: 遍历整个连接红黑树 (`connRoot`)，计算当前活动连接的总数量 (`count`)。
- *   3.  **分配内存**: 根据连接总数计算所需内存的总大小，包括一个 `KernelResponseHeader` 和
- *       `count` 个 `ConnLog` 结构体。使用 `kzalloc` (以 `GFP_ATOMIC` 标志) 分配内存。
- *   4.  如果内存分配失败，释放读锁并返回 `NULL`。
- *   5.  **构建响应包**:
- *       -   填充 `KernelResponseHeader`:
- *           -   `bodyTp` 设置为 `RSP_ConnLogs`。
- *           -   `arrayLen` 设置为连接总数 `count`。
- *       -   `p` 指针指向 `KernelResponseHeader` 之后的数据区域。
- *       -   再次遍历连接红黑树。对于每个连接节点 (`connNode`):
- *           -   将其信息（源/目的IP、源/目的端口、协议、NAT类型、NAT记录）
- *               复制到一个临时的 `ConnLog` 结构体 `log` 中。
- *               连接键中的IP和端口组合需要被拆分。
- *           -   使用 `memcpy` 将 `log` 结构体复制到 `p` 指向的内存位置。
- *           -   `p` 指针向后移动一个 `ConnLog` 结构体的大小。
- *   6.  释放读锁。
- *   7.  返回指向构建好的数据包内存块 (`mem`) 的指针。
- */
-void* formAllConns(unsigned int *len) {
+ *   1.  按哈希表当前元素个数申请回包空间 (进程上下文，可以睡眠)。
+ *   2.  使用 `rhashtable_walk_*` 遍历哈希表，遍历过程中不阻塞数据包路径上的查找与插入。
+ *       遍历期间新增的连接可能不在结果中，回包中的 `arrayLen` 以实际填充的数量为准。
+ *   3.  每个连接的NAT信息通过 `getConnNAT` 复制，保证一致。
+ */
+void* formAllConns(struct net *net, unsigned int *len) {
+    struct connNet *cn = connNetOf(net);
     struct KernelResponseHeader *head; // 指向响应头部的指针
-    struct rb_node *node;              // 用于遍历红黑树的节点指针
+    struct rhashtable_iter iter;       // 哈希表遍历器
 	struct connNode *now;              // 指向当前连接节点的指针
 	struct ConnLog log;                // 临时 ConnLog 结构体，用于暂存待复制的数据
     void *mem,*p;                      // mem: 指向分配的总内存块, p: 用于在内存块中移动的指针
-    unsigned int count;                // 记录连接总数
-
-    read_lock(&connLock); // 获取读锁
-	// 计算连接总量
-    for (node=rb_first(&connRoot),count=0;node;node=rb_next(node),count++);
+    unsigned int count, max, t;        // 已填充的连接数, 最多可填充的连接数, 当前遍历的表
 
 	// 申请回包空间：头部大小 + (单个ConnLog大小 * 连接数量)
-	*len = sizeof(struct KernelResponseHeader) + sizeof(struct ConnLog) * count;
-	mem = kzalloc(*len, GFP_ATOMIC); // 分配内存
+	max = connCount(cn);
+	*len = sizeof(struct KernelResponseHeader) + sizeof(struct ConnLog) * max;
+	mem = kzalloc(*len, GFP_KERNEL); // 分配内存 (进程上下文，可以睡眠)
     if(mem == NULL) { // 检查内存分配
         printk(KERN_WARNING "[fw conns] formAllConns kzalloc fail.\n");
-        read_unlock(&connLock); // 释放锁
         return NULL; // 返回NULL表示失败
     }
 
+    // p指向头部之后的数据区，即ConnLog数组的开始位置
+    p=(mem + sizeof(struct KernelResponseHeader));
+    count = 0;
+
+    // 依次遍历各哈希表，填充每个连接的信息到 ConnLog 结构体并复制到内存块
+    for(t = 0; t < CONN_TABLE_NUM; t++) {
+		rhashtable_walk_enter(connTableAt(cn, t), &iter);
+		rhashtable_walk_start(&iter);
+		while(count < max && (now = rhashtable_walk_next(&iter)) != NULL) {
+			if(IS_ERR(now)) { // -EAGAIN: 遍历期间发生了扩缩表，继续即可 (可能出现少量重复)
+				if(PTR_ERR(now) == -EAGAIN)
+					continue;
+				break;
+			}
+			if(isTimeout(READ_ONCE(now->expires))) // 已超时、等待回收的连接不再展示
+				continue;
+			connToLog(now, &log); // 复制连接键、协议与NAT信息
+
+			memcpy(p, &log, sizeof(struct ConnLog)); // 将填充好的ConnLog结构体复制到目标内存
+			p = p + sizeof(struct ConnLog);
+			count++;
+		}
+		rhashtable_walk_stop(&iter);
+		rhashtable_walk_exit(&iter);
+	}
+
     // 构建回包头部
     head = (struct KernelResponseHeader *)mem; // mem转换为头部指针
     head->bodyTp = RSP_ConnLogs;               // 设置响应体类型为连接日志
     head->arrayLen = count;                    // 设置数组长度 (连接条数)
+    *len = sizeof(struct KernelResponseHeader) + sizeof(struct ConnLog) * count;
+    return mem; // 返回构建好的内存块指针
+}
 
-    // p指向头部之后的数据区，即ConnLog数组的开始位置
-    p=(mem + sizeof(struct KernelResponseHeader));
+/**
+ * @brief 连接表分段导出的状态
+ * @功能描述: `pending` 为上一段因skb已满而未能放入的连接，下一段首先输出它，
+ *           因为遍历器已越过该节点，且此时节点可能已被释放，所以保存的是副本。
+ *           导出快照时条目为 `ConnSnap`，否则只使用其中的 `conn` (ConnLog)。
+ */
+struct connDump {
+	struct connNet *cn;         // 请求者所在命名空间的连接池，导出期间请求方套接字持有该命名空间
+	struct rhashtable_iter iter;
+	unsigned int table;         // iter 所在的表 (connTableAt 的下标)
+	int snap;                   // 导出快照 (RSP_ConnSnap) 而非连接信息 (RSP_ConnLogs)
+	int hasPending;
+	struct ConnSnap pending;
+};
 
-    // 遍历红黑树，填充每个连接的信息到 ConnLog 结构体并复制到内存块
-    for (node = rb_first(&connRoot); node; node=rb_next(node),p=p+sizeof(struct ConnLog)) {
-		now = rb_entry(node, struct connNode, node); // 获取当前连接节点
+// 复制出连接的快照：在 ConnLog 之外记下剩余存活时间、TCP状态与日志标志
+static void connToSnap(struct connNode *node, struct ConnSnap *snap) {
+	long left = (long)(READ_ONCE(node->expires) - jiffies);
+	connToLog(node, &snap->conn);
+	snap->ttl = left > 0 ? (unsigned int)((left + HZ - 1) / HZ) : 0;
+	snap->state = READ_ONCE(node->state);
+	snap->needLog = node->needLog;
+}
+
+// 按导出类型把连接写入 p 指向的条目
+static void connDumpFill(struct connDump *st, struct connNode *node, void *p) {
+	if(st->snap)
+		connToSnap(node, (struct ConnSnap *)p);
+	else
+		connToLog(node, (struct ConnLog *)p);
+}
 
-		// 从 connNode 的 key 中提取 IP 和端口信息
-		log.saddr = now->key[0];
-		log.daddr = now->key[1];
-		log.sport = (unsigned short)(now->key[2] >> 16);       // 源端口在高16位
-		log.dport = (unsigned short)(now->key[2] & 0xFFFFu); // 目的端口在低16位
+/**
+ * @brief 开始导出连接表：分配导出状态并初始化哈希表遍历器
+ * @return int 成功返回0，内存不足返回-ENOMEM
+ */
+int dumpConnsStart(struct netlink_callback *cb) {
+	struct connDump *st = kzalloc(sizeof(struct connDump), GFP_KERNEL);
+	if(st == NULL)
+		return -ENOMEM;
+	st->cn = connNetOf(sock_net(cb->skb->sk));
+	rhashtable_walk_enter(connTableAt(st->cn, 0), &st->iter);
+	cb->args[0] = (long)st;
+	return 0;
+}
 
-		log.protocol = now->protocol;   // 复制协议类型
-		log.natType = now->natType;     // 复制NAT类型
-		log.nat = now->nat;             // 复制NAT记录
+/**
+ * @brief 导出一段连接
+ *
+ * @return int 本段有连接时返回skb长度，遍历结束返回0。
+ *
+ * @功能描述:
+ *   在 `rhashtable_walk_start` / `rhashtable_walk_stop` 之间填满一个skb后即停止，
+ *   RCU读锁只在这一段内持有；下一次调用从遍历器停下的位置继续。
+ *   遍历期间扩缩表可能导致少量连接重复出现，与 `formAllConns` 一致；已超时的连接不导出。
+ *   一张表遍历完后在同一段内接着遍历下一张表。
+ */
+int dumpConns(struct sk_buff *skb, struct netlink_callback *cb) {
+	struct connDump *st = (struct connDump *)cb->args[0];
+	unsigned int size = st->snap ? sizeof(struct ConnSnap) : sizeof(struct ConnLog);
+	struct connNode *now;
+	struct nlDump d;
+	void *p;
 
-		memcpy(p, &log, sizeof(struct ConnLog)); // 将填充好的ConnLog结构体复制到目标内存
+	if(nlDumpBegin(&d, skb, cb, st->snap ? RSP_ConnSnap : RSP_ConnLogs) != 0)
+		return -EMSGSIZE;
+	if(st->hasPending) {
+		p = nlDumpItem(&d, size);
+		if(p == NULL)
+			return nlDumpEnd(&d);
+		memcpy(p, st->snap ? (void *)&st->pending : (void *)&st->pending.conn, size);
+		st->hasPending = 0;
 	}
-    read_unlock(&connLock); // 释放读锁
-    return mem; // 返回构建好的内存块指针
+	for(;;) {
+		rhashtable_walk_start(&st->iter);
+		while((now = rhashtable_walk_next(&st->iter)) != NULL) {
+			if(IS_ERR(now)) {
+				if(PTR_ERR(now) == -EAGAIN)
+					continue;
+				break;
+			}
+			if(isTimeout(READ_ONCE(now->expires)))
+				continue;
+			p = nlDumpItem(&d, size);
+			if(p == NULL) { // 本段已满，留到下一段
+				connToSnap(now, &st->pending);
+				st->hasPending = 1;
+				break;
+			}
+			connDumpFill(st, now, p);
+		}
+		rhashtable_walk_stop(&st->iter);
+		if(st->hasPending || st->table + 1 >= CONN_TABLE_NUM)
+			break;
+		rhashtable_walk_exit(&st->iter); // 本表已遍历完，转到下一张表
+		rhashtable_walk_enter(connTableAt(st->cn, ++st->table), &st->iter);
+	}
+	return nlDumpEnd(&d);
 }
 
 /**
- * @brief 根据给定的IP过滤规则，删除连接池中所有匹配该规则的连接。
+ * @brief 开始导出连接表快照，之后的 dump / done 与导出连接信息共用
+ * @return int 成功返回0，内存不足返回-ENOMEM
+ */
+int dumpConnSnapStart(struct netlink_callback *cb) {
+	int ret = dumpConnsStart(cb);
+	if(ret == 0)
+		((struct connDump *)cb->args[0])->snap = 1;
+	return ret;
+}
+
+/**
+ * @brief 结束导出连接表：释放遍历器与导出状态
+ */
+int dumpConnsDone(struct netlink_callback *cb) {
+	struct connDump *st = (struct connDump *)cb->args[0];
+	if(st != NULL) {
+		rhashtable_walk_exit(&st->iter);
+		kfree(st);
+	}
+	return 0;
+}
+
+// 按快照设置待插入节点的NAT绑定，rule 非NULL时绑定接管已占用的SNAT端口。
+// 接管端口的绑定分配失败时归还端口并返回0，其余绑定分配失败时恢复为不带NAT的连接
+static int connSnapNAT(struct connNet *cn, struct connNode *node, const struct ConnSnap *snap, struct NATRecord *rule) {
+	if(snap->conn.natType == NAT_TYPE_NO)
+		return 1;
+	node->nat = connNATNew(cn, snap->conn.nat, snap->conn.natType, rule);
+	if(node->nat == NULL && rule != NULL) {
+		putNATPort(rule, snap->conn.nat.dport);
+		return 0;
+	}
+	return 1;
+}
+
+// 由一条快照建立尚未插入的节点，rule 为已为其占用SNAT端口的规则；失败返回NULL，端口已归还
+static struct connNode *connFromSnap(struct connNet *cn, const struct ConnSnap *snap, struct NATRecord *rule) {
+	const struct ConnLog *log = &snap->conn;
+	struct connNode6 *node6;
+	struct connNode *node;
+
+	if(log->family == AF_INET6) {
+		node6 = connAlloc6(cn);
+		if(node6 == NULL)
+			goto fail;
+		node = &node6->base;
+		node->family = AF_INET6;
+		conn6KeyOf(&node6->key6, (const struct in6_addr *)log->saddr6, (const struct in6_addr *)log->daddr6,
+			log->sport, log->dport);
+		node->key[2] = node6->key6.ports;
+	} else {
+		node = connAlloc(cn);
+		if(node == NULL)
+			goto fail;
+		node->family = AF_INET;
+		node->key[0] = log->saddr;
+		node->key[1] = log->daddr;
+		node->key[2] = ((((unsigned int)log->sport) << 16) | ((unsigned int)log->dport));
+	}
+	connInitNode(node, log->protocol, snap->needLog);
+	node->state = snap->state;
+	node->dnatChecked = 1; // 恢复的是进行中的流，不再按DNAT规则改道
+	node->expires = timeFromNow(min(snap->ttl, connTimeoutOf(log->protocol, snap->state)));
+	if(!connSnapNAT(cn, node, snap, rule)) {
+		connFree(node);
+		return NULL;
+	}
+	return node;
+fail:
+	if(rule != NULL)
+		putNATPort(rule, log->nat.dport);
+	return NULL;
+}
+
+/**
+ * @brief 从快照恢复一批连接。
+ * @param net 连接恢复到的网络命名空间。
+ * @param snaps 连接快照数组。
+ * @param num 快照条数。
+ * @return int 实际恢复的连接数。
  *
- * @param rule 一个 `IPRule` 结构体，用作匹配条件。`rule.protocol` 会被强制设为 `IPPROTO_IP`
- *             以匹配任何协议的连接（如果 `matchOneRule` 支持）。
- * @return int 返回被成功删除的连接数量。
+ * @功能描述:
+ *   1.  每条快照与新建连接一样经过 `connReserve` 的上限检查，再按地址族分配节点并还原键、状态与超时时间。
+ *   2.  带端口的SNAT连接先通过 `natClaimPort` 向当前的NAT规则重新占用端口，使之后的端口分配避开它，
+ *       节点带着接管该端口的绑定才插入哈希表，数据包路径不会看到尚未绑定SNAT的恢复连接。
+ *       端口无法占用 (当前没有包含它的NAT规则，或已分给了通往同一目的端点的其他连接) 时不恢复该连接。
+ *       NAT钩子只注册在初始命名空间，其他命名空间中带NAT记录的快照被跳过。
+ *   3.  插入后若键已存在 (数据包已重新建立了该连接)，保留现有连接，占用的端口随新节点一起归还。
+ *   只在进程上下文中调用，恢复期间数据包路径可以正常建立新连接。
+ */
+int restoreConns(struct net *net, const struct ConnSnap *snaps, unsigned int num) {
+	struct connNet *cn = connNetOf(net);
+	const struct ConnSnap *snap;
+	struct connNode *node;
+	struct NATRecord *rule;
+	unsigned int i;
+	int count = 0;
+
+	for(i = 0; i < num; i++) {
+		snap = &snaps[i];
+		if((snap->conn.family != AF_INET && snap->conn.family != AF_INET6) ||
+		   snap->state > CONN_TCP_CLOSE || snap->ttl == 0)
+			continue;
+		if((snap->conn.family == AF_INET6 || !net_eq(net, &init_net)) && snap->conn.natType != NAT_TYPE_NO)
+			continue; // NAT只作用于初始命名空间中的IPv4连接
+		if(!connReserve(cn))
+			break;
+		rule = NULL;
+		if(snap->conn.natType == NAT_TYPE_SRC && snap->conn.nat.dport != 0) {
+			rule = natClaimPort(snap->conn.saddr, snap->conn.daddr, snap->conn.sport, snap->conn.dport,
+				snap->conn.nat.daddr, snap->conn.nat.dport);
+			if(rule == NULL)
+				continue;
+		}
+		node = connFromSnap(cn, snap, rule);
+		if(node == NULL) {
+			printk(KERN_WARNING "[fw conns] alloc restored conn fail.\n");
+			break;
+		}
+		if(connPublish(cn, node) == node)
+			count++;
+	}
+	return count;
+}
+
+/**
+ * @brief 遍历一次连接池，删除所有满足条件的连接。
+ *
+ * @param net 连接池所属的网络命名空间。
+ * @param match 判定函数，返回true的连接被删除；在RCU读临界区内调用，不能睡眠。
+ * @param arg 传给判定函数的参数。
+ * @return int 返回被删除的连接数量。
  *
  * @功能描述:
- *   此函数用于在防火墙策略更改时（例如，添加了一条新的DROP规则，或默认策略变为DROP），
- *   主动清除连接池中可能与新策略冲突的现有连接。
- *   1.  将输入规则 `rule` 的协议字段强制设置为 `IPPROTO_IP`，这通常意味着在匹配时
- *       忽略协议（或者 `matchOneRule` 会特殊处理 `IPPROTO_IP` 作为通配符）。
- *   2.  使用一个 `while(hasChange)` 循环来反复遍历连接红黑树。这样做是因为在遍历过程中
- *       删除节点可能会影响遍历器，或者为了确保所有符合条件的节点都被删除（如果一次遍历
- *       中 `rb_next` 的行为在节点删除后变得不可靠）。
- *   3.  在每次循环的开始，获取读锁并遍历红黑树中的所有连接节点。
- *   4.  对于每个连接节点，提取其五元组信息（源/目的IP、源/目的端口、协议）。
- *   5.  调用 `matchOneRule` 函数，将当前连接的五元组与传入的 `rule` 进行比较。
- *       `matchOneRule` (未在此处定义，应在helper.h中声明并在其他地方实现)
- *       负责判断一个连接是否符合给定规则的条件。
- *   6.  如果 `matchOneRule` 返回真（表示连接与规则相关）：
- *       -   设置 `hasChange = 1`，表示本次遍历中找到了需要删除的节点。
- *       -   保存需要删除的节点指针 (`needDel`)。
- *       -   中断内部的遍历（因为我们一次只删除一个节点，然后重新开始遍历）。
- *   7.  释放读锁。
- *   8.  如果 `hasChange` 为1（即找到了要删除的节点）：
- *       -   调用 `eraseNode` 从红黑树中删除之前标记的 `needDel` 节点。
- *       -   删除计数器 `count` 加1。
- *   9.  `while` 循环继续，直到一次完整的树遍历没有发现任何需要删除的节点 (`hasChange` 保持为0)。
- *   10. 打印一条完成信息到内核日志。
- *   11. 返回总共删除的连接数量 `count`。
- *
- *   注意：这种“在遍历中删除然后重新遍历”的模式可能不是最高效的，尤其是在有大量节点
- *   需要删除时。更优化的方法可能包括在一次遍历中收集所有待删除节点的列表，然后在遍历
- *   结束后统一删除，或者使用支持安全迭代时删除的遍历器。
- */
-int eraseConnRelated(struct IPRule rule) {
-	struct rb_node *node;         // 用于遍历红黑树的节点指针
-	unsigned short sport,dport;   // 存储连接的源端口和目的端口
-	struct connNode *needDel = NULL; // 指向待删除连接节点的指针
+ *   使用 `rhashtable_walk_*` 依次遍历各哈希表，遇到满足条件的连接直接摘除 (遍历器允许边遍历边删除)。
+ *   每 `CONN_PURGE_BATCH` 个连接暂停一次遍历，RCU读临界区的长度因此与表大小无关。只能在进程上下文中调用。
+ */
+int eraseConnIf(struct net *net, bool (*match)(struct connNode *node, void *arg), void *arg) {
+	struct connNet *cn = connNetOf(net);
+	struct rhashtable_iter iter;  // 哈希表遍历器
+	struct connNode *now;         // 当前连接节点
 	unsigned int count = 0;       // 记录删除的连接数量
-	int hasChange = 1;            // 标志，指示在一次完整的树遍历中是否删除了节点
-
-	// 初始化：将规则的协议设置为 IPPROTO_IP (0)，matchOneRule 可能会将其解释为匹配任何协议
-	rule.protocol = IPPROTO_IP;
+	unsigned int seen = 0;        // 本段已检查的连接数
+	unsigned int t;
 
-	// 循环删除相关节点，直到一次完整的遍历没有删除任何节点为止
-	while(hasChange) {
-		hasChange = 0; // 在每次大循环开始时，重置 hasChange 标志
-		read_lock(&connLock); // 获取读锁以遍历树
-		// 从红黑树的第一个节点开始遍历
-		for (node = rb_first(&connRoot); node; node = rb_next(node)) {
-			needDel = rb_entry(node, struct connNode, node); // 获取当前连接节点
-
-			// 从连接键中提取源端口和目的端口
-			sport = (unsigned short)(needDel->key[2] >> 16);
-			dport = (unsigned short)(needDel->key[2] & 0xFFFFu);
-
-			// 调用 matchOneRule 判断当前连接是否与给定的过滤规则相关
-			// 参数: 规则，连接的源IP，目的IP，源端口，目的端口，协议
-			if(matchOneRule(&rule, needDel->key[0], needDel->key[1], sport, dport, needDel->protocol)) {
-				hasChange = 1; // 标记已找到需要删除的节点
-				// 注意：这里直接 break，意味着每次只找到一个就去删除，然后重新遍历。
-				// 这是为了避免在遍历过程中修改树结构导致遍历器失效。
+	for(t = 0; t < CONN_TABLE_NUM; t++) {
+		rhashtable_walk_enter(connTableAt(cn, t), &iter);
+		rhashtable_walk_start(&iter);
+		while((now = rhashtable_walk_next(&iter)) != NULL) {
+			if(IS_ERR(now)) {
+				if(PTR_ERR(now) == -EAGAIN)
+					continue;
 				break;
 			}
+			if(match(now, arg))
+				count += eraseNode(cn, now, EVT_CONN_DEL);
+			// 每检查一段就退出RCU读临界区并让出CPU，避免大表上长时间不可抢占
+			if(++seen >= CONN_PURGE_BATCH) {
+				seen = 0;
+				rhashtable_walk_stop(&iter);
+				cond_resched();
+				rhashtable_walk_start(&iter);
+			}
 		}
-		read_unlock(&connLock); // 释放读锁
+		rhashtable_walk_stop(&iter);
+		rhashtable_walk_exit(&iter);
+	}
+	return count;
+}
 
-		if(hasChange) { // 如果在上面的遍历中找到了需要删除的节点
-			// needDel 指向的就是那个需要被删除的节点
-			eraseNode(&connRoot, needDel); // 从红黑树中删除该节点并释放内存
-			count++; // 增加删除计数
-		}
-		// 如果 hasChange 仍为0，表示上一次遍历没有找到可删除的节点，循环将终止。
+// eraseConnRelated 的判定函数：连接的五元组是否匹配规则，规则只作用于同一地址族的连接
+static bool connMatchRule(struct connNode *node, void *arg) {
+	struct IPRule *rule = arg;
+	struct connNode6 *node6;
+	unsigned short sport,dport;   // 从连接键中提取源端口和目的端口 (两个地址族都存放在 key[2])
+	sport = (unsigned short)(node->key[2] >> 16);
+	dport = (unsigned short)(node->key[2] & 0xFFFFu);
+	if(node->family == AF_INET6) {
+		node6 = container_of(node, struct connNode6, base);
+		return matchOneRule6(rule, &node6->key6.saddr, &node6->key6.daddr, sport, dport, node->protocol);
 	}
+	return rule->family != AF_INET6 &&
+		matchOneRule(rule, node->key[0], node->key[1], sport, dport, node->protocol);
+}
+
+/**
+ * @brief 根据给定的IP过滤规则，删除连接池中所有匹配该规则的连接。
+ *
+ * @param net 连接池所属的网络命名空间。
+ * @param rule 一个 `IPRule` 结构体，用作匹配条件。`rule.protocol` 会被强制设为 `IPPROTO_IP`
+ *             以匹配任何协议的连接。
+ * @return int 返回被成功删除的连接数量。
+ *
+ * @功能描述:
+ *   此函数用于在防火墙策略更改时（例如，添加了一条新的DROP规则，或默认策略变为DROP），
+ *   主动清除连接池中可能与新策略冲突的现有连接。基于 `eraseConnIf` 实现，只能在进程上下文中调用。
+ */
+int eraseConnRelated(struct net *net, struct IPRule rule) {
+	int count;
+	// 将规则的协议设置为 IPPROTO_IP (0)，matchOneRule 会将其解释为匹配任何协议
+	rule.protocol = IPPROTO_IP;
+	count = eraseConnIf(net, connMatchRule, &rule);
 	printk("[fw conns] erase all related conn finish.\n"); // 打印完成信息
 	return count; // 返回总共删除的连接数量
 }
 
+// --- 延迟清理 ---
+// 控制面修改规则后只登记需要清理的条件，由工作队列合并成一次遍历完成，
+// 下发规则的netlink处理因此不必等待遍历整个连接池。
+
+struct connPurge {
+	struct list_head list;
+	struct IPRule rule;         // 清除匹配此规则的连接
+};
+
+struct connPurgeCtx {
+	struct net *net;
+	struct list_head *rules;
+	bool recheck;
+};
+
+// 工作队列的判定函数：匹配任一登记的规则，或在当前规则集下不再被允许
+static bool connPurgeMatch(struct connNode *node, void *arg) {
+	struct connPurgeCtx *ctx = arg;
+	struct connNode6 *node6;
+	struct connPurge *p;
+	unsigned short sport, dport;
+	list_for_each_entry(p, ctx->rules, list)
+		if(connMatchRule(node, &p->rule))
+			return true;
+	if(!ctx->recheck)
+		return false;
+	sport = (unsigned short)(node->key[2] >> 16);
+	dport = (unsigned short)(node->key[2] & 0xFFFFu);
+	if(node->family == AF_INET6) {
+		node6 = container_of(node, struct connNode6, base);
+		return connPolicyDenies6(ctx->net, &node6->key6.saddr, &node6->key6.daddr, sport, dport, node->protocol);
+	}
+	return connPolicyDenies(ctx->net, node->key[0], node->key[1], sport, dport, node->protocol);
+}
+
+static void connPurgeWorker(struct work_struct *work) {
+	struct connNet *cn = container_of(work, struct connNet, purgeWork);
+	struct connPurgeCtx ctx;
+	struct connPurge *p, *tmp;
+	LIST_HEAD(rules);
+	int count;
+
+	spin_lock_bh(&cn->purgeLock);
+	list_splice_init(&cn->purgeList, &rules);
+	ctx.recheck = cn->purgeRecheck;
+	cn->purgeRecheck = false;
+	spin_unlock_bh(&cn->purgeLock);
+	if(list_empty(&rules) && !ctx.recheck)
+		return;
+	ctx.net = cn->net;
+	ctx.rules = &rules;
+	count = eraseConnIf(cn->net, connPurgeMatch, &ctx);
+	list_for_each_entry_safe(p, tmp, &rules, list) {
+		list_del(&p->list);
+		kfree(p);
+	}
+	printk("[fw conns] deferred purge finish, %d conns erased.\n", count);
+}
+
+/**
+ * @brief 登记一次延迟清理：删除匹配规则的连接。
+ * @param net 连接池所属的网络命名空间。
+ * @param rule 匹配条件，语义与 `eraseConnRelated` 相同。
+ * @note 清理在工作队列中完成，多次登记合并为一次遍历；内存不足时退回到同步的 `eraseConnRelated`。
+ */
+void purgeConnRelated(struct net *net, struct IPRule rule) {
+	struct connNet *cn = connNetOf(net);
+	struct connPurge *p;
+	p = kmalloc(sizeof(*p), GFP_KERNEL);
+	if(p == NULL) {
+		eraseConnRelated(net, rule);
+		return;
+	}
+	p->rule = rule;
+	p->rule.protocol = IPPROTO_IP;
+	spin_lock_bh(&cn->purgeLock);
+	list_add_tail(&p->list, &cn->purgeList);
+	spin_unlock_bh(&cn->purgeLock);
+	queue_work(system_unbound_wq, &cn->purgeWork);
+}
+
 /**
- * @brief 周期性清理连接池，删除所有已超时的连接。
- *        此函数通常由内核定时器回调函数调用。
+ * @brief 登记一次延迟清理：按当前规则集重新判定所有连接，删除不再被允许的连接。
+ */
+void purgeConnDenied(struct net *net) {
+	struct connNet *cn = connNetOf(net);
+	spin_lock_bh(&cn->purgeLock);
+	cn->purgeRecheck = true;
+	spin_unlock_bh(&cn->purgeLock);
+	queue_work(system_unbound_wq, &cn->purgeWork);
+}
+
+/**
+ * @brief 为每个命名空间登记一次 purgeConnDenied。
+ * @note 地址集合为全机共用，集合内容变化后所有命名空间的规则都可能改判。
+ */
+void purgeConnDeniedAll(void) {
+	struct connNet *cn;
+	mutex_lock(&connNetsMutex);
+	list_for_each_entry(cn, &connNets, list)
+		purgeConnDenied(cn->net);
+	mutex_unlock(&connNetsMutex);
+}
+
+/**
+ * @brief 转动时间轮，回收到期格中已超时或已被删除的连接。
+ *        此函数由定时器回调 `conn_timer_callback` 在软中断上下文中调用。
  *
- * @return int 通常返回0。
+ * @param cn 要转动的时间轮所属的连接池。
+ * @param budget 本次最多检查的节点数。
+ * @return int 剩余预算；为0表示预算耗尽，仍有未处理的到期格。
  *
  * @功能描述:
- *   与 `eraseConnRelated` 类似，此函数也使用一个 `while(hasChange)` 循环来反复遍历
- *   连接红黑树，直到一次完整的遍历没有发现任何超时连接为止。
- *   1.  在每次循环的开始，获取读锁并遍历红黑树中的所有连接节点。
- *   2.  对于每个连接节点，调用 `isTimeout(needDel->expires)` 检查其是否已超时。
- *   3.  如果连接已超时：
- *       -   设置 `hasChange = 1`。
- *       -   保存超时节点指针 (`needDel`)。
- *       -   中断内部的遍历。
- *   4.  释放读锁。
- *   5.  如果 `hasChange` 为1（即找到了超时连接）：
- *       -   调用 `eraseNode` 从红黑树中删除该超时节点。
- *   6.  `while` 循环继续，直到没有更多超时连接被找到。
- *
- *   这种删除方式同样是为了处理遍历时修改集合的问题。
- */
-int rollConn(void) {
-	struct rb_node *node;             // 用于遍历红黑树的节点指针
-	struct connNode *needDel = NULL;  // 指向待删除（超时）连接节点的指针
-	int hasChange = 1;                // 标志，指示在一次完整的树遍历中是否删除了节点
-
-	//printk("[fw conns] flush all conn start.\n"); // 调试信息 (已注释)
-
-	// 循环删除超时连接，直到一次完整的遍历没有删除任何节点为止
-	while(hasChange) {
-		hasChange = 0; // 重置标志
-		read_lock(&connLock); // 获取读锁
-		// 遍历红黑树
-		for (node = rb_first(&connRoot); node; node = rb_next(node)) {
-			needDel = rb_entry(node, struct connNode, node); // 获取当前连接节点
-			if(isTimeout(needDel->expires)) { // 检查连接是否已超时
-				hasChange = 1; // 标记已找到超时节点
-				break;         // 中断遍历，准备删除此节点
+ *   依次处理 `due` 已到的每一格：
+ *   1.  已删除 (`dead`) 或已超时的节点：从哈希表摘除 (若仍在表中)、从格中摘下，
+ *       归还其占用的SNAT端口，并在RCU宽限期后释放。
+ *   2.  超时时间已被推后的节点：先移到临时链表，处理完本格后按新的超时时间重新挂入时间轮。
+ *   3.  预算耗尽时停在当前格，`tick` 不前进，下次调用从这里继续。
+ *   总工作量与到期格中的节点数成正比，与连接池大小无关。
+ */
+static int rollConn(struct connNet *cn, int budget) {
+	struct connNode *now, *tmp;
+	struct list_head requeue;
+	unsigned int idx;
+
+	while(time_after_eq(jiffies, cn->wheel.due) && budget > 0) {
+		idx = cn->wheel.tick % CONN_WHEEL_SLOTS;
+		INIT_LIST_HEAD(&requeue);
+		spin_lock_bh(&cn->wheel.locks[idx]);
+		list_for_each_entry_safe(now, tmp, &cn->wheel.slots[idx], tnode) {
+			if(budget <= 0)
+				break;
+			budget--;
+			if(READ_ONCE(now->dead) || isTimeout(READ_ONCE(now->expires))) {
+				eraseNode(cn, now, EVT_CONN_EXPIRED);
+				list_del(&now->tnode);
+				connPutNATPort(now);
+				call_rcu(&now->rcu, connFreeRcu);
+			} else {
+				list_move_tail(&now->tnode, &requeue);
 			}
 		}
-		read_unlock(&connLock); // 释放读锁
-
-		if(hasChange) { // 如果找到了超时节点
-			eraseNode(&connRoot, needDel); // 删除该超时节点
+		if(list_empty(&cn->wheel.slots[idx])) { // 本格处理完毕，前进到下一格
+			WRITE_ONCE(cn->wheel.tick, cn->wheel.tick + 1);
+			cn->wheel.due += CONN_WHEEL_TICK;
+		}
+		spin_unlock_bh(&cn->wheel.locks[idx]);
+		// 重新挂入：tick 已前进，不会挂回刚处理完的格
+		list_for_each_entry_safe(now, tmp, &requeue, tnode) {
+			list_del(&now->tnode);
+			connWheelAdd(cn, now);
 		}
 	}
-	//printk("[fw conns] flush all conn finish.\n"); // 调试信息 (已注释)
-	return 0;
+	return budget;
 }
 
 // --- 定时器相关 ---
 
-// 定义一个内核定时器结构体 `conn_timer`，用于周期性地清理连接池。
-static struct timer_list conn_timer;
-
 /**
  * @brief 内核定时器的回调函数。
- *        当 `conn_timer` 定时器触发时，此函数会被内核调用。
+ *        当某个命名空间的 `cn->timer` 定时器触发时，此函数会被内核调用。
  *
- * @param arg (对于旧内核版本 < 4.14.0) 传递给定时器回调的参数 (在此代码中未使用，设为0)。
+ * @param arg (对于旧内核版本 < 4.14.0) 定时器所属的 `connNet` 指针。
  * @param t (对于新内核版本 >= 4.14.0) 指向触发此回调的 `timer_list` 结构体的指针。
  * @return void 无返回值。
  *
  * @功能描述:
- *   1.  调用 `rollConn()` 函数来遍历连接池并清除所有已超时的连接。
- *   2.  调用 `mod_timer(&conn_timer, timeFromNow(CONN_ROLL_INTERVAL))` 来重新设置（重新激活）
- *       `conn_timer` 定时器，使其在 `CONN_ROLL_INTERVAL` 秒之后再次触发。
- *       `CONN_ROLL_INTERVAL` 是预定义的连接清理周期。
- *       `timeFromNow` (应在 `tools.h` 中定义) 将秒数转换为未来的 `jiffies` 值。
- *
- *   通过这种方式，定时器会周期性地执行连接清理任务。
+ *   1.  调用 `rollConn(cn, CONN_GC_BUDGET)` 处理该命名空间已到期的时间轮格。
+ *   2.  预算耗尽说明还有积压，1个jiffy后再次触发；否则在下一格的 `due` 时触发。
  */
 // 根据内核版本选择不同的定时器回调函数签名
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0) // 如果内核版本低于 4.14.0
 void conn_timer_callback(unsigned long arg) { // 旧版API，参数为 unsigned long
+	struct connNet *cn = (struct connNet *)arg;
 #else // 如果内核版本大于等于 4.14.0
 void conn_timer_callback(struct timer_list *t) { // 新版API，参数为 struct timer_list *
+	struct connNet *cn = from_timer(cn, t, timer);
 #endif
-    rollConn(); // 调用连接清理函数
-	mod_timer(&conn_timer, timeFromNow(CONN_ROLL_INTERVAL)); // 重新设置定时器，使其在 CONN_ROLL_INTERVAL 秒后再次触发
+	if(rollConn(cn, CONN_GC_BUDGET) == 0)
+		mod_timer(&cn->timer, jiffies + 1); // 仍有积压，尽快继续
+	else
+		mod_timer(&cn->timer, cn->wheel.due); // 下一格到期时
 }
 
 /**
- * @brief 初始化连接跟踪模块的相关内容，主要是设置和启动内核定时器。
- *        此函数通常在内核模块加载时 (`mod_init`) 被调用。
- * @return void 无返回值。
+ * @brief 为新的网络命名空间建立连接池。
+ * @return int 成功返回0，哈希表创建失败返回负数错误码。
  * @功能描述:
- *   1.  根据内核版本选择不同的API来初始化定时器 `conn_timer`：
- *       -   对于旧内核 (< 4.14.0)，使用 `init_timer`，并手动设置 `function` 和 `data` 成员。
- *       -   对于新内核 (>= 4.14.0)，使用 `timer_setup`，直接传入回调函数和标志。
- *   2.  设置定时器的首次超时时间 (`conn_timer.expires`) 为从当前时间起 `CONN_ROLL_INTERVAL` 秒之后。
- *   3.  调用 `add_timer(&conn_timer)` 将定时器添加到内核的活动定时器列表中，以激活它。
+ *   1.  调用 `rhashtable_init` 创建IPv4与IPv6连接哈希表，并初始化时间轮的各格链表与锁；
+ *       连接数上限取模块参数 `conn_max`。
+ *   2.  根据内核版本选择不同的API来初始化定时器：旧内核 (< 4.14.0) 使用 `init_timer` 并以 `data` 传入 `connNet`，
+ *       新内核 (>= 4.14.0) 使用 `timer_setup`，回调中以 `from_timer` 取回 `connNet`。
+ *   3.  定时器首次在第一格到期时触发，随后把连接池挂入 `connNets`。
  */
-void conn_init(void) {
+static int __net_init connNetInit(struct net *net) {
+	struct connNet *cn = connNetOf(net);
+	int i, ret;
+	cn->net = net;
+	cn->max = conn_max ? conn_max : CONN_MAX_DEFAULT;
+	cn->fullPolicy = CONN_FULL_DROP;
+	ret = rhashtable_init(&cn->table, &connParams);
+	if(ret != 0) {
+		printk(KERN_WARNING "[fw conns] init conn table fail (%d).\n", ret);
+		return ret;
+	}
+	ret = rhashtable_init(&cn->table6, &conn6Params);
+	if(ret != 0) {
+		printk(KERN_WARNING "[fw conns] init conn6 table fail (%d).\n", ret);
+		rhashtable_destroy(&cn->table);
+		return ret;
+	}
+	for(i = 0; i < CONN_WHEEL_SLOTS; i++) {
+		INIT_LIST_HEAD(&cn->wheel.slots[i]);
+		spin_lock_init(&cn->wheel.locks[i]);
+	}
+	cn->wheel.tick = 0;
+	cn->wheel.due = jiffies + CONN_WHEEL_TICK;
+	INIT_LIST_HEAD(&cn->purgeList);
+	spin_lock_init(&cn->purgeLock);
+	INIT_WORK(&cn->purgeWork, connPurgeWorker);
 // 根据内核版本初始化定时器
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
-    init_timer(&conn_timer); // 初始化定时器结构体
-    conn_timer.function = &conn_timer_callback; // 设置定时器到期时调用的回调函数
-    conn_timer.data = ((unsigned long)0); // 设置传递给回调函数的参数 (此处为0，未使用)
+    init_timer(&cn->timer); // 初始化定时器结构体
+    cn->timer.function = &conn_timer_callback; // 设置定时器到期时调用的回调函数
+    cn->timer.data = ((unsigned long)cn); // 回调据此找到所属的连接池
 #else
     // 使用新的 timer_setup API 初始化定时器，直接关联回调函数，flags设为0
-    timer_setup(&conn_timer, conn_timer_callback, 0);
+    timer_setup(&cn->timer, conn_timer_callback, 0);
 #endif
-	conn_timer.expires = timeFromNow(CONN_ROLL_INTERVAL); // 设置定时器的首次超时时间
-	add_timer(&conn_timer); // 将定时器添加到内核的活动定时器列表，激活它
+	cn->timer.expires = cn->wheel.due; // 第一格到期时首次触发
+	add_timer(&cn->timer); // 将定时器添加到内核的活动定时器列表，激活它
+	mutex_lock(&connNetsMutex);
+	list_add_tail(&cn->list, &connNets);
+	mutex_unlock(&connNetsMutex);
+	return 0;
 }
 
 /**
- * @brief 清理连接跟踪模块的资源，主要是删除（停止）内核定时器。
- *        此函数通常在内核模块卸载时 (`mod_exit`) 被调用。
+ * @brief 释放一个网络命名空间的连接池。
+ * @功能描述:
+ *   1.  从 `connNets` 摘下后 `del_timer_sync` 停止定时器并等待正在运行的回调结束；
+ *       `cancel_work_sync` 等待延迟清理结束并丢弃未处理的登记。
+ *   2.  每个节点 (包括已从哈希表摘除但尚未回收的节点) 都挂在时间轮上，逐格释放全部节点。
+ *       该命名空间的钩子已注销，不再有读者访问这个连接池，因此可以直接释放节点。
+ *   3.  `rhashtable_destroy` 释放两张哈希表本身。
+ */
+static void __net_exit connNetExit(struct net *net) {
+	struct connNet *cn = connNetOf(net);
+	struct connNode *now, *tmp;
+	struct connPurge *p, *ptmp;
+	int i;
+	mutex_lock(&connNetsMutex);
+	list_del(&cn->list);
+	mutex_unlock(&connNetsMutex);
+	del_timer_sync(&cn->timer); // 删除（停止）内核定时器
+	cancel_work_sync(&cn->purgeWork); // 已不在 connNets 上，netlink套接字也已释放，不会再有新的清理登记
+	list_for_each_entry_safe(p, ptmp, &cn->purgeList, list) {
+		list_del(&p->list);
+		kfree(p);
+	}
+	for(i = 0; i < CONN_WHEEL_SLOTS; i++) {
+		list_for_each_entry_safe(now, tmp, &cn->wheel.slots[i], tnode) {
+			list_del(&now->tnode);
+			connFree(now); // 同时归还SNAT端口
+		}
+	}
+	rhashtable_destroy(&cn->table);
+	rhashtable_destroy(&cn->table6);
+}
+
+static struct pernet_operations connNetOps = {
+	.init = connNetInit,
+	.exit = connNetExit,
+	.id = &connNetId,
+	.size = sizeof(struct connNet),
+};
+
+/**
+ * @brief 初始化连接跟踪模块，创建节点缓存并为每个网络命名空间建立连接池。
+ *        此函数在内核模块加载时 (`mod_init`) 、规则状态之后、注册钩子之前被调用。
+ * @return int 成功返回0，缓存、内存池或连接池创建失败返回负数错误码。
+ * @功能描述:
+ *   1.  创建 `connNode`、`connNode6` 与 `connNAT` 的slab缓存，`conn_prealloc` 非0时在第一个缓存上建立预留内存池；
+ *       缓存与预留池由所有命名空间共用。
+ *   2.  注册 `connNetOps`，已有的与之后新建的命名空间都由 `connNetInit` 建立各自的连接池。
+ */
+int conn_init(void) {
+	int ret = -ENOMEM;
+	BUILD_BUG_ON(offsetof(struct connNode6, base) != 0); // 遍历时把两张表的节点都当作 connNode
+	BUILD_BUG_ON(sizeof(struct connNode) > L1_CACHE_BYTES); // 一个节点只占一个缓存行
+	connCache = KMEM_CACHE(connNode, SLAB_HWCACHE_ALIGN);
+	conn6Cache = KMEM_CACHE(connNode6, SLAB_HWCACHE_ALIGN);
+	connNATCache = KMEM_CACHE(connNAT, 0);
+	if(connCache == NULL || conn6Cache == NULL || connNATCache == NULL) {
+		printk(KERN_WARNING "[fw conns] create conn cache fail.\n");
+		goto fail_cache;
+	}
+	if(conn_prealloc > 0) {
+		connPool = mempool_create_slab_pool(conn_prealloc, connCache);
+		if(connPool == NULL) {
+			printk(KERN_WARNING "[fw conns] reserve %u conns fail.\n", conn_prealloc);
+			goto fail_cache;
+		}
+	}
+	ret = register_pernet_subsys(&connNetOps);
+	if(ret != 0)
+		goto fail_pool;
+	return 0;
+fail_pool:
+	if(connPool != NULL)
+		mempool_destroy(connPool);
+	connPool = NULL;
+fail_cache:
+	kmem_cache_destroy(connNATCache); // 参数为NULL时什么也不做
+	kmem_cache_destroy(conn6Cache);
+	kmem_cache_destroy(connCache);
+	return ret;
+}
+
+/**
+ * @brief 清理连接跟踪模块的资源。
+ *        此函数在内核模块卸载时 (`mod_exit`) 、钩子注销之后被调用。
  * @return void 无返回值。
  * @功能描述:
- *   调用 `del_timer(&conn_timer)` 从内核的活动定时器列表中移除 `conn_timer`。
- *   如果定时器正在等待触发，它将被取消。如果回调函数正在运行，`del_timer` 会等待其完成。
- *   这是确保模块卸载时不会留下悬挂定时器的重要步骤。
+ *   1.  注销 `connNetOps`，由 `connNetExit` 逐个释放各命名空间的连接池。
+ *   2.  `rcu_barrier` 等待时间轮此前提交的延迟释放全部完成，之后才能销毁内存池与slab缓存。
  */
 void conn_exit(void) {
-	del_timer(&conn_timer); // 删除（停止）内核定时器
-}
\ No newline at end of file
+	unregister_pernet_subsys(&connNetOps);
+	rcu_barrier();
+	if(connPool != NULL)
+		mempool_destroy(connPool);
+	kmem_cache_destroy(connCache);
+	kmem_cache_destroy(conn6Cache);
+	kmem_cache_destroy(connNATCache);
+}
@@ -0,0 +1,125 @@
+#include "tools.h"
+#include "helper.h"
+
+// 每CPU一张拒绝缓存，共 DENY_SETS 组，每组 DENY_WAYS 个条目
+static struct denyEntry __percpu *denyTables = NULL;
+
+// 规则代数：规则集、默认动作或地址集合变化时加一，之前写入的条目随即全部失效
+static atomic_t denyGen = ATOMIC_INIT(1);
+
+/**
+ * @brief 分配每CPU的拒绝缓存
+ * @return int 成功返回0，失败返回 -ENOMEM
+ */
+int denycache_init(void) {
+    denyTables = __alloc_percpu(sizeof(struct denyEntry) * DENY_WAYS * DENY_SETS, SMP_CACHE_BYTES);
+    if(denyTables == NULL) {
+        printk(KERN_WARNING "[fw deny] alloc percpu table fail.\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放拒绝缓存
+ * @note 钩子注销之后调用，此时没有数据包在访问它
+ */
+void denycache_exit(void) {
+    free_percpu(denyTables);
+    denyTables = NULL;
+}
+
+/**
+ * @brief 取得当前的规则代数
+ * @return unsigned int 规则代数
+ * @note 须在读取默认动作与匹配规则之前调用：与 denyCacheFlush 的先改后加一配对，
+ *       读到新代数的数据包一定也看到新的规则集与默认动作
+ */
+unsigned int denyCacheGen(void) {
+    return (unsigned int)atomic_read_acquire(&denyGen);
+}
+
+/**
+ * @brief 使所有命名空间的拒绝缓存失效
+ * @note 在新规则集或默认动作生效之后调用；条目在下次被查到或换出时才真正清除
+ */
+void denyCacheFlush(void) {
+    atomic_inc_return(&denyGen);
+}
+
+// 五元组所在的组，组号取哈希的高位
+static struct denyEntry *denySet(struct denyEntry *table, const struct net *net, const struct denyKey *key) {
+    u32 h = jhash2((const u32 *)key, sizeof(*key) / sizeof(u32), net_hash_mix(net));
+    return table + (h >> (32 - DENY_SETS_SHIFT)) * DENY_WAYS;
+}
+
+/**
+ * @brief 查询五元组是否在本代规则下刚被默认动作拒绝过
+ * @param net 数据包所在的网络命名空间
+ * @param gen 数据包开始判定前取得的规则代数
+ * @param key 五元组
+ * @return bool 命中且未超过 DENY_TTL 返回true
+ * @note 同一CPU上进程上下文的出向钩子可能被软中断打断，软中断可能正在改写同一条目：
+ *       与日志环形缓冲区相同，比较前后各读一次 seq，不一致或为奇数时按未命中处理
+ */
+bool denyCacheHas(const struct net *net, unsigned int gen, const struct denyKey *key) {
+    struct denyEntry *set, *e;
+    unsigned long now = jiffies;
+    bool hit = false;
+    u32 seq;
+    int i;
+
+    set = denySet(get_cpu_ptr(denyTables), net, key);
+    for(i = 0; i < DENY_WAYS && !hit; i++) {
+        e = &set[i];
+        seq = READ_ONCE(e->seq);
+        if(seq & 1)
+            continue;
+        barrier();
+        hit = e->net == net && e->gen == gen && time_before(now, e->stamp + DENY_TTL) &&
+            memcmp(&e->key, key, sizeof(*key)) == 0;
+        barrier();
+        if(READ_ONCE(e->seq) != seq)
+            hit = false;
+    }
+    put_cpu_ptr(denyTables);
+    return hit;
+}
+
+/**
+ * @brief 记下一个被默认动作拒绝的五元组
+ * @param net 数据包所在的网络命名空间
+ * @param gen 判定前取得的规则代数，判定期间规则若已变化，该条目写入即失效
+ * @param key 五元组
+ * @note 换掉本组中空闲、已失效或最早写入的条目；同一五元组已在组中时只刷新其写入时刻
+ */
+void denyCacheAdd(const struct net *net, unsigned int gen, const struct denyKey *key) {
+    struct denyEntry *set, *e, *victim = NULL, *oldest = NULL;
+    unsigned long now = jiffies;
+    int i;
+
+    set = denySet(get_cpu_ptr(denyTables), net, key);
+    for(i = 0; i < DENY_WAYS; i++) {
+        e = &set[i];
+        if(e->net == net && memcmp(&e->key, key, sizeof(*key)) == 0) {
+            victim = e;
+            break;
+        }
+        if(e->net == NULL || e->gen != gen || time_after_eq(now, e->stamp + DENY_TTL)) {
+            if(victim == NULL)
+                victim = e;
+        } else if(oldest == NULL || time_before(e->stamp, oldest->stamp))
+            oldest = e;
+    }
+    if(victim == NULL)
+        victim = oldest;
+    WRITE_ONCE(victim->seq, victim->seq + 1);
+    barrier();
+    victim->net = net;
+    victim->gen = gen;
+    victim->stamp = now;
+    victim->key = *key;
+    barrier();
+    WRITE_ONCE(victim->seq, victim->seq + 1);
+    put_cpu_ptr(denyTables);
+}
@@ -0,0 +1,143 @@
+#include "tools.h"
+#include "helper.h"
+
+// DNAT规则哈希表：数据包路径在RCU读临界区内查找，修改由 dnatMutex 串行化
+static struct hlist_head dnatTable[1 << DNAT_HASH_BITS];
+static DEFINE_MUTEX(dnatMutex);
+static unsigned int dnatNum = 0; // 规则条数，只在持有 dnatMutex 时修改
+
+static inline u32 dnatHash(unsigned int daddr, unsigned short dport, u_int8_t proto) {
+    return jhash_3words(daddr, dport, proto, 0) & ((1 << DNAT_HASH_BITS) - 1);
+}
+
+static inline bool dnatSameKey(const struct DNATRule *a, unsigned int daddr, unsigned short dport, u_int8_t proto) {
+    return a->daddr == daddr && a->dport == dport && a->protocol == proto;
+}
+
+// 调用者持有 dnatMutex
+static struct dnatEntry *dnatFind(unsigned int daddr, unsigned short dport, u_int8_t proto) {
+    struct dnatEntry *e;
+    hlist_for_each_entry(e, &dnatTable[dnatHash(daddr, dport, proto)], node) {
+        if(dnatSameKey(&e->rule, daddr, dport, proto))
+            return e;
+    }
+    return NULL;
+}
+
+// 同键的规则只能有一条，修改后端需先删除再添加
+int addDNATRuleToTable(struct DNATRule rule) {
+    struct dnatEntry *e;
+    int ret = 0;
+    if((rule.protocol != IPPROTO_TCP && rule.protocol != IPPROTO_UDP) ||
+       rule.dport == 0 || rule.backendNum == 0 || rule.backendNum > DNAT_MAX_BACKENDS)
+        return -EINVAL;
+    e = kzalloc(sizeof(struct dnatEntry), GFP_KERNEL);
+    if(e == NULL) {
+        printk(KERN_WARNING "[fw dnat] kzalloc fail.\n");
+        return -ENOMEM;
+    }
+    e->rule = rule;
+    mutex_lock(&dnatMutex);
+    if(dnatFind(rule.daddr, rule.dport, rule.protocol) != NULL)
+        ret = -EEXIST;
+    else if(dnatNum >= DNAT_MAX_RULES)
+        ret = -ENOSPC;
+    else {
+        hlist_add_head_rcu(&e->node, &dnatTable[dnatHash(rule.daddr, rule.dport, rule.protocol)]);
+        WRITE_ONCE(dnatNum, dnatNum + 1);
+    }
+    mutex_unlock(&dnatMutex);
+    if(ret != 0)
+        kfree(e);
+    return ret;
+}
+
+// 只摘除规则，已绑定后端的连接不受影响
+int delDNATRuleFromTable(struct DNATRule rule) {
+    struct dnatEntry *e;
+    mutex_lock(&dnatMutex);
+    e = dnatFind(rule.daddr, rule.dport, rule.protocol);
+    if(e != NULL) {
+        hlist_del_rcu(&e->node);
+        WRITE_ONCE(dnatNum, dnatNum - 1);
+    }
+    mutex_unlock(&dnatMutex);
+    if(e == NULL)
+        return 0;
+    kfree_rcu(e, rcu);
+    return 1;
+}
+
+int dumpDNATRules(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct DNATRule *p;
+    struct dnatEntry *e;
+    struct nlDump d;
+    long i;
+    if(nlDumpBegin(&d, skb, cb, RSP_DNATRules) != 0)
+        return -EMSGSIZE;
+    rcu_read_lock();
+    for(; cb->args[0] < (1 << DNAT_HASH_BITS); cb->args[0]++, cb->args[1] = 0) {
+        i = 0;
+        hlist_for_each_entry_rcu(e, &dnatTable[cb->args[0]], node) {
+            if(i++ < cb->args[1])
+                continue;
+            p = nlDumpItem(&d, sizeof(struct DNATRule));
+            if(p == NULL)
+                goto out;
+            *p = e->rule;
+            cb->args[1]++;
+        }
+    }
+out:
+    rcu_read_unlock();
+    return nlDumpEnd(&d);
+}
+
+bool matchDNATRule(unsigned int dip, unsigned short dport, u_int8_t proto,
+    unsigned int sip, unsigned short sport, struct DNATBackend *backend) {
+    const struct DNATBackend *b, *best = NULL;
+    struct dnatEntry *e;
+    u32 score, bestScore = 0;
+    unsigned int i;
+    bool hit = false;
+
+    if(READ_ONCE(dnatNum) == 0)
+        return false;
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(e, &dnatTable[dnatHash(dip, dport, proto)], node) {
+        if(!dnatSameKey(&e->rule, dip, dport, proto))
+            continue;
+        // 每个后端以 (客户端, 后端) 的哈希为权重，取最大者；后端的得分与其他后端无关
+        for(i = 0; i < e->rule.backendNum; i++) {
+            b = &e->rule.backends[i];
+            score = jhash_3words(sip, ((u32)sport << 16) | b->port, b->addr, dip);
+            if(best == NULL || score > bestScore) {
+                best = b;
+                bestScore = score;
+            }
+        }
+        *backend = *best;
+        if(backend->port == 0)
+            backend->port = dport;
+        hit = true;
+        break;
+    }
+    rcu_read_unlock();
+    return hit;
+}
+
+void dnat_exit(void) {
+    struct dnatEntry *e;
+    struct hlist_node *tmp;
+    unsigned int i;
+    mutex_lock(&dnatMutex);
+    for(i = 0; i < (1 << DNAT_HASH_BITS); i++) {
+        hlist_for_each_entry_safe(e, tmp, &dnatTable[i], node) {
+            hlist_del_rcu(&e->node);
+            kfree_rcu(e, rcu);
+        }
+    }
+    WRITE_ONCE(dnatNum, 0);
+    mutex_unlock(&dnatMutex);
+    rcu_barrier();
+}
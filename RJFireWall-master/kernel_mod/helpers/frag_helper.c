@@ -0,0 +1,95 @@
+#include "tools.h"
+#include "helper.h"
+
+// 首个分片的端口记录
+struct fragEntry {
+    const struct net *net;
+    unsigned int saddr;
+    unsigned int daddr;
+    unsigned short id;
+    u_int8_t protocol;
+    u_int8_t valid;
+    unsigned short sport;
+    unsigned short dport;
+    unsigned long expires;
+};
+
+// 每组 FRAG_WAYS 个条目共用一把锁，组内没有空闲或过期的条目时不再记录，不挤掉仍有效的记录
+struct fragBucket {
+    spinlock_t lock;
+    struct fragEntry e[FRAG_WAYS];
+};
+
+static struct fragBucket fragTable[1 << FRAG_HASH_BITS];
+
+static inline struct fragBucket *fragBucketOf(const struct net *net, const struct iphdr *hdr) {
+    u32 h = jhash_3words(hdr->saddr, hdr->daddr, ((u32)hdr->id << 8) | hdr->protocol, net_hash_mix(net));
+    return &fragTable[h & ((1 << FRAG_HASH_BITS) - 1)];
+}
+
+static inline bool fragSameDatagram(const struct fragEntry *e, const struct net *net, const struct iphdr *hdr) {
+    return e->valid && e->net == net && e->saddr == hdr->saddr && e->daddr == hdr->daddr &&
+        e->id == hdr->id && e->protocol == hdr->protocol;
+}
+
+void fragRecord(const struct net *net, const struct iphdr *hdr, unsigned short sport, unsigned short dport) {
+    struct fragBucket *b = fragBucketOf(net, hdr);
+    struct fragEntry *e = NULL;
+    unsigned long now = jiffies;
+    int i;
+    spin_lock_bh(&b->lock);
+    for(i = 0; i < FRAG_WAYS; i++) {
+        if(fragSameDatagram(&b->e[i], net, hdr)) {
+            e = &b->e[i];
+            break;
+        }
+        if(e == NULL && (!b->e[i].valid || !time_before(now, b->e[i].expires)))
+            e = &b->e[i];
+    }
+    if(e != NULL) {
+        e->net = net;
+        e->saddr = hdr->saddr;
+        e->daddr = hdr->daddr;
+        e->id = hdr->id;
+        e->protocol = hdr->protocol;
+        e->sport = sport;
+        e->dport = dport;
+        e->expires = timeFromNow(FRAG_TIMEOUT);
+        e->valid = 1;
+    }
+    spin_unlock_bh(&b->lock);
+}
+
+bool fragLookup(const struct net *net, const struct iphdr *hdr, unsigned short *sport, unsigned short *dport) {
+    struct fragBucket *b = fragBucketOf(net, hdr);
+    bool hit = false;
+    int i;
+    spin_lock_bh(&b->lock);
+    for(i = 0; i < FRAG_WAYS && !hit; i++) {
+        if(fragSameDatagram(&b->e[i], net, hdr) && time_before(jiffies, b->e[i].expires)) {
+            *sport = b->e[i].sport;
+            *dport = b->e[i].dport;
+            hit = true;
+        }
+    }
+    spin_unlock_bh(&b->lock);
+    return hit;
+}
+
+void fragForgetNet(const struct net *net) {
+    unsigned int i;
+    int j;
+    for(i = 0; i < ARRAY_SIZE(fragTable); i++) {
+        spin_lock_bh(&fragTable[i].lock);
+        for(j = 0; j < FRAG_WAYS; j++)
+            if(fragTable[i].e[j].net == net)
+                fragTable[i].e[j].valid = 0;
+        spin_unlock_bh(&fragTable[i].lock);
+    }
+}
+
+void frag_init(void) {
+    unsigned int i;
+    for(i = 0; i < ARRAY_SIZE(fragTable); i++)
+        spin_lock_init(&fragTable[i].lock);
+}
@@ -0,0 +1,381 @@
+#include "tools.h"
+#include "helper.h"
+
+// 各编号的地址集合，数据包路径在RCU读临界区内只读访问；修改与事务由 ipSetMutex 串行化
+static struct ipSet __rcu *ipSets[IPSET_MAX + 1];
+static DEFINE_MUTEX(ipSetMutex);
+
+// 地址集合事务：条目先暂存，提交时与旧集合合并后一次性编译并替换
+static struct {
+    unsigned int owner;         // 开启事务的用户进程PID，0表示没有进行中的事务
+    struct IPSetHead head;
+    struct IPSetEntry *entries; // 暂存的条目 (地址已按前缀长度取整)
+    unsigned int num, cap;
+} ipSetBatch;
+
+static inline u32 ipSetMask(unsigned int plen) {
+    return plen ? ~0u << (32 - plen) : 0;
+}
+
+static int ipSetEntryCmp(const void *a, const void *b) {
+    const struct IPSetEntry *x = a, *y = b;
+    if(x->addr != y->addr)
+        return x->addr < y->addr ? -1 : 1;
+    if(x->plen != y->plen)
+        return x->plen < y->plen ? -1 : 1;
+    return 0;
+}
+
+// 排序并去重，返回剩下的条目数
+static unsigned int ipSetSortUnique(struct IPSetEntry *e, unsigned int num) {
+    unsigned int i, n = 0;
+    if(num == 0)
+        return 0;
+    sort(e, num, sizeof(struct IPSetEntry), ipSetEntryCmp, NULL);
+    for(i = 1; i < num; i++)
+        if(ipSetEntryCmp(&e[n], &e[i]) != 0)
+            e[++n] = e[i];
+    return n + 1;
+}
+
+// 合并两组有序无重复的条目：del 为假时取并集，为真时取 a 中不在 b 里的条目
+static unsigned int ipSetMerge(struct IPSetEntry *out, const struct IPSetEntry *a, unsigned int an,
+    const struct IPSetEntry *b, unsigned int bn, bool del) {
+    unsigned int i = 0, j = 0, n = 0;
+    int c;
+    while(i < an) {
+        c = j < bn ? ipSetEntryCmp(&a[i], &b[j]) : -1;
+        if(c < 0)
+            out[n++] = a[i++];
+        else if(c == 0) {
+            if(!del)
+                out[n++] = a[i];
+            i++;
+            j++;
+        } else {
+            if(!del)
+                out[n++] = b[j];
+            j++;
+        }
+    }
+    while(!del && j < bn)
+        out[n++] = b[j++];
+    return n;
+}
+
+static inline unsigned int ipSetSlot(u32 ip, unsigned int mask) {
+    return jhash_1word(ip, 0) & mask;
+}
+
+/**
+ * @brief 由有序无重复的条目编译集合
+ * @return struct ipSet* 成功返回新集合 (条目、查找表与集合头在同一块内存中)，内存不足返回NULL
+ */
+static struct ipSet *ipSetBuild(unsigned int id, unsigned int type, const struct IPSetEntry *entries, unsigned int num) {
+    struct ipSet *set;
+    struct ipSetRange *r;
+    size_t size = sizeof(struct ipSet) + (size_t)num * sizeof(struct IPSetEntry);
+    unsigned int tableSize = 0, i, slot;
+    u32 lo, hi;
+
+    if(type == IPSET_TYPE_HASH) {
+        tableSize = roundup_pow_of_two(max(num * 2, 16u)); // 装载率不超过一半，线性探测总能遇到空槽
+        size += (size_t)tableSize * sizeof(u32);
+    } else
+        size += (size_t)num * sizeof(struct ipSetRange);
+    set = kvzalloc(size, GFP_KERNEL);
+    if(set == NULL)
+        return NULL;
+    set->id = id;
+    set->type = type;
+    set->num = num;
+    set->entries = (struct IPSetEntry *)(set + 1);
+    if(num)
+        memcpy(set->entries, entries, num * sizeof(struct IPSetEntry));
+    if(type == IPSET_TYPE_HASH) {
+        set->table = (u32 *)(set->entries + num);
+        set->tableMask = tableSize - 1;
+        for(i = 0; i < num; i++) {
+            if(entries[i].addr == 0) {
+                set->hasZero = true;
+                continue;
+            }
+            for(slot = ipSetSlot(entries[i].addr, set->tableMask); set->table[slot] != 0; slot = (slot + 1) & set->tableMask);
+            set->table[slot] = entries[i].addr;
+        }
+        return set;
+    }
+    // 条目按地址升序，区间左端点随之升序，依次合并重叠或相邻的区间
+    set->ranges = (struct ipSetRange *)(set->entries + num);
+    for(i = 0; i < num; i++) {
+        lo = entries[i].addr;
+        hi = lo | ~ipSetMask(entries[i].plen);
+        if(set->rangeNum > 0) {
+            r = &set->ranges[set->rangeNum - 1];
+            if(r->hi == U32_MAX || lo <= r->hi + 1) {
+                if(hi > r->hi)
+                    r->hi = hi;
+                continue;
+            }
+        }
+        set->ranges[set->rangeNum].lo = lo;
+        set->ranges[set->rangeNum].hi = hi;
+        set->rangeNum++;
+    }
+    return set;
+}
+
+static void ipSetFreeRcu(struct rcu_head *head) {
+    kvfree(container_of(head, struct ipSet, rcu));
+}
+
+static bool ipSetContains(const struct ipSet *set, u32 ip) {
+    unsigned int slot, lo, hi, mid;
+    if(set->type == IPSET_TYPE_HASH) {
+        if(ip == 0)
+            return set->hasZero;
+        for(slot = ipSetSlot(ip, set->tableMask); set->table[slot] != 0; slot = (slot + 1) & set->tableMask)
+            if(set->table[slot] == ip)
+                return true;
+        return false;
+    }
+    // 找到最后一个左端点不大于 ip 的区间
+    lo = 0;
+    hi = set->rangeNum;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(set->ranges[mid].lo <= ip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo > 0 && ip <= set->ranges[lo - 1].hi;
+}
+
+bool ipSetHas(unsigned int id, unsigned int ip) {
+    struct ipSet *set;
+    bool ret = false;
+    if(id == 0 || id > IPSET_MAX)
+        return false;
+    rcu_read_lock();
+    set = rcu_dereference(ipSets[id]);
+    if(set != NULL)
+        ret = ipSetContains(set, ip);
+    rcu_read_unlock();
+    return ret;
+}
+
+// 丢弃暂存的条目，调用者需持有 ipSetMutex
+static void dropIPSetBatch(void) {
+    kvfree(ipSetBatch.entries);
+    memset(&ipSetBatch, 0, sizeof(ipSetBatch));
+}
+
+int beginIPSetBatch(unsigned int pid, struct IPSetHead head) {
+    if(pid == 0 || head.id == 0 || head.id > IPSET_MAX)
+        return -EINVAL;
+    if(head.mode == IPSET_MODE_REPLACE) {
+        if(head.type != IPSET_TYPE_HASH && head.type != IPSET_TYPE_NET)
+            return -EINVAL;
+    } else if(head.mode != IPSET_MODE_ADD && head.mode != IPSET_MODE_DEL)
+        return -EINVAL;
+    else if(head.type != 0 && head.type != IPSET_TYPE_HASH && head.type != IPSET_TYPE_NET)
+        return -EINVAL;
+    mutex_lock(&ipSetMutex);
+    if(ipSetBatch.owner != 0 && ipSetBatch.owner != pid)
+        printk(KERN_INFO "[fw ipset] drop uncommitted batch of pid %u.\n", ipSetBatch.owner);
+    dropIPSetBatch();
+    ipSetBatch.owner = pid;
+    ipSetBatch.head = head;
+    mutex_unlock(&ipSetMutex);
+    return 0;
+}
+
+int addIPSetBatch(unsigned int pid, const struct IPSetEntry *entries, unsigned int num) {
+    struct IPSetEntry *grown;
+    unsigned int cap, i;
+    int ret;
+    for(i = 0; i < num; i++)
+        if(entries[i].plen > 32)
+            return -EINVAL;
+    mutex_lock(&ipSetMutex);
+    if(ipSetBatch.owner == 0 || ipSetBatch.owner != pid) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if(num > IPSET_MAX_ENTRIES - ipSetBatch.num) {
+        ret = -E2BIG;
+        goto out;
+    }
+    if(ipSetBatch.num + num > ipSetBatch.cap) {
+        cap = max(ipSetBatch.cap * 2, ipSetBatch.num + num);
+        cap = min(cap, (unsigned int)IPSET_MAX_ENTRIES);
+        grown = kvmalloc_array(cap, sizeof(struct IPSetEntry), GFP_KERNEL);
+        if(grown == NULL) {
+            printk(KERN_WARNING "[fw ipset] kvmalloc fail.\n");
+            ret = -ENOMEM;
+            goto out;
+        }
+        if(ipSetBatch.num)
+            memcpy(grown, ipSetBatch.entries, ipSetBatch.num * sizeof(struct IPSetEntry));
+        kvfree(ipSetBatch.entries);
+        ipSetBatch.entries = grown;
+        ipSetBatch.cap = cap;
+    }
+    for(i = 0; i < num; i++) {
+        ipSetBatch.entries[ipSetBatch.num].addr = entries[i].addr & ipSetMask(entries[i].plen);
+        ipSetBatch.entries[ipSetBatch.num].plen = entries[i].plen;
+        ipSetBatch.num++;
+    }
+    ret = ipSetBatch.num;
+out:
+    mutex_unlock(&ipSetMutex);
+    return ret;
+}
+
+int abortIPSetBatch(unsigned int pid) {
+    int ret = -ENOENT;
+    mutex_lock(&ipSetMutex);
+    if(ipSetBatch.owner != 0 && ipSetBatch.owner == pid) {
+        dropIPSetBatch();
+        ret = 0;
+    }
+    mutex_unlock(&ipSetMutex);
+    return ret;
+}
+
+int commitIPSetBatch(unsigned int pid) {
+    struct ipSet *old, *set;
+    struct IPSetEntry *merged = NULL;
+    const struct IPSetEntry *entries;
+    unsigned int id, type, num, i;
+    int ret;
+
+    mutex_lock(&ipSetMutex);
+    if(ipSetBatch.owner == 0 || ipSetBatch.owner != pid) {
+        ret = -ENOENT;
+        goto out;
+    }
+    id = ipSetBatch.head.id;
+    type = ipSetBatch.head.type;
+    old = rcu_dereference_protected(ipSets[id], lockdep_is_held(&ipSetMutex));
+    if(ipSetBatch.head.mode != IPSET_MODE_REPLACE) {
+        if(old == NULL || (type != 0 && type != old->type)) {
+            ret = -EINVAL;
+            goto out;
+        }
+        type = old->type;
+    }
+    if(type == IPSET_TYPE_HASH) {
+        for(i = 0; i < ipSetBatch.num; i++) {
+            if(ipSetBatch.entries[i].plen != 32) {
+                ret = -EINVAL;
+                goto out;
+            }
+        }
+    }
+    ipSetBatch.num = ipSetSortUnique(ipSetBatch.entries, ipSetBatch.num); // 失败重试时再次排序结果不变
+    entries = ipSetBatch.entries;
+    num = ipSetBatch.num;
+    if(ipSetBatch.head.mode != IPSET_MODE_REPLACE) {
+        merged = kvmalloc_array(old->num + num + 1, sizeof(struct IPSetEntry), GFP_KERNEL);
+        if(merged == NULL) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        num = ipSetMerge(merged, old->entries, old->num, entries, num, ipSetBatch.head.mode == IPSET_MODE_DEL);
+        entries = merged;
+        if(num > IPSET_MAX_ENTRIES) {
+            ret = -E2BIG;
+            goto out;
+        }
+    }
+    set = ipSetBuild(id, type, entries, num);
+    if(set == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    rcu_assign_pointer(ipSets[id], set);
+    if(old != NULL)
+        call_rcu(&old->rcu, ipSetFreeRcu);
+    dropIPSetBatch();
+    denyCacheFlush();
+    purgeConnDeniedAll(); // 各命名空间中引用此集合的规则的判定结果都可能改变
+    printk(KERN_INFO "[fw ipset] set %u commit: %u entries.\n", id, num);
+    ret = num;
+out:
+    mutex_unlock(&ipSetMutex);
+    kvfree(merged);
+    return ret;
+}
+
+int destroyIPSet(unsigned int id) {
+    struct ipSet *old;
+    if(id == 0 || id > IPSET_MAX)
+        return 0;
+    mutex_lock(&ipSetMutex);
+    old = rcu_dereference_protected(ipSets[id], lockdep_is_held(&ipSetMutex));
+    RCU_INIT_POINTER(ipSets[id], NULL);
+    if(old != NULL) {
+        denyCacheFlush();
+        purgeConnDeniedAll(); // 与提交相同：引用此集合的规则此后不再匹配，已据此放行或拒绝的流须重新判定
+    }
+    mutex_unlock(&ipSetMutex);
+    if(old == NULL)
+        return 0;
+    call_rcu(&old->rcu, ipSetFreeRcu);
+    return 1;
+}
+
+int dumpIPSets(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct IPSetInfo *p;
+    struct ipSet *set;
+    struct nlDump d;
+    if(nlDumpBegin(&d, skb, cb, RSP_IPSets) != 0)
+        return -EMSGSIZE;
+    rcu_read_lock();
+    for(; cb->args[0] < IPSET_MAX; cb->args[0]++) {
+        set = rcu_dereference(ipSets[cb->args[0] + 1]);
+        if(set == NULL)
+            continue;
+        p = nlDumpItem(&d, sizeof(struct IPSetInfo));
+        if(p == NULL)
+            break;
+        p->id = set->id;
+        p->type = set->type;
+        p->num = set->num;
+    }
+    rcu_read_unlock();
+    return nlDumpEnd(&d);
+}
+
+int dumpIPSetEntries(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct APPRequest *req = (struct APPRequest *)NLMSG_DATA(cb->nlh);
+    struct IPSetEntry *p;
+    struct ipSet *set;
+    struct nlDump d;
+    if(nlDumpBegin(&d, skb, cb, RSP_IPSetEntries) != 0)
+        return -EMSGSIZE;
+    if(req->msg.num == 0 || req->msg.num > IPSET_MAX)
+        return nlDumpEnd(&d);
+    rcu_read_lock();
+    set = rcu_dereference(ipSets[req->msg.num]);
+    for(; set != NULL && cb->args[0] < set->num; cb->args[0]++) {
+        p = nlDumpItem(&d, sizeof(struct IPSetEntry));
+        if(p == NULL)
+            break;
+        *p = set->entries[cb->args[0]];
+    }
+    rcu_read_unlock();
+    return nlDumpEnd(&d);
+}
+
+void ipset_exit(void) {
+    unsigned int id;
+    mutex_lock(&ipSetMutex);
+    dropIPSetBatch();
+    mutex_unlock(&ipSetMutex);
+    for(id = 1; id <= IPSET_MAX; id++)
+        destroyIPSet(id);
+    rcu_barrier();
+}
@@ -1,232 +1,436 @@
 #include "tools.h"  // 包含自定义的工具函数头文件 (可能包含 getPort 等函数的定义)
-#include "helper.h" // 包含之前注释过的 netlink_helper.h 或类似文件，定义了 IPLog, KernelResponseHeader, RSP_IPLogs, MAX_LOG_LEN 等
+#include "helper.h" // 包含之前注释过的 netlink_helper.h 或类似文件，定义了 IPLog, logRing, KernelResponseHeader, RSP_IPLogs, MAX_LOG_LEN 等
 #include <linux/timekeeping.h> // 包含内核时间相关的头文件，用于获取当前时间戳 (ktime_get_real_ts64)
+#include <linux/percpu.h>      // 每CPU变量：每个CPU持有自己的日志环形缓冲区指针
+#include <linux/vmalloc.h>     // 环形缓冲区以 vmalloc_user 分配，可直接映射到用户空间
+#include <linux/miscdevice.h>  // 日志流设备 /dev/myfw_log
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sort.h>        // 读取时按时间戳合并各CPU的日志
+#include <linux/nsproxy.h>     // 打开日志流设备时取得打开者所在的网络命名空间
 
-// ---- 全局日志管理变量 ----
-// logHead: 指向IP日志链表的头节点。
-static struct IPLog *logHead = NULL;
-// logTail: 指向IP日志链表的尾节点。
-static struct IPLog *logTail = NULL;
-// logNum: 当前日志链表中存储的日志条目数量。
-static unsigned int logNum = 0;
-// logLock: 定义一个读写锁，用于保护对日志链表 (logHead, logTail, logNum) 的并发访问，确保线程安全。
-static DEFINE_RWLOCK(logLock); // DEFINE_RWLOCK 是内核提供的宏，用于静态初始化一个读写锁。
+// ---- 日志管理变量 ----
+// 每个网络命名空间在每个CPU上各有一个环形缓冲区。数据包路径只写本命名空间、本CPU的缓冲区，
+// 因此写日志时无需任何锁，也不会在钩子中分配内存；缓冲区写满后直接覆盖最旧的条目。
+// 缓冲区在命名空间第一次产生日志或第一次打开日志流设备时才分配，从不记日志的命名空间不占用内存。
+struct logNet {
+    struct logRing * __percpu *rings; // 各CPU的缓冲区，尚未分配时为NULL；分配后直到命名空间销毁才释放
+    struct mutex lock;                // 串行化缓冲区的分配
+    struct work_struct alloc;         // 数据包路径遇到未分配的缓冲区时，转到进程上下文分配
+};
+
+static unsigned int logNetId;
+
+static struct logNet *logNetOf(const struct net *net) {
+    return net_generic(net, logNetId);
+}
 
 /**
- * @brief rollLog 函数用于整理日志链表，当日志数量超过最大限制 (MAX_LOG_LEN) 时，
- *        从链表头部移除多余的旧日志节点，以释放空间。
- *
- * @param void 无参数。
- * @return int 返回被移除的日志节点数量。
- *
- * @功能描述:
- *   1. 打印一条调试信息，表示正在整理日志链表。
- *   2. 获取写锁 (write_lock)，因为此操作会修改链表结构和数量。
- *   3. 循环检查当前日志数量 (logNum) 是否大于最大允许长度 (MAX_LOG_LEN)。
- *      - 如果链表头指针 (logHead) 为NULL (异常情况，可能意味着链表已损坏或逻辑错误)，
- *        尝试将 logHead 和 logTail 重置，并更新 logNum。然后释放锁并返回。
- *      - 正常情况下，保存当前头节点 (logHead) 到临时指针 (tmp)。
- *      - 将头指针 (logHead) 指向下一个节点 (logHead->nx)。
- *      - 日志数量 (logNum) 减1。
- *      - 移除的节点计数 (count) 加1。
- *      - 检查尾指针 (logTail) 是否指向了刚刚被移除的节点 (tmp)。
- *        如果是（意味着链表中只有一个节点或者尾指针也指向了头部），则需要更新尾指针，
- *        使其指向新的头节点 (logHead)，并相应更新 logNum。
- *      - 使用 kfree(tmp) 释放被移除的旧日志节点的内存。
- *   4. 循环结束后，释放写锁 (write_unlock)。
- *   5. 返回本次操作移除的日志节点总数 (count)。
- */
-int rollLog(void) {
-    struct IPLog *tmp;          // 临时指针，用于指向待删除的日志节点
-    unsigned int count = 0;     // 记录本次操作删除的日志节点数量
-    printk("[fw logs] roll log chain.\n"); // 内核打印调试信息
-
-    write_lock(&logLock); // 获取写锁，防止并发修改日志链表
-    while(logNum > MAX_LOG_LEN) { // 当日志数量超过最大限制时，循环删除
-        if(logHead == NULL) { // 异常情况：链表头指针丢失 (不应发生)
-            logHead = logTail; // 尝试用尾指针恢复头指针
-            logNum = logTail==NULL ? 0 : 1; // 根据尾指针状态更新日志数量
-            write_unlock(&logLock); // 释放写锁
-            return count; // 返回已删除的数量
-        }
-        tmp = logHead;          // tmp 指向当前的头节点 (最旧的日志)
-        logHead = logHead->nx;  // 头指针后移到下一个节点
-        logNum--;               // 日志总数减一
-        count++;                // 删除计数加一
-
-        if(logTail == tmp) { // 如果尾指针也指向了刚被删除的节点 (说明原链表只有一个节点，或者删除的是最后一个节点)
-            logTail = logHead; // 那么尾指针也应该更新为新的头指针 (如果新头指针为NULL，则链表为空)
-            logNum = logTail==NULL ? 0 : 1; // 再次校准日志数量
+ * @brief 为一个命名空间分配尚未分配的各CPU缓冲区。
+ * @return int 全部分配成功返回0，否则返回-ENOMEM (已分配的部分保留，之后再补齐)。
+ * @note 进程上下文调用。vmalloc_user 分配的缓冲区按页对齐并已清零，所有槽位的 seq 为0，
+ *       与任何已写完的序号 (2*pos+2 >= 2) 都不相等，读者不会误读空槽位。
+ */
+static int logAllocRings(struct logNet *ln) {
+    struct logRing *ring;
+    int cpu, ret = 0;
+    mutex_lock(&ln->lock);
+    for_each_possible_cpu(cpu) {
+        if(*per_cpu_ptr(ln->rings, cpu) != NULL)
+            continue;
+        ring = vmalloc_user(LOG_RING_BYTES);
+        if(ring == NULL) {
+            printk(KERN_WARNING "[fw logs] vmalloc log ring fail.\n");
+            ret = -ENOMEM;
+            break;
         }
-        kfree(tmp); // 释放旧头节点的内存
+        smp_store_release(per_cpu_ptr(ln->rings, cpu), ring); // 清零完成后才让写者看到
+    }
+    mutex_unlock(&ln->lock);
+    return ret;
+}
+
+static void logAllocWork(struct work_struct *work) {
+    logAllocRings(container_of(work, struct logNet, alloc));
+}
+
+#ifndef FW_BENCH // 基准测试模块没有日志流设备
+/**
+ * @brief logOpen / logRelease 在打开日志流设备时记下打开者所在的网络命名空间。
+ *
+ * @功能描述: 文件持有该命名空间的引用，之后的映射都取这个命名空间的缓冲区；
+ *           进程打开设备后再切换命名空间，看到的仍是打开时的日志。
+ */
+static int logOpen(struct inode *inode, struct file *filp) {
+    struct net *net = get_net(current->nsproxy->net_ns);
+    if(logAllocRings(logNetOf(net)) != 0) { // 打开后即可映射每个CPU的缓冲区
+        put_net(net);
+        return -ENOMEM;
     }
-    write_unlock(&logLock); // 释放写锁
-    return count; // 返回总共删除的日志条数
+    filp->private_data = net;
+    return 0;
+}
+
+static int logRelease(struct inode *inode, struct file *filp) {
+    put_net(filp->private_data);
+    return 0;
 }
 
 /**
- * @brief addLog 函数用于向日志链表的尾部添加一条新的IP日志记录。
+ * @brief logMmap 函数将某个CPU的日志环形缓冲区只读映射到用户空间。
  *
- * @param log 要添加的 IPLog 结构体 (通过值传递，函数内部会为其分配内存并复制内容)。
- * @return int 成功添加返回1，内存分配失败返回0。
+ * @param filp 打开的日志流设备文件，private_data 为打开者所在的网络命名空间。
+ * @param vma 用户空间的映射区域，偏移 (vm_pgoff) 为 cpu * LOG_RING_BYTES 对应的页号。
+ * @return int 成功返回0；偏移或长度不合法返回-EINVAL，CPU不存在返回-ENXIO，请求写权限返回-EPERM。
  *
  * @功能描述:
- *   1. 使用 kzalloc 为新的日志条目 (struct IPLog) 分配内核内存。GFP_KERNEL 表示常规内存分配，可能会睡眠。
- *   2. 如果内存分配失败，打印警告信息并返回0。
- *   3. 使用 memcpy 将传入的 log 结构体的内容复制到新分配的内存中。
- *   4. 将新日志节点的 nx (下一个节点) 指针设置为 NULL，因为它将成为新的尾节点。
- *   5. 获取写锁 (write_lock) 以保护对日志链表的修改。
- *   6. 检查日志链表是否为空 (logTail == NULL)。
- *      - 如果为空，则新节点既是头节点也是尾节点。更新 logHead, logTail 和 logNum。
- *      - 释放写锁并返回1。
- *   7. 如果链表不为空，则将当前尾节点 (logTail) 的 nx 指针指向新节点。
- *   8. 更新尾指针 (logTail) 为新节点。
- *   9. 日志数量 (logNum) 加1。
- *   10. 释放写锁 (write_unlock)。
- *   11. 检查添加新日志后，日志总数 (logNum) 是否超过了最大限制 (MAX_LOG_LEN)。
- *       - 如果超过，则调用 rollLog() 函数移除旧的日志。
- *   12. 返回1表示添加成功。
- */
-int addLog(struct IPLog log) {
-    struct IPLog *newLog; // 指向新分配的日志节点的指针
-
-    // 为新的日志条目分配内存并清零
-    // kzalloc = kmalloc + memset(0)
-    // GFP_KERNEL 表示在内核上下文中分配，可能会睡眠
-    newLog = (struct IPLog *) kzalloc(sizeof(struct IPLog), GFP_KERNEL);
-    if(newLog == NULL) { // 检查内存分配是否成功
-        printk(KERN_WARNING "[fw logs] kzalloc fail.\n"); // 分配失败，打印警告
-        return 0; // 返回0表示失败
+ *   1. 由映射偏移计算出CPU编号，要求偏移恰好落在某个缓冲区的起始处，且映射长度等于 LOG_RING_BYTES。
+ *   2. 只允许只读映射，并清除 VM_MAYWRITE 防止之后经 mprotect 改为可写：
+ *      写者与 formAllIPLogs 都依赖 head 与槽位序号，用户空间只能读取，消费位置由用户空间自行维护。
+ *   3. 调用 remap_vmalloc_range 建立映射。映射区域持有设备文件，文件又持有命名空间，
+ *      映射存在期间缓冲区不会被释放，模块也无法卸载。
+ */
+static int logMmap(struct file *filp, struct vm_area_struct *vma) {
+    struct logNet *ln = logNetOf(filp->private_data);
+    unsigned long pages = LOG_RING_BYTES >> PAGE_SHIFT;
+    unsigned long cpu;
+    if(vma->vm_pgoff % pages != 0 || vma->vm_end - vma->vm_start != LOG_RING_BYTES)
+        return -EINVAL;
+    cpu = vma->vm_pgoff / pages;
+    if(cpu >= nr_cpu_ids || !cpu_possible(cpu) || READ_ONCE(*per_cpu_ptr(ln->rings, cpu)) == NULL)
+        return -ENXIO;
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, *per_cpu_ptr(ln->rings, cpu), 0);
+}
+
+static const struct file_operations logDevOps = {
+    .owner = THIS_MODULE,
+    .open = logOpen,
+    .release = logRelease,
+    .mmap = logMmap,
+};
+
+// 日志流设备：用户空间打开 /dev/myfw_log 后逐CPU映射环形缓冲区，轮询 head 即可持续读取日志，
+// 每条日志无需任何系统调用。
+static struct miscdevice logDev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = LOG_DEV_NAME,
+    .fops = &logDevOps,
+    .mode = 0400,
+};
+#endif
+
+/**
+ * @brief logNetInit 函数为新的网络命名空间准备各CPU缓冲区的指针，缓冲区本身延后分配。
+ * @return int 成功返回0，内存不足返回-ENOMEM。
+ */
+static int __net_init logNetInit(struct net *net) {
+    struct logNet *ln = logNetOf(net);
+    ln->rings = alloc_percpu(struct logRing *); // 已清零，即全部未分配
+    if(ln->rings == NULL) {
+        printk(KERN_WARNING "[fw logs] alloc percpu ring pointers fail.\n");
+        return -ENOMEM;
     }
-    memcpy(newLog, &log, sizeof(struct IPLog)); // 将传入的log数据复制到新分配的内存中
-    newLog->nx = NULL; // 新节点是尾节点，所以其next指针为NULL
-
-    // 将新日志添加到日志链表的尾部
-    write_lock(&logLock); // 获取写锁
-    if(logTail == NULL) { // 如果日志链表当前为空
-        logTail = newLog;   // 新节点既是头也是尾
-        logHead = logTail;
-        logNum = 1;         // 日志数量为1
-        write_unlock(&logLock); // 释放写锁
-        //printk("[fw logs] add a log at head.\n"); // 调试打印 (已注释)
-        return 1; // 返回1表示成功
+    mutex_init(&ln->lock);
+    INIT_WORK(&ln->alloc, logAllocWork);
+    return 0;
+}
+
+/**
+ * @brief logNetExit 函数释放命名空间在各CPU上的缓冲区。
+ * @note 过滤钩子先于此注销，不会再有写者访问缓冲区或排入分配任务。
+ */
+static void __net_exit logNetExit(struct net *net) {
+    struct logNet *ln = logNetOf(net);
+    int cpu;
+    cancel_work_sync(&ln->alloc);
+    for_each_possible_cpu(cpu)
+        vfree(*per_cpu_ptr(ln->rings, cpu)); // vfree(NULL) 是安全的
+    free_percpu(ln->rings);
+}
+
+static struct pernet_operations logNetOps = {
+    .init = logNetInit,
+    .exit = logNetExit,
+    .id = &logNetId,
+    .size = sizeof(struct logNet),
+};
+
+/**
+ * @brief log_init 函数为每个网络命名空间分配日志环形缓冲区，并注册日志流设备。
+ *
+ * @return int 成功返回0，缓冲区分配失败返回-ENOMEM，设备注册失败返回 misc_register 的错误码
+ *             (失败时已分配的缓冲区会被释放)。
+ * @note 基准测试模块 (FW_BENCH) 只建立缓冲区，设备名已被 myfw 占用，不再注册。
+ */
+int log_init(void) {
+    int ret = register_pernet_subsys(&logNetOps);
+    if(ret != 0)
+        return ret;
+#ifndef FW_BENCH
+    ret = misc_register(&logDev);
+    if(ret != 0) {
+        printk(KERN_WARNING "[fw logs] register log device fail.\n");
+        unregister_pernet_subsys(&logNetOps);
+        return ret;
     }
-    // 如果链表不为空，将新节点链接到当前尾节点的后面
-    logTail->nx = newLog;
-    logTail = newLog; // 更新尾指针为新节点
-    logNum++;         // 日志数量加一
-    write_unlock(&logLock); // 释放写锁
-    //printk("[fw logs] add a log.\n"); // 调试打印 (已注释)
-
-    if(logNum > MAX_LOG_LEN) { // 如果日志数量超过了最大限制
-        rollLog(); // 调用rollLog来移除旧的日志
+#endif
+    return 0;
+}
+
+/**
+ * @brief log_exit 函数注销日志流设备并释放所有命名空间的日志环形缓冲区。
+ *
+ * @功能描述: 在钩子注销之后调用，此时不会再有写者访问缓冲区；仍有映射时模块不会被卸载。
+ */
+void log_exit(void) {
+#ifndef FW_BENCH
+    misc_deregister(&logDev);
+#endif
+    unregister_pernet_subsys(&logNetOps);
+}
+
+/**
+ * @brief addLogStamped 函数将一条IP日志写入当前CPU的环形缓冲区。
+ *
+ * @param net 日志所属的网络命名空间。
+ * @param log 要添加的 IPLog 结构体 (通过值传递)。
+ * @param stamp 日志的纳秒级时间戳，读取时据此合并各CPU的日志。
+ * @return int 返回1表示添加成功，本CPU的缓冲区尚未分配时返回0。
+ *
+ * @功能描述:
+ *   1. 关闭本CPU的软中断 (local_bh_disable)：POST_ROUTING 钩子可能在进程上下文中运行，
+ *      关闭软中断后同一CPU上不会有第二个写者插入，写者也不会被迁移到其他CPU。
+ *   2. 取得本CPU的缓冲区，以 head 计算写入槽位 (head & (LOG_RING_SIZE-1))。缓冲区满时自然覆盖最旧的条目。
+ *      缓冲区尚未分配时丢弃这条日志，并排入分配任务，分配完成后的日志照常写入。
+ *   3. 先将槽位 seq 置为奇数 2*pos+1 表示正在写入，写入内存屏障后复制日志内容，
+ *      再次写屏障后将 seq 置为 2*pos+2 表示写入完成，最后推进 head。
+ *   4. 恢复软中断。
+ */
+static int addLogStamped(struct net *net, struct IPLog log, u64 stamp) {
+    struct logRing *ring;
+    struct logSlot *slot;
+    unsigned long pos;
+
+    local_bh_disable();
+    ring = READ_ONCE(*this_cpu_ptr(logNetOf(net)->rings));
+    if(unlikely(ring == NULL)) {
+        schedule_work(&logNetOf(net)->alloc);
+        local_bh_enable();
+        return 0;
     }
-    return 1; // 返回1表示成功
+    pos = ring->head;
+    slot = &ring->slot[pos & (LOG_RING_SIZE - 1)];
+    WRITE_ONCE(slot->seq, 2 * pos + 1); // 标记写入中，读者看到奇数序号即放弃该槽位
+    smp_wmb();
+    slot->stamp = stamp;
+    slot->log = log;
+    slot->log.nx = NULL;
+    smp_wmb();
+    WRITE_ONCE(slot->seq, 2 * pos + 2); // 写入完成
+    WRITE_ONCE(ring->head, pos + 1);
+    local_bh_enable();
+    return 1;
 }
 
 /**
- * @brief addLogBySKB 函数根据网络数据包 (sk_buff) 和指定的处理动作 (action) 创建一条IP日志，并将其添加到日志链表中。
+ * @brief addLog 函数向当前CPU的日志环形缓冲区添加一条IP日志记录。
+ *
+ * @param log 要添加的IPLog结构体。
+ * @return int 返回1表示添加成功。
  *
+ * @功能描述: 以 log.tm (秒) 换算出的时间戳写入，供没有更精确时间的调用者使用。
+ */
+int addLog(struct net *net, struct IPLog log) {
+    return addLogStamped(net, log, (u64)log.tm * NSEC_PER_SEC);
+}
+
+/**
+ * @brief addLogBySKB 函数根据网络数据包 (sk_buff) 和指定的处理动作 (action) 创建一条IP日志，并将其写入日志环形缓冲区。
+ *
+ * @param net 数据包所在的网络命名空间，日志写入该命名空间的缓冲区。
  * @param action 对该数据包采取的处理动作 (例如 NF_ACCEPT, NF_DROP)。
  * @param skb 指向网络数据包的套接字缓冲区 (struct sk_buff) 的指针。
- * @return int 调用 addLog 的返回值 (成功为1，失败为0)。
+ * @return int 返回1表示添加成功。
  *
  * @功能描述:
  *   1. 声明一个 IPLog 结构体变量 log。
- *   2. 获取当前时间戳 (秒级精度) 并存入 log.tm。
+ *   2. 获取当前时间戳，秒级部分存入 log.tm，纳秒级时间戳用于读取时合并排序。
  *      - 使用 ktime_get_real_ts64(&now) 获取高精度时间。
  *   3. 从 skb 中获取IP头部指针。
  *   4. 调用 getPort (自定义函数) 从 skb 和IP头部中提取源端口和目的端口。
- *   5. 从IP头部中提取源IP地址、目的IP地址、数据包负载长度 (总长度 - IP头长度) 和协议类型，
+ *   5. 从IP头部中提取源IP地址、目的IP地址、数据包负载长度 (skb长度 - IP头长度) 和协议类型，
  *      进行必要的字节序转换 (ntohl, ntohs) 后存入 log 结构体的相应字段。
  *   6. 将传入的 action 存入 log.action。
- *   7. 将 log.nx 设置为 NULL (因为 addLog 函数会处理链表链接)。
- *   8. 调用 addLog(log) 函数将这条新创建的日志添加到全局日志链表中。
- *   9. 返回 addLog 的结果。
+ *   7. 调用 addLogStamped 将日志写入当前CPU的环形缓冲区，全程不分配内存、不加锁。
  */
-int addLogBySKB(unsigned int action, struct sk_buff *skb) {
+int addLogBySKB(struct net *net, unsigned int action, struct sk_buff *skb) {
     struct IPLog log;               // 临时日志结构体，用于填充信息
     unsigned short sport,dport;     // 用于存储源端口和目的端口
 	struct iphdr *header;           // 指向IP头部的指针
     struct timespec64 now;          // 用于获取高精度时间戳
 
     ktime_get_real_ts64(&now);      // 获取当前的真实时间 (自Epoch以来的秒数和纳秒数)
+    memset(&log, 0, sizeof(log));   // 日志会映射给用户空间，未用到的字段 (如IPv6地址) 须清零
     log.tm = now.tv_sec;            // 将秒数存入日志的时间戳字段
+    log.family = AF_INET;
 
     header = ip_hdr(skb);           // 从skb获取IP头部
-	getPort(skb, header, &sport, &dport); // 调用工具函数获取源、目的端口 (需要处理TCP/UDP等)
+	getPort(net, skb, header, &sport, &dport); // 调用工具函数获取源、目的端口 (需要处理TCP/UDP等)
 
     log.saddr = ntohl(header->saddr); // 获取源IP地址并转换为主机字节序
     log.daddr = ntohl(header->daddr); // 获取目的IP地址并转换为主机字节序
     log.sport = sport;                // 存储源端口 (已是主机字节序，如果getPort返回的是网络字节序则需转换)
     log.dport = dport;                // 存储目的端口 (同上)
-    // 计算IP数据包的负载长度：IP总长度 (header->tot_len) - IP头部长度 (header->ihl * 4)
-    // header->tot_len 是网络字节序，需要用 ntohs 转换
-    // header->ihl 是以4字节为单位的IP头部长度
-    log.len = ntohs(header->tot_len) - (header->ihl * 4);
+    // 计算IP数据包的负载长度：数据包长度 - IP头部长度 (header->ihl * 4)
+    // 不使用 header->tot_len：GRO聚合包的 tot_len 可能不等于聚合后的长度 (BIG TCP 时为0)
+    log.len = skb->len - skb_network_offset(skb) - (header->ihl * 4);
     log.protocol = header->protocol;  // 获取协议类型 (如 TCP, UDP, ICMP)
     log.action = action;              // 存储对该数据包采取的动作
-    log.nx = NULL;                    // 下一个日志指针初始化为NULL (addLog会处理)
+    log.nx = NULL;
 
-    return addLog(log); // 调用addLog将填充好的日志结构体添加到链表
+    return addLogStamped(net, log, timespec64_to_ns(&now));
+}
+
+/**
+ * @brief addLogBySKB 的IPv6版本。
+ *
+ * @param thoff 传输层头部的偏移，用于从负载长度中扣除扩展头。
+ * @param proto/sport/dport 调用者已由 getPort6 解析出的上层协议与端口，这里不再重复解析扩展头。
+ * @return int 返回1表示添加成功。
+ */
+int addLogBySKB6(struct net *net, unsigned int action, struct sk_buff *skb, int thoff, u_int8_t proto, unsigned short sport, unsigned short dport) {
+    struct IPLog log;
+    struct ipv6hdr *header = ipv6_hdr(skb);
+    struct timespec64 now;
+
+    ktime_get_real_ts64(&now);
+    memset(&log, 0, sizeof(log));
+    log.tm = now.tv_sec;
+    log.family = AF_INET6;
+    memcpy(log.saddr6, &header->saddr, sizeof(log.saddr6));
+    memcpy(log.daddr6, &header->daddr, sizeof(log.daddr6));
+    log.sport = sport;
+    log.dport = dport;
+    log.len = max_t(int, (int)sizeof(struct ipv6hdr) + ntohs(header->payload_len) - thoff, 0); // 上层负载长度 (巨型帧记为0)
+    log.protocol = proto;
+    log.action = action;
+    return addLogStamped(net, log, timespec64_to_ns(&now));
+}
+
+/**
+ * @brief 从一个CPU的环形缓冲区中复制出所有完整的日志条目。
+ * @param ring 要读取的环形缓冲区
+ * @param out 输出数组，至少可容纳 LOG_RING_SIZE 个槽位
+ * @return unsigned int 复制出的有效条目数量
+ * @note 读者不加锁，与写者并发进行。复制前后序号不一致的槽位 (复制期间被覆盖) 会被丢弃。
+ */
+static unsigned int snapshotLogRing(struct logRing *ring, struct logSlot *out) {
+    unsigned long head, pos, seq;
+    struct logSlot *slot;
+    unsigned int n = 0;
+
+    head = READ_ONCE(ring->head);
+    smp_rmb();
+    for(pos = head > LOG_RING_SIZE ? head - LOG_RING_SIZE : 0; pos < head; pos++) {
+        slot = &ring->slot[pos & (LOG_RING_SIZE - 1)];
+        seq = READ_ONCE(slot->seq);
+        if(seq != 2 * pos + 2) // 正在写入或已被更新的日志覆盖
+            continue;
+        smp_rmb();
+        out[n].stamp = slot->stamp;
+        out[n].log = slot->log;
+        smp_rmb();
+        if(READ_ONCE(slot->seq) != seq) // 复制期间被覆盖，内容可能是撕裂的
+            continue;
+        out[n].seq = seq;
+        n++;
+    }
+    return n;
+}
+
+// 按时间戳升序比较两条日志
+static int cmpLogSlot(const void *a, const void *b) {
+    const struct logSlot *x = a, *y = b;
+    if(x->stamp < y->stamp)
+        return -1;
+    return x->stamp > y->stamp;
+}
+
+/**
+ * @brief 合并一个命名空间在所有CPU上的日志环形缓冲区，得到按时间升序排列的快照
+ * @param net 网络命名空间
+ * @param count [out] 快照中的日志条数
+ * @return struct logSlot* 快照数组 (调用者以 kvfree 释放)，内存不足返回NULL
+ * @note 进程上下文调用
+ */
+static struct logSlot *collectLogs(struct net *net, unsigned int *count) {
+    struct logNet *ln = logNetOf(net);
+    struct logSlot *all;
+    struct logRing *ring;
+    int cpu;
+    all = kvmalloc_array(num_possible_cpus(), sizeof(struct logSlot) * LOG_RING_SIZE, GFP_KERNEL);
+    if(all == NULL) {
+        printk(KERN_WARNING "[fw logs] collect logs kvmalloc fail.\n");
+        return NULL;
+    }
+    *count = 0;
+    for_each_possible_cpu(cpu) {
+        ring = READ_ONCE(*per_cpu_ptr(ln->rings, cpu));
+        if(ring != NULL)
+            *count += snapshotLogRing(ring, all + *count);
+    }
+    sort(all, *count, sizeof(struct logSlot), cmpLogSlot, NULL);
+    return all;
 }
 
 /**
- * @brief formAllIPLogs 函数用于从全局日志链表中提取指定数量的最新日志，
+ * @brief formAllIPLogs 函数合并所有CPU的日志环形缓冲区，提取指定数量的最新日志，
  *        并将它们打包成一个包含 KernelResponseHeader 的内存块，通常用于通过Netlink发送给用户空间。
  *
- * @param num 用户空间请求获取的日志条目数量。如果为0或大于实际日志数，则获取所有日志。
+ * @param net 请求者所在的网络命名空间。
+ * @param num 用户空间请求获取的日志条目数量。如果为0或大于实际日志数，则获取所有日志 (至多 MAX_LOG_LEN 条)。
  * @param len [输出参数] 指向一个unsigned int的指针，函数会通过它返回最终构建的数据包的总长度 (字节数)。
- * @return void* 指向构建好的数据包内存块的指针。如果内存分配失败或无日志，则返回NULL。
+ * @return void* 指向构建好的数据包内存块的指针。如果内存分配失败，则返回NULL。
  *
  * @功能描述:
- *   1. 声明必要的指针和计数器。
- *   2. 获取读锁 (read_lock)，因为此操作仅读取日志链表。
- *   3. 遍历整个日志链表一次，计算当前日志的总数量 (count)。
- *   4. 打印调试信息，显示日志总数和请求数量。
- *   5. 根据请求数量 (num) 和实际日志数量 (count) 确定实际要发送的日志数量 (num)。
- *      - 如果 num 为0 (表示获取所有) 或 num 大于 count，则将 num 设置为 count。
- *   6. 计算所需内存的总大小：KernelResponseHeader 的大小 + (IPLog 结构体的大小 * 实际发送的日志数量 num)。
- *      将此大小存入输出参数 *len。
- *   7. 使用 kzalloc 分配计算得到的内存大小。GFP_ATOMIC 表示在原子上下文中分配，不能睡眠 (通常用于中断处理或持有锁时)。
- *      这里使用 GFP_ATOMIC 可能因为持有读锁，但如果日志量很大，kzalloc 可能会有性能影响。
- *      如果是在普通进程上下文且可以睡眠，GFP_KERNEL 更合适。
- *   8. 如果内存分配失败，打印警告，释放读锁，并返回NULL。
- *   9. 构建回包：
- *      - 将分配的内存块的起始地址转换为 KernelResponseHeader 指针 (head)。
- *      - 设置 head->bodyTp 为 RSP_IPLogs (表示消息体是IP日志数组)。
- *      - 设置 head->arrayLen 为实际发送的日志数量 (num)。
- *      - p 指针指向 KernelResponseHeader 之后的数据区域，即IPLog数组的起始位置。
- *   10. 再次遍历日志链表 (从 logHead 开始)。
- *       - 为了只获取最新的 num 条日志，使用一个技巧：先让 count 减去 num。
- *       - 在遍历时，如果 count 大于0，则跳过当前日志并递减 count (这会跳过 (总数-num) 条最旧的日志)。
- *       - 当 count 小于等于0时，开始将当前日志节点 (now) 的内容通过 memcpy 复制到 p 指向的内存位置。
- *       - p 指针向后移动一个 IPLog 结构体的大小，为下一个日志条目做准备。
- *   11. 复制完成后，释放读锁 (read_unlock)。
- *   12. 返回指向构建好的数据包内存块 (mem) 的指针。
- */
-void* formAllIPLogs(unsigned int num, unsigned int *len) {
+ *   1. 调用 collectLogs 逐个CPU无锁复制完整的日志条目，并按纳秒级时间戳排序，
+ *      使不同CPU上的日志按发生顺序交织在一起。
+ *   4. 根据请求数量 (num) 确定实际要发送的日志数量，取时间最新的 num 条。
+ *   5. 分配回包内存，填写 KernelResponseHeader (bodyTp = RSP_IPLogs, arrayLen = num)，
+ *      随后按时间从旧到新复制日志。
+ *   6. 释放临时数组并返回回包内存。
+ */
+void* formAllIPLogs(struct net *net, unsigned int num, unsigned int *len) {
     struct KernelResponseHeader *head; // 指向响应头部的指针
-    struct IPLog *now;                 // 用于遍历日志链表的指针
-    void *mem,*p;                      // mem: 指向分配的总内存块, p: 用于在内存块中移动的指针
-    unsigned int count;                // 记录日志链表中的实际日志总数
+    struct logSlot *all;               // 所有CPU日志的临时合并数组
+    struct IPLog *p;                   // 回包中IPLog数组的写入位置
+    void *mem;                         // 指向分配的总内存块
+    unsigned int count, i;             // count: 合并后的日志总数
 
-    read_lock(&logLock); // 获取读锁，因为我们只读取日志数据
-    // 第一次遍历：计算日志链表中的日志总数
-    for(now=logHead, count=0; now!=NULL; now=now->nx, count++);
+    all = collectLogs(net, &count);
+    if(all == NULL)
+        return NULL;
     printk("[fw logs] form logs count=%d, need num=%d.\n", count, num); // 打印日志总数和请求数
 
     // 确定实际要发送的日志数量
-    if(num == 0 || num > count) // 如果请求0条或请求数大于实际数，则发送所有日志
+    if(num == 0 || num > MAX_LOG_LEN)
+        num = MAX_LOG_LEN;
+    if(num > count)
         num = count;
 
     // 计算需要分配的总内存大小 = 头部大小 + (单个日志大小 * 日志数量)
     *len = sizeof(struct KernelResponseHeader) + sizeof(struct IPLog) * num;
-    // 分配内存，GFP_ATOMIC用于原子上下文，不能睡眠 (持有锁时常用)
-    mem = kzalloc(*len, GFP_ATOMIC);
+    mem = kzalloc(*len, GFP_KERNEL);
     if(mem == NULL) { // 检查内存分配是否成功
         printk(KERN_WARNING "[fw logs] formAllIPLogs kzalloc fail.\n");
-        read_unlock(&logLock); // 释放锁
+        kvfree(all);
         return NULL; // 返回NULL表示失败
     }
 
@@ -235,20 +439,75 @@ void* formAllIPLogs(unsigned int num, unsigned int *len) {
     head->bodyTp = RSP_IPLogs;                 // 设置响应体类型为IP日志
     head->arrayLen = num;                      // 设置数组长度 (即日志条数)
 
-    // p指向头部之后的数据区，即IPLog数组的开始位置
-    p = (mem + sizeof(struct KernelResponseHeader));
+    // 排序后最新的 num 条位于数组末尾，按时间从旧到新复制
+    p = (struct IPLog *)(mem + sizeof(struct KernelResponseHeader));
+    for(i = count - num; i < count; i++)
+        *p++ = all[i].log;
+    kvfree(all);
+    return mem; // 返回构建好的内存块指针
+}
 
-    // 第二次遍历：复制日志数据到内存块
-    // 为了获取最新的 num 条日志，我们从头开始遍历，但跳过前面的 (count - num) 条旧日志
-    for(now=logHead; now!=NULL; now=now->nx) {
-        if(count > num) { // 如果当前总日志数 (count) 大于要发送的日志数 (num)
-            count--;      // 表示这条日志是旧的，跳过它
-            continue;
-        }
-        // 当 count <= num 时，开始复制日志
-        memcpy(p, now, sizeof(struct IPLog)); // 将当前日志节点数据复制到p指向的内存
-        p = p + sizeof(struct IPLog);         // p后移，准备下一个日志的位置
+/**
+ * @brief 日志分段导出的状态：开始导出时取得的快照及下一条待发送的位置
+ */
+struct logDump {
+    struct logSlot *all;
+    unsigned int count;
+    unsigned int pos;
+};
+
+/**
+ * @brief dumpIPLogsStart 函数在分段导出开始时合并各CPU的日志。
+ *
+ * @param cb 导出上下文，状态保存在 args[0]。
+ * @return int 成功返回0，内存不足返回-ENOMEM。
+ *
+ * @功能描述: 请求中的 num 为0时导出快照中的全部日志，不受 MAX_LOG_LEN 限制；否则只导出最新的 num 条。
+ */
+int dumpIPLogsStart(struct netlink_callback *cb) {
+    struct APPRequest *req = (struct APPRequest *)NLMSG_DATA(cb->nlh);
+    struct logDump *st;
+    st = kzalloc(sizeof(struct logDump), GFP_KERNEL);
+    if(st == NULL)
+        return -ENOMEM;
+    st->all = collectLogs(sock_net(cb->skb->sk), &st->count);
+    if(st->all == NULL) {
+        kfree(st);
+        return -ENOMEM;
     }
-    read_unlock(&logLock); // 释放读锁
-    return mem; // 返回构建好的内存块指针
-}
\ No newline at end of file
+    if(req->msg.num != 0 && req->msg.num < st->count)
+        st->pos = st->count - req->msg.num;
+    cb->args[0] = (long)st;
+    return 0;
+}
+
+/**
+ * @brief dumpIPLogs 函数按时间从旧到新发送一段日志。
+ * @return int 本段有日志时返回skb长度，发送完毕返回0。
+ */
+int dumpIPLogs(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct logDump *st = (struct logDump *)cb->args[0];
+    struct IPLog *p;
+    struct nlDump d;
+    if(nlDumpBegin(&d, skb, cb, RSP_IPLogs) != 0)
+        return -EMSGSIZE;
+    for(; st->pos < st->count; st->pos++) {
+        p = nlDumpItem(&d, sizeof(struct IPLog));
+        if(p == NULL)
+            break;
+        *p = st->all[st->pos].log;
+    }
+    return nlDumpEnd(&d);
+}
+
+/**
+ * @brief dumpIPLogsDone 函数释放导出使用的日志快照。
+ */
+int dumpIPLogsDone(struct netlink_callback *cb) {
+    struct logDump *st = (struct logDump *)cb->args[0];
+    if(st != NULL) {
+        kvfree(st->all);
+        kfree(st);
+    }
+    return 0;
+}
@@ -1,62 +1,289 @@
 #include "tools.h"
 #include "helper.h"
 
-static struct NATRecord *natRuleHead = NULL;
-static DEFINE_RWLOCK(natRuleLock);
+// NAT规则链以RCU方式发布：数据包路径在RCU读临界区内无锁遍历，
+// 修改由 natRuleMutex 串行化，被摘除的规则在最后一个引用释放并经过宽限期后才回收
+static struct NATRecord __rcu *natRuleHead = NULL;
+static DEFINE_MUTEX(natRuleMutex);
+
+#define natRuleNext(r) rcu_dereference((r)->nx)
+
+#define natPoolOf(r) container_of(r, struct natPortPool, rule)
+
+static void natPoolFree(struct natPortPool *pool) {
+    kvfree(pool->users);
+    kvfree(pool->bitmap);
+    free_percpu(pool->hits);
+    kfree(pool);
+}
+
+static void natPoolFreeRcu(struct rcu_head *head) {
+    natPoolFree(container_of(head, struct natPortPool, rcu));
+}
+
+// 最后一个引用释放时回收规则及其端口池。数据包路径可能刚由 matchNATRule 取得规则指针，
+// 因此延迟到RCU宽限期之后释放；期间 getNewNATPort 无法再取得引用，不会分配到端口。
+static void natPoolRelease(struct kref *ref) {
+    call_rcu(&container_of(ref, struct natPortPool, ref)->rcu, natPoolFreeRcu);
+}
+
+static void natRulePut(struct NATRecord *rule) {
+    kref_put(&natPoolOf(rule)->ref, natPoolRelease);
+}
+
+// 创建规则及其端口池，端口范围为 rule.sport ~ rule.dport (不含端口0)
+static struct NATRecord *natRuleAlloc(struct NATRecord rule) {
+    struct natPortPool *pool;
+    unsigned int minPort = rule.sport ? rule.sport : 1;
+    pool = (struct natPortPool *) kzalloc(sizeof(struct natPortPool), GFP_KERNEL);
+    if(pool == NULL)
+        return NULL;
+    pool->rule = rule;
+    kref_init(&pool->ref);
+    spin_lock_init(&pool->lock);
+    pool->minPort = minPort;
+    pool->size = (rule.dport >= minPort) ? rule.dport - minPort + 1 : 0;
+    pool->hits = alloc_percpu(struct ruleCounter);
+    if(pool->hits == NULL) {
+        natPoolFree(pool);
+        return NULL;
+    }
+    if(pool->size > 0) {
+        pool->users = kvcalloc(pool->size, sizeof(unsigned int), GFP_KERNEL);
+        pool->bitmap = kvcalloc(BITS_TO_LONGS(pool->size), sizeof(unsigned long), GFP_KERNEL);
+        if(pool->users == NULL || pool->bitmap == NULL) {
+            natPoolFree(pool);
+            return NULL;
+        }
+    }
+    return &pool->rule;
+}
+
+// 当前发布的源前缀树，规则链为空时为NULL；只在持有 natRuleMutex 时替换
+static struct natIndex __rcu *natIdx = NULL;
+
+static inline unsigned int natPrefixMask(unsigned int plen) {
+    return plen ? ~0u << (32 - plen) : 0;
+}
+
+// 第 i 位 (从最高位数起，i<32)
+static inline unsigned int natBit(unsigned int ip, unsigned int i) {
+    return (ip >> (31 - i)) & 1;
+}
+
+// 掩码高位连续的1的个数。不连续的掩码按此取前缀，查找时仍以 isIPMatch 复核
+static unsigned int natMaskLen(unsigned int mask) {
+    unsigned int plen = 0;
+    while(plen < 32 && (mask & (0x80000000u >> plen)))
+        plen++;
+    return plen;
+}
+
+static int natTrieNew(struct natIndex *idx, unsigned int key, unsigned int plen) {
+    struct natTrieNode *node = &idx->nodes[idx->nodeNum];
+    node->key = key;
+    node->plen = plen;
+    node->child[0] = node->child[1] = -1;
+    node->ruleStart = 0;
+    node->ruleNum = 0;
+    return idx->nodeNum++;
+}
+
+// 插入前缀 key/plen，返回代表它的节点下标；每次最多新增两个节点
+static int natTrieInsert(struct natIndex *idx, unsigned int key, unsigned int plen) {
+    int *slot = &idx->root, cur, n, leaf;
+    struct natTrieNode *node;
+    unsigned int diff, common;
+    for(;;) {
+        if(*slot < 0)
+            return *slot = natTrieNew(idx, key, plen);
+        cur = *slot;
+        node = &idx->nodes[cur];
+        diff = key ^ node->key;
+        common = diff ? 32 - fls(diff) : 32;
+        common = min_t(unsigned int, common, min_t(unsigned int, plen, node->plen));
+        if(common == node->plen) {
+            if(plen == node->plen)
+                return cur;
+            slot = &node->child[natBit(key, node->plen)]; // 节点数组预先分配，slot 始终有效
+            continue;
+        }
+        if(common == plen) { // 新前缀是 node 的祖先
+            n = natTrieNew(idx, key, plen);
+            idx->nodes[n].child[natBit(node->key, plen)] = cur;
+            *slot = n;
+            return n;
+        }
+        // 二者在第 common 位分叉，插入一个不带规则的分叉节点
+        n = natTrieNew(idx, key & natPrefixMask(common), common);
+        leaf = natTrieNew(idx, key, plen);
+        idx->nodes[n].child[natBit(key, common)] = leaf;
+        idx->nodes[n].child[natBit(node->key, common)] = cur;
+        *slot = n;
+        return leaf;
+    }
+}
+
+/**
+ * @brief 由规则链构建源前缀树
+ * @param head 规则链首
+ * @param skip 不收录的规则 (即将删除的规则)，可为NULL
+ * @return struct natIndex* 规则链为空时返回NULL，内存不足时返回 ERR_PTR(-ENOMEM)
+ */
+static struct natIndex *natIndexBuild(struct NATRecord *head, struct NATRecord *skip) {
+    struct natIndex *idx;
+    struct NATRecord *now;
+    unsigned int num = 0, i, acc;
+    int *owner;
+    for(now = head; now != NULL; now = now->nx)
+        num += (now != skip);
+    if(num == 0)
+        return NULL;
+    idx = kvmalloc(sizeof(struct natIndex) + num * 2 * sizeof(struct natTrieNode) +
+        num * sizeof(struct NATRecord *), GFP_KERNEL);
+    owner = kvmalloc_array(num, sizeof(int), GFP_KERNEL);
+    if(idx == NULL || owner == NULL) {
+        kvfree(idx);
+        kvfree(owner);
+        return ERR_PTR(-ENOMEM);
+    }
+    idx->root = -1;
+    idx->nodeNum = 0;
+    idx->ruleNum = num;
+    idx->nodes = (struct natTrieNode *)(idx + 1);
+    idx->rules = (struct NATRecord **)(idx->nodes + num * 2);
+    for(now = head, i = 0; now != NULL; now = now->nx) {
+        if(now == skip)
+            continue;
+        owner[i] = natTrieInsert(idx, now->saddr & natPrefixMask(natMaskLen(now->smask)), natMaskLen(now->smask));
+        idx->nodes[owner[i++]].ruleNum++;
+    }
+    for(i = 0, acc = 0; i < idx->nodeNum; i++) {
+        idx->nodes[i].ruleStart = acc;
+        acc += idx->nodes[i].ruleNum;
+        idx->nodes[i].ruleNum = 0;
+    }
+    // 按链表顺序放入各自节点，前缀相同的规则保持链表中的先后
+    for(now = head, i = 0; now != NULL; now = now->nx) {
+        if(now == skip)
+            continue;
+        idx->rules[idx->nodes[owner[i]].ruleStart + idx->nodes[owner[i]].ruleNum++] = now;
+        i++;
+    }
+    kvfree(owner);
+    return idx;
+}
+
+static void natIndexFreeRcu(struct rcu_head *head) {
+    kvfree(container_of(head, struct natIndex, rcu));
+}
+
+// 发布新的源前缀树，旧树在宽限期后释放。调用者持有 natRuleMutex
+static void natIndexSwap(struct natIndex *idx) {
+    struct natIndex *old = rcu_dereference_protected(natIdx, lockdep_is_held(&natRuleMutex));
+    rcu_assign_pointer(natIdx, idx);
+    if(old != NULL)
+        call_rcu(&old->rcu, natIndexFreeRcu);
+}
+
+/**
+ * @brief 在源前缀树中查找规则
+ * @param natIP 非0时只接受转换后地址为 natIP 且端口池包含 port 的规则
+ * @return struct NATRecord* 源前缀最长的可用规则，没有则返回NULL
+ * @note 沿 sip 下降时记下带规则的节点 (前缀长度严格递增，至多33个)，再由深到浅检查
+ */
+static inline struct NATRecord *natIndexLookup(const struct natIndex *idx, unsigned int sip, unsigned int dip,
+    unsigned int natIP, unsigned short port) {
+    const struct natTrieNode *hit[33], *node;
+    struct NATRecord *r;
+    int n = idx->root, depth = 0;
+    unsigned int i;
+    while(n >= 0) {
+        node = &idx->nodes[n];
+        if((sip ^ node->key) & natPrefixMask(node->plen))
+            break;
+        if(node->ruleNum)
+            hit[depth++] = node;
+        if(node->plen == 32)
+            break;
+        n = node->child[natBit(sip, node->plen)];
+    }
+    while(depth-- > 0) {
+        node = hit[depth];
+        for(i = 0; i < node->ruleNum; i++) {
+            r = idx->rules[node->ruleStart + i];
+            if(!isIPMatch(sip, r->saddr, r->smask) ||
+               isIPMatch(dip, r->saddr, r->smask) || dip == r->daddr)
+                continue;
+            if(natIP != 0 && (r->daddr != natIP ||
+               (unsigned int)(port - natPoolOf(r)->minPort) >= natPoolOf(r)->size))
+                continue;
+            return r;
+        }
+    }
+    return NULL;
+}
 
 // 首部新增一条NAT规则
 struct NATRecord * addNATRuleToChain(struct NATRecord rule) {
     struct NATRecord *newRule;
-    newRule = (struct NATRecord *) kzalloc(sizeof(struct NATRecord), GFP_KERNEL);
+    struct natIndex *idx;
+    newRule = natRuleAlloc(rule);
     if(newRule == NULL) {
-        printk(KERN_WARNING "[fw nat] kzalloc fail.\n");
+        printk(KERN_WARNING "[fw nat] alloc rule fail.\n");
         return NULL;
     }
-    memcpy(newRule, &rule, sizeof(struct NATRecord));
-    // 新增规则至规则链表
-    write_lock(&natRuleLock);
-    if(natRuleHead == NULL) {
-        natRuleHead = newRule;
-        natRuleHead->nx = NULL;
-        write_unlock(&natRuleLock);
-        return newRule;
-    }
-    newRule->nx = natRuleHead;
-    natRuleHead = newRule;
-    write_unlock(&natRuleLock);
+    mutex_lock(&natRuleMutex);
+    newRule->nx = rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex));
+    idx = natIndexBuild(newRule, NULL); // 新规则尚未发布，先按加入后的链构建索引
+    if(IS_ERR(idx)) {
+        mutex_unlock(&natRuleMutex);
+        printk(KERN_WARNING "[fw nat] build index fail.\n");
+        natRulePut(newRule);
+        return NULL;
+    }
+    // 新增规则至规则链表首部：先连好后继再发布，读者看到的总是完整的链
+    rcu_assign_pointer(natRuleHead, newRule);
+    natIndexSwap(idx);
+    mutex_unlock(&natRuleMutex);
     return newRule;
 }
 
 // 删除序号为num的NAT规则
 int delNATRuleFromChain(int num) {
-    struct NATRecord *now,*tmp;
+    struct NATRecord *tmp = NULL, **pp;
+    struct natIndex *idx = NULL;
     struct IPRule iprule;
-    int count = 0;
-    write_lock(&natRuleLock);
-    if(num == 0) {
-        tmp = natRuleHead;
-        natRuleHead = natRuleHead->nx;
-        kfree(tmp);
-        write_unlock(&natRuleLock);
-        return 1;
-    }
-    for(now=natRuleHead,count=1;now!=NULL && now->nx!=NULL;now=now->nx,count++) {
-        if(count == num) { // 删除规则
-            tmp = now->nx;
-            now->nx = now->nx->nx;
-            iprule.saddr = tmp->saddr; // 消除连接池影响
-            iprule.smask = tmp->smask;
-            iprule.dmask = 0;
-            iprule.sport = 0xFFFFu;
-            iprule.dport = 0xFFFFu;
-            eraseConnRelated(iprule);
-            kfree(tmp);
-            write_unlock(&natRuleLock);
-            return 1;
+    int count;
+    mutex_lock(&natRuleMutex);
+    for(pp=(struct NATRecord **)&natRuleHead,count=0;*pp!=NULL;pp=&(*pp)->nx,count++) {
+        if(count == num) {
+            tmp = *pp;
+            break;
+        }
+    }
+    if(tmp != NULL) {
+        idx = natIndexBuild(rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex)), tmp);
+        if(IS_ERR(idx)) { // 索引仍引用该规则，不能删除
+            mutex_unlock(&natRuleMutex);
+            printk(KERN_WARNING "[fw nat] build index fail.\n");
+            return 0;
         }
+        // 删除规则：只摘链，正在遍历它的读者仍能经 tmp->nx 继续走下去
+        rcu_assign_pointer(*pp, tmp->nx);
+        natIndexSwap(idx);
     }
-    write_unlock(&natRuleLock);
-    return 0;
+    mutex_unlock(&natRuleMutex);
+    if(tmp == NULL)
+        return 0;
+    memset(&iprule, 0, sizeof(iprule)); // 消除连接池影响
+    iprule.saddr = tmp->saddr;
+    iprule.smask = tmp->smask;
+    iprule.sport = 0xFFFFu;
+    iprule.dport = 0xFFFFu;
+    purgeConnRelated(&init_net, iprule); // NAT只在初始命名空间生效
+    natRulePut(tmp); // 仍占用端口的连接持有各自的引用；索引已不再引用它
+    return 1;
 }
 
 // 将所有NAT规则形成Netlink回包
@@ -65,39 +292,248 @@ void* formAllNATRules(unsigned int *len) {
     struct NATRecord *now;
     void *mem,*p;
     unsigned int count;
-    read_lock(&natRuleLock);
-    for(now=natRuleHead,count=0;now!=NULL;now=now->nx,count++);
+    mutex_lock(&natRuleMutex); // 只读，但要保证计数与复制之间链表不变
+    for(now=rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex)),count=0;now!=NULL;now=now->nx,count++);
     *len = sizeof(struct KernelResponseHeader) + sizeof(struct NATRecord)*count;
-    mem = kzalloc(*len, GFP_ATOMIC);
+    mem = kzalloc(*len, GFP_KERNEL);
     if(mem == NULL) {
         printk(KERN_WARNING "[fw nat] kzalloc fail.\n");
-        read_unlock(&natRuleLock);
+        mutex_unlock(&natRuleMutex);
         return NULL;
     }
     head = (struct KernelResponseHeader *)mem;
     head->bodyTp = RSP_NATRules;
     head->arrayLen = count;
-    for(now=natRuleHead,p=(mem + sizeof(struct KernelResponseHeader));now!=NULL;now=now->nx,p=p+sizeof(struct NATRecord))
+    for(now=rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex)),p=(mem + sizeof(struct KernelResponseHeader));now!=NULL;now=now->nx,p=p+sizeof(struct NATRecord))
         memcpy(p, now, sizeof(struct NATRecord));
-    read_unlock(&natRuleLock);
+    mutex_unlock(&natRuleMutex);
     return mem;
 }
 
+/**
+ * @brief 分段导出NAT规则链
+ * @param skb 本次填充的skb
+ * @param cb 导出上下文，args[0] 为下一条待导出规则的序号
+ * @return int 本段有规则时返回skb长度，已导出完毕返回0
+ */
+int dumpNATRules(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct NATRecord *now, *p;
+    struct nlDump d;
+    long i;
+    if(nlDumpBegin(&d, skb, cb, RSP_NATRules) != 0)
+        return -EMSGSIZE;
+    rcu_read_lock();
+    for(now=rcu_dereference(natRuleHead),i=0;now!=NULL && i<cb->args[0];now=natRuleNext(now),i++);
+    for(;now!=NULL;now=natRuleNext(now)) {
+        p = nlDumpItem(&d, sizeof(struct NATRecord));
+        if(p == NULL)
+            break;
+        *p = *now;
+        p->nx = NULL;
+        cb->args[0]++;
+    }
+    rcu_read_unlock();
+    return nlDumpEnd(&d);
+}
+
+/**
+ * @brief 查找匹配的SNAT规则
+ * @return struct NATRecord* 命中返回规则指针，否则返回NULL
+ * @note 调用者需处于RCU读临界区内，且只能在退出临界区前使用返回的规则；
+ *       需要更长时间持有规则时 (如分配到的端口) 由 getNewNATPort 取得引用
+ */
 struct NATRecord *matchNATRule(unsigned int sip, unsigned int dip, int *isMatch) {
+    struct natIndex *idx = rcu_dereference(natIdx);
     struct NATRecord *now;
     *isMatch = 0;
-    read_lock(&natRuleLock);
-	for(now=natRuleHead;now!=NULL;now=now->nx) {
-		if(isIPMatch(sip, now->saddr, now->smask) &&
-           !isIPMatch(dip, now->saddr, now->smask) &&
-           dip != now->daddr) {
-            read_unlock(&natRuleLock);
-            *isMatch = 1;
-			return now;
-		}
-	}
-	read_unlock(&natRuleLock);
-    return NULL;
+    if(idx == NULL)
+        return NULL;
+    now = natIndexLookup(idx, sip, dip, 0, 0);
+    *isMatch = (now != NULL);
+    return now;
+}
+
+/**
+ * @brief 累加一次NAT规则命中
+ * @note 数据包路径调用，this_cpu 操作本身即可防止抢占导致的计数丢失
+ */
+void natRuleCountHit(struct NATRecord *rule, unsigned int packets, unsigned int bytes) {
+    struct natPortPool *pool = natPoolOf(rule);
+    this_cpu_add(pool->hits->packets, packets);
+    this_cpu_add(pool->hits->bytes, bytes);
+}
+
+/**
+ * @brief 汇总各NAT规则的命中计数
+ * @param num [out] 规则条数
+ * @return struct RuleStat* 成功返回计数数组(需要调用者以kvfree释放)，失败返回NULL
+ */
+struct RuleStat *formNATRuleStats(unsigned int *num) {
+    struct NATRecord *now;
+    struct natPortPool *pool;
+    struct RuleStat *stats;
+    unsigned int count, i;
+    int cpu;
+    mutex_lock(&natRuleMutex); // 保证计数与汇总之间链表不变
+    for(now=rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex)),count=0;now!=NULL;now=now->nx,count++);
+    stats = kvcalloc(max(count, 1u), sizeof(struct RuleStat), GFP_KERNEL);
+    if(stats == NULL) {
+        printk(KERN_WARNING "[fw nat] kvcalloc fail.\n");
+        mutex_unlock(&natRuleMutex);
+        return NULL;
+    }
+    for(now=rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex)),i=0;now!=NULL;now=now->nx,i++) {
+        pool = natPoolOf(now);
+        stats[i].index = i;
+        for_each_possible_cpu(cpu) {
+            stats[i].packets += READ_ONCE(per_cpu_ptr(pool->hits, cpu)->packets);
+            stats[i].bytes += READ_ONCE(per_cpu_ptr(pool->hits, cpu)->bytes);
+        }
+    }
+    mutex_unlock(&natRuleMutex);
+    *num = count;
+    return stats;
+}
+
+/**
+ * @brief 释放NAT规则链
+ * @note 模块卸载时在 conn_exit 之后调用，此时连接已归还全部端口
+ */
+void nat_exit(void) {
+    struct NATRecord *head, *tmp;
+    mutex_lock(&natRuleMutex);
+    head = rcu_dereference_protected(natRuleHead, lockdep_is_held(&natRuleMutex));
+    RCU_INIT_POINTER(natRuleHead, NULL);
+    natIndexSwap(NULL);
+    mutex_unlock(&natRuleMutex);
+    while(head != NULL) {
+        tmp = head;
+        head = tmp->nx;
+        natRulePut(tmp);
+    }
+    rcu_barrier(); // 等待延迟释放完成后模块才能卸载
+}
+
+// 端口对该目的端点是否已被占用：SNAT后的返回流量由反向连接识别
+static bool natPortTaken(struct NATRecord *rule, unsigned int dip, unsigned short dport, unsigned short port) {
+    return findConn(&init_net, dip, rule->daddr, dport, port) != NULL;
+}
+
+// 占用池中第idx个端口，调用者持有pool->lock；规则已被删除时返回0
+static unsigned short natPoolTake(struct natPortPool *pool, unsigned int idx) {
+    if(!kref_get_unless_zero(&pool->ref))
+        return 0;
+    if(pool->users[idx]++ == 0) {
+        __set_bit(idx, pool->bitmap);
+        pool->used++;
+    }
+    pool->cursor = (idx + 1 < pool->size) ? idx + 1 : 0;
+    return pool->minPort + idx;
+}
+
+/**
+ * @brief 为SNAT分配端口
+ * @param rule 匹配到的NAT规则
+ * @param dip 目的IP地址
+ * @param dport 目的端口
+ * @return unsigned short 分配到的端口，端口耗尽返回0
+ * @note 先从位图中 `cursor` 之后找未被占用的端口，通常只需一次查找即可；
+ *       池已占满时退化为逐个端口探测反向连接，复用对该目的端点空闲的端口
+ */
+unsigned short getNewNATPort(struct NATRecord *rule, unsigned int dip, unsigned short dport) {
+    struct natPortPool *pool = natPoolOf(rule);
+    unsigned int i, idx, tries;
+    unsigned short port = 0;
+
+    if(pool->size == 0)
+        return 0;
+    spin_lock_bh(&pool->lock);
+    for(tries = 0; tries < NAT_PORT_TRIES && pool->used < pool->size; tries++) {
+        idx = find_next_zero_bit(pool->bitmap, pool->size, pool->cursor);
+        if(idx >= pool->size)
+            idx = find_first_zero_bit(pool->bitmap, pool->size);
+        if(!natPortTaken(rule, dip, dport, pool->minPort + idx)) {
+            port = natPoolTake(pool, idx);
+            goto out;
+        }
+        // 位图未记录，但残留的反向连接仍在使用，跳过
+        pool->cursor = (idx + 1 < pool->size) ? idx + 1 : 0;
+    }
+    for(i = 0; i < pool->size; i++) {
+        idx = (pool->cursor + i) % pool->size;
+        if(pool->users[idx] == UINT_MAX)
+            continue;
+        if(!natPortTaken(rule, dip, dport, pool->minPort + idx)) {
+            port = natPoolTake(pool, idx);
+            break;
+        }
+    }
+out:
+    spin_unlock_bh(&pool->lock);
+    return port;
+}
+
+/**
+ * @brief 为导入的SNAT连接重新占用其原先的端口
+ * @param sip 连接的源IP地址
+ * @param dip 连接的目的IP地址
+ * @param sport 连接的源端口
+ * @param dport 连接的目的端口
+ * @param natIP 转换后的源IP地址
+ * @param port 转换后的源端口
+ * @return struct NATRecord* 占用成功返回分配该端口的规则 (已取得引用，由 setConnSNAT 接管)，
+ *         没有匹配的规则、端口不在其范围内，或该端口已被 getNewNATPort 分给通往同一目的端点的其他连接时返回NULL
+ * @note 与 getNewNATPort 不同，端口已被占用时仍然计入：导入前后是同一条连接。
+ *       反向连接存在但转换回的不是本连接的源端点时，说明端口已分给了别的连接
+ */
+struct NATRecord *natClaimPort(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport,
+        unsigned int natIP, unsigned short port) {
+    struct NATRecord *now, *ret = NULL;
+    struct NATRecord back;
+    struct natIndex *index;
+    struct natPortPool *pool;
+    struct connNode *rev;
+    unsigned int idx;
+    bool busy;
+
+    if(natIP == 0)
+        return NULL;
+    rcu_read_lock();
+    index = rcu_dereference(natIdx);
+    now = index ? natIndexLookup(index, sip, dip, natIP, port) : NULL; // 与 matchNATRule 相同的优先级
+    if(now != NULL) {
+        pool = natPoolOf(now);
+        idx = port - pool->minPort;
+        spin_lock_bh(&pool->lock);
+        rev = findConn(&init_net, dip, natIP, dport, port); // 与 getNewNATPort 一样在池锁内探测反向连接
+        busy = rev != NULL && (getConnNAT(rev, &back) != NAT_TYPE_DEST || back.daddr != sip || back.dport != sport);
+        if(!busy && pool->users[idx] != UINT_MAX && natPoolTake(pool, idx) != 0)
+            ret = now;
+        spin_unlock_bh(&pool->lock);
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+/**
+ * @brief 归还SNAT端口
+ * @param rule 分配该端口的NAT规则
+ * @param port 要归还的端口
+ * @note 可在软中断上下文调用，释放的是 getNewNATPort 成功时取得的引用
+ */
+void putNATPort(struct NATRecord *rule, unsigned short port) {
+    struct natPortPool *pool = natPoolOf(rule);
+    unsigned int idx = port - pool->minPort;
+
+    if(idx < pool->size) {
+        spin_lock_bh(&pool->lock);
+        if(pool->users[idx] > 0 && --pool->users[idx] == 0) {
+            __clear_bit(idx, pool->bitmap);
+            pool->used--;
+        }
+        spin_unlock_bh(&pool->lock);
+    }
+    natRulePut(rule);
 }
 
 struct NATRecord genNATRecord(unsigned int preIP, unsigned int afterIP, unsigned short prePort, unsigned short afterPort) {
@@ -1,18 +1,34 @@
 #include "helper.h" // 包含头文件 "helper.h"，可能定义了此文件中使用的某些结构或函数
 
-// 定义一个静态的套接字指针 nlsk，用于 Netlink 通信。初始化为 NULL。
-static struct sock *nlsk = NULL;
+// 每个网络命名空间各有一个内核 Netlink 套接字，请求在哪个命名空间收到，就在哪个命名空间回复。
+// 连接超时事件可能在套接字释放之后产生，因此套接字指针受RCU保护，已释放时为NULL。
+struct nlNet {
+	struct sock __rcu *sk;
+};
+
+static unsigned int nlNetId;
+
+// 注销命名空间操作时各命名空间的 nlNet 随即释放，而连接超时事件此时可能仍在产生，
+// 因此注销前先清除此标志并等待RCU宽限期，之后的事件不再访问 nlNet。
+// 未调用 netlink_init 时 (例如基准测试模块) 始终为false，事件路径视为无人监听。
+static bool nlReady = false;
+
+static inline struct nlNet *nlNetOf(struct net *net) {
+	return net_generic(net, nlNetId);
+}
 
 /**
  * @brief nlSend 函数用于通过 Netlink 向用户空间进程发送数据。
  *
+ * @param net 目标进程所在的网络命名空间。
  * @param pid 目标用户空间进程的ID。
+ * @param seq 所回复请求的序列号。
  * @param data 指向要发送数据的指针。
  * @param len 要发送数据的长度。
  * @return int 发送成功则返回0或正数，失败则返回负数错误码。
  *
  * @功能描述:
- *   1. 分配一个新的 Netlink 消息缓冲区 (sk_buff)。
+ *   1. 分配一个新的 Netlink 消息缓冲区 (sk_buff)。命名空间的套接字已释放时返回 -1。
  *   2. 如果分配失败，则打印警告信息并返回 -1。
  *   3. 使用 nlmsg_put 构建 Netlink 消息头。
  *   4. 将要发送的数据 (data) 拷贝到 Netlink 消息的数据部分。
@@ -21,10 +37,11 @@ static struct sock *nlsk = NULL;
  *   7. 打印发送信息，包括目标PID、数据长度和发送结果。
  *   8. 返回 netlink_unicast 的结果。
  */
-int nlSend(unsigned int pid, void *data, unsigned int len) {
+int nlSend(struct net *net, unsigned int pid, unsigned int seq, void *data, unsigned int len) {
 	int retval; // 用于存储函数返回值
 	struct nlmsghdr *nlh; // 指向 Netlink 消息头的指针
 	struct sk_buff *skb; // 指向套接字缓冲区的指针
+	struct sock *sk;
 
 	// 初始化 sk_buff
 	// nlmsg_new: 分配一个新的 Netlink 消息，参数 len 是数据负载的长度，GFP_ATOMIC 表示在原子上下文中分配内存，不能睡眠。
@@ -37,11 +54,11 @@ int nlSend(unsigned int pid, void *data, unsigned int len) {
 	// nlmsg_put: 向 sk_buff 中添加一个 Netlink 消息头。
 	// skb: 套接字缓冲区。
 	// 0: 发送进程的PID (内核通常为0)。
-	// 0: 序列号。
+	// seq: 序列号，与请求相同，同一套接字上有多个未完成的请求时据此区分回复。
 	// 0: 消息类型 (这里未使用特定类型)。
 	// NLMSG_SPACE(len) - NLMSG_HDRLEN: 数据负载的长度。NLMSG_SPACE(len) 计算包含头部的总长度。
 	// 0: 消息标志。
-	nlh = nlmsg_put(skb, 0, 0, 0, NLMSG_SPACE(len) - NLMSG_HDRLEN, 0);
+	nlh = nlmsg_put(skb, 0, seq, 0, NLMSG_SPACE(len) - NLMSG_HDRLEN, 0);
 
 	// 发送数据
 	// NLMSG_DATA(nlh): 获取 Netlink 消息数据部分的指针。
@@ -52,11 +69,19 @@ int nlSend(unsigned int pid, void *data, unsigned int len) {
 	NETLINK_CB(skb).dst_group = 0; // 设置目标组为0，表示这是一个单播消息，而不是多播到某个组。
 
 	// netlink_unicast: 将 Netlink 消息单播到指定的用户空间进程。
-	// nlsk: Netlink 套接字。
+	// sk: 所在命名空间的 Netlink 套接字。
 	// skb: 要发送的套接字缓冲区。
 	// pid: 目标用户空间进程的PID。
 	// MSG_DONTWAIT: 非阻塞发送。
-	retval = netlink_unicast(nlsk, skb, pid, MSG_DONTWAIT);
+	rcu_read_lock();
+	sk = rcu_dereference(nlNetOf(net)->sk);
+	if(sk != NULL)
+		retval = netlink_unicast(sk, skb, pid, MSG_DONTWAIT);
+	else {
+		kfree_skb(skb);
+		retval = -1;
+	}
+	rcu_read_unlock();
 
 	// 打印发送日志信息
 	// nlh->nlmsg_len - NLMSG_SPACE(0): 计算实际发送的数据负载长度。NLMSG_SPACE(0) 实际上是 NLMSG_HDRLEN。
@@ -66,37 +91,134 @@ int nlSend(unsigned int pid, void *data, unsigned int len) {
 }
 
 /**
- * @brief nlRecv 函数是 Netlink 套接字接收到消息时的回调函数。
+ * @brief nlHasListeners 函数判断指定多播组当前是否有用户空间监听者。
  *
- * @param skb 指向接收到的套接字缓冲区 (struct sk_buff) 的指针。
+ * @param net 网络命名空间。
+ * @param group 多播组编号 (FW_GROUP_*)。
+ * @return int 有监听者返回非0，套接字尚未创建、已释放或无人监听返回0。
+ */
+int nlHasListeners(struct net *net, unsigned int group) {
+	struct sock *sk;
+	int ret;
+
+	rcu_read_lock();
+	sk = READ_ONCE(nlReady) ? rcu_dereference(nlNetOf(net)->sk) : NULL;
+	ret = sk != NULL && netlink_has_listeners(sk, group);
+	rcu_read_unlock();
+	return ret;
+}
+
+/**
+ * @brief nlSendEvent 函数向命名空间内的多播组推送一个事件。
+ *
+ * @param net 事件所属的网络命名空间。
+ * @param group 多播组编号 (FW_GROUP_*)。
+ * @param ev 指向要推送的事件。
  * @return void 无返回值。
  *
  * @功能描述:
- *   1. 从 skb 中获取 Netlink 消息头 (nlh)。
- *   2. 校验接收到的 Netlink 数据包的合法性 (长度是否足够)。
- *   3. 如果数据包非法，则打印警告信息并返回。
- *   4. 从消息头中提取数据负载 (data)、发送方PID (pid) 和数据长度 (len)。
- *   5. 校验数据长度是否至少为一个 APPRequest 结构的大小。
- *   6. 如果数据长度不足，则打印警告信息并返回。
- *   7. 打印接收到的数据信息。
- *   8. 调用 dealAppMessage 函数处理来自用户空间应用的消息。
+ *   1. 无监听者时直接返回，调用方通常已先用 nlHasListeners 跳过事件的构造。
+ *   2. 以 GFP_ATOMIC 分配消息，消息体为 KernelResponseHeader (bodyTp = RSP_Event, arrayLen = 1) 加事件本身，
+ *      与请求应答使用相同的格式。
+ *   3. 调用 nlmsg_multicast 发送给组内所有监听者。监听者接收缓冲区满时事件被丢弃，
+ *      不会阻塞数据包路径，也不逐条打印日志。
  */
-void nlRecv(struct sk_buff *skb) {
-	void *data; // 指向接收到的数据的指针
-	struct nlmsghdr *nlh = NULL; // 指向 Netlink 消息头的指针
-	unsigned int pid,len; // 用于存储发送方PID和数据长度
+void nlSendEvent(struct net *net, unsigned int group, struct FwEvent *ev) {
+	struct KernelResponseHeader *head;
+	struct nlmsghdr *nlh;
+	struct sk_buff *skb;
+	struct sock *sk;
+	unsigned int len = sizeof(struct KernelResponseHeader) + sizeof(struct FwEvent);
+
+	if(!nlHasListeners(net, group))
+		return;
+	skb = nlmsg_new(len, GFP_ATOMIC);
+	if(skb == NULL)
+		return;
+	nlh = nlmsg_put(skb, 0, 0, 0, NLMSG_SPACE(len) - NLMSG_HDRLEN, 0);
+	head = (struct KernelResponseHeader *)NLMSG_DATA(nlh);
+	head->bodyTp = RSP_Event;
+	head->arrayLen = 1;
+	memcpy(NLMSG_DATA(nlh) + sizeof(struct KernelResponseHeader), ev, sizeof(struct FwEvent));
+	NETLINK_CB(skb).dst_group = group;
+	rcu_read_lock();
+	sk = READ_ONCE(nlReady) ? rcu_dereference(nlNetOf(net)->sk) : NULL;
+	if(sk != NULL)
+		nlmsg_multicast(sk, skb, 0, group, GFP_ATOMIC);
+	else
+		kfree_skb(skb);
+	rcu_read_unlock();
+}
+
+/**
+ * @brief nlDumpStart 函数在请求所在命名空间的内核Netlink套接字上启动一次分段导出。
+ *
+ * @param skb 用户空间的请求。
+ * @param nlh 请求的消息头。
+ * @param control 导出回调，调用后即可释放。
+ * @return int netlink_dump_start 的返回值 (部分内核版本成功时返回 -EINTR)。
+ */
+int nlDumpStart(struct sk_buff *skb, struct nlmsghdr *nlh, struct netlink_dump_control *control) {
+	control->module = THIS_MODULE;
+	// 正在处理该命名空间的请求，套接字不会在此期间释放
+	return netlink_dump_start(rcu_dereference_protected(nlNetOf(sock_net(skb->sk))->sk, 1), skb, nlh, control);
+}
 
-    // 检查 skb
-    // nlmsg_hdr(skb): 从 skb 中获取 Netlink 消息头。
-    nlh = nlmsg_hdr(skb);
-	// 校验数据包长度是否合法
-	// nlh->nlmsg_len: Netlink 消息头中记录的总长度 (包括头部和数据)。
-	// NLMSG_HDRLEN: Netlink 消息头的标准长度。
-	// skb->len: 套接字缓冲区中实际接收到的数据总长度。
-	if ((nlh->nlmsg_len < NLMSG_HDRLEN) || (skb->len < nlh->nlmsg_len)) {
-		printk(KERN_WARNING "[fw netlink] Illegal netlink packet!\n"); // 非法数据包，打印警告
-		return; // 直接返回，不处理
+/**
+ * @brief nlDumpBegin 函数在导出skb中开始一段 NLM_F_MULTI 消息。
+ *
+ * @param d [输出参数] 本段的状态。
+ * @param skb 导出回调提供的skb。
+ * @param cb 导出回调的上下文，用于取得请求方的端口号与序列号。
+ * @param bodyTp 本段的响应类型。
+ * @return int 成功返回0，skb放不下消息头返回 -EMSGSIZE。
+ */
+int nlDumpBegin(struct nlDump *d, struct sk_buff *skb, struct netlink_callback *cb, unsigned int bodyTp) {
+	d->skb = skb;
+	d->nlh = nlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, 0,
+		sizeof(struct KernelResponseHeader), NLM_F_MULTI);
+	if(d->nlh == NULL)
+		return -EMSGSIZE;
+	d->head = (struct KernelResponseHeader *)NLMSG_DATA(d->nlh);
+	d->head->bodyTp = bodyTp;
+	d->head->arrayLen = 0;
+	return 0;
+}
+
+/**
+ * @brief nlDumpItem 函数在本段末尾追加一个条目。
+ *
+ * @param d 本段的状态。
+ * @param size 条目大小。
+ * @return void* 条目的写入位置，skb剩余空间不足时返回NULL。
+ */
+void *nlDumpItem(struct nlDump *d, unsigned int size) {
+	if(skb_tailroom(d->skb) < (int)size)
+		return NULL;
+	d->head->arrayLen++;
+	return skb_put(d->skb, size);
+}
+
+/**
+ * @brief nlDumpEnd 函数结束本段消息。
+ *
+ * @param d 本段的状态。
+ * @return int 本段有条目时返回skb长度，netlink会在用户空间读走后再次调用导出回调；
+ *             本段为空说明已导出完毕，撤销本段并返回0，netlink随后发送 NLMSG_DONE。
+ */
+int nlDumpEnd(struct nlDump *d) {
+	if(d->head->arrayLen == 0) {
+		nlmsg_cancel(d->skb, d->nlh);
+		return 0;
 	}
+	nlmsg_end(d->skb, d->nlh);
+	return d->skb->len;
+}
+
+// 处理skb中的一条请求消息，调用者已校验消息头与消息长度
+static void nlRecvOne(struct sk_buff *skb, struct nlmsghdr *nlh) {
+	void *data; // 指向接收到的数据的指针
+	unsigned int pid,len; // 用于存储发送方PID和数据长度
 
     // 处理数据
 	// NLMSG_DATA(nlh): 获取 Netlink 消息数据部分的指针。
@@ -114,19 +236,48 @@ void nlRecv(struct sk_buff *skb) {
 	}
 
 	// 打印接收日志信息
-	printk("[fw netlink] data receive from user: user_pid=%d, len=%d\n", pid, len);
-
-	// 调用 dealAppMessage 函数处理从用户空间接收到的应用消息。
-	// pid: 发送消息的用户进程ID。
-	// data: 指向消息数据的指针。
-	// len: 消息数据的长度。
-	// (此函数 dealAppMessage 的定义不在此代码片段中)
-	dealAppMessage(pid, data, len);
+	printk("[fw netlink] data receive from user: user_pid=%d, len=%d, seq=%u\n", pid, len, nlh->nlmsg_seq);
+
+	if((nlh->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP && dealAppDump(skb, nlh, data))
+		return;
+
+	// 调用 dealAppMessage 函数处理从用户空间接收到的应用消息，回复带回请求的序列号。
+	// 请求作用于发送方所在的网络命名空间。
+	dealAppMessage(sock_net(skb->sk), pid, nlh->nlmsg_seq, data, len);
+}
+
+/**
+ * @brief nlRecv 函数是 Netlink 套接字接收到消息时的回调函数。
+ *
+ * @param skb 指向接收到的套接字缓冲区 (struct sk_buff) 的指针。
+ * @return void 无返回值。
+ *
+ * @功能描述:
+ *   1. 用户空间可以在一次发送中携带多条请求，依次取出 skb 中的每条 Netlink 消息。
+ *   2. 校验消息头的合法性 (长度是否足够)，非法时打印警告信息并丢弃其余部分。
+ *   3. 每条消息交给 nlRecvOne：校验数据长度至少为一个 APPRequest，带有 NLM_F_DUMP 标志且
+ *      支持分段导出的请求交给 dealAppDump，其余调用 dealAppMessage 处理。
+ *   4. 每条回复都带回对应请求的 nlmsg_seq，用户空间可以同时有多个未完成的请求。
+ */
+void nlRecv(struct sk_buff *skb) {
+	struct nlmsghdr *nlh; // 指向 Netlink 消息头的指针
+	int remain = skb->len; // skb 中尚未处理的字节数
+
+	for(nlh = nlmsg_hdr(skb); remain > 0; nlh = nlmsg_next(nlh, &remain)) {
+		// 校验数据包长度是否合法
+		// nlh->nlmsg_len: Netlink 消息头中记录的总长度 (包括头部和数据)。
+		// NLMSG_HDRLEN: Netlink 消息头的标准长度。
+		if(!nlmsg_ok(nlh, remain)) {
+			printk(KERN_WARNING "[fw netlink] Illegal netlink packet!\n"); // 非法数据包，打印警告
+			return; // 直接返回，不处理其余部分
+		}
+		nlRecvOne(skb, nlh);
+	}
 }
 
 // 定义 Netlink 内核配置结构体 nltest_cfg
 struct netlink_kernel_cfg nltest_cfg = {
-	.groups = 0,         // 多播组掩码，0表示不加入任何预定义的多播组。
+	.groups = FW_GROUP_MAX, // 多播组数量：连接事件与规则命中事件两个组。
 	.flags = 0,          // 配置标志，通常为0。
 	.input = nlRecv,     // 指定接收到 Netlink 消息时的回调函数为 nlRecv。
 	.bind = NULL,        // 当用户空间套接字绑定到此内核 Netlink 协议时调用的回调函数，这里为NULL。
@@ -135,48 +286,67 @@ struct netlink_kernel_cfg nltest_cfg = {
 	// .compare: (较新内核中可能有) 用于比较skb的函数，这里未指定。
 };
 
+// 在新的网络命名空间中创建内核 Netlink 套接字
+static int __net_init nlNetInit(struct net *net) {
+	struct sock *sk;
+
+	// netlink_kernel_create: 创建一个内核 Netlink 套接字。
+	// net: 所属的网络命名空间，该命名空间中的用户空间进程通过它与防火墙通信。
+	// NETLINK_MYFW: 自定义的 Netlink 协议号 (例如 17, 18... 最大值通常是 MAX_LINKS-1，一般选择一个未被使用的值)。
+	// &nltest_cfg: Netlink 内核配置，包含了输入回调函数等。
+	sk = netlink_kernel_create(net, NETLINK_MYFW, &nltest_cfg);
+	if (!sk) { // 检查套接字是否创建成功
+		printk(KERN_WARNING "[fw netlink] can not create a netlink socket\n"); // 创建失败，打印警告
+		return -ENOMEM;
+	}
+	rcu_assign_pointer(nlNetOf(net)->sk, sk);
+	printk("[fw netlink] netlink_kernel_create() success, nlsk = %p\n", sk); // 创建成功，打印信息
+	return 0;
+}
+
+// 网络命名空间销毁或模块卸载时释放套接字，等待正在发送事件的路径离开后再释放
+static void __net_exit nlNetExit(struct net *net) {
+	struct nlNet *nn = nlNetOf(net);
+	struct sock *sk = rcu_dereference_protected(nn->sk, 1);
+
+	RCU_INIT_POINTER(nn->sk, NULL);
+	synchronize_rcu();
+	// netlink_kernel_release: 释放一个内核 Netlink 套接字。
+	netlink_kernel_release(sk);
+}
+
+static struct pernet_operations nlNetOps = {
+	.init = nlNetInit,
+	.exit = nlNetExit,
+	.id = &nlNetId,
+	.size = sizeof(struct nlNet),
+};
+
 /**
- * @brief netlink_init 函数用于初始化 Netlink 套接字。
+ * @brief netlink_init 函数用于初始化 Netlink 通信。
  *
  * @param void 无参数。
- * @return struct sock* 初始化成功则返回创建的 Netlink 套接字指针，失败则返回 NULL。
+ * @return int 成功返回0，失败返回负数错误码。
  *
  * @功能描述:
- *   1. 调用 netlink_kernel_create 创建一个内核空间的 Netlink 套接字。
- *      - &init_net: 网络命名空间，通常是 init_net。
- *      - NETLINK_MYFW: 自定义的 Netlink 协议类型 (应在头文件中定义，例如 #define NETLINK_MYFW 30)。
- *      - &nltest_cfg: 指向 Netlink 内核配置结构体的指针。
- *   2. 检查套接字是否创建成功。
- *   3. 如果创建失败，打印警告信息并返回 NULL。
- *   4. 如果创建成功，打印成功信息和套接字指针地址。
- *   5. 将创建的套接字赋值给全局变量 nlsk。
- *   6. 返回创建的套接字指针。
+ *   注册网络命名空间操作：已有的和此后创建的每个网络命名空间中都会创建一个
+ *   NETLINK_MYFW 协议的内核套接字，命名空间销毁时随之释放。
  */
-struct sock *netlink_init() {
-    // netlink_kernel_create: 创建一个内核 Netlink 套接字。
-    // &init_net: 指定网络命名空间，通常是默认的 init_net。
-    // NETLINK_MYFW: 自定义的 Netlink 协议号 (例如 17, 18... 最大值通常是 MAX_LINKS-1，一般选择一个未被使用的值)。
-    // &nltest_cfg: Netlink 内核配置，包含了输入回调函数等。
-    nlsk = netlink_kernel_create(&init_net, NETLINK_MYFW, &nltest_cfg);
-	if (!nlsk) { // 检查套接字是否创建成功
-		printk(KERN_WARNING "[fw netlink] can not create a netlink socket\n"); // 创建失败，打印警告
-		return NULL; // 返回 NULL
-	}
-	printk("[fw netlink] netlink_kernel_create() success, nlsk = %p\n", nlsk); // 创建成功，打印信息
-    return nlsk; // 返回创建的套接字
+int netlink_init(void) {
+	int ret = register_pernet_subsys(&nlNetOps);
+	if(ret == 0)
+		WRITE_ONCE(nlReady, true);
+	return ret;
 }
 
 /**
- * @brief netlink_release 函数用于释放之前创建的 Netlink 套接字。
+ * @brief netlink_release 函数用于释放所有命名空间中的 Netlink 套接字。
  *
  * @param void 无参数。
  * @return void 无返回值。
- *
- * @功能描述:
- *   调用 netlink_kernel_release 释放由 nlsk 指向的 Netlink 套接字。
  */
-void netlink_release() {
-    // netlink_kernel_release: 释放一个内核 Netlink 套接字。
-    // nlsk: 要释放的套接字。
-    netlink_kernel_release(nlsk);
-}
\ No newline at end of file
+void netlink_release(void) {
+	WRITE_ONCE(nlReady, false);
+	synchronize_rcu();
+	unregister_pernet_subsys(&nlNetOps);
+}
@@ -0,0 +1,109 @@
+#include "tools.h"
+#include "helper.h"
+
+// 所有CPU共用的令牌桶哈希表，共 RL_SETS 组，每组 RL_WAYS 个桶共用一把锁
+struct rlSet {
+    spinlock_t lock;
+    struct rlBucket b[RL_WAYS];
+} ____cacheline_aligned_in_smp;
+
+static struct rlSet rlTable[RL_SETS];
+
+/**
+ * @brief 初始化令牌桶哈希表
+ * @return int 总是返回0
+ */
+int ratelimit_init(void) {
+    unsigned int i;
+    for(i = 0; i < RL_SETS; i++) {
+        spin_lock_init(&rlTable[i].lock);
+        memset(rlTable[i].b, 0, sizeof(rlTable[i].b));
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放令牌桶哈希表
+ * @note 哈希表是静态分配的，无需释放
+ */
+void ratelimit_exit(void) {
+}
+
+/**
+ * @brief 找到 (或换入) 对应的令牌桶并尝试取走一个令牌
+ * @param rule 命中的规则
+ * @param key (规则, 源前缀) 的哈希，非0
+ * @return bool 取到令牌返回true
+ * @note 在组锁内完成补充与扣减，同一源前缀经不同CPU到达的新连接共用一个令牌桶。
+ *       新换入的桶只带本次连接要用的一个令牌，之后按 rate 补充到 burst 为止
+ */
+static bool rlTake(struct IPRule *rule, u32 key) {
+    struct rlSet *set = &rlTable[key >> (32 - RL_SETS_SHIFT)];
+    struct rlBucket *b, *victim;
+    unsigned long now = jiffies, elapsed;
+    u32 rate = min_t(u32, rule->rate, RL_LIMIT_MAX);
+    u32 cap = min_t(u32, rule->burst ? rule->burst : rate, RL_LIMIT_MAX) * RL_TOKEN;
+    u64 add;
+    bool ok;
+    int i;
+
+    spin_lock_bh(&set->lock);
+    victim = &set->b[0];
+    for(i = 0, b = NULL; i < RL_WAYS; i++) {
+        if(set->b[i].key == key) {
+            b = &set->b[i];
+            break;
+        }
+        if(victim->key != 0 && (set->b[i].key == 0 || time_before(set->b[i].stamp, victim->stamp)))
+            victim = &set->b[i];
+    }
+    if(b == NULL) { // 新的源前缀，换掉本组中空闲或最久未用的桶
+        b = victim;
+        b->key = key;
+        b->tokens = min_t(u32, RL_TOKEN, cap);
+        b->stamp = now;
+    } else {
+        // 按经过的时间补充令牌，长时间空闲的桶直接补满，避免乘法溢出
+        elapsed = now - b->stamp;
+        add = elapsed >= 3600 * HZ ? cap : div_u64((u64)elapsed * rate * RL_TOKEN, HZ);
+        b->tokens = (u32)min_t(u64, (u64)b->tokens + add, cap);
+        b->stamp = now;
+    }
+    ok = b->tokens >= RL_TOKEN;
+    if(ok)
+        b->tokens -= RL_TOKEN;
+    spin_unlock_bh(&set->lock);
+    return ok;
+}
+
+// 规则的哈希种子：同一源前缀在不同规则、不同网络命名空间的同名规则下使用不同的令牌桶
+static u32 rlSeed(struct net *net, struct IPRule *rule) {
+    return jhash(rule->name, strnlen(rule->name, MAXRuleNameLen + 1), rule->family ^ net_hash_mix(net));
+}
+
+/**
+ * @brief 判断IPv4新连接是否在规则的限速之内
+ * @param net 数据包所在的网络命名空间
+ * @param rule 命中的规则
+ * @param sip 源IP地址(主机字节序)，按 rule->limitPlen 取前缀
+ * @return bool 允许新建返回true
+ */
+bool rateLimitAdmit(struct net *net, struct IPRule *rule, unsigned int sip) {
+    unsigned int plen = min_t(unsigned int, rule->limitPlen, 32);
+    u32 key;
+    sip &= plen ? ~0u << (32 - plen) : 0;
+    key = jhash_2words(sip, plen, rlSeed(net, rule));
+    return rlTake(rule, key ? key : 1);
+}
+
+/**
+ * @brief 判断IPv6新连接是否在规则的限速之内
+ */
+bool rateLimitAdmit6(struct net *net, struct IPRule *rule, const struct in6_addr *sip) {
+    unsigned int plen = min_t(unsigned int, rule->limitPlen, 128);
+    struct in6_addr prefix;
+    u32 key;
+    ipv6_addr_prefix(&prefix, sip, plen);
+    key = jhash2(prefix.s6_addr32, 4, rlSeed(net, rule) ^ plen);
+    return rlTake(rule, key ? key : 1);
+}
@@ -1,118 +1,503 @@
 #include "tools.h"
 #include "helper.h"
 
-static struct IPRule *ipRuleHead = NULL;
-static DEFINE_RWLOCK(ipRuleLock);
+// 每个网络命名空间各有一套规则链、分类器、批量事务与默认动作，按 ruleNetId 挂在 struct net 上
+struct ruleNet {
+    struct IPRule *head;
+    // 由规则链编译出的分类器，数据包只访问它：读者在RCU读临界区内取用，无需加锁
+    struct ruleClassifier __rcu *cls;
+    struct mutex mutex;        // 串行化规则链的修改与分类器重建，同时是 cls 的唯一写者
+    unsigned int defaultAction; // 未命中任何规则时的动作，READ_ONCE/WRITE_ONCE 访问
+    // 未命中任何规则、按默认动作处理的新连接计数，不随分类器替换
+    struct ruleCounter __percpu *defaultHits;
+    // 批量规则事务：规则先暂存在这里，提交时一次性编译并替换，期间数据包仍使用旧规则集
+    struct {
+        unsigned int owner;       // 开启事务的用户进程PID，0表示没有进行中的事务
+        unsigned int mode;        // IPRULE_BATCH_REPLACE 或 IPRULE_BATCH_APPEND
+        struct IPRule *rules;     // 暂存的规则数组
+        unsigned int num, cap;    // 已暂存的规则数与数组容量
+    } batch;
+};
+
+static unsigned int ruleNetId;
+
+static struct ruleNet *ruleNetOf(const struct net *net) {
+    return net_generic(net, ruleNetId);
+}
+
+/**
+ * @brief 将规则链编译为分类器
+ * @param head 规则链首部
+ * @param skip 非空时跳过名称为skip的规则(用于删除前预先构建)
+ * @return struct ruleClassifier* 成功返回新分类器，失败返回NULL
+ * @note 调用者需持有rn->mutex
+ */
+static struct ruleClassifier *compileIPRules(struct IPRule *head, const char *skip) {
+    struct ruleClassifier *cls;
+    struct IPRule *now, *rules;
+    unsigned int count, i;
+    for(now=head,count=0;now!=NULL;now=now->nx,count++);
+    rules = kvmalloc_array(count ? count : 1, sizeof(struct IPRule), GFP_KERNEL);
+    if(rules == NULL) {
+        printk(KERN_WARNING "[fw rules] kvmalloc fail.\n");
+        return NULL;
+    }
+    for(now=head,i=0;now!=NULL;now=now->nx) {
+        if(skip != NULL && strcmp(now->name, skip)==0)
+            continue;
+        rules[i] = *now;
+        rules[i].nx = NULL;
+        i++;
+    }
+    cls = buildClassifier(rules, i);
+    if(cls == NULL)
+        kvfree(rules);
+    return cls;
+}
+
+// 发布新分类器，等待宽限期结束 (此后不会再有数据包在使用旧分类器) 再释放旧分类器。
+// 旧分类器的计数此时已不再变化，新分类器在释放前按规则名称继承它们。
+// 新分类器发布后拒绝缓存随即失效，按旧规则记下的拒绝不再被查到。
+// 调用者需持有rn->mutex
+static void swapIPRuleClassifier(struct ruleNet *rn, struct ruleClassifier *cls) {
+    struct ruleClassifier *old;
+    old = rcu_dereference_protected(rn->cls, lockdep_is_held(&rn->mutex));
+    rcu_assign_pointer(rn->cls, cls);
+    denyCacheFlush();
+    if(old == NULL)
+        return;
+    synchronize_rcu();
+    clsInheritHits(cls, old);
+    freeClassifier(old);
+}
 
 // 在名称为after的规则后新增一条规则，after为空时则在首部新增一条规则
 /**
  * @brief 向规则链表中添加新IP规则
+ * @param net 规则链所属的网络命名空间
  * @param after 新规则要插入的位置(规则名称)，空字符串表示插入到链表头部
  * @param rule 要添加的规则结构体
  * @return struct IPRule* 成功返回新规则指针，失败返回NULL
- * @note 使用读写锁保证并发安全，会消除相关连接的影响
+ * @note 插入后重新编译分类器并原子替换，随后消除相关连接的影响
  */
-struct IPRule * addIPRuleToChain(char after[], struct IPRule rule) {
-    struct IPRule *newRule,*now;
+struct IPRule * addIPRuleToChain(struct net *net, char after[], struct IPRule rule) {
+    struct ruleNet *rn = ruleNetOf(net);
+    struct IPRule *newRule,*now,**pos = NULL;
+    struct ruleClassifier *cls;
     newRule = (struct IPRule *) kzalloc(sizeof(struct IPRule), GFP_KERNEL);
     if(newRule == NULL) {
         printk(KERN_WARNING "[fw rules] kzalloc fail.\n");
         return NULL;
     }
     memcpy(newRule, &rule, sizeof(struct IPRule));
-    // 新增规则至规则链表
-    write_lock(&ipRuleLock);
-    if(rule.action != NF_ACCEPT) 
-        eraseConnRelated(rule); // 消除新增规则的影响
-    if(ipRuleHead == NULL) {
-        ipRuleHead = newRule;
-        ipRuleHead->nx = NULL;
-        write_unlock(&ipRuleLock);
-        return newRule;
-    }
-    if(strlen(after)==0) {
-        newRule->nx = ipRuleHead;
-        ipRuleHead = newRule;
-        write_unlock(&ipRuleLock);
-        return newRule;
-    }
-    for(now=ipRuleHead;now!=NULL;now=now->nx) {
-        if(strcmp(now->name, after)==0) {
-            newRule->nx = now->nx;
-            now->nx = newRule;
-            write_unlock(&ipRuleLock);
-            return newRule;
+    mutex_lock(&rn->mutex);
+    // 确定插入位置
+    if(rn->head == NULL || strlen(after)==0) {
+        pos = &rn->head;
+    } else {
+        for(now=rn->head;now!=NULL;now=now->nx) {
+            if(strcmp(now->name, after)==0) {
+                pos = &now->nx;
+                break;
+            }
         }
     }
-    // 添加失败
-    write_unlock(&ipRuleLock);
-    kfree(newRule);
-    return NULL;
+    if(pos == NULL) { // 添加失败
+        mutex_unlock(&rn->mutex);
+        kfree(newRule);
+        return NULL;
+    }
+    newRule->nx = *pos;
+    *pos = newRule;
+    cls = compileIPRules(rn->head, NULL);
+    if(cls == NULL) { // 编译失败则撤销插入，保持规则链与分类器一致
+        *pos = newRule->nx;
+        mutex_unlock(&rn->mutex);
+        kfree(newRule);
+        return NULL;
+    }
+    swapIPRuleClassifier(rn, cls);
+    if(rule.action != NF_ACCEPT)
+        purgeConnRelated(net, rule); // 消除新增规则的影响
+    mutex_unlock(&rn->mutex);
+    return newRule;
 }
 
 // 删除所有名称为name的规则
 /**
  * @brief 从规则链表中删除指定名称的规则
+ * @param net 规则链所属的网络命名空间
  * @param name 要删除的规则名称
  * @return int 实际删除的规则数量
- * @note 会删除链表中所有匹配名称的规则，并消除相关连接的影响
+ * @note 会删除链表中所有匹配名称的规则，并消除相关连接的影响；
+ *       先编译不含这些规则的分类器，编译失败时规则链保持不变并返回0
  */
-int delIPRuleFromChain(char name[]) {
-    struct IPRule *now,*tmp;
+int delIPRuleFromChain(struct net *net, char name[]) {
+    struct ruleNet *rn = ruleNetOf(net);
+    struct IPRule *now,*tmp,**pp;
+    struct ruleClassifier *cls;
     int count = 0;
-    write_lock(&ipRuleLock);
-    while(ipRuleHead!=NULL && strcmp(ipRuleHead->name,name)==0) {
-        tmp = ipRuleHead;
-        ipRuleHead = ipRuleHead->nx;
-        eraseConnRelated(*tmp); // 消除删除规则的影响
-        kfree(tmp);
-        count++;
+    mutex_lock(&rn->mutex);
+    for(now=rn->head;now!=NULL;now=now->nx)
+        if(strcmp(now->name,name)==0)
+            count++;
+    if(count == 0) {
+        mutex_unlock(&rn->mutex);
+        return 0;
+    }
+    cls = compileIPRules(rn->head, name);
+    if(cls == NULL) {
+        mutex_unlock(&rn->mutex);
+        return 0;
     }
-    for(now=ipRuleHead;now!=NULL && now->nx!=NULL;) {
-        if(strcmp(now->nx->name,name)==0) { // 删除下条规则
-            tmp = now->nx;
-            now->nx = now->nx->nx;
-            eraseConnRelated(*tmp); // 消除删除规则的影响
+    swapIPRuleClassifier(rn, cls);
+    for(pp=&rn->head;*pp!=NULL;) {
+        if(strcmp((*pp)->name,name)==0) {
+            tmp = *pp;
+            *pp = tmp->nx;
+            purgeConnRelated(net, *tmp); // 消除删除规则的影响
             kfree(tmp);
-            count++;
         } else {
-            now = now->nx;
+            pp = &(*pp)->nx;
         }
     }
-    write_unlock(&ipRuleLock);
+    mutex_unlock(&rn->mutex);
     return count;
 }
 
 // 将所有规则形成Netlink回包
+// 释放一条规则链
+static void freeIPRuleList(struct IPRule *head) {
+    struct IPRule *tmp;
+    while(head != NULL) {
+        tmp = head;
+        head = tmp->nx;
+        kfree(tmp);
+    }
+}
+
+// 丢弃暂存的批量规则，调用者需持有rn->mutex
+static void dropIPRuleBatch(struct ruleNet *rn) {
+    kvfree(rn->batch.rules);
+    memset(&rn->batch, 0, sizeof(rn->batch));
+}
+
+/**
+ * @brief 开始一次批量规则事务
+ * @param pid 发起事务的用户进程PID
+ * @param mode IPRULE_BATCH_REPLACE 替换整个规则链，IPRULE_BATCH_APPEND 追加到规则链末尾
+ * @return int 成功返回0，模式非法返回-EINVAL
+ * @note 同一时刻只保留一个事务，新事务会丢弃尚未提交的旧事务(例如发起者已退出)
+ */
+int beginIPRuleBatch(struct net *net, unsigned int pid, unsigned int mode) {
+    struct ruleNet *rn = ruleNetOf(net);
+    if(pid == 0 || (mode != IPRULE_BATCH_REPLACE && mode != IPRULE_BATCH_APPEND))
+        return -EINVAL;
+    mutex_lock(&rn->mutex);
+    if(rn->batch.owner != 0 && rn->batch.owner != pid)
+        printk(KERN_INFO "[fw rules] drop uncommitted batch of pid %u.\n", rn->batch.owner);
+    dropIPRuleBatch(rn);
+    rn->batch.owner = pid;
+    rn->batch.mode = mode;
+    mutex_unlock(&rn->mutex);
+    return 0;
+}
+
+/**
+ * @brief 向批量规则事务追加一段规则
+ * @param pid 发起事务的用户进程PID
+ * @param rules 规则数组
+ * @param num 规则数
+ * @return int 成功返回已暂存的规则总数；没有属于pid的事务返回-ENOENT，
+ *         超过IPRULE_BATCH_MAX返回-E2BIG，内存不足返回-ENOMEM
+ */
+int addIPRuleBatch(struct net *net, unsigned int pid, const struct IPRule *rules, unsigned int num) {
+    struct ruleNet *rn = ruleNetOf(net);
+    struct IPRule *grown;
+    unsigned int cap, i;
+    int ret;
+    mutex_lock(&rn->mutex);
+    if(rn->batch.owner == 0 || rn->batch.owner != pid) {
+        ret = -ENOENT;
+        goto out;
+    }
+    if(num > IPRULE_BATCH_MAX - rn->batch.num) {
+        ret = -E2BIG;
+        goto out;
+    }
+    if(rn->batch.num + num > rn->batch.cap) {
+        cap = max(rn->batch.cap * 2, rn->batch.num + num);
+        cap = min(cap, (unsigned int)IPRULE_BATCH_MAX);
+        grown = kvmalloc_array(cap, sizeof(struct IPRule), GFP_KERNEL);
+        if(grown == NULL) {
+            printk(KERN_WARNING "[fw rules] kvmalloc fail.\n");
+            ret = -ENOMEM;
+            goto out;
+        }
+        if(rn->batch.num)
+            memcpy(grown, rn->batch.rules, rn->batch.num * sizeof(struct IPRule));
+        kvfree(rn->batch.rules);
+        rn->batch.rules = grown;
+        rn->batch.cap = cap;
+    }
+    for(i=0;i<num;i++) {
+        rn->batch.rules[rn->batch.num] = rules[i];
+        rn->batch.rules[rn->batch.num].name[MAXRuleNameLen] = '\0';
+        rn->batch.rules[rn->batch.num].nx = NULL;
+        rn->batch.num++;
+    }
+    ret = rn->batch.num;
+out:
+    mutex_unlock(&rn->mutex);
+    return ret;
+}
+
+/**
+ * @brief 放弃批量规则事务
+ * @param pid 发起事务的用户进程PID
+ * @return int 成功返回0，没有属于pid的事务返回-ENOENT
+ */
+int abortIPRuleBatch(struct net *net, unsigned int pid) {
+    struct ruleNet *rn = ruleNetOf(net);
+    int ret = -ENOENT;
+    mutex_lock(&rn->mutex);
+    if(rn->batch.owner != 0 && rn->batch.owner == pid) {
+        dropIPRuleBatch(rn);
+        ret = 0;
+    }
+    mutex_unlock(&rn->mutex);
+    return ret;
+}
+
+/**
+ * @brief 提交批量规则事务
+ * @param pid 发起事务的用户进程PID
+ * @return int 成功返回提交后规则链中的规则数；没有属于pid的事务返回-ENOENT，内存不足返回-ENOMEM
+ * @note 新规则链与分类器在旁路构建，任何一步失败时当前规则集保持不变且事务仍可重试提交；
+ *       替换后登记一次延迟清理，由工作队列遍历一次连接池清除在新规则集下不再被允许的连接
+ */
+int commitIPRuleBatch(struct net *net, unsigned int pid) {
+    struct ruleNet *rn = ruleNetOf(net);
+    struct IPRule *head = NULL, **tail = &head, *now, *node, *old;
+    struct ruleClassifier *cls;
+    unsigned int i, count = 0;
+    mutex_lock(&rn->mutex);
+    if(rn->batch.owner == 0 || rn->batch.owner != pid) {
+        mutex_unlock(&rn->mutex);
+        return -ENOENT;
+    }
+    // 追加模式下先复制现有规则链，保证失败时旧链完好
+    if(rn->batch.mode == IPRULE_BATCH_APPEND) {
+        for(now=rn->head;now!=NULL;now=now->nx) {
+            node = kmemdup(now, sizeof(struct IPRule), GFP_KERNEL);
+            if(node == NULL)
+                goto nomem;
+            node->nx = NULL;
+            *tail = node;
+            tail = &node->nx;
+            count++;
+        }
+    }
+    for(i=0;i<rn->batch.num;i++) {
+        node = kmemdup(&rn->batch.rules[i], sizeof(struct IPRule), GFP_KERNEL);
+        if(node == NULL)
+            goto nomem;
+        *tail = node;
+        tail = &node->nx;
+        count++;
+    }
+    cls = compileIPRules(head, NULL);
+    if(cls == NULL)
+        goto nomem;
+    old = rn->head;
+    rn->head = head;
+    swapIPRuleClassifier(rn, cls);
+    freeIPRuleList(old);
+    dropIPRuleBatch(rn);
+    purgeConnDenied(net);
+    printk(KERN_INFO "[fw rules] batch commit: %u rules.\n", count);
+    mutex_unlock(&rn->mutex);
+    return count;
+nomem:
+    printk(KERN_WARNING "[fw rules] batch commit fail: no memory.\n");
+    freeIPRuleList(head);
+    mutex_unlock(&rn->mutex);
+    return -ENOMEM;
+}
+
 /**
  * @brief 将内存中的规则链表转换为Netlink响应格式
  * @param len [out] 返回生成的响应数据长度
  * @return void* 成功返回响应数据指针(需要调用者释放)，失败返回NULL
- * @note 使用读锁保证并发安全
+ * @note 持有rn->mutex保证并发安全
  */
-void* formAllIPRules(unsigned int *len) {
+void* formAllIPRules(struct net *net, unsigned int *len) {
+    struct ruleNet *rn = ruleNetOf(net);
     struct KernelResponseHeader *head;
     struct IPRule *now;
     void *mem,*p;
     unsigned int count;
-    read_lock(&ipRuleLock);
-    for(now=ipRuleHead,count=0;now!=NULL;now=now->nx,count++);
+    mutex_lock(&rn->mutex);
+    for(now=rn->head,count=0;now!=NULL;now=now->nx,count++);
     *len = sizeof(struct KernelResponseHeader) + sizeof(struct IPRule)*count;
-    mem = kzalloc(*len, GFP_ATOMIC);
+    mem = kzalloc(*len, GFP_KERNEL);
     if(mem == NULL) {
         printk(KERN_WARNING "[fw rules] kzalloc fail.\n");
-        read_unlock(&ipRuleLock);
+        mutex_unlock(&rn->mutex);
         return NULL;
     }
     head = (struct KernelResponseHeader *)mem;
     head->bodyTp = RSP_IPRules;
     head->arrayLen = count;
-    for(now=ipRuleHead,p=(mem + sizeof(struct KernelResponseHeader));now!=NULL;now=now->nx,p=p+sizeof(struct IPRule))
+    for(now=rn->head,p=(mem + sizeof(struct KernelResponseHeader));now!=NULL;now=now->nx,p=p+sizeof(struct IPRule))
         memcpy(p, now, sizeof(struct IPRule));
-    read_unlock(&ipRuleLock);
+    mutex_unlock(&rn->mutex);
     return mem;
 }
 
+/**
+ * @brief 汇总各规则与默认动作的命中计数
+ * @param num [out] 规则条数
+ * @param deflt [out] 默认动作的计数
+ * @return struct RuleStat* 成功返回计数数组(需要调用者以kvfree释放)，失败返回NULL
+ * @note 持有rn->mutex，期间分类器不会被替换
+ */
+struct RuleStat *formIPRuleStats(struct net *net, unsigned int *num, struct RuleStat *deflt) {
+    struct ruleNet *rn = ruleNetOf(net);
+    struct ruleClassifier *cls;
+    struct RuleStat *stats;
+    struct ruleCounter c;
+    unsigned int i, n;
+    int cpu;
+    memset(deflt, 0, sizeof(*deflt));
+    for_each_possible_cpu(cpu) {
+        deflt->packets += READ_ONCE(per_cpu_ptr(rn->defaultHits, cpu)->packets);
+        deflt->bytes += READ_ONCE(per_cpu_ptr(rn->defaultHits, cpu)->bytes);
+    }
+    mutex_lock(&rn->mutex);
+    cls = rcu_dereference_protected(rn->cls, lockdep_is_held(&rn->mutex));
+    n = cls ? cls->ruleNum : 0;
+    stats = kvcalloc(max(n, 1u), sizeof(struct RuleStat), GFP_KERNEL);
+    if(stats == NULL) {
+        printk(KERN_WARNING "[fw rules] kvcalloc fail.\n");
+        mutex_unlock(&rn->mutex);
+        return NULL;
+    }
+    for(i = 0; i < n; i++) {
+        memcpy(stats[i].name, cls->rules[i].name, sizeof(stats[i].name));
+        stats[i].index = i;
+        clsReadHits(cls, i, &c);
+        stats[i].packets = c.packets;
+        stats[i].bytes = c.bytes;
+    }
+    mutex_unlock(&rn->mutex);
+    *num = n;
+    return stats;
+}
+
+/**
+ * @brief 分段导出规则链
+ * @param skb 本次填充的skb
+ * @param cb 导出上下文，args[0] 为下一条待导出规则的序号
+ * @return int 本段有规则时返回skb长度，已导出完毕返回0
+ * @note 两段之间规则链可能被修改，此时导出结果与普通获取一样只保证每段内部一致
+ */
+int dumpIPRules(struct sk_buff *skb, struct netlink_callback *cb) {
+    struct ruleNet *rn = ruleNetOf(sock_net(skb->sk));
+    struct IPRule *now, *p;
+    struct nlDump d;
+    long i;
+    if(nlDumpBegin(&d, skb, cb, RSP_IPRules) != 0)
+        return -EMSGSIZE;
+    mutex_lock(&rn->mutex);
+    for(now=rn->head,i=0;now!=NULL && i<cb->args[0];now=now->nx,i++);
+    for(;now!=NULL;now=now->nx) {
+        p = nlDumpItem(&d, sizeof(struct IPRule));
+        if(p == NULL)
+            break;
+        *p = *now;
+        p->nx = NULL;
+        cb->args[0]++;
+    }
+    mutex_unlock(&rn->mutex);
+    return nlDumpEnd(&d);
+}
+
+/**
+ * @brief 读取命名空间的默认动作
+ */
+unsigned int getDefaultAction(struct net *net) {
+    return READ_ONCE(ruleNetOf(net)->defaultAction);
+}
+
+/**
+ * @brief 修改命名空间的默认动作
+ * @param action NF_ACCEPT 或 NF_DROP
+ * @note 之后的新连接立即按新动作处理，已有连接由调用者登记清理；拒绝缓存在新动作写入之后失效
+ */
+void setDefaultAction(struct net *net, unsigned int action) {
+    WRITE_ONCE(ruleNetOf(net)->defaultAction, action);
+    denyCacheFlush();
+}
+
+/**
+ * @brief 为命中拒绝缓存、未经过规则匹配的数据包累加默认动作的计数
+ */
+void countDefaultHit(struct net *net, unsigned int packets, unsigned int bytes) {
+    struct ruleNet *rn = ruleNetOf(net);
+    this_cpu_add(rn->defaultHits->packets, packets);
+    this_cpu_add(rn->defaultHits->bytes, bytes);
+}
+
+// 新命名空间从空规则链与放行的默认动作开始
+static int __net_init ruleNetInit(struct net *net) {
+    struct ruleNet *rn = ruleNetOf(net);
+    mutex_init(&rn->mutex);
+    rn->defaultAction = NF_ACCEPT;
+    rn->defaultHits = alloc_percpu(struct ruleCounter);
+    if(rn->defaultHits == NULL) {
+        printk(KERN_WARNING "[fw rules] alloc default counter fail.\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// 释放规则链、分类器与未提交的批量事务，此时该命名空间的钩子与netlink套接字都已撤销
+static void __net_exit ruleNetExit(struct net *net) {
+    struct ruleNet *rn = ruleNetOf(net);
+    mutex_lock(&rn->mutex);
+    swapIPRuleClassifier(rn, NULL);
+    freeIPRuleList(rn->head);
+    rn->head = NULL;
+    dropIPRuleBatch(rn);
+    mutex_unlock(&rn->mutex);
+    free_percpu(rn->defaultHits);
+}
+
+static struct pernet_operations ruleNetOps = {
+    .init = ruleNetInit,
+    .exit = ruleNetExit,
+    .id = &ruleNetId,
+    .size = sizeof(struct ruleNet),
+};
+
+/**
+ * @brief 为每个网络命名空间建立规则状态
+ * @return int 成功返回0，失败返回负数错误码
+ * @note 模块加载时在连接池之前调用，连接池的延迟清理需要按规则重新判定连接
+ */
+int rule_init(void) {
+    return register_pernet_subsys(&ruleNetOps);
+}
+
+/**
+ * @brief 释放所有命名空间的规则链、分类器与未提交的批量事务
+ * @note 模块卸载时调用，此时钩子已注销
+ */
+void rule_exit(void) {
+    unregister_pernet_subsys(&ruleNetOps);
+}
+
 /**
  * @brief 检查单个规则是否匹配数据包
  * @param rule 要检查的规则指针
@@ -129,31 +514,117 @@ bool matchOneRule(struct IPRule *rule,
 			isIPMatch(dip,rule->daddr,rule->dmask) &&
 			(sport >= ((unsigned short)(rule->sport >> 16)) && sport <= ((unsigned short)(rule->sport & 0xFFFFu))) &&
 			(dport >= ((unsigned short)(rule->dport >> 16)) && dport <= ((unsigned short)(rule->dport & 0xFFFFu))) &&
+			(rule->protocol == IPPROTO_IP || rule->protocol == proto) &&
+			(rule->sset == 0 || ipSetHas(rule->sset, sip)) &&
+			(rule->dset == 0 || ipSetHas(rule->dset, dip)));
+}
+
+/**
+ * @brief 检查单个IPv6规则是否匹配数据包
+ * @param rule 要检查的规则指针，IPv4规则永远不匹配
+ * @param sip 源IPv6地址
+ * @param dip 目的IPv6地址
+ * @return bool 匹配返回true，否则返回false
+ * @note 前缀长度超过128时按128处理
+ */
+bool matchOneRule6(struct IPRule *rule,
+ const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto) {
+    return (rule->family == AF_INET6 && rule->sset == 0 && rule->dset == 0 && // 地址集合只收录IPv4地址
+			ipv6_prefix_equal(sip, (const struct in6_addr *)rule->saddr6, min_t(unsigned int, rule->splen, 128)) &&
+			ipv6_prefix_equal(dip, (const struct in6_addr *)rule->daddr6, min_t(unsigned int, rule->dplen, 128)) &&
+			(sport >= ((unsigned short)(rule->sport >> 16)) && sport <= ((unsigned short)(rule->sport & 0xFFFFu))) &&
+			(dport >= ((unsigned short)(rule->dport >> 16)) && dport <= ((unsigned short)(rule->dport & 0xFFFFu))) &&
 			(rule->protocol == IPPROTO_IP || rule->protocol == proto));
 }
 
 // 进行过滤规则匹配，isMatch存储是否匹配到规则
+/**
+ * @brief 按当前分类器与默认动作判定连接是否不再被允许
+ * @note 供延迟清理在遍历连接池时调用，与数据包匹配一样在RCU读临界区内访问分类器
+ */
+bool connPolicyDenies(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto) {
+    struct IPRule *rule;
+    unsigned int action;
+    struct ruleNet *rn = ruleNetOf(net);
+    rcu_read_lock();
+    rule = classifyPacket(rcu_dereference(rn->cls), sip, dip, sport, dport, proto);
+    action = rule ? rule->action : READ_ONCE(rn->defaultAction);
+    rcu_read_unlock();
+    return action != NF_ACCEPT;
+}
+
+/**
+ * @brief connPolicyDenies 的IPv6版本，按分类器中的IPv6规则与默认动作判定
+ */
+bool connPolicyDenies6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto) {
+    struct IPRule *rule;
+    unsigned int action;
+    struct ruleNet *rn = ruleNetOf(net);
+    rcu_read_lock();
+    rule = classifyPacket6(rcu_dereference(rn->cls), sip, dip, sport, dport, proto);
+    action = rule ? rule->action : READ_ONCE(rn->defaultAction);
+    rcu_read_unlock();
+    return action != NF_ACCEPT;
+}
+
+// 记录一次规则或默认动作的命中，调用者处于取得cls的RCU读临界区内
+static void countRuleHit(struct ruleNet *rn, struct ruleClassifier *cls, struct IPRule *rule, unsigned int packets, unsigned int bytes) {
+    if(rule != NULL) {
+        clsCountHit(cls, rule, packets, bytes);
+        return;
+    }
+    this_cpu_add(rn->defaultHits->packets, packets);
+    this_cpu_add(rn->defaultHits->bytes, bytes);
+}
+
 /**
  * @brief 匹配数据包与规则链表
  * @param skb 网络数据包
+ * @param sport/dport 调用者以 getPort 解析出的端口
  * @param isMatch [out] 是否匹配到规则
  * @return struct IPRule 返回匹配到的规则
- * @note 使用读锁保证并发安全
+ * @note 通过编译后的分类器查找；RCU读临界区保证匹配期间旧分类器不被释放，命中的规则在退出前复制出来。
+ *       命中的规则 (未命中时为默认动作) 同时累加一次计数
  */
-struct IPRule matchIPRules(struct sk_buff *skb, int *isMatch) {
+struct IPRule matchIPRules(struct net *net, struct sk_buff *skb, unsigned short sport, unsigned short dport, int *isMatch) {
+    struct ruleNet *rn = ruleNetOf(net);
     struct IPRule *now,ret;
-	unsigned short sport,dport;
+	struct ruleClassifier *cls;
 	struct iphdr *header = ip_hdr(skb);
 	*isMatch = 0;
-	getPort(skb,header,&sport,&dport);
-	read_lock(&ipRuleLock);
-	for(now=ipRuleHead;now!=NULL;now=now->nx) {
-		if(matchOneRule(now,ntohl(header->saddr),ntohl(header->daddr),sport,dport,header->protocol)) {
-				ret = *now;
-				*isMatch = 1;
-				break;
-		}
+	rcu_read_lock();
+	cls = rcu_dereference(rn->cls);
+	now = classifyPacket(cls,ntohl(header->saddr),ntohl(header->daddr),sport,dport,header->protocol);
+	countRuleHit(rn, cls, now, skbSegs(skb), skb->len);
+	if(now != NULL) {
+		ret = *now;
+		*isMatch = 1;
 	}
-	read_unlock(&ipRuleLock);
+	rcu_read_unlock();
 	return ret;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief 匹配IPv6数据包与IPv6规则
+ * @param skb 网络数据包
+ * @param proto/sport/dport 由 getPort6 跳过扩展头后得到的上层协议与端口
+ * @param isMatch [out] 是否匹配到规则
+ * @return struct IPRule 返回匹配到的规则
+ */
+struct IPRule matchIPRules6(struct net *net, struct sk_buff *skb, u_int8_t proto, unsigned short sport, unsigned short dport, int *isMatch) {
+	struct ruleNet *rn = ruleNetOf(net);
+	struct IPRule *now,ret;
+	struct ruleClassifier *cls;
+	struct ipv6hdr *header = ipv6_hdr(skb);
+	*isMatch = 0;
+	rcu_read_lock();
+	cls = rcu_dereference(rn->cls);
+	now = classifyPacket6(cls,&header->saddr,&header->daddr,sport,dport,proto);
+	countRuleHit(rn, cls, now, skbSegs(skb), skb->len);
+	if(now != NULL) {
+		ret = *now;
+		*isMatch = 1;
+	}
+	rcu_read_unlock();
+	return ret;
+}
@@ -0,0 +1,80 @@
+#include "tools.h"
+#include "helper.h"
+
+// 各钩子点的耗时统计，每个CPU一份
+static DEFINE_PER_CPU(struct HookStat [HOOK_STAT_NUM], hookStats);
+
+/**
+ * @brief 记录一次钩子调用的耗时
+ * @param hook 钩子点(HOOK_STAT_*)
+ * @param cycles 本次调用的CPU周期数
+ * @note 数据包路径调用；各字段分别用 this_cpu 操作累加，调用期间被迁移到其他CPU也不会丢失计数
+ */
+void hookStatAdd(unsigned int hook, cycles_t cycles) {
+    unsigned int bucket = min_t(unsigned int, fls64(cycles), HOOK_HIST_BUCKETS - 1);
+    this_cpu_inc(hookStats[hook].calls);
+    this_cpu_add(hookStats[hook].cycles, cycles);
+    this_cpu_inc(hookStats[hook].hist[bucket]);
+}
+
+// 汇总各CPU的钩子耗时统计
+static void sumHookStats(struct HookStat *out) {
+    struct HookStat *s;
+    int cpu, h, b;
+    memset(out, 0, sizeof(struct HookStat) * HOOK_STAT_NUM);
+    for_each_possible_cpu(cpu) {
+        s = per_cpu(hookStats, cpu);
+        for(h = 0; h < HOOK_STAT_NUM; h++) {
+            out[h].calls += READ_ONCE(s[h].calls);
+            out[h].cycles += READ_ONCE(s[h].cycles);
+            for(b = 0; b < HOOK_HIST_BUCKETS; b++)
+                out[h].hist[b] += READ_ONCE(s[h].hist[b]);
+        }
+    }
+}
+
+/**
+ * @brief 生成统计响应
+ * @param net 网络命名空间
+ * @param len [out] 响应长度
+ * @return void* 成功返回响应数据(需要调用者以kvfree释放)，失败返回NULL
+ * @note 过滤规则与NAT规则分别在各自的锁下汇总，两者之间规则可能变化；
+ *       钩子耗时为全部命名空间的合计，NAT规则计数只出现在初始命名空间的响应中
+ */
+void *formAllStats(struct net *net, unsigned int *len) {
+    struct KernelResponseHeader *head;
+    struct FwStatsHead *body;
+    struct RuleStat *rules, *nats = NULL, deflt;
+    unsigned int ruleNum, natNum = 0;
+    void *mem = NULL;
+
+    rules = formIPRuleStats(net, &ruleNum, &deflt);
+    if(rules == NULL)
+        return NULL;
+    if(net_eq(net, &init_net)) {
+        nats = formNATRuleStats(&natNum);
+        if(nats == NULL)
+            goto out;
+    }
+    *len = sizeof(struct KernelResponseHeader) + sizeof(struct FwStatsHead) +
+        sizeof(struct RuleStat) * (ruleNum + natNum);
+    mem = kvzalloc(*len, GFP_KERNEL);
+    if(mem == NULL) {
+        printk(KERN_WARNING "[fw stats] kvzalloc fail.\n");
+        goto out;
+    }
+    head = (struct KernelResponseHeader *)mem;
+    head->bodyTp = RSP_Stats;
+    head->arrayLen = ruleNum + natNum;
+    body = (struct FwStatsHead *)(mem + sizeof(struct KernelResponseHeader));
+    sumHookStats(body->hooks);
+    body->deflt = deflt;
+    body->ruleNum = ruleNum;
+    body->natNum = natNum;
+    memcpy(body + 1, rules, sizeof(struct RuleStat) * ruleNum);
+    memcpy((struct RuleStat *)(body + 1) + ruleNum, nats, sizeof(struct RuleStat) * natNum);
+out:
+    kvfree(rules);
+    kvfree(nats);
+    return mem;
+}
@@ -2,12 +2,93 @@
 #include "helper.h" // 包含之前注释过的 netlink_helper.h 或类似文件，定义了 IPRule, connNode, matchIPRules, hasConn, addConn, addLogBySKB 等
 #include "hook.h"   // 包含此钩子函数自身相关的声明或 Netfilter 注册信息 (可能)
 
-// 定义默认的防火墙动作，初始化为 NF_ACCEPT，表示默认允许所有数据包通过。
-// NF_ACCEPT 和 NF_DROP 是 Netfilter 定义的宏，分别代表接受和丢弃数据包。
-unsigned int DEFAULT_ACTION = NF_ACCEPT;
+// 规则、连接与日志都属于数据包所在的网络命名空间 (state->net)，默认动作也按命名空间分别设置。
 
 /**
- * @brief hook_main Netfilter 钩子函数
+ * @brief 用本数据包的TCP标志推进连接状态。
+ *
+ * @param conn 数据包所属方向的连接节点，可为NULL。
+ * @param skb 当前数据包。
+ * @param proto 传输层协议。
+ * @param thoff 传输层头部在 skb 中的偏移 (IPv4 为首部长度，IPv6 为跳过扩展头之后的位置)。
+ *
+ * @功能描述: 仅处理TCP；通过 `skb_header_pointer` 读取TCP头部，头部不完整或 thoff 为负 (非首个分片) 时不做任何改动。
+ */
+static void trackTCPState(struct connNode *conn, struct sk_buff *skb, u_int8_t proto, int thoff) {
+    struct tcphdr _th, *th;
+    if(conn == NULL || proto != IPPROTO_TCP || thoff < 0)
+        return;
+    th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+    if(th != NULL)
+        updateConnState(conn, th);
+}
+
+/**
+ * @brief 向规则命中事件组推送一次命中。
+ *
+ * @param net 数据包所在的网络命名空间，事件只发给该命名空间中的监听者。
+ * @param rule 命中的规则。
+ * @param sip 源IP (主机字节序)，dip/sport/dport/proto 同数据包。
+ *
+ * @功能描述: 无监听者时调用方已跳过，这里只负责填写事件。
+ */
+static void ruleHitEvent(struct net *net, struct IPRule *rule, unsigned int sip, unsigned int dip,
+        unsigned short sport, unsigned short dport, u_int8_t proto) {
+    struct FwEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EVT_RULE_HIT;
+    ev.tm = ktime_get_real_seconds();
+    ev.conn.family = AF_INET;
+    ev.conn.saddr = sip;
+    ev.conn.daddr = dip;
+    ev.conn.sport = sport;
+    ev.conn.dport = dport;
+    ev.conn.protocol = proto;
+    ev.conn.natType = NAT_TYPE_NO;
+    memcpy(ev.ruleName, rule->name, sizeof(ev.ruleName));
+    ev.action = rule->action;
+    nlSendEvent(net, FW_GROUP_RULE, &ev);
+}
+
+// ruleHitEvent 的IPv6版本，地址填写在 conn.saddr6/daddr6 中
+static void ruleHitEvent6(struct net *net, struct IPRule *rule, struct ipv6hdr *header,
+        unsigned short sport, unsigned short dport, u_int8_t proto) {
+    struct FwEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EVT_RULE_HIT;
+    ev.tm = ktime_get_real_seconds();
+    ev.conn.family = AF_INET6;
+    memcpy(ev.conn.saddr6, &header->saddr, sizeof(ev.conn.saddr6));
+    memcpy(ev.conn.daddr6, &header->daddr, sizeof(ev.conn.daddr6));
+    ev.conn.sport = sport;
+    ev.conn.dport = dport;
+    ev.conn.protocol = proto;
+    ev.conn.natType = NAT_TYPE_NO;
+    memcpy(ev.ruleName, rule->name, sizeof(ev.ruleName));
+    ev.action = rule->action;
+    nlSendEvent(net, FW_GROUP_RULE, &ev);
+}
+
+// 拒绝缓存的键：IPv4地址放在 s6_addr32[3]，与IPv6的键互不相交
+static void denyKeyOf(struct denyKey *key, unsigned int sip, unsigned int dip,
+        unsigned short sport, unsigned short dport, u_int8_t proto) {
+    memset(key, 0, sizeof(*key));
+    key->saddr.s6_addr32[3] = sip;
+    key->daddr.s6_addr32[3] = dip;
+    key->ports = ((u32)sport << 16) | dport;
+    key->proto = proto;
+}
+
+static void denyKeyOf6(struct denyKey *key, const struct ipv6hdr *header,
+        unsigned short sport, unsigned short dport, u_int8_t proto) {
+    key->saddr = header->saddr;
+    key->daddr = header->daddr;
+    key->ports = ((u32)sport << 16) | dport;
+    key->proto = proto | DENY_KEY_V6;
+}
+
+/**
+ * @brief hook_main 的过滤逻辑 (IPv4)
  *
  * @param priv 传递给钩子函数的私有数据指针 (在此示例中未使用)。
  * @param skb 指向当前正在被处理的网络数据包的套接字缓冲区 (struct sk_buff) 的指针。
@@ -21,29 +102,43 @@ unsigned int DEFAULT_ACTION = NF_ACCEPT;
  *   1. 从数据包中提取源/目的IP地址和端口号。
  *   2. 检查连接池中是否已存在该数据包对应的连接记录。
  *      - 如果存在，并且该连接标记为需要日志，则记录日志，然后直接接受 (NF_ACCEPT) 该数据包，以提高效率。
- *   3. 如果连接池中不存在该连接，则尝试匹配已定义的IP防火墙规则。
+ *   3. 如果连接池中不存在该连接，且默认动作为丢弃，先查拒绝缓存：该五元组在当前规则下刚被默认动作
+ *      丢弃过时直接丢弃，只累加默认动作的计数。否则尝试匹配已定义的IP防火墙规则。
  *      - 如果匹配到规则：
  *          - 根据规则设置处理动作 (action)，可能是接受或丢弃。
+ *          - 规则设置了限速 (`rate`) 时，该源前缀的新建连接超出速率则改为丢弃。
  *          - 如果规则要求记录日志，则记录日志。
+ *          - 有监听者时向 `FW_GROUP_RULE` 多播组推送规则命中事件。
+ *      - 未匹配任何规则、按默认动作丢弃时，把五元组记入拒绝缓存，同一流随后的数据包不再匹配规则。
  *   4. 如果最终的动作是接受 (NF_ACCEPT)，则将此新连接添加到连接池中，并标记是否需要日志。
+ *      连接无法加入连接池 (满表且未能淘汰旧连接，或内存不足) 时丢弃该数据包。
+ *   对于TCP，无论是已有连接还是新建连接，都用本包的标志推进连接状态，状态决定连接的超时时长。
+ *   放行的数据包所属的连接会通过 `cacheConn` 留给同一钩子点上的NAT钩子，免去一次查表。
  *   5. 返回最终确定的处理动作 (action)。
  */
-unsigned int hook_main(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+static unsigned int filterIPv4(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
     struct IPRule rule;             // 用于存储匹配到的IP规则。
     struct connNode *conn;          // 指向连接池中查找到的连接节点的指针。
     unsigned short sport, dport;    // 分别存储源端口号和目的端口号。
-    unsigned int sip, dip, action = DEFAULT_ACTION; // sip: 源IP, dip: 目的IP, action: 对数据包的最终处理动作，默认为 DEFAULT_ACTION。
+    unsigned int sip, dip, action;  // sip: 源IP, dip: 目的IP, action: 对数据包的最终处理动作，默认为本命名空间的默认动作。
+    unsigned int gen;               // 开始判定前的规则代数，拒绝缓存据此判断条目是否仍然有效。
+    struct denyKey key;             // 拒绝缓存的键。
     int isMatch = 0;                // 标志位，指示是否匹配到IP规则 (0: 未匹配, 1: 匹配)。
     int isLog = 0;                  // 标志位，指示此数据包是否需要记录日志 (0: 不需要, 1: 需要)。
+    int thoff;                      // TCP头部的偏移，非首个分片为-1。
 
     // 初始化
 	// ip_hdr(skb): 从 sk_buff 中获取IP头部的指针。
 	struct iphdr *header = ip_hdr(skb);
-	// getPort(skb, header, &sport, &dport): 自定义函数 (可能在 tools.h 中定义)，
+	// getPort(state->net, skb, header, &sport, &dport): 自定义函数 (可能在 tools.h 中定义)，
 	// 用于从 skb 和 IP 头部中提取传输层 (TCP/UDP) 的源端口和目的端口。
-	// 注意：此函数需要能正确处理不同协议 (如TCP, UDP, ICMP) 以及分片等情况。
-	// 对于ICMP等没有端口的协议，sport 和 dport 可能会被设置为0或特定值。
-	getPort(skb, header, &sport, &dport);
+	// 对于ICMP等没有端口的协议，sport 和 dport 被设置为0。
+	// 非首个分片沿用首个分片的端口，查不到首个分片时端口为0；传输层头部截断的数据包
+	// 无法归入任何连接，也无法按端口匹配规则，直接丢弃。
+	if(getPort(state->net, skb, header, &sport, &dport) != 0)
+		return NF_DROP;
+    // 非首个分片没有传输层头部，不能据此推进TCP状态
+    thoff = (header->frag_off & htons(IP_OFFSET)) ? -1 : header->ihl * 4;
     // ntohl(header->saddr): 将IP头部中的源IP地址从网络字节序转换为主机字节序。
     sip = ntohl(header->saddr);
     // ntohl(header->daddr): 将IP头部中的目的IP地址从网络字节序转换为主机字节序。
@@ -51,38 +146,57 @@ unsigned int hook_main(void *priv, struct sk_buff *skb, const struct nf_hook_sta
 
     // 查询是否有已有连接
     // hasConn(sip, dip, sport, dport): 调用连接池的函数，检查是否存在与当前数据包五元组匹配的活动连接。
-    conn = hasConn(sip, dip, sport, dport);
+    conn = hasConn(state->net, sip, dip, sport, dport);
     if(conn != NULL) { // 如果找到了已存在的连接
         if(conn->needLog) { // 如果此连接被标记为需要记录日志
             // addLogBySKB(action, skb): 根据当前数据包和确定的动作 (这里因为是已有连接，通常是NF_ACCEPT) 记录日志。
-            // 注意：这里的 action 还是初始的 DEFAULT_ACTION (NF_ACCEPT)。如果已有连接本身有特定策略，这里可能需要调整。
+            // 注意：这里的 action 还是初始的默认动作。如果已有连接本身有特定策略，这里可能需要调整。
             // 但通常对于已建立的连接，快速路径是直接接受。
-            addLogBySKB(NF_ACCEPT, skb); // 对于已存在的连接，我们通常直接接受它，并按需记录日志
+            addLogBySKB(state->net, NF_ACCEPT, skb); // 对于已存在的连接，我们通常直接接受它，并按需记录日志
         }
+        trackTCPState(conn, skb, header->protocol, thoff);
+        cacheConn(skb, state, conn); // 同一钩子点上的NAT钩子直接复用此连接
         // 对于已存在且活跃的连接，通常快速放行，不再进行规则匹配。
         // 同时，hasConn 内部可能已经刷新了该连接的超时时间。
         return NF_ACCEPT; // 返回接受，数据包继续在协议栈中处理。
     }
 
+    // 先取规则代数再读默认动作：读到新代数时一定也读到新的默认动作与规则集
+    gen = denyCacheGen();
+    action = getDefaultAction(state->net);
+    if(action == NF_DROP) {
+        denyKeyOf(&key, sip, dip, sport, dport, header->protocol);
+        if(denyCacheHas(state->net, gen, &key)) {
+            countDefaultHit(state->net, skbSegs(skb), skb->len);
+            return NF_DROP;
+        }
+    }
+
     // 如果没有找到已存在的连接，则需要进行规则匹配
-    // matchIPRules(skb, &isMatch): 调用IP规则匹配函数。
-    // skb: 当前数据包。
+    // matchIPRules(skb, sport, dport, &isMatch): 调用IP规则匹配函数。
+    // skb: 当前数据包；sport/dport: 上面已解析出的端口，不再重复读取传输层头部。
     // &isMatch: 输出参数，如果匹配到规则，*isMatch 会被设置为1。
     // 返回值: 如果匹配成功，返回匹配到的 IPRule 结构体副本；否则内容未定义或为特定初始值。
-    rule = matchIPRules(skb, &isMatch);
+    rule = matchIPRules(state->net, skb, sport, dport, &isMatch);
     if(isMatch) { // 如果匹配到了一条规则
-        // printk(KERN_DEBUG ...): 内核打印调试信息，显示匹配到的规则名称。
-        printk(KERN_DEBUG "[fw netfilter] patch rule %s.\n", rule.name);
         // 根据匹配到的规则设置处理动作。
         // rule.action 存储的是规则定义的动作 (应该是 NF_ACCEPT 或 NF_DROP)。
         action = (rule.action == NF_ACCEPT) ? NF_ACCEPT : NF_DROP;
+        // 限速规则：该源前缀的新建连接超出速率时丢弃，不再为其分配连接节点
+        if(action == NF_ACCEPT && rule.rate != 0 && !rateLimitAdmit(state->net, &rule, sip))
+            action = NF_DROP;
         if(rule.log) { // 如果规则要求记录日志
             isLog = 1; // 设置日志标记为1
             // addLogBySKB(action, skb): 根据当前数据包和规则决定的动作记录日志。
-            addLogBySKB(action, skb);
+            addLogBySKB(state->net, action, skb);
         }
+        if(nlHasListeners(state->net, FW_GROUP_RULE))
+            ruleHitEvent(state->net, &rule, sip, dip, sport, dport, header->protocol);
+    } else if(action == NF_DROP) {
+        // 如果 isMatch 为 0 (即没有匹配到任何自定义规则)，action 将保持为默认动作。
+        // 默认动作为丢弃时记下该五元组，同一流随后的数据包在拒绝缓存中即可判定。
+        denyCacheAdd(state->net, gen, &key);
     }
-    // 如果 isMatch 为 0 (即没有匹配到任何自定义规则)，action 将保持为 DEFAULT_ACTION。
 
     // 更新连接池
     if(action == NF_ACCEPT) { // 如果最终的处理动作是接受数据包
@@ -90,11 +204,107 @@ unsigned int hook_main(void *priv, struct sk_buff *skb, const struct nf_hook_sta
         // 将这个新的连接添加到连接池中。
         // header->protocol: IP头部中的协议字段 (例如 IPPROTO_TCP, IPPROTO_UDP)。
         // isLog: 传递之前根据规则确定的日志标记，新连接将继承此日志属性。
-        addConn(sip, dip, sport, dport, header->protocol, isLog);
+        conn = addConn(state->net, sip, dip, sport, dport, header->protocol, isLog);
+        if(conn == NULL) // 连接池已满或分配失败：不放行无法跟踪的新连接
+            return NF_DROP;
+        trackTCPState(conn, skb, header->protocol, thoff);
+        cacheConn(skb, state, conn);
     }
 
     // 返回最终的处理动作给Netfilter框架。
     // 如果是 NF_DROP，数据包将被丢弃。
     // 如果是 NF_ACCEPT，数据包将继续沿协议栈向上传递或转发。
     return action;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief hook_main6 的过滤逻辑 (IPv6)
+ *
+ * @param priv 未使用。
+ * @param skb 当前正在被处理的IPv6数据包。
+ * @param state 钩子调用的状态信息。
+ * @return unsigned int NF_ACCEPT 或 NF_DROP。
+ *
+ * @功能描述:
+ *   流程与 `hook_main` 相同：先查IPv6连接表，命中则放行；默认丢弃时再查拒绝缓存；否则匹配IPv6规则，
+ *   放行的新连接加入连接池，与IPv4连接共用超时、上限与事件。
+ *   与IPv4不同的是上层协议与端口要在跳过扩展头之后才能取得，扩展头无法解析的报文直接丢弃。
+ *   NAT只支持IPv4，因此这里不为NAT钩子缓存连接。
+ */
+static unsigned int filterIPv6(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+    struct ipv6hdr *header = ipv6_hdr(skb);
+    struct connNode *conn;
+    struct IPRule rule;
+    unsigned short sport, dport;
+    unsigned int action, gen;
+    struct denyKey key;
+    u_int8_t proto;
+    int thoff, isMatch = 0, isLog = 0;
+
+    thoff = getPort6(skb, &proto, &sport, &dport);
+    if(thoff < 0)
+        return NF_DROP;
+    conn = hasConn6(state->net, &header->saddr, &header->daddr, sport, dport);
+    if(conn != NULL) {
+        if(conn->needLog)
+            addLogBySKB6(state->net, NF_ACCEPT, skb, thoff, proto, sport, dport);
+        trackTCPState(conn, skb, proto, thoff);
+        return NF_ACCEPT;
+    }
+    gen = denyCacheGen();
+    action = getDefaultAction(state->net);
+    if(action == NF_DROP) {
+        denyKeyOf6(&key, header, sport, dport, proto);
+        if(denyCacheHas(state->net, gen, &key)) {
+            countDefaultHit(state->net, skbSegs(skb), skb->len);
+            return NF_DROP;
+        }
+    }
+    rule = matchIPRules6(state->net, skb, proto, sport, dport, &isMatch);
+    if(isMatch) {
+        action = (rule.action == NF_ACCEPT) ? NF_ACCEPT : NF_DROP;
+        if(action == NF_ACCEPT && rule.rate != 0 && !rateLimitAdmit6(state->net, &rule, &header->saddr))
+            action = NF_DROP;
+        if(rule.log) {
+            isLog = 1;
+            addLogBySKB6(state->net, action, skb, thoff, proto, sport, dport);
+        }
+        if(nlHasListeners(state->net, FW_GROUP_RULE))
+            ruleHitEvent6(state->net, &rule, header, sport, dport, proto);
+    } else if(action == NF_DROP)
+        denyCacheAdd(state->net, gen, &key);
+    if(action == NF_ACCEPT) {
+        conn = addConn6(state->net, &header->saddr, &header->daddr, sport, dport, proto, isLog);
+        if(conn == NULL)
+            return NF_DROP;
+        trackTCPState(conn, skb, proto, thoff);
+    }
+    return action;
+}
+
+// 过滤钩子按所在钩子点计入耗时统计，IPv4与IPv6共用
+#define filterStatOf(state) ((state)->hook == NF_INET_PRE_ROUTING ? HOOK_STAT_FILTER_IN : HOOK_STAT_FILTER_OUT)
+
+/**
+ * @brief IPv4 过滤钩子，注册在 PRE_ROUTING 与 POST_ROUTING。
+ *
+ * @功能描述: 执行 `filterIPv4` 并以 `get_cycles` 记录其耗时。
+ */
+unsigned int hook_main(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+    cycles_t start = get_cycles();
+    unsigned int ret = filterIPv4(priv, skb, state);
+    hookStatAdd(filterStatOf(state), get_cycles() - start);
+    return ret;
+}
+
+/**
+ * @brief IPv6 过滤钩子，注册在 PRE_ROUTING 与 POST_ROUTING。
+ *
+ * @功能描述: 执行 `filterIPv6` 并记录其耗时。
+ */
+unsigned int hook_main6(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+    cycles_t start = get_cycles();
+    unsigned int ret = filterIPv6(priv, skb, state);
+    hookStatAdd(filterStatOf(state), get_cycles() - start);
+    return ret;
+}
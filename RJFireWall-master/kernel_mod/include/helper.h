@@ -18,6 +18,27 @@
 #define REQ_ADDNATRule 7     // 请求：添加一条NAT规则
 #define REQ_DELNATRule 8     // 请求：删除一条NAT规则
 #define REQ_GETNATRules 9    // 请求：获取所有NAT规则
+#define REQ_GETTimeouts 16   // 请求：获取连接超时配置
+#define REQ_SETTimeouts 17   // 请求：设置连接超时配置
+#define REQ_GETConnStats 19  // 请求：获取连接池容量与满表统计
+#define REQ_SETConnLimit 20  // 请求：设置连接数上限与满表策略
+#define REQ_BeginIPRules 23  // 请求：开始批量规则事务 (msg.num 为 IPRULE_BATCH_*)
+#define REQ_ChunkIPRules 24  // 请求：向事务追加一段规则 (msg.num 条 IPRule 紧跟在请求之后)
+#define REQ_CommitIPRules 25 // 请求：提交批量规则事务
+#define REQ_AbortIPRules 26  // 请求：放弃批量规则事务
+#define REQ_GETStats 27      // 请求：获取规则命中计数与钩子耗时统计
+#define REQ_GETConnSnap 29   // 请求：导出连接表快照 (只以 NLM_F_DUMP 分段导出)
+#define REQ_LoadConns 30     // 请求：导入一段连接快照 (msg.num 条 ConnSnap 紧跟在请求之后)
+#define REQ_ADDDNATRule 32   // 请求：添加一条DNAT (端口转发) 规则
+#define REQ_DELDNATRule 33   // 请求：删除一条DNAT规则 (按 msg.dnatRule 的地址、端口与协议)
+#define REQ_GETDNATRules 34  // 请求：获取所有DNAT规则
+#define REQ_BeginIPSet 36    // 请求：开始一个地址集合事务 (msg.ipSet 指定集合、类型与模式)
+#define REQ_ChunkIPSet 37    // 请求：向集合事务追加一段条目 (msg.num 个 IPSetEntry 紧跟在请求之后)
+#define REQ_CommitIPSet 38   // 请求：提交地址集合事务
+#define REQ_AbortIPSet 39    // 请求：放弃地址集合事务
+#define REQ_DestroyIPSet 40  // 请求：删除编号为 msg.num 的地址集合
+#define REQ_GETIPSets 41     // 请求：获取所有地址集合的概要 (只以 NLM_F_DUMP 分段导出)
+#define REQ_GETIPSetEntries 42 // 请求：获取编号为 msg.num 的集合的条目 (只以 NLM_F_DUMP 分段导出)
 
 // 定义响应类型常量，用于内核向APP发送响应时标识消息体内容类型。
 #define RSP_Only_Head 10     // 响应：仅包含头部信息 (通常表示操作成功或失败，无额外数据)
@@ -26,6 +47,21 @@
 #define RSP_IPLogs 13        // 响应：IP日志列表 (消息体是 IPLog 结构体数组)
 #define RSP_NATRules 14      // 响应：NAT规则/记录列表 (消息体是 NATRecord 结构体数组)
 #define RSP_ConnLogs 15      // 响应：连接日志/信息列表 (消息体是 ConnLog 结构体数组)
+#define RSP_Timeouts 18      // 响应：连接超时配置 (消息体是一个 ConnTimeouts 结构体)
+#define RSP_ConnStats 21     // 响应：连接池统计 (消息体是一个 ConnStats 结构体)
+#define RSP_Event 22         // 多播事件 (消息体是一个 FwEvent 结构体)
+#define RSP_Stats 28         // 响应：命中与耗时统计 (消息体是一个 FwStatsHead 加 RuleStat 数组)
+#define RSP_ConnSnap 31      // 响应：连接快照 (消息体是 ConnSnap 结构体数组)
+#define RSP_DNATRules 35     // 响应：DNAT规则列表 (消息体是 DNATRule 结构体数组)
+#define RSP_IPSets 43        // 响应：地址集合概要 (消息体是 IPSetInfo 结构体数组)
+#define RSP_IPSetEntries 44  // 响应：地址集合条目 (消息体是 IPSetEntry 结构体数组)
+
+// 批量规则事务的模式与大小限制
+#define IPRULE_BATCH_REPLACE 1  // 提交时用暂存的规则替换整个规则链
+#define IPRULE_BATCH_APPEND 2   // 提交时把暂存的规则追加到规则链末尾
+#define IPRULE_BATCH_CHUNK 256  // 每条 REQ_ChunkIPRules 请求最多携带的规则数
+#define CONN_SNAP_CHUNK 256     // 每条 REQ_LoadConns 请求最多携带的连接数
+#define IPRULE_BATCH_MAX 65536  // 一个事务最多暂存的规则数
 
 /**
  * @brief IP规则结构体 (IPRule)
@@ -40,8 +76,18 @@ struct IPRule {
     unsigned int sport;          // 源端口号范围。高2字节表示最小端口，低2字节表示最大端口。0表示任意端口。
     unsigned int dport;          // 目的端口号范围。同上。0表示任意端口。
     u_int8_t protocol;           // 协议类型 (例如 TCP, UDP, ICMP)
+    u_int8_t family;             // 地址族：0 或 AF_INET 为IPv4规则；AF_INET6 为IPv6规则，此时使用下面的 v6 字段
+    u_int8_t splen;              // IPv6 源地址前缀长度 (0-128)
+    u_int8_t dplen;              // IPv6 目的地址前缀长度 (0-128)
     unsigned int action;         // 对匹配此规则的数据包采取的动作 (例如允许、拒绝)
     unsigned int log;            // 是否记录日志 (1表示记录，0表示不记录)
+    unsigned int saddr6[4];      // IPv6 源地址 (网络字节序)
+    unsigned int daddr6[4];      // IPv6 目的地址 (网络字节序)
+    unsigned int rate;           // 限速：每个源前缀每秒允许新建的连接数，0表示不限速 (仅对放行规则有效)
+    unsigned int burst;          // 限速：令牌桶容量，即每个源前缀可瞬间新建的连接数，0表示等于 rate
+    u_int8_t limitPlen;          // 限速：按源地址的前多少位归为同一个源前缀 (IPv4 0-32，IPv6 0-128)
+    u_int8_t sset;               // 源地址须属于此编号的地址集合 (IPSET_MAX 以内)，0表示不引用集合；只用于IPv4规则
+    u_int8_t dset;               // 目的地址须属于此编号的地址集合，同上
     struct IPRule* nx;           // 指向下一条IP规则的指针 (用于在内核中形成链表，在与用户空间交互时可能不直接使用)
 };
 
@@ -56,8 +102,11 @@ struct IPLog {
     unsigned short sport;        // 源端口号 (网络字节序)
     unsigned short dport;        // 目的端口号 (网络字节序)
     u_int8_t protocol;           // 协议类型
+    u_int8_t family;             // 地址族 (AF_INET 或 AF_INET6)，IPv6 时地址在 saddr6/daddr6 中
     unsigned int len;            // 数据包长度
     unsigned int action;         // 对该数据包采取的动作
+    unsigned int saddr6[4];      // IPv6 源地址 (网络字节序)
+    unsigned int daddr6[4];      // IPv6 目的地址 (网络字节序)
     struct IPLog* nx;            // 指向下一条IP日志的指针 (用于内核中可能的链式存储)
 };
 
@@ -77,6 +126,69 @@ struct NATRecord {
     struct NATRecord* nx;       // 指向下一条NAT记录/规则的指针 (用于内核中可能的链式存储)
 };
 
+// 一条DNAT规则最多的后端数
+#define DNAT_MAX_BACKENDS 8
+
+/**
+ * @brief DNAT后端 (DNATBackend)
+ */
+struct DNATBackend {
+    unsigned int addr;          // 后端IP地址 (主机字节序)
+    unsigned short port;        // 后端端口，0表示沿用原目的端口
+    unsigned short pad;
+};
+
+/**
+ * @brief DNAT (端口转发) 规则结构体 (DNATRule)
+ * @功能描述: 以 (daddr, dport, protocol) 为键，到达该地址与端口的新连接被转发到某一个后端。
+ *           有多个后端时按 (源IP, 源端口) 做一致性哈希选择，增删后端只影响落在该后端上的新连接。
+ */
+struct DNATRule {
+    unsigned int daddr;         // 被访问的目的IP地址 (主机字节序)
+    unsigned short dport;       // 被访问的目的端口
+    u_int8_t protocol;          // IPPROTO_TCP 或 IPPROTO_UDP
+    u_int8_t backendNum;        // 后端个数 (1 ~ DNAT_MAX_BACKENDS)
+    struct DNATBackend backends[DNAT_MAX_BACKENDS];
+};
+
+// 地址集合：过滤规则以编号引用，集合内容可整体替换或增删，而不改动规则链
+#define IPSET_MAX 64               // 集合编号为 1 ~ IPSET_MAX
+#define IPSET_TYPE_HASH 1          // 单个IPv4地址的哈希集合，条目前缀长度必须为32
+#define IPSET_TYPE_NET 2           // IPv4前缀集合
+#define IPSET_MODE_REPLACE 1       // 提交时替换集合的全部条目 (集合不存在时创建)
+#define IPSET_MODE_ADD 2           // 提交时把条目加入已有集合
+#define IPSET_MODE_DEL 3           // 提交时从已有集合删除条目
+#define IPSET_CHUNK 2048           // 每条 REQ_ChunkIPSet 请求最多携带的条目数
+#define IPSET_MAX_ENTRIES (1<<21)  // 一个集合最多的条目数
+
+/**
+ * @brief 地址集合事务的参数 (IPSetHead)
+ * @功能描述: 替换模式下 type 为集合类型；增删模式下 type 为0或与已有集合相同。
+ */
+struct IPSetHead {
+    u_int8_t id;                // 集合编号
+    u_int8_t type;              // IPSET_TYPE_*
+    u_int8_t mode;              // IPSET_MODE_*
+    u_int8_t pad;
+};
+
+/**
+ * @brief 地址集合条目 (IPSetEntry)
+ */
+struct IPSetEntry {
+    unsigned int addr;          // IPv4地址或前缀 (主机字节序)
+    unsigned int plen;          // 前缀长度 (0-32)
+};
+
+/**
+ * @brief 地址集合概要 (IPSetInfo)
+ */
+struct IPSetInfo {
+    unsigned int id;
+    unsigned int type;
+    unsigned int num;           // 条目数
+};
+
 /**
  * @brief 连接日志/信息结构体 (ConnLog)
  * @功能描述: 定义一条网络连接的详细信息，包括可能的NAT转换。
@@ -87,8 +199,131 @@ struct ConnLog {
     unsigned short sport;       // 连接的源端口号
     unsigned short dport;       // 连接的目的端口号
     u_int8_t protocol;          // 连接的协议类型
+    u_int8_t family;            // 地址族 (AF_INET 或 AF_INET6)，IPv6 时地址在 saddr6/daddr6 中
     int natType;                // NAT转换类型 (例如 NAT_TYPE_NO, NAT_TYPE_SRC)
-    struct NATRecord nat;       // 该连接对应的NAT记录信息
+    struct NATRecord nat;       // 该连接对应的NAT记录信息 (仅IPv4)
+    unsigned int saddr6[4];     // IPv6 源地址 (网络字节序)
+    unsigned int daddr6[4];     // IPv6 目的地址 (网络字节序)
+};
+
+/**
+ * @brief 连接快照结构体 (ConnSnap)
+ * @功能描述: 连接表导出/导入时使用的记录，在 ConnLog 之外保存恢复连接所需的状态。
+ */
+struct ConnSnap {
+    struct ConnLog conn;        // 连接键、协议、地址族与NAT记录
+    unsigned int ttl;           // 导出时剩余的存活时间 (秒)
+    u_int8_t state;             // TCP连接状态 (CONN_TCP_*)
+    u_int8_t needLog;           // 是否为该连接的数据包记录日志
+};
+
+/**
+ * @brief 连接超时配置结构体 (ConnTimeouts)
+ * @功能描述: 按协议及TCP状态划分的连接存活时长（秒）。
+ *           设置时值为0的字段保持内核中的原值不变。
+ */
+struct ConnTimeouts {
+    unsigned int tcpSyn;     // TCP握手阶段 (只见过SYN)
+    unsigned int tcpEst;     // TCP已建立
+    unsigned int tcpFin;     // TCP关闭中 (见过FIN)
+    unsigned int tcpClose;   // TCP已关闭 (见过RST)
+    unsigned int udp;        // UDP
+    unsigned int icmp;       // ICMP
+    unsigned int other;      // 其他协议
+};
+
+// 连接池满时对新连接的处理策略
+#define CONN_FULL_DROP 1   // 丢弃新连接的数据包
+#define CONN_FULL_EVICT 2  // 在最先检查的一批连接中淘汰最早到期的一个，为新连接腾出位置
+
+/**
+ * @brief 连接池容量配置结构体 (ConnLimit)
+ * @功能描述: 设置时值为0的字段保持内核中的原值不变。
+ */
+struct ConnLimit {
+    unsigned int maxConns;   // 连接数上限
+    unsigned int policy;     // 满表策略 (CONN_FULL_DROP 或 CONN_FULL_EVICT)
+};
+
+/**
+ * @brief 连接池统计结构体 (ConnStats)
+ * @功能描述: 描述连接池当前的容量、配置以及自模块加载以来的满表计数。
+ */
+struct ConnStats {
+    unsigned int connNum;    // 当前连接数
+    unsigned int maxConns;   // 连接数上限
+    unsigned int policy;     // 满表策略
+    unsigned int prealloc;   // 预留的节点数 (模块参数 conn_prealloc)
+    unsigned int tableFull;  // 新建连接时触及上限的次数
+    unsigned int evicted;    // 因满表被淘汰的连接数
+    unsigned int allocFail;  // 节点内存分配失败的次数
+};
+
+// 统计钩子耗时的钩子点，IPv6过滤钩子计入同一钩子点的过滤统计
+#define HOOK_STAT_FILTER_IN 0   // 过滤钩子 (PRE_ROUTING)
+#define HOOK_STAT_FILTER_OUT 1  // 过滤钩子 (POST_ROUTING)
+#define HOOK_STAT_NAT_IN 2      // DNAT钩子 (PRE_ROUTING)
+#define HOOK_STAT_NAT_OUT 3     // SNAT钩子 (POST_ROUTING)
+#define HOOK_STAT_NUM 4
+#define HOOK_HIST_BUCKETS 32    // 桶0为0个周期，桶i (i>0) 为 [2^(i-1), 2^i) 个周期，最后一个桶不设上限
+
+/**
+ * @brief 钩子耗时统计结构体 (HookStat)
+ * @功能描述: 钩子函数自进入到返回所用的CPU周期数 (get_cycles) 的调用次数、总和与对数直方图。
+ */
+struct HookStat {
+    unsigned long long calls;                     // 调用次数
+    unsigned long long cycles;                    // 周期数总和
+    unsigned long long hist[HOOK_HIST_BUCKETS];   // 各耗时区间的调用次数
+};
+
+/**
+ * @brief 规则命中统计结构体 (RuleStat)
+ * @功能描述: 一条过滤规则或NAT规则命中的数据包数与字节数。过滤规则只在新连接的首包上匹配，
+ *           已有连接的后续数据包走连接池快速路径，不计入规则；NAT规则在连接绑定SNAT时计数。
+ */
+struct RuleStat {
+    char name[MAXRuleNameLen+1];   // 过滤规则的名称，NAT规则为空
+    unsigned int index;            // 规则在链表中的序号
+    unsigned long long packets;    // 命中的数据包数
+    unsigned long long bytes;      // 命中的字节数
+};
+
+/**
+ * @brief 统计响应的头部 (FwStatsHead)
+ * @功能描述: RSP_Stats 的消息体以此开头，其后依次是 ruleNum 个过滤规则与 natNum 个NAT规则的 RuleStat。
+ */
+struct FwStatsHead {
+    struct HookStat hooks[HOOK_STAT_NUM]; // 各钩子点的耗时统计 (HOOK_STAT_*)
+    struct RuleStat deflt;                // 未命中任何规则、按默认动作处理的新连接
+    unsigned int ruleNum;                 // 过滤规则条数
+    unsigned int natNum;                  // NAT规则条数
+};
+
+// 多播组，用户空间绑定时 nl_groups 取 1 << (组号-1)
+#define FW_GROUP_CONN 1      // 连接事件：新建、NAT绑定、超时、删除
+#define FW_GROUP_RULE 2      // 规则命中事件
+#define FW_GROUP_MAX 2
+
+// 事件类型
+#define EVT_CONN_NEW 1       // 新建连接
+#define EVT_CONN_NAT 2       // 连接绑定了NAT记录
+#define EVT_CONN_EXPIRED 3   // 连接超时
+#define EVT_CONN_DEL 4       // 连接因满表淘汰或规则变化被删除
+#define EVT_RULE_HIT 5       // 数据包命中过滤规则
+
+/**
+ * @brief 多播事件结构体 (FwEvent)
+ * @功能描述: 内核以 KernelResponseHeader (bodyTp = RSP_Event) 加一个 FwEvent 的形式向多播组推送增量事件，
+ *           监听者据此维护连接表的镜像，无需反复拉取全表。
+ *           连接事件填写 conn；规则命中事件额外填写 ruleName 与 action，其中 conn 为数据包的五元组。
+ */
+struct FwEvent {
+    unsigned int type;                 // 事件类型 (EVT_*)
+    long tm;                           // 事件发生时间 (秒)
+    struct ConnLog conn;               // 连接或数据包的五元组及NAT信息
+    char ruleName[MAXRuleNameLen+1];   // 命中的规则名称
+    unsigned int action;               // 命中规则的动作
 };
 
 /**
@@ -101,8 +336,12 @@ struct APPRequest {
     union {                                   // 联合体，根据请求类型(tp)的不同，msg中存储不同的数据
         struct IPRule ipRule;                 // 当tp为 REQ_ADDIPRule 时，存储IP规则信息
         struct NATRecord natRule;             // 当tp为 REQ_ADDNATRule 时，存储NAT规则信息
+        struct DNATRule dnatRule;             // 当tp为 REQ_ADDDNATRule 或 REQ_DELDNATRule 时，存储DNAT规则
+        struct IPSetHead ipSet;               // 当tp为 REQ_BeginIPSet 时，存储集合事务的参数
         unsigned int defaultAction;           // 当tp为 REQ_SETAction 时，存储默认动作
         unsigned int num;                     // 通用数字参数，例如 REQ_GETAllIPLogs 时可能用于指定获取日志数量
+        struct ConnTimeouts timeouts;         // 当tp为 REQ_SETTimeouts 时，存储新的超时配置
+        struct ConnLimit connLimit;           // 当tp为 REQ_SETConnLimit 时，存储新的容量配置
     } msg;                                    // 请求的具体消息内容
 };
 
@@ -132,27 +371,96 @@ struct KernelResponseHeader {
 // 函数声明：
 /**
  * @brief 初始化Netlink通信。
- * @return struct sock* Netlink套接字指针，失败则返回NULL。
- * @功能描述: 创建并配置内核端的Netlink套接字，用于接收和发送消息。
+ * @return int 成功返回0，失败返回负数错误码。
+ * @功能描述: 为每个网络命名空间 (包括此后新建的) 创建内核端的Netlink套接字，用于接收和发送消息。
  */
-struct sock *netlink_init(void);
+int netlink_init(void);
 
 /**
  * @brief 释放Netlink资源。
  * @return void
- * @功能描述: 关闭并释放在netlink_init中创建的Netlink套接字。
+ * @功能描述: 关闭并释放所有命名空间中由netlink_init创建的Netlink套接字。
  */
 void netlink_release(void);
 
 /**
  * @brief 通过Netlink向用户空间进程发送数据。
+ * @param net 目标进程所在的网络命名空间。
  * @param pid 目标用户空间进程的ID。
+ * @param seq 所回复请求的序列号，用户空间据此把回复与请求对应起来。
  * @param data 指向要发送数据的指针。
  * @param len 要发送数据的长度。
  * @return int 发送成功则返回0或正数，失败则返回负数。
  * @功能描述: 内核模块使用此函数将数据通过Netlink发送给指定的用户空间应用程序。
  */
-int nlSend(unsigned int pid, void *data, unsigned int len);
+int nlSend(struct net *net, unsigned int pid, unsigned int seq, void *data, unsigned int len);
+
+/**
+ * @brief 判断命名空间内的多播组当前是否有监听者。
+ * @param net 网络命名空间。
+ * @param group 多播组 (FW_GROUP_*)。
+ * @return int 有监听者返回非0。
+ * @功能描述: 供数据包路径在构造事件之前快速判断，无人监听时不产生任何开销。
+ */
+int nlHasListeners(struct net *net, unsigned int group);
+
+/**
+ * @brief 向命名空间内的多播组推送一个事件。
+ * @param net 事件所属的网络命名空间，只有该命名空间中的监听者能收到。
+ * @param group 多播组 (FW_GROUP_*)。
+ * @param ev 要推送的事件，发送前会被复制。
+ * @return void
+ * @功能描述: 无监听者时直接返回；可在软中断上下文调用，接收缓冲区满时事件被丢弃。
+ */
+void nlSendEvent(struct net *net, unsigned int group, struct FwEvent *ev);
+
+// ----- 分段导出 (dump) 相关 -----
+// 用户空间以 NLM_F_DUMP 发出获取规则/连接/日志/NAT规则的请求时，内核通过 netlink_dump_start
+// 分多次填充消息：每条消息带 NLM_F_MULTI，内容为 KernelResponseHeader 加本段的条目，
+// 最后以 NLMSG_DONE 结束。每次只填满一个skb，遍历位置保存在 netlink_callback 中，随用户空间读取逐段推进。
+
+/**
+ * @brief 正在填充的一段导出消息。
+ */
+struct nlDump {
+    struct sk_buff *skb;
+    struct nlmsghdr *nlh;
+    struct KernelResponseHeader *head; // head->arrayLen 为本段已填充的条目数
+};
+
+/**
+ * @brief 启动一次分段导出。
+ * @param skb 用户空间的请求。
+ * @param nlh 请求的消息头。
+ * @param control 导出回调。
+ * @return int netlink_dump_start 的返回值。
+ */
+int nlDumpStart(struct sk_buff *skb, struct nlmsghdr *nlh, struct netlink_dump_control *control);
+
+/**
+ * @brief 在导出skb中开始一段消息。
+ * @param d 输出，本段的状态。
+ * @param skb 导出回调的skb。
+ * @param cb 导出回调的上下文。
+ * @param bodyTp 本段的响应类型 (RSP_*)。
+ * @return int 成功返回0，skb空间不足返回-EMSGSIZE。
+ */
+int nlDumpBegin(struct nlDump *d, struct sk_buff *skb, struct netlink_callback *cb, unsigned int bodyTp);
+
+/**
+ * @brief 在本段末尾追加一个条目。
+ * @param d 本段的状态。
+ * @param size 条目大小，须为4字节的整数倍以保持消息对齐。
+ * @return void* 条目的写入位置；skb已满返回NULL，调用者应保存位置并结束本段。
+ */
+void *nlDumpItem(struct nlDump *d, unsigned int size);
+
+/**
+ * @brief 结束本段消息。
+ * @param d 本段的状态。
+ * @return int 作为导出回调的返回值：本段有条目时返回skb长度 (继续导出)，没有条目时撤销本段并返回0 (导出结束)。
+ */
+int nlDumpEnd(struct nlDump *d);
 
 
 // ----- 应用交互相关 -------
@@ -160,55 +468,126 @@ int nlSend(unsigned int pid, void *data, unsigned int len);
 
 /**
  * @brief 处理从用户空间应用通过Netlink接收到的消息。
+ * @param net 发送方所在的网络命名空间，请求只作用于该命名空间的规则与连接。
  * @param pid 发送消息的用户空间进程ID。
+ * @param seq 请求的序列号，回复中原样带回。
  * @param msg 指向接收到的消息数据的指针 (通常是 struct APPRequest)。
  * @param len 消息数据的长度。
  * @return int 处理结果，通常0表示成功，负数表示错误。
  * @功能描述: 这是Netlink消息的主要处理入口，根据消息类型分发到不同的处理函数。
  */
-int dealAppMessage(unsigned int pid, void *msg, unsigned int len);
+int dealAppMessage(struct net *net, unsigned int pid, unsigned int seq, void *msg, unsigned int len);
+
+/**
+ * @brief 处理以 NLM_F_DUMP 发来的请求。
+ * @param skb 请求所在的skb。
+ * @param nlh 请求的消息头。
+ * @param req 请求内容。
+ * @return int 已按分段导出处理返回1；该请求类型不支持分段导出返回0，调用者应按普通请求处理。
+ * @功能描述: 规则、连接、日志与NAT规则的获取请求以分段导出的方式回复，导出启动失败时回复一条文本消息。
+ */
+int dealAppDump(struct sk_buff *skb, struct nlmsghdr *nlh, struct APPRequest *req);
 
 /**
  * @brief 构建包含所有IP规则的数据包，用于发送给用户空间。
+ * @param net 网络命名空间。
  * @param len [输出参数] 指向一个unsigned int的指针，函数会通过它返回构建的数据包的总长度。
  * @return void* 指向构建好的数据包的指针 (通常是 struct IPRule 数组，前面可能有一个 KernelResponseHeader)。如果无规则或失败，可能返回NULL。
  * @功能描述: 收集内核中当前所有的IP规则，并将其格式化为用户空间可解析的格式。
  */
-void* formAllIPRules(unsigned int *len);
+void* formAllIPRules(struct net *net, unsigned int *len);
+
+/**
+ * @brief 分段导出IP规则的回调。
+ * @功能描述: cb->args[0] 保存下一条待导出规则的序号，每次在请求方命名空间的规则锁内从链表头跳到该位置。
+ */
+int dumpIPRules(struct sk_buff *skb, struct netlink_callback *cb);
 
 /**
  * @brief 将一条IP规则添加到防火墙规则链中。
+ * @param net 规则链所属的网络命名空间。
  * @param after 一个字符串，指定新规则要插入到哪条现有规则之后。如果为空或特定值，可能表示添加到链表头部或尾部。
  * @param rule 要添加的IP规则 (struct IPRule)。
  * @return struct IPRule* 指向新添加的规则在链表中的节点，如果添加失败则返回NULL。
  * @功能描述: 在内核的IP规则链表中插入一条新的规则。
  */
-struct IPRule * addIPRuleToChain(char after[], struct IPRule rule);
+struct IPRule * addIPRuleToChain(struct net *net, char after[], struct IPRule rule);
 
 /**
  * @brief 从防火墙规则链中删除指定名称的IP规则。
+ * @param net 规则链所属的网络命名空间。
  * @param name 要删除的规则的名称。
  * @return int 成功删除返回0，未找到规则或删除失败返回负数。
  * @功能描述: 根据规则名称在内核的IP规则链表中查找并移除相应的规则。
  */
-int delIPRuleFromChain(char name[]);
+int delIPRuleFromChain(struct net *net, char name[]);
+
+/**
+ * @brief 批量规则事务：开始、追加一段规则、提交、放弃。
+ * @param net 网络命名空间，每个命名空间同时最多有一个事务。
+ * @param pid 发起事务的用户进程PID，追加/提交/放弃只接受同一PID。
+ * @功能描述: 规则先暂存，提交时在旁路构建新规则链与分类器后一次性替换，并只遍历一次连接池清除
+ *           在新规则集下不再被允许的连接。提交失败时当前规则集不变。
+ *           addIPRuleBatch 返回已暂存的规则数，commitIPRuleBatch 返回提交后的规则数，失败均返回负的错误码。
+ */
+int beginIPRuleBatch(struct net *net, unsigned int pid, unsigned int mode);
+int addIPRuleBatch(struct net *net, unsigned int pid, const struct IPRule *rules, unsigned int num);
+int commitIPRuleBatch(struct net *net, unsigned int pid);
+int abortIPRuleBatch(struct net *net, unsigned int pid);
 
 /**
  * @brief 构建包含指定数量IP日志的数据包，用于发送给用户空间。
+ * @param net 网络命名空间，只读取该命名空间的日志缓冲区。
  * @param num 要获取的日志条目数量。
  * @param len [输出参数] 指向一个unsigned int的指针，函数会通过它返回构建的数据包的总长度。
  * @return void* 指向构建好的数据包的指针 (通常是 struct IPLog 数组，前面可能有 KernelResponseHeader)。
  * @功能描述: 从内核日志缓存中获取最新的IP日志，并格式化。
  */
-void* formAllIPLogs(unsigned int num, unsigned int *len);
+void* formAllIPLogs(struct net *net, unsigned int num, unsigned int *len);
+
+/**
+ * @brief 分段导出IP日志的回调 (start / dump / done)。
+ * @功能描述: start 时合并各CPU缓冲区得到按时间排序的快照 (请求中的 num 为0时导出全部仍保留的日志)，
+ *           dump 逐段发送快照，done 释放快照。
+ */
+int dumpIPLogsStart(struct netlink_callback *cb);
+int dumpIPLogs(struct sk_buff *skb, struct netlink_callback *cb);
+int dumpIPLogsDone(struct netlink_callback *cb);
 
 /**
  * @brief 构建包含所有当前连接信息的数据包，用于发送给用户空间。
+ * @param net 网络命名空间。
  * @param len [输出参数] 指向一个unsigned int的指针，函数会通过它返回构建的数据包的总长度。
  * @return void* 指向构建好的数据包的指针 (通常是 struct ConnLog 数组，前面可能有 KernelResponseHeader)。
  * @功能描述: 获取内核中当前跟踪的所有网络连接信息，并格式化。
  */
-void* formAllConns(unsigned int *len);
+void* formAllConns(struct net *net, unsigned int *len);
+
+/**
+ * @brief 分段导出连接表的回调 (start / dump / done)。
+ * @功能描述: 遍历器保存在导出状态中，每段只在 rhashtable_walk_start/stop 之间持有RCU读锁，
+ *           段与段之间不持有任何锁，内存占用与连接数无关。
+ */
+int dumpConnsStart(struct netlink_callback *cb);
+int dumpConns(struct sk_buff *skb, struct netlink_callback *cb);
+int dumpConnsDone(struct netlink_callback *cb);
+
+/**
+ * @brief 开始分段导出连接表快照 (RSP_ConnSnap)，dump / done 与 dumpConns、dumpConnsDone 共用。
+ */
+int dumpConnSnapStart(struct netlink_callback *cb);
+
+/**
+ * @brief 从快照恢复一批连接。
+ * @param net 恢复到的网络命名空间。
+ * @param snaps 连接快照数组。
+ * @param num 快照条数。
+ * @return int 实际恢复的连接数；已存在、状态无效或超出连接数上限的条目被跳过。
+ * @功能描述: 剩余存活时间不超过当前配置的超时时间。SNAT连接按原端口重新向匹配的NAT规则占用端口，
+ *           占用成功后才与绑定一起插入连接表；找不到规则或端口已被其他连接使用时不恢复该连接。
+ *           NAT只在初始网络命名空间中生效，其他命名空间跳过带NAT的快照。
+ */
+int restoreConns(struct net *net, const struct ConnSnap *snaps, unsigned int num);
 
 /**
  * @brief 将一条NAT规则添加到NAT规则链中。
@@ -234,51 +613,429 @@ int delNATRuleFromChain(int num); // 参数num的具体含义需要看实现，
  */
 void* formAllNATRules(unsigned int *len);
 
+/**
+ * @brief 分段导出NAT规则的回调。
+ * @功能描述: cb->args[0] 保存下一条待导出规则的序号。
+ */
+int dumpNATRules(struct sk_buff *skb, struct netlink_callback *cb);
+
+/**
+ * @brief 释放NAT规则链。
+ * @return void
+ * @功能描述: 在模块卸载时、连接池清理之后调用；连接已释放其占用的端口，规则及其端口池随之释放。
+ */
+void nat_exit(void);
+
+// ----- 统计相关 -----
+// 各钩子点的耗时直方图按CPU存放，数据包路径只做本CPU上的加法；读取时汇总各CPU。
+// 在32位平台上读取与累加不是原子的，统计值可能偶有偏差，仅供观测。
+
+#include <linux/timex.h> // get_cycles
+
+/**
+ * @brief 记录一次钩子调用的耗时。
+ * @param hook 钩子点 (HOOK_STAT_*)。
+ * @param cycles 本次调用所用的CPU周期数。
+ */
+void hookStatAdd(unsigned int hook, cycles_t cycles);
+
+/**
+ * @brief 生成统计响应。
+ * @param net 网络命名空间；NAT规则只存在于初始命名空间，其他命名空间的响应不含NAT规则计数。
+ * @param len [输出参数] 响应的长度。
+ * @return void* KernelResponseHeader (bodyTp = RSP_Stats) 加 FwStatsHead 与 RuleStat 数组，
+ *         以 kvmalloc 分配由调用者 kvfree；失败返回NULL。
+ */
+void *formAllStats(struct net *net, unsigned int *len);
+
+// ----- 新建连接限速相关 -----
+// 设置了 rate 的放行规则按源前缀限制新建连接的速率：每个 (规则, 源前缀) 对应一个令牌桶，
+// 新连接消耗一个令牌，令牌按 rate 个每秒补充、最多积攒 burst 个，没有令牌时丢弃该新连接。
+// 令牌桶存放在所有CPU共用的固定大小组相联哈希表中，每组一把自旋锁，组满时淘汰最久未用的桶；
+// 同一源前缀的连接被分散到多个CPU时仍共用一个令牌桶。新换入的桶只带一个令牌，
+// 被淘汰后再换入的源前缀不会因此重新得到 burst 个令牌。
+
+#include <linux/jhash.h>
+
+#define RL_WAYS 4                            // 每组的令牌桶个数 (一组连同锁占一个缓存行)
+#define RL_SETS_SHIFT 10                     // 哈希表组数的指数
+#define RL_SETS (1u << RL_SETS_SHIFT)        // 哈希表的组数
+#define RL_TOKEN 1000                        // 一个令牌细分为多少份，使低速率也能按jiffies平滑补充
+#define RL_LIMIT_MAX 1000000                 // rate 与 burst 的上限，超出按上限处理
+
+/**
+ * @brief 令牌桶
+ */
+struct rlBucket {
+    u32 key;             // (规则, 源前缀) 的哈希，0表示空闲
+    u32 tokens;          // 剩余令牌 (以 1/RL_TOKEN 个为单位)
+    unsigned long stamp; // 上次补充令牌时的 jiffies
+};
+
+/**
+ * @brief 初始化令牌桶哈希表。
+ * @return int 总是返回0。
+ * @功能描述: 在模块加载时、注册钩子之前调用。
+ */
+int ratelimit_init(void);
+
+/**
+ * @brief 释放令牌桶哈希表。
+ * @功能描述: 在模块卸载时、钩子注销之后调用。
+ */
+void ratelimit_exit(void);
+
+/**
+ * @brief 判断IPv4新连接是否在规则的限速之内。
+ * @param net 数据包所在的网络命名空间，不同命名空间的同名规则与同一源地址互不共享令牌桶。
+ * @param rule 命中的规则，rule->rate 不为0。
+ * @param sip 源IP地址 (主机字节序)。
+ * @return bool 允许新建返回true，超出速率返回false。
+ */
+bool rateLimitAdmit(struct net *net, struct IPRule *rule, unsigned int sip);
+
+/**
+ * @brief rateLimitAdmit 的IPv6版本。
+ */
+bool rateLimitAdmit6(struct net *net, struct IPRule *rule, const struct in6_addr *sip);
+
+// ----- 拒绝缓存相关 -----
+// 默认动作为丢弃时，被拒绝的新流不会留下连接，其后的重传与洪泛包每一个都要重新匹配规则。
+// 拒绝缓存记下最近未匹配任何规则、按默认动作被丢弃的五元组，钩子在匹配规则之前先查一次，
+// 命中即直接丢弃。缓存为每CPU一张的固定大小组相联表，组满时换掉最早写入的条目，条目在 DENY_TTL 后过期。
+// 每个条目记下写入时的规则代数，规则集、默认动作或地址集合变化时代数加一，旧条目随即全部失效。
+
+#define DENY_WAYS 4                          // 每组的条目数
+#define DENY_SETS_SHIFT 7                    // 每CPU拒绝缓存组数的指数
+#define DENY_SETS (1u << DENY_SETS_SHIFT)    // 每CPU拒绝缓存的组数
+#define DENY_TTL HZ                          // 条目的存活时长 (jiffies)
+
+/**
+ * @brief 拒绝缓存的键：IPv4地址存放在 s6_addr32[3] 中，其余字节为0
+ */
+struct denyKey {
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    u32 ports;           // 源端口在高16位，目的端口在低16位
+    u32 proto;           // 上层协议，IPv6时再或上 DENY_KEY_V6
+};
+
+#define DENY_KEY_V6 0x100u
+
+/**
+ * @brief 拒绝缓存的条目 (恰好占一个缓存行)
+ */
+struct denyEntry {
+    u32 seq;             // 写入次数的两倍，奇数表示正在写入
+    u32 gen;             // 写入时的规则代数
+    unsigned long stamp; // 写入时的 jiffies
+    const struct net *net; // 所属网络命名空间，NULL表示空闲
+    struct denyKey key;
+};
+
+/**
+ * @brief 分配每CPU的拒绝缓存。
+ * @return int 成功返回0，失败返回 -ENOMEM。
+ * @功能描述: 在模块加载时、注册钩子之前调用。
+ */
+int denycache_init(void);
+
+/**
+ * @brief 释放拒绝缓存。
+ * @功能描述: 在模块卸载时、钩子注销之后调用。
+ */
+void denycache_exit(void);
+
+/**
+ * @brief 取得当前的规则代数，数据包须在读取默认动作与匹配规则之前取得。
+ */
+unsigned int denyCacheGen(void);
+
+/**
+ * @brief 使全部拒绝缓存失效。
+ * @功能描述: 在新的规则集、默认动作或地址集合生效之后调用；任一命名空间的变化都使所有条目失效。
+ */
+void denyCacheFlush(void);
+
+/**
+ * @brief 查询与记录被默认动作拒绝的五元组。
+ * @param net 数据包所在的网络命名空间。
+ * @param gen 数据包开始判定前以 denyCacheGen 取得的规则代数。
+ * @param key 五元组。
+ * @功能描述: denyCacheHas 命中且未过期时返回true。只在钩子中调用，只访问本CPU的表。
+ */
+bool denyCacheHas(const struct net *net, unsigned int gen, const struct denyKey *key);
+void denyCacheAdd(const struct net *net, unsigned int gen, const struct denyKey *key);
+
 
 // ----- netfilter相关 -----
 // 这部分声明了与Netfilter钩子函数交互、IP规则匹配和日志记录相关的函数。
 
-// 最大缓存日志长度
-#define MAX_LOG_LEN 1000 // 定义内核中IP日志缓存区的最大条目数量。
+// 单次读取日志时最多返回的条目数量
+#define MAX_LOG_LEN 1000 // 各CPU环形缓冲区合并后，只取时间最新的至多 MAX_LOG_LEN 条返回给用户空间。
+
+// ----- 日志环形缓冲区相关 -----
+// 每个CPU独占一个固定大小的环形缓冲区，写满后覆盖最旧的条目，写日志时既不分配内存也不加锁。
+// 每个槽位带有序号 seq：写入第 pos 条时先置为 2*pos+1 (写入中)，写完后置为 2*pos+2，
+// 读者在复制前后各检查一次 seq，不一致即说明该槽位在复制期间被覆盖，丢弃该条。
+// 缓冲区同时通过字符设备 /dev/myfw_log 只读映射给用户空间，用户空间自行维护消费位置，
+// 因此 logSlot / logRing 的布局属于与用户空间共享的协议，须与 common.h 保持一致。
+
+#define LOG_RING_SHIFT 10                    // 每CPU环形缓冲区大小的指数
+#define LOG_RING_SIZE (1u << LOG_RING_SHIFT) // 每CPU环形缓冲区可容纳的日志条数 (2的幂，便于取模)
+#define LOG_RING_BYTES PAGE_ALIGN(sizeof(struct logRing)) // 每个缓冲区按页对齐后的大小，也是映射偏移的步长
+#define LOG_DEV_NAME "myfw_log"              // 日志流设备名
+
+struct logSlot {
+    unsigned long seq;   // 槽位序号，奇数表示正在写入
+    unsigned long long stamp; // 纳秒级时间戳，读取时据此合并各CPU的日志
+    struct IPLog log;    // 日志内容
+};
+
+struct logRing {
+    unsigned long head;                  // 已写入的日志总数，下一个写入位置为 head % LOG_RING_SIZE
+    struct logSlot slot[LOG_RING_SIZE];
+};
+
+/**
+ * @brief 为各网络命名空间准备日志环形缓冲区并注册日志流设备。
+ * @return int 成功返回0，失败返回负数错误码。
+ * @功能描述: 在模块加载时、注册钩子之前调用。各命名空间的缓冲区在其第一次产生日志或第一次打开
+ *           日志流设备时才分配；映射日志流设备时看到的是打开者所在命名空间的缓冲区。
+ */
+int log_init(void);
+
+/**
+ * @brief 注销日志流设备并释放所有CPU的日志环形缓冲区。
+ * @return void
+ * @功能描述: 在模块卸载时、钩子注销之后调用。
+ */
+void log_exit(void);
 
 /**
  * @brief 在Netfilter钩子中匹配IP数据包与已定义的IP规则。
+ * @param net 数据包所在的网络命名空间 (state->net)。
  * @param skb 指向当前正在被处理的网络数据包的套接字缓冲区 (struct sk_buff)。
+ * @param sport/dport 调用者以 getPort 解析出的端口，非首个分片沿用首个分片的端口。
  * @param isMatch [输出参数] 指向一个int的指针，函数通过它返回是否匹配到规则 (1表示匹配，0表示未匹配)。
  * @return struct IPRule 如果匹配到规则，则返回指向该匹配规则的指针；如果未匹配到任何规则，则返回NULL。
  * @功能描述: 遍历IP规则链表，检查传入的数据包是否符合某条规则的条件。
  */
-struct IPRule matchIPRules(struct sk_buff *skb, int *isMatch);
+struct IPRule matchIPRules(struct net *net, struct sk_buff *skb, unsigned short sport, unsigned short dport, int *isMatch);
+
+/**
+ * @brief 匹配IPv6数据包与IPv6规则。
+ * @param net 数据包所在的网络命名空间。
+ * @param skb 当前数据包，地址取自其IPv6头部。
+ * @param proto/sport/dport 调用者以 getPort6 解析出的上层协议与端口。
+ * @param isMatch [输出参数] 是否匹配到规则。
+ * @return struct IPRule 匹配到的规则的副本。
+ */
+struct IPRule matchIPRules6(struct net *net, struct sk_buff *skb, u_int8_t proto, unsigned short sport, unsigned short dport, int *isMatch);
+
+/**
+ * @brief 汇总各过滤规则与默认动作的命中计数。
+ * @param net 网络命名空间。
+ * @param num [输出参数] 规则条数。
+ * @param deflt [输出参数] 按默认动作处理的新连接计数。
+ * @return struct RuleStat* 按规则顺序排列的计数 (kvmalloc 分配，由调用者 kvfree)，失败返回NULL。
+ */
+struct RuleStat *formIPRuleStats(struct net *net, unsigned int *num, struct RuleStat *deflt);
+
+/**
+ * @brief 注册规则的网络命名空间状态。
+ * @return int 成功返回0，失败返回负数错误码。
+ * @功能描述: 在模块加载时、注册钩子之前调用。每个网络命名空间各有独立的规则链、分类器、
+ *           批量事务与默认动作，新建的命名空间从空规则链与默认放行开始。
+ */
+int rule_init(void);
+
+/**
+ * @brief 释放规则链与分类器。
+ * @return void
+ * @功能描述: 在模块卸载时调用，释放所有命名空间的IP规则及编译出的分类器。
+ */
+void rule_exit(void);
+
+/**
+ * @brief 读取与修改命名空间的默认动作 (NF_ACCEPT / NF_DROP)。
+ * @功能描述: 默认动作作用于未匹配任何规则的新连接，修改后由调用者决定是否清除已有连接。
+ */
+unsigned int getDefaultAction(struct net *net);
+void setDefaultAction(struct net *net, unsigned int action);
+
+/**
+ * @brief 为按默认动作处理的数据包累加一次计数。
+ * @功能描述: 供拒绝缓存命中时调用，这些数据包不再经过 matchIPRules，统计中的默认动作计数仍然完整。
+ */
+void countDefaultHit(struct net *net, unsigned int packets, unsigned int bytes);
+
+// ----- 规则分类器相关 -----
+// 规则链表每次变化后被编译为一棵决策树 (HyperSplit 风格)，数据包沿树下降到叶子后
+// 只需对少量候选规则调用 matchOneRule，首匹配顺序与链表一致。
+// 决策树只收录IPv4规则；IPv6规则另按链表顺序记下标，由 classifyPacket6 逐条匹配。
+
+#define CLS_DIM_SIP 0          // 维度：源IP
+#define CLS_DIM_DIP 1          // 维度：目的IP
+#define CLS_DIM_SPORT 2        // 维度：源端口
+#define CLS_DIM_DPORT 3        // 维度：目的端口
+#define CLS_DIM_PROTO 4        // 维度：协议
+#define CLS_DIM_NUM 5          // 维度数量
+#define CLS_LEAF 0xFF          // clsNode.dim 取此值表示叶子节点
+#define CLS_LEAF_RULES 8       // 候选规则数不超过此值时不再切分
+#define CLS_MAX_DEPTH 24       // 决策树最大深度
+#define CLS_MAX_NODES (1<<18)  // 树节点数量上限，超过则退化为线性匹配
+#define CLS_MAX_LEAF_LEN (1<<20) // 所有叶子中规则下标总数上限，超过则退化为线性匹配
+
+/**
+ * @brief 决策树节点
+ * @功能描述: 内部节点按 dim 维上的 split 切分，值<=split 走 child，否则走 child+1；
+ *           叶子节点的候选规则为 leafRules[child] 起的 count 个下标。
+ */
+struct clsNode {
+    unsigned int split;
+    unsigned int child;
+    unsigned int count;
+    u_int8_t dim;
+};
+
+/**
+ * @brief 规则命中计数
+ */
+struct ruleCounter {
+    u64 packets;
+    u64 bytes;
+};
+
+#include <asm/local64.h>
+
+// 分类器各CPU段中的一项命中计数；local64 的读改写在本CPU上不会被中断或软中断打断
+struct clsCounter {
+    local64_t packets;
+    local64_t bytes;
+};
+
+/**
+ * @brief 编译后的规则分类器
+ * @功能描述: 持有规则链的一份只读副本，构建完成后不再修改，整体替换。
+ *           命中计数按CPU分段存放 (第cpu段为 hits[cpu*hitStride] 起的 ruleNum 项)，数据包只写本CPU的一段；
+ *           每段按缓存行对齐，相邻CPU的计数不落在同一缓存行中；
+ *           base 记录替换分类器时从旧分类器继承的同名规则计数，只在持有规则锁的进程上下文中访问。
+ */
+struct ruleClassifier {
+    unsigned int ruleNum;      // 规则条数
+    unsigned int nodeNum;      // 树节点数
+    unsigned int leafLen;      // leafRules 长度
+    struct IPRule *rules;      // 按链表顺序排列的规则副本
+    struct clsNode *nodes;     // 树节点数组，nodes[0] 为根
+    unsigned int *leafRules;   // 各叶子的候选规则下标(按优先级升序)
+    unsigned int rule6Num;     // IPv6规则条数
+    unsigned int *rules6;      // IPv6规则在 rules 中的下标(按优先级升序)
+    unsigned int hitStride;    // 每个CPU计数段的项数 (ruleNum 向上补齐到整缓存行)
+    struct clsCounter *hits;   // 各CPU的命中计数
+    struct ruleCounter *base;  // 继承的命中计数
+};
+
+/**
+ * @brief 将规则数组编译为分类器。
+ * @param rules 按优先级排列的规则数组 (kvmalloc 分配)，成功时所有权转移给分类器。
+ * @param num 规则条数。
+ * @return struct ruleClassifier* 成功返回分类器，失败返回NULL。
+ */
+struct ruleClassifier *buildClassifier(struct IPRule *rules, unsigned int num);
+
+/**
+ * @brief 释放分类器。
+ */
+void freeClassifier(struct ruleClassifier *cls);
+
+/**
+ * @brief 在分类器中查找第一条匹配数据包的规则。
+ * @return struct IPRule* 命中返回规则指针，未命中返回NULL。
+ */
+struct IPRule *classifyPacket(struct ruleClassifier *cls, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto);
+
+/**
+ * @brief 在分类器的IPv6规则中查找第一条匹配数据包的规则。
+ * @return struct IPRule* 命中返回规则指针，未命中返回NULL。
+ */
+struct IPRule *classifyPacket6(struct ruleClassifier *cls, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto);
+
+/**
+ * @brief 为分类器中的一条规则累加一次命中。
+ * @param rule classifyPacket/classifyPacket6 返回的规则指针。
+ * @param packets 数据包个数，GSO聚合包按分段数计。
+ * @param bytes 数据包长度。
+ */
+void clsCountHit(struct ruleClassifier *cls, struct IPRule *rule, unsigned int packets, unsigned int bytes);
+
+/**
+ * @brief 读取分类器中第idx条规则的命中计数 (继承值加各CPU之和)。
+ */
+void clsReadHits(struct ruleClassifier *cls, unsigned int idx, struct ruleCounter *out);
+
+/**
+ * @brief 新分类器按规则名称继承旧分类器的命中计数。
+ * @功能描述: 须在旧分类器不再被数据包使用 (宽限期结束) 之后调用，继承的计数才是完整的。
+ */
+void clsInheritHits(struct ruleClassifier *cls, struct ruleClassifier *old);
 
 /**
  * @brief 添加一条IP日志到内核日志缓存中。
+ * @param net 日志所属的网络命名空间。
  * @param log 要添加的IP日志条目 (struct IPLog)。
- * @return int 成功添加返回0，缓存满或其他错误返回负数。
- * @功能描述: 将构造好的IPLog结构体存入内核的日志队列或数组中。
+ * @return int 成功添加返回1，本CPU的缓冲区尚未分配 (日志被丢弃) 时返回0。
+ * @功能描述: 将构造好的IPLog结构体写入当前CPU的日志环形缓冲区，缓冲区满时覆盖最旧的条目。
  */
-int addLog(struct IPLog log);
+int addLog(struct net *net, struct IPLog log);
 
 /**
  * @brief 根据数据包信息和处理动作直接添加一条IP日志。
+ * @param net 数据包所在的网络命名空间。
  * @param action 对该数据包采取的动作。
  * @param skb 指向当前网络数据包的套接字缓冲区。
  * @return int 成功添加返回0，失败返回负数。
  * @功能描述: 这是一个便捷函数，直接从sk_buff中提取信息并结合action来创建并添加IP日志。
  */
-int addLogBySKB(unsigned int action, struct sk_buff *skb);
+int addLogBySKB(struct net *net, unsigned int action, struct sk_buff *skb);
+
+/**
+ * @brief 为IPv6数据包添加一条IP日志。
+ * @param net 数据包所在的网络命名空间。
+ * @param action 对该数据包采取的动作。
+ * @param skb 指向当前网络数据包的套接字缓冲区。
+ * @param thoff 传输层头部的偏移 (即 getPort6 的返回值)。
+ * @param proto/sport/dport getPort6 解析出的上层协议与端口。
+ * @return int 成功添加返回1。
+ */
+int addLogBySKB6(struct net *net, unsigned int action, struct sk_buff *skb, int thoff, u_int8_t proto, unsigned short sport, unsigned short dport);
 
 
 // ----- 连接池相关 --------
 // 这部分定义了与网络连接跟踪 (connection tracking) 相关的常量、数据结构和函数声明。
 // 连接跟踪用于记录和管理网络连接的状态，是实现有状态防火墙和NAT的基础。
 
-#include <linux/rbtree.h> // 包含Linux内核红黑树库的头文件，连接池可能使用红黑树来高效存储和查找连接。
+#include <linux/rhashtable.h> // 连接池使用可伸缩哈希表存储，查找在RCU读临界区内无锁完成。
+#include <linux/workqueue.h>  // 超时清理在工作队列 (进程上下文) 中执行。
+#include <linux/mempool.h>    // 连接节点可选的预留内存池。
 
 #define CONN_NEEDLOG 0x10      // 连接属性标志：表示此连接需要记录日志。
 #define CONN_MAX_SYM_NUM 3     // 连接标识符 (conn_key_t) 的数组元素数量。通常用于存储源IP、目的IP、协议相关的组合键。
-#define CONN_EXPIRES 7         // 新建连接或已有连接刷新时的默认存活时长（秒）。
-#define CONN_NAT_TIMES 10      // NAT连接的超时时间相对于普通连接的倍率 (即NAT连接超时时间 = CONN_EXPIRES * CONN_NAT_TIMES)。
-#define CONN_ROLL_INTERVAL 5   // 定期清理超时连接的定时器时间间隔（秒）。
+#define CONN_EXPIRES 7         // 未单独配置的协议所用的默认存活时长（秒）。
+#define CONN_TIMEOUT_TCP_SYN 30    // 以下为超时配置的默认值（秒），可通过 REQ_SETTimeouts 修改。
+#define CONN_TIMEOUT_TCP_EST 600
+#define CONN_TIMEOUT_TCP_FIN 30
+#define CONN_TIMEOUT_TCP_CLOSE 5
+#define CONN_TIMEOUT_UDP 30
+#define CONN_TIMEOUT_ICMP 5
+#define CONN_TIMEOUT_MAX (5*24*3600) // 单项超时配置允许的最大值（秒）。
+#define CONN_MAX_DEFAULT (1 << 17) // 连接数上限的默认值，可由模块参数 conn_max 或 REQ_SETConnLimit 修改。
+#define CONN_EVICT_SCAN 64     // 满表淘汰时最多检查的节点数。
+#define CONN_ROLL_INTERVAL 1   // 超时时间轮每格的时间跨度，即清理定时器的触发间隔（秒）。
+#define CONN_WHEEL_SLOTS 256   // 超时时间轮的格数，一圈覆盖 CONN_WHEEL_SLOTS * CONN_ROLL_INTERVAL 秒。
+#define CONN_PURGE_BATCH 256   // 清理遍历每检查这么多连接就退出一次RCU读临界区并让出CPU。
+#define CONN_GC_BUDGET 8192    // 每次定时器触发最多检查的连接数，超出部分推迟到下一次触发。
+#define CONN_REFRESH_GAP (HZ)  // 刷新超时时间的最小推后量 (jiffies)，小于此值时不写入，减少缓存行争用。
 
 // 定义连接的唯一标识符类型 conn_key_t。
 // 它是一个包含 CONN_MAX_SYM_NUM 个 unsigned int 的数组。
@@ -286,21 +1043,72 @@ int addLogBySKB(unsigned int action, struct sk_buff *skb);
 // 这里的 CONN_MAX_SYM_NUM 为 3，具体存储内容需看实现。
 typedef unsigned int conn_key_t[CONN_MAX_SYM_NUM];
 
+/**
+ * @brief 连接的NAT绑定 (connNAT)
+ * @功能描述: 只有经过NAT的连接才分配，挂在 connNode.nat 上。绑定一经发布便不再修改，
+ *           替换时整块换新并以RCU延迟释放旧绑定，读者不需要加锁。字段含义与 NATRecord 作为记录时相同。
+ */
+struct connNAT {
+    unsigned int saddr;         // 转换前的地址
+    unsigned int daddr;         // 转换后的地址
+    unsigned short sport;       // 转换前的端口
+    unsigned short dport;       // 转换后的端口
+    int natType;                // NAT_TYPE_SRC 或 NAT_TYPE_DEST
+    struct NATRecord *rule;     // SNAT端口所属的NAT规则，连接释放时归还 dport (持有规则的引用)；以 xchg 取走
+    struct rcu_head rcu;
+};
+
 /**
  * @brief 连接节点结构体 (connNode)
- * @功能描述: 代表连接池中的一个连接条目。通常存储在红黑树中以便快速查找。
+ * @功能描述: 代表连接池中的一个连接条目，存储在哈希表中以便快速查找。
+ *           节点通过RCU延迟释放，数据包路径可在不加锁的情况下访问。
+ *           在64位内核上恰好占一个缓存行：查找比较的键、超时时间与状态位于最前面，
+ *           大多数连接不经过NAT，NAT绑定另行分配。
  */
 typedef struct connNode {
-    struct rb_node node;    // 红黑树节点，用于将此结构嵌入到红黑树中。
+    struct rhash_head node; // 哈希表节点，用于将此结构嵌入到哈希表中。
     conn_key_t key;         // 连接的唯一标识符。
-    unsigned long expires;  // 连接的绝对超时时间 (通常是jiffies值)。
     u_int8_t protocol;      // 连接的协议类型 (TCP, UDP等)，主要用于向用户空间展示。
     u_int8_t needLog;       // 标志位，指示此连接相关的包是否需要记录日志 (可能与CONN_NEEDLOG配合使用)。
-
-    struct NATRecord nat;   // 如果此连接经过了NAT，这里存储相关的NAT转换记录。
-    int natType;            // 此连接的NAT转换类型 (NAT_TYPE_SRC, NAT_TYPE_NO 等)。
+    u_int8_t dead;          // 已从哈希表摘除，等待时间轮回收。
+    u_int8_t state;         // TCP连接状态 (CONN_TCP_*)，仅由本方向的数据包驱动。
+    unsigned long expires;  // 连接的绝对超时时间 (jiffies值)，以 READ_ONCE/WRITE_ONCE 无锁访问。
+    struct connNAT *nat;    // NAT绑定，未经NAT时为NULL；以 xchg 发布、rcu_dereference 读取。
+    union {
+        struct list_head tnode; // 挂在超时时间轮某一格上的链表节点。
+        struct rcu_head rcu;    // 从时间轮摘下之后用于 call_rcu 延迟释放，与 tnode 不会同时使用。
+    };
+    u_int8_t family;        // 地址族 (AF_INET 或 AF_INET6)。
+    u_int8_t dnatChecked;   // 已按DNAT规则判定过，之后的数据包不再查表；只在首包上判定，已建立的流不会中途被转发。
 } connNode;
 
+/**
+ * @brief IPv6连接的键 (conn6Key)
+ * @功能描述: 128位地址只保存一份；ports 与 connNode.key[2] 的编码相同 (源端口在高16位)。
+ */
+struct conn6Key {
+    struct in6_addr saddr;
+    struct in6_addr daddr;
+    unsigned int ports;
+};
+
+/**
+ * @brief IPv6连接节点 (connNode6)
+ * @功能描述: 在 connNode 之后追加 conn6Key，存放在独立的哈希表中；时间轮、超时、事件与统计
+ *           都通过 base 与IPv4连接共用。base.key[2] 同样填写端口，base.key[0..1] 不使用。
+ */
+typedef struct connNode6 {
+    struct connNode base;
+    struct conn6Key key6;
+} connNode6;
+
+// TCP连接状态，决定该连接使用 ConnTimeouts 中的哪一项超时时长。
+#define CONN_TCP_NONE 0        // 尚未见到可判断状态的报文
+#define CONN_TCP_SYN 1         // 握手阶段
+#define CONN_TCP_EST 2         // 已建立
+#define CONN_TCP_FIN 3         // 已发出FIN
+#define CONN_TCP_CLOSE 4       // 已发出RST
+
 // 宏：计算从现在开始 'plus' 秒之后的时间点 (以jiffies为单位)。
 // jiffies 是内核中的一个全局变量，表示系统启动以来经过的时钟节拍数。
 // HZ 是每秒的时钟节拍数。
@@ -310,10 +1118,11 @@ typedef struct connNode {
 
 /**
  * @brief 初始化连接池。
- * @return void
- * @功能描述: 在模块加载时调用，用于创建和初始化连接池所需的数据结构 (如红黑树的根)。
+ * @return int 成功返回0，失败返回负数错误码。
+ * @功能描述: 在模块加载时调用，为每个网络命名空间创建连接哈希表并启动超时清理定时器。
+ *           节点缓存与NAT绑定池由所有命名空间共用。
  */
-void conn_init(void);
+int conn_init(void);
 
 /**
  * @brief 清理并退出连接池。
@@ -324,18 +1133,21 @@ void conn_exit(void);
 
 /**
  * @brief 查找一个现有的连接。
+ * @param net 数据包所在的网络命名空间，只在该命名空间的连接表中查找。
  * @param sip 源IP地址。
  * @param dip 目的IP地址。
  * @param sport 源端口号。
  * @param dport 目的端口号。
  * @return struct connNode* 如果找到匹配的连接，则返回指向该连接节点的指针；否则返回NULL。
  * @功能描述: 根据连接的五元组 (或其派生key) 在连接池中查找是否存在活动连接。
+ *           调用者需处于RCU读临界区内 (netfilter 钩子满足此条件)，返回的指针在临界区内有效。
  */
-struct connNode *hasConn(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport);
+struct connNode *hasConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport);
 // 注意：hasConn 的参数列表可能不直接构成 conn_key_t，函数内部会转换。
 
 /**
  * @brief 添加一个新的连接到连接池。
+ * @param net 数据包所在的网络命名空间，连接计入该命名空间的连接数上限。
  * @param sip 源IP地址。
  * @param dip 目的IP地址。
  * @param sport 源端口号。
@@ -345,7 +1157,17 @@ struct connNode *hasConn(unsigned int sip, unsigned int dip, unsigned short spor
  * @return struct connNode* 成功添加则返回指向新创建的连接节点的指针；失败 (如内存不足) 则返回NULL。
  * @功能描述: 当一个新的、未被跟踪的连接首次出现时，调用此函数将其添加到连接池，并设置其初始超时时间。
  */
-struct connNode *addConn(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log);
+struct connNode *addConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log);
+
+/**
+ * @brief 查找一个现有的IPv6连接，语义与 hasConn 相同。
+ */
+struct connNode *hasConn6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport);
+
+/**
+ * @brief 添加一个新的IPv6连接，语义与 addConn 相同。
+ */
+struct connNode *addConn6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto, u_int8_t log);
 
 /**
  * @brief 判断一个数据包是否匹配单条IP规则。
@@ -360,14 +1182,47 @@ struct connNode *addConn(unsigned int sip, unsigned int dip, unsigned short spor
  */
 bool matchOneRule(struct IPRule *rule, unsigned int sip, unsigned int dip, unsigned short sport, unsigned int dport, u_int8_t proto);
 
+/**
+ * @brief 判断一个IPv6数据包是否匹配单条IPv6规则 (按前缀长度比较地址)。
+ */
+bool matchOneRule6(struct IPRule *rule, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto);
+
 /**
  * @brief 清除与指定IP规则相关的连接。
+ * @param net 网络命名空间。
  * @param rule 一个IP规则 (struct IPRule)。
  * @return int 返回被清除的连接数量或操作状态码。
  * @功能描述: 当一条IP规则被删除或修改时，可能需要清除连接池中所有基于该旧规则建立的连接。
  *           此函数遍历连接池，移除那些如果按照新规则集本不应存在的连接。
  */
-int eraseConnRelated(struct IPRule rule);
+int eraseConnRelated(struct net *net, struct IPRule rule);
+
+/**
+ * @brief 遍历一次命名空间的连接池，删除判定函数返回true的连接。
+ * @param net 网络命名空间。
+ * @param match 判定函数，在RCU读临界区内调用，不能睡眠。
+ * @param arg 传给判定函数的参数。
+ * @return int 返回被删除的连接数量。只能在进程上下文中调用。
+ */
+int eraseConnIf(struct net *net, bool (*match)(struct connNode *node, void *arg), void *arg);
+
+/**
+ * @brief 登记延迟清理，由工作队列合并为一次连接池遍历。
+ * @功能描述: purgeConnRelated 清除匹配规则的连接 (语义同 eraseConnRelated)；
+ *           purgeConnDenied 按当前规则集重新判定所有连接，清除不再被允许的连接。
+ *           两者只登记并排队，立即返回，可在持有规则锁时调用。
+ *           purgeConnDeniedAll 对所有命名空间执行 purgeConnDenied，供被多个命名空间的规则引用的IP集合变化时使用。
+ */
+void purgeConnRelated(struct net *net, struct IPRule rule);
+void purgeConnDenied(struct net *net);
+void purgeConnDeniedAll(void);
+
+/**
+ * @brief 按当前规则集与默认动作判定一个连接是否不再被允许。
+ * @return bool 不被允许返回true。可在RCU读临界区内调用。
+ */
+bool connPolicyDenies(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport, u_int8_t proto);
+bool connPolicyDenies6(struct net *net, const struct in6_addr *sip, const struct in6_addr *dip, unsigned short sport, unsigned short dport, u_int8_t proto);
 
 /**
  * @brief 延长一个连接的超时时间。
@@ -378,19 +1233,164 @@ int eraseConnRelated(struct IPRule rule);
  */
 void addConnExpires(struct connNode *node, unsigned int plus);
 
+/**
+ * @brief 获取连接在当前协议与状态下应使用的存活时长。
+ * @param node 指向连接节点的指针。
+ * @return unsigned int 存活时长（秒）。
+ */
+unsigned int getConnTimeout(struct connNode *node);
+
+/**
+ * @brief 根据本方向数据包的TCP标志推进连接状态。
+ * @param node 指向连接节点的指针。
+ * @param th 指向该数据包TCP头部副本的指针。
+ * @return void
+ * @功能描述: 状态变化时立即按新状态重设超时时间 (可以缩短)，使已关闭的连接尽快过期。
+ */
+void updateConnState(struct connNode *node, const struct tcphdr *th);
+
+/**
+ * @brief 修改连接超时配置。
+ * @param timeouts 新的超时配置，值为0的字段保持不变。
+ * @return int 成功返回0，存在超出 CONN_TIMEOUT_MAX 的字段时返回-EINVAL且不做任何修改。
+ * @功能描述: 新配置对之后刷新或状态变化的连接生效。
+ */
+int setConnTimeouts(struct ConnTimeouts timeouts);
+
+/**
+ * @brief 将当前连接超时配置形成Netlink回包。
+ * @param len [输出参数] 回包长度。
+ * @return void* 回包内存 (需调用者kfree)，失败返回NULL。
+ */
+void *formConnTimeouts(unsigned int *len);
+
+/**
+ * @brief 修改命名空间的连接数上限与满表策略。
+ * @param net 网络命名空间。
+ * @param limit 新的容量配置，值为0的字段保持不变。
+ * @return int 成功返回0，策略取值非法时返回-EINVAL。
+ * @功能描述: 调低上限不会淘汰已有连接，只会限制之后的新建连接。
+ */
+int setConnLimit(struct net *net, struct ConnLimit limit);
+
+/**
+ * @brief 将命名空间的连接池统计形成Netlink回包。
+ * @param net 网络命名空间。
+ * @param len [输出参数] 回包长度。
+ * @return void* 回包内存 (需调用者kfree)，失败返回NULL。
+ */
+void *formConnStats(struct net *net, unsigned int *len);
+
 
 // ---- NAT 初始操作相关 ----
 // 这部分声明了与NAT操作（特别是源NAT的端口分配和规则匹配）相关的函数。
 
+#include <linux/kref.h>   // NAT规则及其端口池以引用计数管理生命周期。
+#include <linux/bitmap.h> // 端口池以位图记录已占用的端口。
+
+#define NAT_PORT_TRIES 8  // 从位图取空闲端口时，因反向连接冲突而跳过的最大次数。
+
+/**
+ * @brief NAT规则及其端口池 (natPortPool)
+ * @功能描述: 内核中每条NAT规则都以此结构存放，`rule` 即规则链表上的节点。
+ *           位图中置位的端口至少被一条SNAT连接占用，`users` 记录占用该端口的SNAT连接数
+ *           (同一端口可以同时服务于不同的远端)。
+ *           规则链表与每条占用端口的连接各持有一个引用，删除规则后已有连接仍能安全地归还端口。
+ *           引用归零后在RCU宽限期之后才释放内存，数据包路径上取得的规则指针在钩子返回前保持有效。
+ */
+struct natPortPool {
+    struct NATRecord rule;   // 规则本身 (rule.sport ~ rule.dport 为端口范围)
+    struct kref ref;         // 引用计数
+    spinlock_t lock;         // 保护以下字段
+    unsigned short minPort;  // 池中第一个端口 (排除了端口0)
+    unsigned int size;       // 池中端口个数
+    unsigned int cursor;     // 下一次从位图此处开始查找，使端口轮转使用
+    unsigned int used;       // 位图中置位的端口数
+    unsigned int *users;     // 每个端口的占用连接数
+    unsigned long *bitmap;   // 已占用端口的位图
+    struct ruleCounter __percpu *hits; // 各CPU上绑定到此规则的SNAT连接计数
+    struct rcu_head rcu;     // 最后一个引用释放后延迟回收
+};
+
+/**
+ * @brief NAT源前缀树节点
+ * @功能描述: 路径压缩的二叉前缀树，节点代表前缀 key/plen，子节点按第 plen 位 (从最高位数起) 区分。
+ *           源前缀恰为此节点的规则存放在 natIndex.rules[ruleStart] 起的 ruleNum 项中。
+ */
+struct natTrieNode {
+    unsigned int key;        // 前缀 (主机字节序，plen之后的位为0)
+    unsigned int plen;       // 前缀长度
+    int child[2];            // 子节点下标，-1表示没有
+    unsigned int ruleStart;
+    unsigned int ruleNum;
+};
+
+/**
+ * @brief 编译后的NAT规则索引
+ * @功能描述: 每次NAT规则链变化后在进程上下文中重建并整体替换，构建完成后只读。
+ *           查找时优先选择源前缀最长的规则，前缀相同时按规则链顺序 (即 `nat ls` 的序号)。
+ *           只记下规则指针而不持有引用：被删除的规则在新索引发布之后才释放引用，并经RCU宽限期回收。
+ */
+struct natIndex {
+    int root;                  // 根节点下标，-1表示空树
+    unsigned int nodeNum;
+    unsigned int ruleNum;
+    struct natTrieNode *nodes; // 节点数组 (至多 2*ruleNum 个)
+    struct NATRecord **rules;  // 按节点分组的规则指针
+    struct rcu_head rcu;
+};
+
 /**
  * @brief为一个连接设置NAT转换信息。
+ * @param net 连接所在的网络命名空间。
  * @param node 指向连接节点 (struct connNode) 的指针。
  * @param record NAT转换的具体记录 (struct NATRecord)，包含了转换前后的IP和端口。
  * @param natType NAT转换的类型 (NAT_TYPE_SRC 等)。
- * @return int 操作成功返回0，失败返回负数。
- * @功能描述: 当一个连接需要进行NAT时，此函数更新连接节点中的NAT相关信息。
+ * @return int 成功返回1，node为NULL或无法分配NAT绑定时返回0。
+ * @功能描述: 当一个连接需要进行NAT时，此函数为连接换上新的NAT绑定。
  */
-int setConnNAT(struct connNode *node, struct NATRecord record, int natType);
+int setConnNAT(struct net *net, struct connNode *node, struct NATRecord record, int natType);
+
+/**
+ * @brief 读取一个连接的NAT转换信息。
+ * @param node 指向连接节点 (struct connNode) 的指针。
+ * @param record [输出参数] 存放NAT记录的副本，可为NULL。
+ * @return int 连接的NAT转换类型 (NAT_TYPE_*)。
+ * @功能描述: 绑定整块发布、不在原处修改，与 setConnNAT 并发时读到的是新旧绑定之一。
+ */
+int getConnNAT(struct connNode *node, struct NATRecord *record);
+
+/**
+ * @brief 为一个连接设置SNAT转换信息，并让连接持有所用端口。
+ * @param net 连接所在的网络命名空间。
+ * @param node 指向连接节点的指针。
+ * @param record SNAT记录，其中 dport 为由 rule 分配的端口。
+ * @param rule 分配该端口的NAT规则；调用者已通过 getNewNATPort 取得端口及规则的引用，此后由连接负责归还。
+ * @return int 成功返回1，node为NULL或无法分配NAT绑定时归还端口并返回0。
+ * @功能描述: 若连接此前已持有端口 (并发的两次SNAT)，旧端口会被归还。
+ */
+int setConnSNAT(struct net *net, struct connNode *node, struct NATRecord record, struct NATRecord *rule);
+
+/**
+ * @brief 查找连接但不刷新其超时时间。
+ * @param net 网络命名空间。
+ * @param sip 源IP地址。
+ * @param dip 目的IP地址。
+ * @param sport 源端口号。
+ * @param dport 目的端口号。
+ * @return struct connNode* 找到且未超时的连接，否则返回NULL。
+ * @功能描述: 供端口分配探测反向连接是否存在，调用者需处于RCU读临界区内。
+ */
+struct connNode *findConn(struct net *net, unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport);
+
+/**
+ * @brief 每CPU流缓存：hook_main 记下数据包所属的连接，同一钩子点上随后的NAT钩子取用。
+ * @功能描述: 以 skb 与 nf_hook_state 识别同一次钩子调用，并核对五元组；取用后即清空。
+ *           takeCachedConn 未命中时返回NULL，调用者退回到 hasConn。二者都只能在钩子中调用。
+ */
+void cacheConn(const struct sk_buff *skb, const struct nf_hook_state *state, struct connNode *conn);
+struct connNode *takeCachedConn(const struct sk_buff *skb, const struct nf_hook_state *state,
+ unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport);
 
 /**
  * @brief 匹配数据包与已定义的NAT规则。
@@ -398,17 +1398,60 @@ int setConnNAT(struct connNode *node, struct NATRecord record, int natType);
  * @param dip 数据包的原始目的IP地址 (对于SNAT，目的IP通常不参与规则匹配，但可能用于更复杂的场景)。
  * @param isMatch [输出参数] 指向一个int的指针，函数通过它返回是否匹配到NAT规则 (1表示匹配，0表示未匹配)。
  * @return struct NATRecord* 如果匹配到NAT规则，则返回指向该NAT规则的指针；否则返回NULL。
- * @功能描述: 遍历NAT规则链表，检查出向数据包是否符合某条SNAT规则的条件。
+ * @功能描述: 在NAT源前缀树中按 sip 下降，从最长的源前缀开始检查出向数据包是否符合某条SNAT规则的条件，
+ *           前缀相同的规则按规则链顺序检查。
+ *           索引以RCU发布，调用者需处于RCU读临界区内，返回的指针只在退出临界区前有效。
  */
 struct NATRecord *matchNATRule(unsigned int sip, unsigned int dip, int *isMatch);
 
+/**
+ * @brief 为一条NAT规则累加一次命中。
+ * @param rule matchNATRule 返回的规则，调用者仍处于取得它的RCU读临界区内。
+ * @param packets 触发SNAT绑定的数据包个数 (GSO聚合包的分段数)。
+ * @param bytes 触发SNAT绑定的数据包长度。
+ */
+void natRuleCountHit(struct NATRecord *rule, unsigned int packets, unsigned int bytes);
+
+/**
+ * @brief 汇总各NAT规则的命中计数。
+ * @param num [输出参数] 规则条数。
+ * @return struct RuleStat* 按规则链顺序排列的计数 (kvmalloc 分配，由调用者 kvfree)，失败返回NULL。
+ */
+struct RuleStat *formNATRuleStats(unsigned int *num);
+
 /**
  * @brief 为NAT转换获取一个新的可用源端口。
- * @param rule 匹配到的NAT规则 (struct NATRecord)，其中定义了可用的端口范围。
- * @return unsigned short 返回一个可用的转换后源端口号。如果端口耗尽或出错，可能返回0或特定错误值。
- * @功能描述: 根据NAT规则中定义的端口范围，并考虑当前已使用的端口，分配一个新的、未被占用的端口用于SNAT。
+ * @param rule 匹配到的NAT规则，须由 addNATRuleToChain 创建。
+ * @param dip 连接的目的IP地址。
+ * @param dport 连接的目的端口。
+ * @return unsigned short 返回一个可用的转换后源端口号。如果端口耗尽则返回0。
+ * @功能描述: 优先从端口池位图中取一个未被任何连接占用的端口；池中端口都已占用时，
+ *           再选取一个对该目的端点尚未使用 (反向连接不存在) 的端口复用。
+ *           成功时同时取得规则的一个引用，须通过 setConnSNAT 交给连接或以 putNATPort 归还。
  */
-unsigned short getNewNATPort(struct NATRecord rule);
+unsigned short getNewNATPort(struct NATRecord *rule, unsigned int dip, unsigned short dport);
+
+/**
+ * @brief 归还由 getNewNATPort 取得的端口及规则引用。
+ * @param rule 分配该端口的NAT规则。
+ * @param port 要归还的端口。
+ * @return void
+ */
+void putNATPort(struct NATRecord *rule, unsigned short port);
+
+/**
+ * @brief 为从快照恢复的SNAT连接重新占用原端口。
+ * @param sip 连接的源IP地址。
+ * @param dip 连接的目的IP地址。
+ * @param sport 连接的源端口。
+ * @param dport 连接的目的端口。
+ * @param natIP 转换后的源IP地址。
+ * @param port 转换后的源端口。
+ * @return struct NATRecord* 成功返回分配该端口的规则并取得其引用，须交给连接的SNAT绑定；
+ *         没有包含该端口的规则，或端口已分给通往同一目的端点的其他连接时返回NULL。
+ */
+struct NATRecord *natClaimPort(unsigned int sip, unsigned int dip, unsigned short sport, unsigned short dport,
+        unsigned int natIP, unsigned short port);
 
 /**
  * @brief 生成一个NAT记录结构体。
@@ -421,4 +1464,180 @@ unsigned short getNewNATPort(struct NATRecord rule);
  */
 struct NATRecord genNATRecord(unsigned int preIP, unsigned int afterIP, unsigned short prePort, unsigned short afterPort);
 
+// ----- 地址集合相关 -----
+// 每个地址集合编译为只读的查找结构后以RCU发布，修改时整体替换：
+// 哈希集合用开放定址表，一次命中 O(1)；前缀集合把前缀合并为互不相交的地址区间，二分查找不超过32步。
+
+/**
+ * @brief 前缀集合中的一个地址区间 [lo, hi]
+ */
+struct ipSetRange {
+    u32 lo;
+    u32 hi;
+};
+
+/**
+ * @brief 编译后的地址集合
+ * @功能描述: entries 按 (addr, plen) 升序且无重复，用于导出与下一次增删；
+ *           哈希集合的 table 以0表示空槽，地址0.0.0.0 另由 hasZero 记录。
+ */
+struct ipSet {
+    unsigned int id;
+    unsigned int type;             // IPSET_TYPE_HASH 或 IPSET_TYPE_NET
+    unsigned int num;              // 条目数
+    struct IPSetEntry *entries;
+    u32 *table;                    // 哈希集合的开放定址表
+    unsigned int tableMask;
+    bool hasZero;
+    struct ipSetRange *ranges;     // 前缀集合的区间，按 lo 升序
+    unsigned int rangeNum;
+    struct rcu_head rcu;
+};
+
+/**
+ * @brief 开始一次地址集合事务。
+ * @param pid 发起事务的用户进程PID。
+ * @param head 集合编号、类型与模式。
+ * @return int 成功返回0，参数非法返回-EINVAL。
+ * @功能描述: 与批量规则事务一样同一时刻只保留一个事务，新事务丢弃尚未提交的旧事务。
+ */
+int beginIPSetBatch(unsigned int pid, struct IPSetHead head);
+
+/**
+ * @brief 向地址集合事务追加一段条目。
+ * @return int 成功返回已暂存的条目数；没有属于pid的事务返回-ENOENT，条目非法返回-EINVAL，
+ *         超过 IPSET_MAX_ENTRIES 返回-E2BIG，内存不足返回-ENOMEM。
+ */
+int addIPSetBatch(unsigned int pid, const struct IPSetEntry *entries, unsigned int num);
+
+/**
+ * @brief 提交地址集合事务。
+ * @return int 成功返回集合提交后的条目数；没有属于pid的事务返回-ENOENT，
+ *         增删模式下集合不存在或类型不符返回-EINVAL，内存不足返回-ENOMEM (事务保留，可重试)。
+ * @功能描述: 新集合在旁路构建后替换旧集合，随后登记一次延迟清理，按新的集合内容重新判定所有连接。
+ */
+int commitIPSetBatch(unsigned int pid);
+
+/**
+ * @brief 放弃地址集合事务。
+ * @return int 成功返回0，没有属于pid的事务返回-ENOENT。
+ */
+int abortIPSetBatch(unsigned int pid);
+
+/**
+ * @brief 删除一个地址集合。
+ * @return int 删除的集合数 (0或1)。引用它的规则此后不再匹配任何数据包。
+ */
+int destroyIPSet(unsigned int id);
+
+/**
+ * @brief 判断地址是否属于集合。
+ * @param id 集合编号，不存在的集合不包含任何地址。
+ * @param ip IPv4地址 (主机字节序)。
+ * @return bool 属于返回true。
+ * @note 可在任意上下文调用，内部自行进入RCU读临界区。
+ */
+bool ipSetHas(unsigned int id, unsigned int ip);
+
+/**
+ * @brief 分段导出地址集合概要、或一个集合的条目的回调。
+ * @note dumpIPSetEntries 导出请求中 msg.num 指定的集合，cb->args[0] 为已导出的条目数。
+ */
+int dumpIPSets(struct sk_buff *skb, struct netlink_callback *cb);
+int dumpIPSetEntries(struct sk_buff *skb, struct netlink_callback *cb);
+
+/**
+ * @brief 释放所有地址集合与未提交的事务。
+ */
+void ipset_exit(void);
+
+// ----- 分片相关 -----
+
+#define FRAG_HASH_BITS 10   // 分片端口缓存的组数 (2的幂)
+#define FRAG_WAYS 4         // 每组的条目数，每组一把锁
+#define FRAG_TIMEOUT 30     // 首个分片的端口记录保留的秒数，与内核默认的分片重组超时相同
+
+/**
+ * @brief 记下首个分片 (带MF标志、偏移为0) 的端口，供同一数据报的后续分片使用。
+ * @note 以 (命名空间, 源地址, 目的地址, IP标识, 协议) 区分数据报；所在的组已满时不记录。
+ *       可在软中断上下文中调用。
+ */
+void fragRecord(const struct net *net, const struct iphdr *hdr, unsigned short sport, unsigned short dport);
+
+/**
+ * @brief 为非首个分片取得其所属数据报的端口。
+ * @return bool 已见过该数据报的首个分片且记录未过期时返回true。
+ * @功能描述: 钩子注册在分片重组之前，后续分片不带传输层头部，只能沿用首个分片的端口，
+ *           从而与首个分片落在同一个连接上。首个分片晚于后续分片到达或未能记录时查不到记录，
+ *           调用者按端口为0处理，与IPv6的非首个分片相同。
+ */
+bool fragLookup(const struct net *net, const struct iphdr *hdr, unsigned short *sport, unsigned short *dport);
+
+/**
+ * @brief 作废某个网络命名空间的全部分片记录，在该命名空间的钩子注销后调用。
+ */
+void fragForgetNet(const struct net *net);
+
+/**
+ * @brief 初始化分片端口缓存的锁，须在钩子注册之前调用。
+ */
+void frag_init(void);
+
+// ----- DNAT (端口转发) 相关 -----
+// DNAT规则存放在以 (目的IP, 目的端口, 协议) 为键的RCU哈希表中，PRE_ROUTING 上只需一次查表。
+// 规则只决定新连接绑定的后端，绑定后连接沿用自己的NAT记录，删除规则不影响已有连接。
+
+#define DNAT_HASH_BITS 10  // DNAT哈希表的桶数为 1<<DNAT_HASH_BITS
+#define DNAT_MAX_RULES 4096 // DNAT规则条数上限
+
+/**
+ * @brief 哈希表中的一条DNAT规则
+ */
+struct dnatEntry {
+    struct hlist_node node;
+    struct DNATRule rule;
+    struct rcu_head rcu;   // 删除后经过宽限期再释放
+};
+
+/**
+ * @brief 添加一条DNAT规则。
+ * @param rule 要添加的规则。
+ * @return int 成功返回0；参数非法返回-EINVAL，同键规则已存在返回-EEXIST，
+ *         超过条数上限或内存不足返回-ENOSPC/-ENOMEM。
+ */
+int addDNATRuleToTable(struct DNATRule rule);
+
+/**
+ * @brief 删除与 rule 同键的DNAT规则。
+ * @return int 删除的规则数 (0或1)。
+ */
+int delDNATRuleFromTable(struct DNATRule rule);
+
+/**
+ * @brief 分段导出DNAT规则的回调。
+ * @note cb->args[0] 为当前桶号，cb->args[1] 为桶内已导出的条目数。
+ */
+int dumpDNATRules(struct sk_buff *skb, struct netlink_callback *cb);
+
+/**
+ * @brief 为一个新的入站连接选择DNAT后端。
+ * @param dip 目的IP地址 (主机字节序)。
+ * @param dport 目的端口。
+ * @param proto 协议。
+ * @param sip 源IP地址，与 sport 一起作为一致性哈希的键。
+ * @param sport 源端口。
+ * @param backend [输出参数] 选中的后端，port 已按规则补全。
+ * @return bool 命中DNAT规则返回true。
+ * @功能描述: 在后端中按最高随机权重 (rendezvous) 哈希选择，增删后端时其余后端上的映射保持不变。
+ *           可在软中断上下文中调用，内部自行进入RCU读临界区。
+ */
+bool matchDNATRule(unsigned int dip, unsigned short dport, u_int8_t proto,
+    unsigned int sip, unsigned short sport, struct DNATBackend *backend);
+
+/**
+ * @brief 释放所有DNAT规则。
+ * @note 模块卸载时在钩子注销之后调用。
+ */
+void dnat_exit(void);
+
 #endif // _NETLINK_HELPER_H 结束条件预处理指令
\ No newline at end of file
@@ -3,7 +3,13 @@
 
 #include "dependency.h"
 
-void getPort(struct sk_buff *skb, struct iphdr *hdr, unsigned short *src_port, unsigned short *dst_port);
+int getPort(const struct net *net, struct sk_buff *skb, struct iphdr *hdr, unsigned short *src_port, unsigned short *dst_port);
+int getPort6(struct sk_buff *skb, u_int8_t *proto, unsigned short *src_port, unsigned short *dst_port);
 bool isIPMatch(unsigned int ipl, unsigned int ipr, unsigned int mask);
 
+// 数据包代表的报文个数：GRO/GSO聚合包只经过钩子一次，计数时按其分段数计
+static inline unsigned int skbSegs(const struct sk_buff *skb) {
+	return skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+}
+
 #endif
\ No newline at end of file
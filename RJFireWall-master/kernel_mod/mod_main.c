@@ -18,15 +18,14 @@
  * 2.  **模块初始化 (`mod_init`)**:
  *     -   在模块加载时被调用。
  *     -   打印模块加载信息到内核日志。
- *     -   使用 `nf_register_net_hook` 函数将上面定义的四个Netfilter钩子操作注册到内核网络栈中，
- *         使其能够拦截和处理网络数据包。
+ *     -   通过网络命名空间操作 `fwNetOps` 把过滤钩子注册到每个网络命名空间 (包括之后新建的)，
+ *         NAT钩子只注册到初始网络命名空间，使其能够拦截和处理网络数据包。
  *     -   调用 `netlink_init()` 初始化Netlink通信接口，用于内核模块与用户空间应用程序的交互。
  *     -   调用 `conn_init()` 初始化连接跟踪机制，用于管理和跟踪网络连接状态。
  * 3.  **模块退出 (`mod_exit`)**:
  *     -   在模块卸载时被调用。
  *     -   打印模块卸载信息到内核日志。
- *     -   使用 `nf_unregister_net_hook` 函数从内核网络栈中注销之前注册的四个Netfilter钩子，
- *         停止数据包拦截。
+ *     -   从所有网络命名空间中注销过滤钩子，并从初始网络命名空间中注销NAT钩子，停止数据包拦截。
  *     -   调用 `netlink_release()` 释放Netlink通信资源。
  *     -   调用 `conn_exit()` 清理连接跟踪机制的资源。
  * 4.  **模块元数据**:
@@ -68,6 +67,24 @@ static struct nf_hook_ops nfop_out={
 	.priority	= NF_IP_PRI_FIRST	// priority: 优先级为尽可能早。
 };
 
+/**
+ * @brief `nfop6_in` / `nfop6_out`: IPv6数据包的过滤钩子，钩子点与优先级同 `nfop_in` / `nfop_out`，
+ *        使用 `hook_main6` 函数；同一命名空间中IPv6连接与IPv4连接共用同一个连接池与规则分类器。
+ */
+static struct nf_hook_ops nfop6_in={
+	.hook		= hook_main6,
+	.pf		= PF_INET6,
+	.hooknum	= NF_INET_PRE_ROUTING,
+	.priority	= NF_IP6_PRI_FIRST
+};
+
+static struct nf_hook_ops nfop6_out={
+	.hook		= hook_main6,
+	.pf		= PF_INET6,
+	.hooknum	= NF_INET_POST_ROUTING,
+	.priority	= NF_IP6_PRI_FIRST
+};
+
 /**
  * @brief `natop_in`: Netfilter钩子操作结构体，用于入站数据包的NAT处理 (主要用于DNAT，在PRE_ROUTING点)。
  *        此钩子在数据包路由决策之前被调用，允许修改目的地址/端口。
@@ -92,6 +109,47 @@ static struct nf_hook_ops natop_out={
 						// 这是Netfilter为SNAT操作定义的标准优先级。
 };
 
+// 每个网络命名空间都注册的过滤钩子；规则、连接与日志按 state->net 各自独立
+static struct nf_hook_ops *filterOps[] = { &nfop_in, &nfop_out, &nfop6_in, &nfop6_out };
+
+// NAT规则与端口池由整个主机共用，NAT钩子只注册到初始网络命名空间
+static struct nf_hook_ops *natOps[] = { &natop_in, &natop_out };
+
+/**
+ * @brief 在一个网络命名空间中注册过滤钩子。
+ *
+ * @param net 新建的 (或模块加载时已存在的) 网络命名空间。
+ * @return int 成功返回0，失败返回负数错误码，该命名空间的创建随之失败。
+ */
+static int __net_init fwNetInit(struct net *net) {
+	unsigned int i;
+	int ret;
+
+	for(i = 0; i < ARRAY_SIZE(filterOps); i++) {
+		ret = nf_register_net_hook(net, filterOps[i]);
+		if(ret != 0) {
+			printk(KERN_WARNING "[fw main] register filter hook fail: %d.\n", ret);
+			while(i-- > 0)
+				nf_unregister_net_hook(net, filterOps[i]);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+// 网络命名空间销毁或模块卸载时注销该命名空间的过滤钩子
+static void __net_exit fwNetExit(struct net *net) {
+	unsigned int i;
+	for(i = 0; i < ARRAY_SIZE(filterOps); i++)
+		nf_unregister_net_hook(net, filterOps[i]);
+	fragForgetNet(net); // 命名空间的地址可能被之后新建的命名空间重用
+}
+
+static struct pernet_operations fwNetOps = {
+	.init = fwNetInit,
+	.exit = fwNetExit,
+};
+
 /**
  * @brief 模块初始化函数 (`mod_init`)。
  *        当内核模块被加载 (例如通过 `insmod`) 时，此函数会被自动调用。
@@ -100,28 +158,72 @@ static struct nf_hook_ops natop_out={
  *
  * @功能描述:
  *   1.  向内核日志打印一条消息，表明模块已加载。
- *   2.  调用 `nf_register_net_hook` 函数，将 `nfop_in`, `nfop_out`, `natop_in`, `natop_out`
- *       这四个Netfilter钩子操作注册到当前网络命名空间 (`&init_net`) 的IPv4协议栈中。
- *       注册成功后，这些钩子函数就能开始拦截和处理网络数据包。
- *   3.  调用 `netlink_init()` 来初始化Netlink套接字，以便内核模块可以与用户空间应用程序通信。
- *   4.  调用 `conn_init()` 来初始化连接跟踪系统所需的数据结构和定时器等。
- *   5.  返回0表示所有初始化步骤成功完成。
+ *   2.  调用 `frag_init()` 初始化分片端口缓存，
+ *       调用 `log_init()` 准备各命名空间的日志环形缓冲区并注册日志流设备，调用 `rule_init()` 准备规则链与默认动作，
+ *       再调用 `conn_init()` 来初始化连接跟踪系统所需的哈希表和定时器等，任一失败则模块加载失败。
+ *       这三者都按网络命名空间各自分配，并且必须在钩子注册之前就绪，否则钩子可能访问尚未初始化的状态；
+ *       之后新建的命名空间也按注册顺序依次初始化，销毁时按相反顺序释放。
+ *       随后调用 `ratelimit_init()` 初始化限速规则共用的令牌桶表，调用 `denycache_init()` 分配
+ *       默认丢弃时使用的每CPU拒绝缓存。
+ *   3.  调用 `netlink_init()` 在每个网络命名空间中创建Netlink套接字，以便内核模块可以与用户空间应用程序通信。
+ *   4.  注册 `fwNetOps`，在每个网络命名空间中注册 `nfop_in`, `nfop_out` 与IPv6的 `nfop6_in`, `nfop6_out`
+ *       过滤钩子；再把 `natop_in`, `natop_out` 注册到初始网络命名空间 (`&init_net`) 的IPv4协议栈中
+ *       (IPv6只做过滤，不做NAT)。注册成功后，这些钩子函数就能开始拦截和处理网络数据包。
+ *   5.  返回0表示所有初始化步骤成功完成，任一步失败时按相反顺序撤销已完成的步骤。
  */
 static int mod_init(void){
+	unsigned int i;
+	int ret;
 	printk("my firewall module loaded.\n"); // 向内核日志输出模块加载信息
 
-	// 注册Netfilter钩子
-	// nf_register_net_hook(&init_net, &nf_hook_ops_struct)
-	// &init_net: 指向默认网络命名空间的指针。
-	nf_register_net_hook(&init_net,&nfop_in);   // 注册入站过滤钩子
-	nf_register_net_hook(&init_net,&nfop_out);  // 注册出站过滤钩子
-	nf_register_net_hook(&init_net,&natop_in);  // 注册入站NAT钩子 (DNAT)
-	nf_register_net_hook(&init_net,&natop_out); // 注册出站NAT钩子 (SNAT)
-
-	netlink_init(); // 初始化Netlink通信接口
-	conn_init();    // 初始化连接跟踪系统
+	frag_init();          // 初始化分片端口缓存
+	ret = log_init();     // 日志环形缓冲区与日志流设备
+	if(ret != 0)
+		return ret;
+	ret = rule_init();    // 准备各命名空间的规则链与默认动作
+	if(ret != 0)
+		goto out_log;
+	ret = conn_init();    // 初始化连接跟踪系统
+	if(ret != 0)
+		goto out_rule;
+	ret = ratelimit_init(); // 初始化新建连接限速的令牌桶表
+	if(ret != 0)
+		goto out_conn;
+	ret = denycache_init(); // 分配拒绝缓存
+	if(ret != 0)
+		goto out_ratelimit;
+	ret = netlink_init(); // 初始化Netlink通信接口
+	if(ret != 0)
+		goto out_deny;
 
+	// 注册Netfilter钩子：过滤钩子进入每个网络命名空间，NAT钩子只进入初始命名空间
+	ret = register_pernet_subsys(&fwNetOps);
+	if(ret != 0)
+		goto out_netlink;
+	for(i = 0; i < ARRAY_SIZE(natOps); i++) {
+		ret = nf_register_net_hook(&init_net, natOps[i]);
+		if(ret != 0)
+			goto out_nat;
+	}
 	return 0; // 返回0表示初始化成功
+
+out_nat:
+	while(i-- > 0)
+		nf_unregister_net_hook(&init_net, natOps[i]);
+	unregister_pernet_subsys(&fwNetOps);
+out_netlink:
+	netlink_release();
+out_deny:
+	denycache_exit();
+out_ratelimit:
+	ratelimit_exit();
+out_conn:
+	conn_exit();
+out_rule:
+	rule_exit();
+out_log:
+	log_exit();
+	return ret;
 }
 
 /**
@@ -132,22 +234,33 @@ static int mod_init(void){
  *
  * @功能描述:
  *   1.  向内核日志打印一条消息，表明模块正在退出。
- *   2.  调用 `nf_unregister_net_hook` 函数，注销之前在 `mod_init` 中注册的四个Netfilter钩子。
+ *   2.  注销 `fwNetOps` (从每个网络命名空间中注销过滤钩子)，再从初始网络命名空间中注销两个NAT钩子。
  *       这会从网络协议栈中移除模块的数据包处理逻辑。
- *   3.  调用 `netlink_release()` 来关闭Netlink套接字并释放相关资源。
+ *   3.  调用 `netlink_release()` 来关闭各命名空间的Netlink套接字并释放相关资源。
  *   4.  调用 `conn_exit()` 来清理连接跟踪系统的所有状态和资源，例如释放连接条目、停止定时器等。
+ *   5.  调用 `rule_exit()` 释放IP规则链及编译出的规则分类器，再调用 `ipset_exit()` 释放规则引用的地址集合。
+ *   6.  调用 `nat_exit()` 释放NAT规则链；必须在 `conn_exit()` 之后，此时各连接已归还所占端口。
+ *       随后调用 `dnat_exit()` 释放DNAT规则表。
+ *   7.  调用 `ratelimit_exit()`、`denycache_exit()` 与 `log_exit()` 释放令牌桶表、拒绝缓存与每CPU日志环形缓冲区。
  */
 static void mod_exit(void){
+	unsigned int i;
 	printk("my firewall module exit.\n"); // 向内核日志输出模块退出信息
 
 	// 注销Netfilter钩子
-	nf_unregister_net_hook(&init_net,&nfop_in);
-	nf_unregister_net_hook(&init_net,&nfop_out);
-	nf_unregister_net_hook(&init_net,&natop_in);
-	nf_unregister_net_hook(&init_net,&natop_out);
+	unregister_pernet_subsys(&fwNetOps);
+	for(i = 0; i < ARRAY_SIZE(natOps); i++)
+		nf_unregister_net_hook(&init_net, natOps[i]);
 
 	netlink_release(); // 释放Netlink资源
 	conn_exit();       // 清理连接跟踪系统
+	rule_exit();       // 释放规则链与分类器
+	ipset_exit();      // 释放地址集合
+	nat_exit();        // 释放NAT规则及其端口池 (连接已归还全部端口)
+	dnat_exit();       // 释放DNAT规则
+	ratelimit_exit();  // 释放令牌桶表
+	denycache_exit();  // 释放拒绝缓存
+	log_exit();        // 释放日志环形缓冲区
 
 }
 
@@ -1,28 +1,52 @@
 #include "tools.h"
+#include "helper.h"
 
-void getPort(struct sk_buff *skb, struct iphdr *hdr, unsigned short *src_port, unsigned short *dst_port){
-	struct tcphdr *tcpHeader;
-	struct udphdr *udpHeader;
-	switch(hdr->protocol){
-		case IPPROTO_TCP:
-			//printk("TCP protocol\n");
-			tcpHeader = (struct tcphdr *)(skb->data + (hdr->ihl * 4));
-			*src_port = ntohs(tcpHeader->source);
-			*dst_port = ntohs(tcpHeader->dest);
-			break;
-		case IPPROTO_UDP:
-			//printk("UDP protocol\n");
-			udpHeader = (struct udphdr *)(skb->data + (hdr->ihl * 4));
-			*src_port = ntohs(udpHeader->source);
-			*dst_port = ntohs(udpHeader->dest);
-			break;
-		case IPPROTO_ICMP:
-		default:
-			//printk("other protocol\n");
-			*src_port = 0;
-			*dst_port = 0;
-			break;
+// 取得IPv4数据包的TCP/UDP端口，没有端口的协议记为0。头部经 skb_header_pointer 读取，
+// 非线性的数据包 (GRO聚合包、分散在页片段中的数据) 同样适用。
+// 端口只在首个分片中：首个分片的端口记入分片缓存，之后的分片从缓存取得端口。
+// 非首个分片找不到首个分片的记录时端口为0，与IPv6相同按无端口的数据包处理。
+// 成功返回0；传输层头部不完整时端口为0，返回-1。
+int getPort(const struct net *net, struct sk_buff *skb, struct iphdr *hdr, unsigned short *src_port, unsigned short *dst_port){
+	struct udphdr _ports, *ports; // TCP与UDP头部的前4字节都是源、目的端口
+	*src_port = 0;
+	*dst_port = 0;
+	if(hdr->protocol != IPPROTO_TCP && hdr->protocol != IPPROTO_UDP)
+		return 0;
+	if(hdr->frag_off & htons(IP_OFFSET)) {
+		fragLookup(net, hdr, src_port, dst_port);
+		return 0;
 	}
+	ports = skb_header_pointer(skb, skb_network_offset(skb) + hdr->ihl * 4, 4, &_ports);
+	if(ports == NULL)
+		return -1;
+	*src_port = ntohs(ports->source);
+	*dst_port = ntohs(ports->dest);
+	if(hdr->frag_off & htons(IP_MF))
+		fragRecord(net, hdr, *src_port, *dst_port);
+	return 0;
+}
+
+// 跳过IPv6扩展头，取得上层协议与端口，返回传输层头部的偏移；扩展头无法解析时返回负数。
+// 非首个分片不带传输层头部，端口记为0。
+int getPort6(struct sk_buff *skb, u_int8_t *proto, unsigned short *src_port, unsigned short *dst_port){
+	struct udphdr _ports, *ports; // TCP与UDP头部的前4字节都是源、目的端口
+	u8 nexthdr = ipv6_hdr(skb)->nexthdr;
+	__be16 frag_off;
+	int off;
+	*src_port = 0;
+	*dst_port = 0;
+	off = ipv6_skip_exthdr(skb, sizeof(struct ipv6hdr), &nexthdr, &frag_off);
+	if(off < 0)
+		return off;
+	*proto = nexthdr;
+	if((nexthdr == IPPROTO_TCP || nexthdr == IPPROTO_UDP) && (frag_off & htons(~0x7)) == 0) {
+		ports = skb_header_pointer(skb, off, 4, &_ports);
+		if(ports != NULL) {
+			*src_port = ntohs(ports->source);
+			*dst_port = ntohs(ports->dest);
+		}
+	}
+	return off;
 }
 
 bool isIPMatch(unsigned int ipl, unsigned int ipr, unsigned int mask) {